@@ -0,0 +1,112 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Comparison between the fixed opening angle and the error-controlled mode: for each
+// configuration, the runtime and the median and 99th percentile of the relative errors
+// of the accelerations (wrt the exact accelerations of a sample of particles) are printed.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <iostream>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <tbb/task_scheduler_init.h>
+
+#include <rakau/tree.hpp>
+
+#include "common.hpp"
+
+using namespace rakau;
+using namespace rakau_benchmark;
+
+int main(int argc, char **argv)
+{
+    std::cout.precision(4);
+
+    const auto popts = parse_accpot_benchmark_options(argc, argv);
+
+    std::optional<tbb::task_scheduler_init> t_init;
+    if (std::get<4>(popts)) {
+        t_init.emplace(std::get<4>(popts));
+    }
+
+    auto runner = [&popts](auto x) {
+        using fp_type = decltype(x);
+
+        auto inner = [&](auto m) {
+            const auto [nparts, _1, max_leaf_n, ncrit, _2, bsize, a, mac_value, parinit, _3, _4, _5, _6] = popts;
+
+            auto parts = get_plummer_sphere(nparts, static_cast<fp_type>(a), static_cast<fp_type>(bsize), parinit);
+
+            octree<fp_type, decltype(m)::value> t{kwargs::x_coords = parts.data() + nparts,
+                                                  kwargs::y_coords = parts.data() + 2 * nparts,
+                                                  kwargs::z_coords = parts.data() + 3 * nparts,
+                                                  kwargs::masses = parts.data(),
+                                                  kwargs::nparts = nparts,
+                                                  kwargs::max_leaf_n = max_leaf_n,
+                                                  kwargs::ncrit = ncrit};
+            std::cout << t << '\n';
+
+            // The exact accelerations of a sample of (at most) 1000 particles.
+            const auto stride = std::max(nparts / 1000u, decltype(nparts)(1));
+            std::vector<std::array<fp_type, 3>> eaccs;
+            for (std::size_t i = 0; i < nparts; i += stride) {
+                eaccs.push_back(t.exact_acc_u(i));
+            }
+
+            std::array<std::vector<fp_type>, 3> accs;
+            auto run = [&](const char *desc, fp_type value, auto f) {
+                const auto start = std::chrono::high_resolution_clock::now();
+                f();
+                const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                                         std::chrono::high_resolution_clock::now() - start)
+                                         .count();
+                std::vector<fp_type> errs;
+                for (std::size_t i = 0, k = 0; i < nparts; i += stride, ++k) {
+                    fp_type d2(0), r2(0);
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        d2 += (accs[j][i] - eaccs[k][j]) * (accs[j][i] - eaccs[k][j]);
+                        r2 += eaccs[k][j] * eaccs[k][j];
+                    }
+                    errs.push_back(std::sqrt(d2 / r2));
+                }
+                std::sort(errs.begin(), errs.end());
+                std::cout << desc << " = " << value << ": " << elapsed << u8"μs, median error: "
+                          << errs[errs.size() / 2u] << ", 99th percentile error: " << errs[errs.size() * 99u / 100u]
+                          << '\n';
+            };
+
+            for (auto theta : {fp_type(1), fp_type(0.75), fp_type(0.5), fp_type(0.35), fp_type(0.25)}) {
+                run("theta", theta, [&]() { t.accs_u(accs, theta); });
+            }
+            // NOTE: in the error-controlled mode, the MAC value is the largest opening angle.
+            for (auto err_tol : {fp_type(1E-2), fp_type(3E-3), fp_type(1E-3)}) {
+                run("err_tol", err_tol, [&]() { t.accs_u(accs, mac_value, kwargs::err_tol = err_tol); });
+            }
+        };
+
+        if (std::get<11>(popts) == "bh") {
+            inner(std::integral_constant<mac, mac::bh>{});
+        } else {
+            inner(std::integral_constant<mac, mac::bh_geom>{});
+        }
+    };
+
+    if (std::get<10>(popts) == "float") {
+        runner(0.f);
+    } else {
+        runner(0.);
+    }
+}
@@ -0,0 +1,117 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Accuracy and throughput of the fast inverse sqrt implementation
+// wrt the standard sqrt + division, for the default batch type.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <xsimd/xsimd.hpp>
+
+#include <rakau/detail/simd.hpp>
+#include <rakau/detail/simple_timer.hpp>
+#include <rakau/tree.hpp>
+
+using namespace rakau;
+
+int main(int argc, char **argv)
+{
+    namespace po = boost::program_options;
+
+    std::cout.precision(20);
+
+    unsigned long nvalues;
+    unsigned niter;
+    std::string fp_type;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()("help", "produce help message")(
+        "nvalues", po::value<unsigned long>(&nvalues)->default_value(1'000'000ul), "number of input values")(
+        "niter", po::value<unsigned>(&niter)->default_value(100u), "number of passes over the input values")(
+        "fp_type", po::value<std::string>(&fp_type)->default_value("double"),
+        "floating-point type to use in the computations");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << desc << "\n";
+        std::exit(0);
+    }
+
+    if (fp_type != "float" && fp_type != "double") {
+        throw std::invalid_argument("Only the 'float' and 'double' floating-point types are supported, but the type '"
+                                    + fp_type + "' was specified instead");
+    }
+
+    auto runner = [nvalues, niter](auto x) {
+        using fp_type = decltype(x);
+        using batch_type = xsimd::simd_type<fp_type>;
+        constexpr auto batch_size = batch_type::size;
+
+        if constexpr (!use_fast_inv_sqrt<batch_type>) {
+            std::cout << "The fast inverse sqrt is not available for the batch type of size " << batch_size
+                      << ", or it has been disabled at configuration time.\n";
+        } else {
+            // Round up the number of values to the batch size.
+            const auto size = (nvalues + batch_size - 1u) / batch_size * batch_size;
+
+            // Squared distances spanning several orders of magnitude.
+            std::mt19937 rng;
+            std::uniform_real_distribution<fp_type> edist(fp_type(-6), fp_type(6));
+            std::vector<fp_type> in(size), out_fast(size), out_std(size);
+            std::generate(in.begin(), in.end(), [&edist, &rng]() { return std::pow(fp_type(10), edist(rng)); });
+
+            {
+                simple_timer st("fast inverse sqrt");
+                for (auto n = 0u; n < niter; ++n) {
+                    for (decltype(in.size()) i = 0; i < size; i += batch_size) {
+                        inv_sqrt(batch_type(in.data() + i, xsimd::unaligned_mode{}))
+                            .store_unaligned(out_fast.data() + i);
+                    }
+                }
+            }
+
+            {
+                simple_timer st("sqrt + division");
+                for (auto n = 0u; n < niter; ++n) {
+                    for (decltype(in.size()) i = 0; i < size; i += batch_size) {
+                        (batch_type(fp_type(1)) / xsimd_sqrt(batch_type(in.data() + i, xsimd::unaligned_mode{})))
+                            .store_unaligned(out_std.data() + i);
+                    }
+                }
+            }
+
+            // Relative errors wrt an extended-precision computation.
+            long double max_err_fast = 0, max_err_std = 0;
+            for (decltype(in.size()) i = 0; i < size; ++i) {
+                const auto exact = 1.l / std::sqrt(static_cast<long double>(in[i]));
+                max_err_fast = std::max(max_err_fast, std::abs((out_fast[i] - exact) / exact));
+                max_err_std = std::max(max_err_std, std::abs((out_std[i] - exact) / exact));
+            }
+            std::cout << "Max relative error, fast inverse sqrt: " << max_err_fast << '\n';
+            std::cout << "Max relative error, sqrt + division  : " << max_err_std << '\n';
+        }
+    };
+
+    if (fp_type == "float") {
+        runner(0.f);
+    } else {
+        runner(0.);
+    }
+}
@@ -0,0 +1,47 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef RAKAU_DETAIL_CPU_FWD_HPP
+#define RAKAU_DETAIL_CPU_FWD_HPP
+
+#include <array>
+#include <cstddef>
+
+#include <rakau/detail/tree_fwd.hpp>
+
+namespace rakau
+{
+
+template <std::size_t, typename, typename, mac>
+class tree;
+
+inline namespace detail
+{
+
+// The instruction sets for which the cpu kernels are precompiled
+// when rakau is configured with runtime ISA dispatch.
+enum class cpu_isa { sse2, avx2, avx512 };
+
+// The instruction set selected at runtime. This is the best instruction set
+// supported by the host cpu, unless a lower one is requested via the
+// RAKAU_CPU_ISA environment variable (which can be set to "sse2", "avx2" or "avx512").
+cpu_isa cpu_dispatch_isa() __attribute__((visibility("default")));
+
+// Default values of the tree parameters for the instruction set selected at runtime.
+unsigned cpu_dispatch_default_max_leaf_n() __attribute__((visibility("default")));
+unsigned cpu_dispatch_default_ncrit() __attribute__((visibility("default")));
+
+template <cpu_isa ISA, unsigned Q, std::size_t NDim, typename F, typename UInt, mac MAC>
+void cpu_acc_pot_impl(const tree<NDim, F, UInt, MAC> &, const std::array<F *, tree_nvecs_res<Q, NDim>> &, F, F, F,
+                      tree_size_t<F>, tree_size_t<F>, bool, bool,
+                      const tree_active_t<F> *) __attribute__((visibility("default")));
+
+} // namespace detail
+} // namespace rakau
+
+#endif
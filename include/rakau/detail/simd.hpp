@@ -9,7 +9,12 @@
 #ifndef RAKAU_DETAIL_SIMD_HPP
 #define RAKAU_DETAIL_SIMD_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <type_traits>
 
 #include <xsimd/xsimd.hpp>
@@ -42,6 +47,23 @@ inline thread_local unsigned long long simd_fma_counter_tl = 0;
 inline thread_local unsigned long long simd_sqrt_counter_tl = 0;
 inline thread_local unsigned long long simd_rsqrt_counter_tl = 0;
 
+// Add the thread-local counters of the calling thread to the global
+// atomic ones, then reset them. This is a no-op if rakau was not
+// compiled with RAKAU_WITH_SIMD_COUNTERS.
+inline void flush_simd_counters_tl()
+{
+#if defined(RAKAU_WITH_SIMD_COUNTERS)
+    simd_fma_counter += simd_fma_counter_tl;
+    simd_fma_counter_tl = 0;
+
+    simd_sqrt_counter += simd_sqrt_counter_tl;
+    simd_sqrt_counter_tl = 0;
+
+    simd_rsqrt_counter += simd_rsqrt_counter_tl;
+    simd_rsqrt_counter_tl = 0;
+#endif
+}
+
 // Wrappers around some xsimd function. They will increase the corresponding
 // thread-local counters if compiled with RAKAU_WITH_SIMD_COUNTERS.
 template <typename B>
@@ -83,7 +105,7 @@ inline xsimd::batch<F, N> inv_sqrt_newton_iter(xsimd::batch<F, N> y0, xsimd::bat
     return half_y0 * three_minus_muls;
 }
 
-// Computation of 1/sqrt(x)**3 via fast rsqrt.
+// Computation of 1/sqrt(x) and 1/sqrt(x)**3 via fast rsqrt.
 #if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
 
 inline xsimd::batch<float, 16> inv_sqrt(xsimd::batch<float, 16> x)
@@ -105,6 +127,24 @@ inline xsimd::batch<float, 16> inv_sqrt_3(xsimd::batch<float, 16> x)
     return tmp * tmp * tmp;
 }
 
+inline xsimd::batch<double, 8> inv_sqrt(xsimd::batch<double, 8> x)
+{
+#if defined(RAKAU_WITH_SIMD_COUNTERS)
+    ++simd_rsqrt_counter_tl;
+#endif
+    // NOTE: AVX512F provides a double-precision rsqrt with 14 bits of precision,
+    // thus we don't need to go through single precision (as we do in the AVX
+    // implementation below). Two Newton iterations bring the result to
+    // (almost) full double precision.
+    return inv_sqrt_newton_iter(inv_sqrt_newton_iter(xsimd::batch<double, 8>(_mm512_rsqrt14_pd(x)), x), x);
+}
+
+inline xsimd::batch<double, 8> inv_sqrt_3(xsimd::batch<double, 8> x)
+{
+    const auto tmp = inv_sqrt(x);
+    return tmp * tmp * tmp;
+}
+
 #endif
 
 #if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX_VERSION
@@ -123,13 +163,48 @@ inline xsimd::batch<float, 8> inv_sqrt_3(xsimd::batch<float, 8> x)
     return tmp * tmp * tmp;
 }
 
+#if XSIMD_X86_INSTR_SET < XSIMD_X86_AVX512_VERSION
+
+// NOTE: with AVX512 available, the default batch size for double is 8,
+// and the implementation above is used.
+inline xsimd::batch<double, 4> inv_sqrt(xsimd::batch<double, 4> x)
+{
+#if defined(RAKAU_WITH_SIMD_COUNTERS)
+    ++simd_rsqrt_counter_tl;
+#endif
+    // There's no double-precision rsqrt in AVX: convert to single precision,
+    // compute the rsqrt there, convert back and refine the result with two Newton
+    // iterations in double precision. Starting from the ~12 bits of the rsqrt, this gives
+    // a relative error of ~1E-13.
+    auto retval = inv_sqrt_newton_iter(
+        inv_sqrt_newton_iter(xsimd::batch<double, 4>(_mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(x)))), x), x);
+    // NOTE: the initial guess is garbage for values which are not
+    // representable as normal single-precision values (e.g., a very small
+    // distance without softening). Fall back to the standard computation for them.
+    const xsimd::batch<double, 4> flt_min(static_cast<double>(std::numeric_limits<float>::min())),
+        flt_max(static_cast<double>(std::numeric_limits<float>::max()));
+    const auto in_range = (x >= flt_min) & (x <= flt_max);
+    if (!xsimd::all(in_range)) {
+        retval = xsimd::select(in_range, retval, xsimd::batch<double, 4>(1.) / xsimd_sqrt(x));
+    }
+    return retval;
+}
+
+inline xsimd::batch<double, 4> inv_sqrt_3(xsimd::batch<double, 4> x)
+{
+    const auto tmp = inv_sqrt(x);
+    return tmp * tmp * tmp;
+}
+
+#endif
+
 #endif
 
 // Small variable template helper to establish if a fast implementation
 // of the inverse sqrt for an xsimd batch of type B is available.
 // Currently, this is true for:
-// - AVX 8-floats batches,
-// - AVX512 16-floats batches.
+// - AVX 8-floats and 4-doubles batches,
+// - AVX512 16-floats and 8-doubles batches.
 // NOTE: there are intrinsics in SSE for rsqrt as well, but they don't seem to
 // improve performance for our use case. I could not understand why exactly that's
 // the case.
@@ -139,12 +214,172 @@ inline constexpr bool has_fast_inv_sqrt =
     (std::is_same_v<xsimd_scalar_t<B>, float> && B::size == 8u)
 #if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
     || (std::is_same_v<xsimd_scalar_t<B>, float> && B::size == 16u)
+    || (std::is_same_v<xsimd_scalar_t<B>, double> && B::size == 8u)
+#else
+    || (std::is_same_v<xsimd_scalar_t<B>, double> && B::size == 4u)
 #endif
 #else
     false
 #endif
     ;
 
+// Masked memory operations on batches, used to process the tail of a sequence
+// whose size is not a multiple of the batch size without reading/writing past
+// the end of the sequence. The general implementation goes through a temporary
+// aligned buffer.
+template <typename B, typename = void>
+struct batch_mask_ops {
+    using value_type = xsimd_scalar_t<B>;
+    // Load the first n elements starting at ptr. The remaining lanes are set to zero.
+    static B load(const value_type *ptr, std::size_t n)
+    {
+        assert(n < B::size);
+        alignas(XSIMD_DEFAULT_ALIGNMENT) value_type tmp[B::size]{};
+        std::copy(ptr, ptr + n, tmp);
+        return B(tmp, xsimd::aligned_mode{});
+    }
+    // Store the first n lanes of b starting at ptr.
+    static void store(const B &b, value_type *ptr, std::size_t n)
+    {
+        assert(n < B::size);
+        alignas(XSIMD_DEFAULT_ALIGNMENT) value_type tmp[B::size];
+        b.store_aligned(tmp);
+        std::copy(tmp, tmp + n, ptr);
+    }
+};
+
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
+
+template <>
+struct batch_mask_ops<xsimd::batch<float, 16>> {
+    static xsimd::batch<float, 16> load(const float *ptr, std::size_t n)
+    {
+        assert(n < 16u);
+        return xsimd::batch<float, 16>(_mm512_maskz_loadu_ps(static_cast<__mmask16>((1u << n) - 1u), ptr));
+    }
+    static void store(const xsimd::batch<float, 16> &b, float *ptr, std::size_t n)
+    {
+        assert(n < 16u);
+        _mm512_mask_storeu_ps(ptr, static_cast<__mmask16>((1u << n) - 1u), b);
+    }
+};
+
+template <>
+struct batch_mask_ops<xsimd::batch<double, 8>> {
+    static xsimd::batch<double, 8> load(const double *ptr, std::size_t n)
+    {
+        assert(n < 8u);
+        return xsimd::batch<double, 8>(_mm512_maskz_loadu_pd(static_cast<__mmask8>((1u << n) - 1u), ptr));
+    }
+    static void store(const xsimd::batch<double, 8> &b, double *ptr, std::size_t n)
+    {
+        assert(n < 8u);
+        _mm512_mask_storeu_pd(ptr, static_cast<__mmask8>((1u << n) - 1u), b);
+    }
+};
+
+#endif
+
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX_VERSION
+
+// NOTE: AVX has no mask registers, the masks for vmaskmov are integer vectors
+// whose lanes have the sign bit set for the elements to be loaded/stored. We build
+// them by reading a sliding window of width 8 (for floats) or 4 (for doubles)
+// over the arrays below.
+inline constexpr std::int32_t avx_mask_table_32[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+inline constexpr std::int64_t avx_mask_table_64[8] = {-1, -1, -1, -1, 0, 0, 0, 0};
+
+template <>
+struct batch_mask_ops<xsimd::batch<float, 8>> {
+    static __m256i mask(std::size_t n)
+    {
+        assert(n < 8u);
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(avx_mask_table_32 + 8u - n));
+    }
+    static xsimd::batch<float, 8> load(const float *ptr, std::size_t n)
+    {
+        return xsimd::batch<float, 8>(_mm256_maskload_ps(ptr, mask(n)));
+    }
+    static void store(const xsimd::batch<float, 8> &b, float *ptr, std::size_t n)
+    {
+        _mm256_maskstore_ps(ptr, mask(n), b);
+    }
+};
+
+template <>
+struct batch_mask_ops<xsimd::batch<double, 4>> {
+    static __m256i mask(std::size_t n)
+    {
+        assert(n < 4u);
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(avx_mask_table_64 + 4u - n));
+    }
+    static xsimd::batch<double, 4> load(const double *ptr, std::size_t n)
+    {
+        return xsimd::batch<double, 4>(_mm256_maskload_pd(ptr, mask(n)));
+    }
+    static void store(const xsimd::batch<double, 4> &b, double *ptr, std::size_t n)
+    {
+        _mm256_maskstore_pd(ptr, mask(n), b);
+    }
+};
+
+#endif
+
+// Load a batch of type B from ptr, where n is the number of elements available
+// starting from ptr. If n is at least the batch size, a normal load with mode Mode
+// (either aligned or unaligned) is performed. Otherwise, only the first n
+// elements are read and the remaining lanes are set to zero.
+template <typename B, typename Mode>
+inline B batch_load_n(const xsimd_scalar_t<B> *ptr, std::size_t n, Mode)
+{
+    if (n >= B::size) {
+        return B(ptr, Mode{});
+    }
+    return batch_mask_ops<B>::load(ptr, n);
+}
+
+// Store the batch b into ptr, where n is the number of elements available
+// starting from ptr. If n is less than the batch size, only the first n
+// lanes of b are written.
+template <typename B, typename Mode>
+inline void batch_store_n(const B &b, xsimd_scalar_t<B> *ptr, std::size_t n, Mode)
+{
+    if (n >= B::size) {
+        if constexpr (std::is_same_v<Mode, xsimd::aligned_mode>) {
+            b.store_aligned(ptr);
+        } else {
+            b.store_unaligned(ptr);
+        }
+    } else {
+        batch_mask_ops<B>::store(b, ptr, n);
+    }
+}
+
+// Compute a batch mask in which the first n lanes are set to true,
+// and the other lanes are set to false.
+template <typename B>
+inline auto batch_lane_mask(std::size_t n)
+{
+    using value_type = xsimd_scalar_t<B>;
+    alignas(XSIMD_DEFAULT_ALIGNMENT) value_type idx[B::size];
+    for (std::size_t i = 0; i < B::size; ++i) {
+        idx[i] = static_cast<value_type>(i);
+    }
+    return B(idx, xsimd::aligned_mode{}) < B(static_cast<value_type>(n));
+}
+
+// Compute a batch mask in which only the lane with index l is set to true.
+template <typename B>
+inline auto batch_lane_eq_mask(std::size_t l)
+{
+    using value_type = xsimd_scalar_t<B>;
+    alignas(XSIMD_DEFAULT_ALIGNMENT) value_type idx[B::size];
+    for (std::size_t i = 0; i < B::size; ++i) {
+        idx[i] = static_cast<value_type>(i);
+    }
+    return B(idx, xsimd::aligned_mode{}) == B(static_cast<value_type>(l));
+}
+
 // Small helper to establish if simd is available for the type F.
 template <typename F, typename = void>
 struct has_simd_impl : std::false_type {
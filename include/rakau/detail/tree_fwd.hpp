@@ -43,7 +43,7 @@ namespace rakau
 {
 
 // Multipole acceptance criteria.
-enum class mac { bh, bh_geom };
+enum class mac { bh, bh_geom, relative, bh_box };
 
 inline namespace detail
 {
@@ -115,6 +115,36 @@ struct tree_node_t<NDim, F, UInt, mac::bh_geom> : base_tree_node_t<NDim, F, UInt
     }
 };
 
+// Tree node for the relative (Gadget-style) MAC.
+template <std::size_t NDim, typename F, typename UInt>
+struct tree_node_t<NDim, F, UInt, mac::relative> : base_tree_node_t<NDim, F, UInt> {
+    // Node properties (COM coordinates + mass), square of the node dimension and
+    // product of the node mass and of the square of the node dimension.
+    F props[NDim + 1u], dim2, mdim2;
+    friend bool operator==(const tree_node_t &n1, const tree_node_t &n2)
+    {
+        using base = base_tree_node_t<NDim, F, UInt>;
+        return std::equal(std::begin(n1.props), std::end(n1.props), std::begin(n2.props)) && n1.dim2 == n2.dim2
+               && n1.mdim2 == n2.mdim2 && static_cast<const base &>(n1) == static_cast<const base &>(n2);
+    }
+};
+
+// Tree node for the BH MAC based on the bounding box of the particles.
+template <std::size_t NDim, typename F, typename UInt>
+struct tree_node_t<NDim, F, UInt, mac::bh_box> : base_tree_node_t<NDim, F, UInt> {
+    // Node properties (COM coordinates + mass), square of the largest extent of the
+    // bounding box of the particles in the node, and the corners of the bounding box.
+    F props[NDim + 1u], dim2, lo[NDim], hi[NDim];
+    friend bool operator==(const tree_node_t &n1, const tree_node_t &n2)
+    {
+        using base = base_tree_node_t<NDim, F, UInt>;
+        return std::equal(std::begin(n1.props), std::end(n1.props), std::begin(n2.props)) && n1.dim2 == n2.dim2
+               && std::equal(std::begin(n1.lo), std::end(n1.lo), std::begin(n2.lo))
+               && std::equal(std::begin(n1.hi), std::end(n1.hi), std::begin(n2.hi))
+               && static_cast<const base &>(n1) == static_cast<const base &>(n2);
+    }
+};
+
 // Critical node.
 template <typename F, typename UInt>
 struct tree_cnode_t {
@@ -124,6 +154,18 @@ struct tree_cnode_t {
     tree_size_t<F> begin, end;
 };
 
+// The subset of active particles in a computation of accelerations/potentials
+// restricted to a subset of the target particles.
+template <typename F>
+struct tree_active_t {
+    // The sorted indices (in the internal order) of the active particles.
+    std::vector<tree_size_t<F>> idx;
+    // For each critical node containing active particles: the index of
+    // the node in the list of critical nodes and the range of its active
+    // particles in idx.
+    std::vector<std::array<tree_size_t<F>, 3>> cnodes;
+};
+
 // Computation of the number of vectors needed to store the result
 // of an acceleration/potential computation.
 template <unsigned Q, std::size_t NDim>
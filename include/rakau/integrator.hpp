@@ -0,0 +1,305 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef RAKAU_INTEGRATOR_HPP
+#define RAKAU_INTEGRATOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/numeric/conversion/cast.hpp>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <rakau/detail/igor.hpp>
+#include <rakau/detail/simple_timer.hpp>
+#include <rakau/tree.hpp>
+
+namespace rakau
+{
+
+namespace kwargs
+{
+
+// kwargs for the block timestep integrator.
+IGOR_MAKE_NAMED_ARGUMENT(max_rung);
+IGOR_MAKE_NAMED_ARGUMENT(eta);
+
+} // namespace kwargs
+
+// Hierarchical block timestep kick-drift-kick integrator.
+//
+// Each particle is assigned to a rung r in the [0, max_rung] range, and it is advanced with the timestep
+// dt / 2**r, where dt is the base timestep. The rung of a particle is chosen as the smallest r for which
+// dt / 2**r <= eta * sqrt(eps / |a|), where eps is the softening length and a the acceleration of the particle.
+// A particle can move to a coarser rung only at the instants in which the coarser rung is synchronised.
+//
+// step() advances the whole system by dt in 2**max_rung substeps. The positions are drifted, and the tree
+// rebuilt, only at the end of the substeps in which at least one particle completes its timestep, and the
+// accelerations are then computed only for such particles (see the 'active' keyword argument of the tree).
+//
+// The velocities, accelerations and rungs are stored in the internal (Morton) order of the tree.
+template <std::size_t NDim, typename F, typename UInt, mac MAC>
+class block_kdk
+{
+public:
+    using tree_type = tree<NDim, F, UInt, MAC>;
+    using size_type = typename tree_type::size_type;
+
+    // Constructor from a tree, the velocities of its particles (in the original order, as iterators),
+    // the base timestep and the MAC value. The optional keyword arguments are the grav constant G,
+    // the softening length eps, the maximum rung max_rung and the accuracy parameter eta.
+    template <typename It, typename... KwArgs>
+    explicit block_kdk(tree_type t, const std::array<It, NDim> &vel, F dt, F mac_value, KwArgs &&... args)
+        : m_tree(std::move(t)), m_dt(dt), m_mac_value(mac_value)
+    {
+        igor::parser p{args...};
+
+        static_assert(!p.has_duplicates(), "The block_kdk constructor cannot have duplicate keyword arguments.");
+        static_assert(!p.has_unnamed_arguments(),
+                      "Only keyword arguments can be passed in the parameter pack of the block_kdk constructor");
+
+        if constexpr (p.has(kwargs::G)) {
+            m_G = boost::numeric_cast<F>(p(kwargs::G));
+        }
+        if constexpr (p.has(kwargs::eps)) {
+            m_eps = boost::numeric_cast<F>(p(kwargs::eps));
+        }
+        if constexpr (p.has(kwargs::max_rung)) {
+            m_max_rung = boost::numeric_cast<unsigned>(p(kwargs::max_rung));
+        }
+        if constexpr (p.has(kwargs::eta)) {
+            m_eta = boost::numeric_cast<F>(p(kwargs::eta));
+        }
+
+        if (rakau_unlikely(!std::isfinite(m_dt) || m_dt <= F(0))) {
+            throw std::domain_error("The timestep must be finite and positive, but it is " + std::to_string(m_dt)
+                                    + " instead");
+        }
+        if (rakau_unlikely(!std::isfinite(m_eta) || m_eta <= F(0))) {
+            throw std::domain_error("The timestep accuracy parameter eta must be finite and positive, but it is "
+                                    + std::to_string(m_eta) + " instead");
+        }
+        // NOTE: the substeps are counted via 64-bit unsigned integers.
+        if (rakau_unlikely(m_max_rung >= 64u)) {
+            throw std::invalid_argument("The maximum rung must be less than 64, but it is "
+                                        + std::to_string(m_max_rung) + " instead");
+        }
+        // NOTE: the rung criterion needs a length scale.
+        if (rakau_unlikely(m_max_rung && !(m_eps > F(0)))) {
+            throw std::invalid_argument("A positive softening length is needed when the maximum rung is nonzero");
+        }
+
+        // Copy the velocities in the internal order.
+        const auto np = m_tree.nparts();
+        const auto &perm = m_tree.perm();
+        using it_diff_t = typename std::iterator_traits<It>::difference_type;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            m_vel[j].resize(np);
+            m_acc[j].resize(np);
+            for (size_type i = 0; i < np; ++i) {
+                m_vel[j][i] = *(vel[j] + boost::numeric_cast<it_diff_t>(perm[i]));
+            }
+        }
+
+        // Compute the initial accelerations and assign the rungs.
+        m_tree.accs_u(m_acc, m_mac_value, kwargs::G = m_G, kwargs::eps = m_eps);
+        m_rungs.resize(np);
+        m_rung_counts.resize(m_max_rung + 1u);
+        for (size_type i = 0; i < np; ++i) {
+            m_rungs[i] = rung_from_acc(i);
+            ++m_rung_counts[m_rungs[i]];
+        }
+        // All the particles start their timestep at the first substep.
+        m_act.resize(np);
+        std::iota(m_act.begin(), m_act.end(), size_type(0));
+    }
+
+private:
+    // The rung of the particle at index i, as determined by its acceleration.
+    unsigned rung_from_acc(size_type i) const
+    {
+        F a2(0);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            a2 += m_acc[j][i] * m_acc[j][i];
+        }
+        // NOTE: for a null acceleration, dt_i is infinite and the particle stays on rung 0.
+        const auto dt_i = m_eta * std::sqrt(m_eps / std::sqrt(a2));
+        unsigned retval = 0;
+        auto dt_r = m_dt;
+        while (retval < m_max_rung && dt_r > dt_i) {
+            ++retval;
+            dt_r /= F(2);
+        }
+        return retval;
+    }
+    // The coarsest rung whose timesteps begin/end at the substep boundary k. All the rungs
+    // finer than the returned one are synchronised as well.
+    unsigned sync_rung(std::uint64_t k) const
+    {
+        auto retval = m_max_rung;
+        while (retval && !(k & ((std::uint64_t(1) << (m_max_rung - retval + 1u)) - 1u))) {
+            --retval;
+        }
+        return retval;
+    }
+    // Apply a half kick to the particles whose indices are in m_act.
+    void half_kick()
+    {
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, m_act.size()), [this](const auto &range) {
+            for (auto k = range.begin(); k != range.end(); ++k) {
+                const auto i = m_act[k];
+                const auto h = std::ldexp(m_dt, -static_cast<int>(m_rungs[i] + 1u));
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    m_vel[j][i] = std::fma(m_acc[j][i], h, m_vel[j][i]);
+                }
+            }
+        });
+    }
+    // Drift all the particles by t, and re-order the particle data
+    // according to the new internal order of the tree.
+    void drift(F t)
+    {
+        m_tree.update_particles_u([this, t](const auto &p_its) {
+            tbb::parallel_for(tbb::blocked_range<size_type>(0, m_tree.nparts()), [this, t, &p_its](const auto &range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        p_its[j][i] = std::fma(m_vel[j][i], t, p_its[j][i]);
+                    }
+                }
+            });
+        });
+        const auto &lp = m_tree.last_perm();
+        auto reorder = [&lp](auto &vec, auto &tmp) {
+            tmp.resize(vec.size());
+            tbb::parallel_for(tbb::blocked_range<size_type>(0, lp.size()), [&lp, &vec, &tmp](const auto &range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    tmp[i] = vec[lp[i]];
+                }
+            });
+            vec.swap(tmp);
+        };
+        for (std::size_t j = 0; j < NDim; ++j) {
+            reorder(m_vel[j], m_tmp);
+            reorder(m_acc[j], m_tmp);
+        }
+        reorder(m_rungs, m_tmp_rungs);
+    }
+
+public:
+    // Advance the system by the base timestep.
+    void step()
+    {
+        simple_timer st("block timestep");
+        const auto nsub = std::uint64_t(1) << m_max_rung;
+        const auto dt_min = m_dt / static_cast<F>(nsub);
+        // The time elapsed since the last drift.
+        F t_drift(0);
+        for (std::uint64_t k = 0; k < nsub; ++k) {
+            // Opening half kick for the particles starting their timestep at substep k. These
+            // are the particles which completed their timestep at the previous substep.
+            half_kick();
+            m_act.clear();
+            t_drift += dt_min;
+            // The particles on the rungs from r_min onwards complete their timestep at the end of this substep.
+            const auto r_min = sync_rung(k + 1u);
+            size_type n_act = 0;
+            for (auto r = r_min; r <= m_max_rung; ++r) {
+                n_act += m_rung_counts[r];
+            }
+            if (!n_act) {
+                continue;
+            }
+            drift(t_drift);
+            t_drift = F(0);
+            // Determine the active particles and compute their accelerations.
+            m_act.reserve(n_act);
+            for (size_type i = 0; i < m_rungs.size(); ++i) {
+                if (m_rungs[i] >= r_min) {
+                    m_act.push_back(i);
+                }
+            }
+            m_tree.accs_u(m_acc, m_mac_value, kwargs::G = m_G, kwargs::eps = m_eps, kwargs::active = m_act);
+            m_n_evals += n_act;
+            // Closing half kick.
+            half_kick();
+            // Re-assign the rungs of the active particles. The new rungs cannot
+            // be coarser than r_min, as those are not synchronised at this substep.
+            for (const auto i : m_act) {
+                --m_rung_counts[m_rungs[i]];
+                m_rungs[i] = std::max(rung_from_acc(i), r_min);
+                ++m_rung_counts[m_rungs[i]];
+            }
+        }
+        // NOTE: at the end of the last substep, all the particles are synchronised
+        // and they are all in m_act, ready for the next opening half kick.
+        m_time += m_dt;
+    }
+    const tree_type &get_tree() const
+    {
+        return m_tree;
+    }
+    const auto &vels() const
+    {
+        return m_vel;
+    }
+    const auto &accs() const
+    {
+        return m_acc;
+    }
+    const auto &rungs() const
+    {
+        return m_rungs;
+    }
+    F time() const
+    {
+        return m_time;
+    }
+    F dt() const
+    {
+        return m_dt;
+    }
+    unsigned max_rung() const
+    {
+        return m_max_rung;
+    }
+    // The total number of force evaluations on single particles performed by step().
+    std::uint64_t n_evals() const
+    {
+        return m_n_evals;
+    }
+
+private:
+    tree_type m_tree;
+    std::array<f_vector<F>, NDim> m_vel, m_acc;
+    std::vector<unsigned> m_rungs;
+    // Number of particles on each rung.
+    std::vector<size_type> m_rung_counts;
+    // The indices of the particles starting/completing their timestep.
+    std::vector<size_type> m_act;
+    // Temporary buffers used in the re-ordering of the particle data.
+    f_vector<F> m_tmp;
+    std::vector<unsigned> m_tmp_rungs;
+    F m_dt, m_mac_value, m_G = F(1), m_eps = F(0), m_eta = F(0.025), m_time = F(0);
+    unsigned m_max_rung = 0;
+    std::uint64_t m_n_evals = 0;
+};
+
+} // namespace rakau
+
+#endif
@@ -0,0 +1,682 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef RAKAU_PM_HPP
+#define RAKAU_PM_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/numeric/conversion/cast.hpp>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <rakau/detail/igor.hpp>
+#include <rakau/detail/simple_timer.hpp>
+#include <rakau/detail/tree_fwd.hpp>
+#include <rakau/tree.hpp>
+
+namespace rakau
+{
+
+namespace kwargs
+{
+
+// kwargs for the particle-mesh solver.
+IGOR_MAKE_NAMED_ARGUMENT(assignment);
+
+} // namespace kwargs
+
+// Mass assignment schemes of the particle-mesh solver: cloud-in-cell and triangular-shaped cloud.
+enum class pm_assignment { cic, tsc };
+
+inline namespace detail
+{
+
+// Complex multiplication without the special handling of infinities and NaNs required by the standard.
+template <typename F>
+inline std::complex<F> pm_cmul(const std::complex<F> &a, const std::complex<F> &b)
+{
+    return std::complex<F>(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+}
+
+// Iterative radix-2 complex FFT of size n, which must be a power of two.
+template <typename F>
+class pm_fft
+{
+public:
+    explicit pm_fft(std::size_t n) : m_n(n), m_tw(n / 2u), m_rev(n)
+    {
+        assert(n && !(n & (n - 1u)));
+        // NOTE: the twiddle factors are computed in long double to limit the accumulation of roundoff errors.
+        const auto two_pi = 6.283185307179586476925286766559005768L;
+        for (std::size_t k = 0; k < n / 2u; ++k) {
+            const auto arg = -two_pi * static_cast<long double>(k) / static_cast<long double>(n);
+            m_tw[k] = std::complex<F>(static_cast<F>(std::cos(arg)), static_cast<F>(std::sin(arg)));
+        }
+        unsigned log2_n = 0;
+        while ((std::size_t(1) << log2_n) < n) {
+            ++log2_n;
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            std::size_t r = 0;
+            for (unsigned b = 0; b < log2_n; ++b) {
+                r |= ((i >> b) & 1u) << (log2_n - 1u - b);
+            }
+            m_rev[i] = r;
+        }
+    }
+    // In-place transform of the n values starting at data. The forward transform uses the exp(-2*pi*i*j*k/n)
+    // kernel, the inverse transform the exp(2*pi*i*j*k/n) kernel. Neither is normalised.
+    void operator()(std::complex<F> *data, bool inverse) const
+    {
+        for (std::size_t i = 0; i < m_n; ++i) {
+            if (i < m_rev[i]) {
+                std::swap(data[i], data[m_rev[i]]);
+            }
+        }
+        for (std::size_t len = 2; len <= m_n; len <<= 1) {
+            const auto half = len / 2u, tw_stride = m_n / len;
+            for (std::size_t i = 0; i < m_n; i += len) {
+                for (std::size_t k = 0; k < half; ++k) {
+                    const auto &tw = m_tw[k * tw_stride];
+                    const auto t = pm_cmul(inverse ? std::conj(tw) : tw, data[i + k + half]);
+                    data[i + k + half] = data[i + k] - t;
+                    data[i + k] += t;
+                }
+            }
+        }
+    }
+    std::size_t size() const
+    {
+        return m_n;
+    }
+    // The twiddle factor exp(-2*pi*i*k/n), for k < n/2.
+    const std::complex<F> &twiddle(std::size_t k) const
+    {
+        assert(k < m_tw.size());
+        return m_tw[k];
+    }
+
+private:
+    std::size_t m_n;
+    std::vector<std::complex<F>> m_tw;
+    std::vector<std::size_t> m_rev;
+};
+
+// Forward FFT of the n real values at x, where n is twice the size of fft_h. The n/2 + 1 non-redundant
+// complex coefficients are written into out. The real values are packed into a complex sequence of size n/2,
+// which is transformed with fft_h and then untangled using the twiddle factors of fft_n (a plan of size n).
+// buf is a temporary buffer of size n/2.
+template <typename F>
+inline void pm_rfft_fwd(const pm_fft<F> &fft_n, const pm_fft<F> &fft_h, const F *x, std::complex<F> *out,
+                        std::complex<F> *buf)
+{
+    const auto m = fft_h.size();
+    assert(fft_n.size() == 2u * m);
+    for (std::size_t k = 0; k < m; ++k) {
+        buf[k] = std::complex<F>(x[2u * k], x[2u * k + 1u]);
+    }
+    fft_h(buf, false);
+    out[0] = std::complex<F>(buf[0].real() + buf[0].imag(), F(0));
+    out[m] = std::complex<F>(buf[0].real() - buf[0].imag(), F(0));
+    for (std::size_t k = 1; k < m; ++k) {
+        const auto zk = buf[k], zc = std::conj(buf[m - k]);
+        // The transforms of the even and odd values.
+        const auto fe = (zk + zc) * (F(1) / F(2)), d = zk - zc;
+        const auto fo = std::complex<F>(d.imag() * (F(1) / F(2)), -d.real() * (F(1) / F(2)));
+        out[k] = fe + pm_cmul(fft_n.twiddle(k), fo);
+    }
+}
+
+// Inverse of pm_rfft_fwd(): the n real values reconstructed from the n/2 + 1 complex coefficients
+// at in are written, multiplied by n, into x. buf is a temporary buffer of size n/2.
+template <typename F>
+inline void pm_rfft_inv(const pm_fft<F> &fft_n, const pm_fft<F> &fft_h, const std::complex<F> *in, F *x,
+                        std::complex<F> *buf)
+{
+    const auto m = fft_h.size();
+    assert(fft_n.size() == 2u * m);
+    for (std::size_t k = 0; k < m; ++k) {
+        const auto xk = in[k], xc = std::conj(in[m - k]);
+        // NOTE: these are twice the transforms of the even and odd values.
+        const auto fe = xk + xc, fo = pm_cmul(xk - xc, std::conj(fft_n.twiddle(k)));
+        buf[k] = fe + std::complex<F>(-fo.imag(), fo.real());
+    }
+    fft_h(buf, true);
+    for (std::size_t k = 0; k < m; ++k) {
+        x[2u * k] = buf[k].real();
+        x[2u * k + 1u] = buf[k].imag();
+    }
+}
+
+} // namespace detail
+
+// Particle-mesh solver for the long-range part of the gravitational interaction (TreePM).
+//
+// The solver works on a periodic cubic mesh of n**3 points covering the domain of an octree, [-L/2, L/2)**3,
+// where L is the box size. The masses of the particles are assigned to the mesh via the cloud-in-cell or the
+// triangular-shaped cloud scheme, the Poisson equation is solved via a real 3D FFT, and the accelerations and
+// potentials are interpolated back to the particles with the same scheme. If a split scale r_split is
+// provided, the Green's function is multiplied by exp(-k**2 * r_split**2), so that the solver computes the
+// long-range counterpart of the short-range interaction computed by the tree when the same r_split keyword
+// argument is passed to its accs/pots functions. The sum of the two is then the periodic gravitational field,
+// up to the contributions of the periodic images of the pairs closer than the cutoff radius.
+//
+// The mass assignment reads the particles in the Morton order of the tree, and it is parallelised over the
+// tree cells at a coarse level: cells whose footprints on the mesh cannot overlap are processed in parallel.
+template <typename F>
+class particle_mesh
+{
+    static_assert(std::is_floating_point_v<F>, "The particle-mesh solver requires a floating-point type.");
+
+public:
+    using size_type = tree_size_t<F>;
+
+    // Constructor from the number of mesh points per dimension n and the box size. The optional keyword
+    // arguments are the split scale r_split (by default zero, i.e., the plain Newtonian interaction) and the
+    // mass assignment scheme assignment (by default, pm_assignment::cic).
+    template <typename... KwArgs>
+    explicit particle_mesh(size_type n, F box_size, KwArgs &&... args) : m_n(n), m_box_size(box_size)
+    {
+        igor::parser p{args...};
+
+        static_assert(!p.has_duplicates(), "The particle_mesh constructor cannot have duplicate keyword arguments.");
+        static_assert(!p.has_unnamed_arguments(),
+                      "Only keyword arguments can be passed in the parameter pack of the particle_mesh constructor");
+
+        if constexpr (p.has(kwargs::r_split)) {
+            m_r_split = boost::numeric_cast<F>(p(kwargs::r_split));
+        }
+        if constexpr (p.has(kwargs::assignment)) {
+            m_assignment = p(kwargs::assignment);
+        }
+
+        if (rakau_unlikely(m_n < 4u || (m_n & (m_n - 1u)))) {
+            throw std::invalid_argument("The number of mesh points per dimension must be a power of two not smaller "
+                                        "than 4, but it is "
+                                        + std::to_string(m_n) + " instead");
+        }
+        // NOTE: make sure the mesh size can be computed without overflow.
+        if (rakau_unlikely(m_n > std::numeric_limits<size_type>::max() / m_n / m_n)) {
+            throw std::overflow_error("The number of mesh points per dimension (" + std::to_string(m_n)
+                                      + ") is too large");
+        }
+        if (rakau_unlikely(!std::isfinite(m_box_size) || m_box_size <= F(0))) {
+            throw std::domain_error("The box size of the particle-mesh solver must be finite and positive, but it is "
+                                    + std::to_string(m_box_size) + " instead");
+        }
+        if (rakau_unlikely(!std::isfinite(m_r_split) || m_r_split < F(0))) {
+            throw std::domain_error("The split scale of the particle-mesh solver must be finite and non-negative, but "
+                                    "it is "
+                                    + std::to_string(m_r_split) + " instead");
+        }
+        if (rakau_unlikely(m_assignment != pm_assignment::cic && m_assignment != pm_assignment::tsc)) {
+            throw std::invalid_argument("Invalid mass assignment scheme for the particle-mesh solver");
+        }
+
+        m_fft_n = pm_fft<F>(m_n);
+        m_fft_h = pm_fft<F>(m_n / 2u);
+        m_rmesh.resize(m_n * m_n * m_n);
+        m_rho.resize(m_n * m_n * (m_n / 2u + 1u));
+        m_work.resize(m_rho.size());
+        build_green();
+    }
+
+private:
+    // The signed frequency corresponding to the mesh index i.
+    F freq(size_type i) const
+    {
+        return i < m_n / 2u ? static_cast<F>(i) : -static_cast<F>(m_n - i);
+    }
+    // Build the Green's function, including the normalisation of the inverse FFT and
+    // the deconvolution of the assignment/interpolation kernels.
+    void build_green()
+    {
+        const auto nh = m_n / 2u + 1u;
+        const auto pi = static_cast<F>(3.141592653589793238462643383279502884L);
+        const auto k_unit = F(2) * pi / m_box_size;
+        const auto rs2 = m_r_split * m_r_split;
+        const auto p_order = m_assignment == pm_assignment::cic ? 2 : 3;
+        const auto norm = F(4) * pi / (m_box_size * m_box_size * m_box_size);
+        // Window function of the assignment scheme along one dimension.
+        auto window = [this, pi, p_order](F f) {
+            const auto x = pi * f / static_cast<F>(m_n);
+            return x == F(0) ? F(1) : static_cast<F>(std::pow(std::sin(x) / x, p_order));
+        };
+        m_green.resize(m_rho.size());
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, m_n), [&](const auto &range) {
+            for (auto ix = range.begin(); ix != range.end(); ++ix) {
+                const auto fx = freq(ix), wx = window(fx);
+                for (size_type iy = 0; iy < m_n; ++iy) {
+                    const auto fy = freq(iy), wy = window(fy);
+                    for (size_type kz = 0; kz < nh; ++kz) {
+                        const auto fz = static_cast<F>(kz), wz = window(fz);
+                        const auto k2 = k_unit * k_unit * (fx * fx + fy * fy + fz * fz);
+                        const auto w = wx * wy * wz;
+                        m_green[(ix * m_n + iy) * nh + kz]
+                            = k2 == F(0) ? F(0) : -norm * std::exp(-k2 * rs2) / (k2 * w * w);
+                    }
+                }
+            }
+        });
+        // The long-range potential induced by a unit mass on itself, that is, the sum of the undeconvolved
+        // Green's function over the whole spectrum. It is computed only for a nonzero split scale, as otherwise
+        // the sum does not converge with the mesh resolution.
+        m_self_pot = F(0);
+        if (m_r_split != F(0)) {
+            long double acc = 0;
+            for (size_type ix = 0; ix < m_n; ++ix) {
+                const auto fx = freq(ix);
+                for (size_type iy = 0; iy < m_n; ++iy) {
+                    const auto fy = freq(iy);
+                    for (size_type kz = 0; kz < nh; ++kz) {
+                        const auto fz = static_cast<F>(kz);
+                        const auto k2 = k_unit * k_unit * (fx * fx + fy * fy + fz * fz);
+                        if (k2 == F(0)) {
+                            continue;
+                        }
+                        // NOTE: the z frequencies other than 0 and n/2 appear twice in the full spectrum.
+                        const auto mult = (kz == 0u || kz == m_n / 2u) ? 1 : 2;
+                        acc -= mult * static_cast<long double>(norm * std::exp(-k2 * rs2) / k2);
+                    }
+                }
+            }
+            m_self_pot = static_cast<F>(acc);
+        }
+    }
+    // Forward FFT of m_rmesh into m_rho.
+    void fft_forward()
+    {
+        const auto n = m_n, nh = m_n / 2u + 1u;
+        // Real transforms along z.
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, n * n), [this, n, nh](const auto &range) {
+            std::vector<std::complex<F>> buf(n / 2u);
+            for (auto l = range.begin(); l != range.end(); ++l) {
+                pm_rfft_fwd(m_fft_n, m_fft_h, m_rmesh.data() + l * n, m_rho.data() + l * nh, buf.data());
+            }
+        });
+        fft_strided(m_rho, false);
+    }
+    // Inverse FFT of m_work into m_rmesh. m_work is overwritten.
+    void fft_inverse()
+    {
+        const auto n = m_n, nh = m_n / 2u + 1u;
+        fft_strided(m_work, true);
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, n * n), [this, n, nh](const auto &range) {
+            std::vector<std::complex<F>> buf(n / 2u);
+            for (auto l = range.begin(); l != range.end(); ++l) {
+                pm_rfft_inv(m_fft_n, m_fft_h, m_work.data() + l * nh, m_rmesh.data() + l * n, buf.data());
+            }
+        });
+    }
+    // Complex transforms of the half spectrum spec along y and x.
+    void fft_strided(std::vector<std::complex<F>> &spec, bool inverse) const
+    {
+        const auto n = m_n, nh = m_n / 2u + 1u;
+        // The transform along an axis: the lines are identified by an outer index o (with stride o_stride) and
+        // by the z frequency kz, the points along each line are separated by stride.
+        auto axis = [&spec, inverse, n, nh, this](size_type o_stride, size_type stride) {
+            tbb::parallel_for(tbb::blocked_range<size_type>(0, n * nh), [&](const auto &range) {
+                std::vector<std::complex<F>> buf(n);
+                for (auto l = range.begin(); l != range.end(); ++l) {
+                    const auto base = spec.data() + (l / nh) * o_stride + l % nh;
+                    for (size_type i = 0; i < n; ++i) {
+                        buf[i] = base[i * stride];
+                    }
+                    m_fft_n(buf.data(), inverse);
+                    for (size_type i = 0; i < n; ++i) {
+                        base[i * stride] = buf[i];
+                    }
+                }
+            });
+        };
+        // NOTE: the order of the transforms along x and y is irrelevant.
+        axis(n * nh, nh);
+        axis(nh, n * nh);
+    }
+    // The index of the first mesh point and the weights of the assignment kernel with P points
+    // for the mesh coordinate u.
+    template <unsigned P>
+    static std::pair<long long, std::array<F, P>> kernel_weights(F u)
+    {
+        if constexpr (P == 2u) {
+            const auto fl = std::floor(u), d = u - fl;
+            return {static_cast<long long>(fl), std::array<F, 2>{F(1) - d, d}};
+        } else {
+            static_assert(P == 3u);
+            const auto fl = std::floor(u + F(1) / F(2)), d = u - fl;
+            const auto a = F(1) / F(2) - d, b = F(1) / F(2) + d;
+            return {static_cast<long long>(fl) - 1,
+                    std::array<F, 3>{a * a * (F(1) / F(2)), F(3) / F(4) - d * d, b * b * (F(1) / F(2))}};
+        }
+    }
+    // The mesh coordinates of the particle at index i, in the internal order of the tree.
+    template <typename Tree>
+    std::array<F, 3> mesh_coords(const Tree &t, size_type i) const
+    {
+        const auto p_its = t.p_its_u();
+        const auto scale = static_cast<F>(m_n) / m_box_size, half = m_box_size / F(2);
+        return std::array<F, 3>{(p_its[0][i] + half) * scale, (p_its[1][i] + half) * scale,
+                                (p_its[2][i] + half) * scale};
+    }
+    // Assign to m_rmesh the masses of the particles in the index range [begin, end).
+    template <unsigned P, typename Tree>
+    void deposit_range(const Tree &t, size_type begin, size_type end)
+    {
+        const auto mask = m_n - 1u;
+        const auto m_ptr = t.p_its_u()[3];
+        for (auto i = begin; i != end; ++i) {
+            const auto u = mesh_coords(t, i);
+            const auto [x0, wx] = kernel_weights<P>(u[0]);
+            const auto [y0, wy] = kernel_weights<P>(u[1]);
+            const auto [z0, wz] = kernel_weights<P>(u[2]);
+            const auto m = m_ptr[i];
+            for (unsigned a = 0; a < P; ++a) {
+                // NOTE: the periodic wrapping of the (possibly negative) indices
+                // relies on the mesh size being a power of two.
+                const auto ix = static_cast<size_type>(x0 + a) & mask;
+                for (unsigned b = 0; b < P; ++b) {
+                    const auto iy = static_cast<size_type>(y0 + b) & mask;
+                    const auto mw = m * wx[a] * wy[b];
+                    const auto row = m_rmesh.data() + (ix * m_n + iy) * m_n;
+                    for (unsigned c = 0; c < P; ++c) {
+                        row[static_cast<size_type>(z0 + c) & mask] += mw * wz[c];
+                    }
+                }
+            }
+        }
+    }
+    // Mass assignment.
+    template <unsigned P, typename Tree>
+    void deposit(const Tree &t)
+    {
+        using UInt = std::remove_const_t<std::remove_pointer_t<decltype(t.c_it_u())>>;
+        std::fill(m_rmesh.begin(), m_rmesh.end(), F(0));
+        const auto np = t.nparts();
+        // Establish the level of the tree cells used to partition the particles. A cell at level lev covers
+        // s = n / 2**lev mesh points per dimension, and the footprint of its particles extends at most P/2 + 1
+        // points beyond the cell (accounting for the rounding in the computation of the mesh coordinates).
+        // Thus, with s >= 8, the footprints of two cells whose coordinates differ by two along at least one
+        // dimension cannot overlap, and the cells with the same parity of their coordinates can be processed
+        // in parallel.
+        unsigned log2_n = 0;
+        while ((size_type(1) << log2_n) < m_n) {
+            ++log2_n;
+        }
+        const auto cbits = static_cast<unsigned>(cbits_v<UInt, 3>);
+        const auto lev = std::min({log2_n >= 3u ? log2_n - 3u : 0u, cbits, 5u});
+        if (!lev) {
+            deposit_range<P>(t, 0, np);
+            return;
+        }
+        // Group the particles by cell. The particles are in Morton order, thus the particles
+        // in a cell are contiguous. The lowest 3 bits of the Morton code of a cell encode the
+        // parities of its coordinates.
+        const auto c_ptr = t.c_it_u();
+        const auto shift = (cbits - lev) * 3u;
+        std::array<std::vector<std::pair<size_type, size_type>>, 8> chunks;
+        for (size_type i = 0; i != np;) {
+            const auto key = static_cast<UInt>(c_ptr[i] >> shift);
+            auto j = i + 1u;
+            for (; j != np && static_cast<UInt>(c_ptr[j] >> shift) == key; ++j) {
+            }
+            chunks[static_cast<std::size_t>(key & 7u)].emplace_back(i, j);
+            i = j;
+        }
+        for (const auto &ch : chunks) {
+            tbb::parallel_for(tbb::blocked_range<size_type>(0, static_cast<size_type>(ch.size())),
+                              [this, &t, &ch](const auto &range) {
+                                  for (auto k = range.begin(); k != range.end(); ++k) {
+                                      deposit_range<P>(t, ch[k].first, ch[k].second);
+                                  }
+                              });
+        }
+    }
+    // Interpolate m_rmesh at the position of the particles, writing the result multiplied by the factor
+    // fac into out (in the internal order of the tree).
+    template <unsigned P, typename Tree>
+    void interpolate(const Tree &t, F *out, F fac) const
+    {
+        const auto mask = m_n - 1u;
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, t.nparts()), [&](const auto &range) {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto u = mesh_coords(t, i);
+                const auto [x0, wx] = kernel_weights<P>(u[0]);
+                const auto [y0, wy] = kernel_weights<P>(u[1]);
+                const auto [z0, wz] = kernel_weights<P>(u[2]);
+                F acc(0);
+                for (unsigned a = 0; a < P; ++a) {
+                    const auto ix = static_cast<size_type>(x0 + a) & mask;
+                    for (unsigned b = 0; b < P; ++b) {
+                        const auto iy = static_cast<size_type>(y0 + b) & mask;
+                        const auto row = m_rmesh.data() + (ix * m_n + iy) * m_n;
+                        F acc_z(0);
+                        for (unsigned c = 0; c < P; ++c) {
+                            acc_z += wz[c] * row[static_cast<size_type>(z0 + c) & mask];
+                        }
+                        acc += wx[a] * wy[b] * acc_z;
+                    }
+                }
+                out[i] = acc * fac;
+            }
+        });
+    }
+    // Fill m_work with the spectrum of the potential (if j == 3) or of the j-th component of the acceleration.
+    void build_spectrum(std::size_t j)
+    {
+        const auto n = m_n, nh = m_n / 2u + 1u;
+        const auto k_unit = F(2) * static_cast<F>(3.141592653589793238462643383279502884L) / m_box_size;
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, n), [&](const auto &range) {
+            for (auto ix = range.begin(); ix != range.end(); ++ix) {
+                for (size_type iy = 0; iy < n; ++iy) {
+                    for (size_type kz = 0; kz < nh; ++kz) {
+                        const auto idx = (ix * n + iy) * nh + kz;
+                        const auto phi = m_rho[idx] * m_green[idx];
+                        if (j == 3u) {
+                            m_work[idx] = phi;
+                        } else {
+                            // NOTE: the acceleration is -grad(phi), that is, -i*k*phi in Fourier space.
+                            // The derivative of the Nyquist modes is set to zero.
+                            const auto i_j = j == 0u ? ix : (j == 1u ? iy : kz);
+                            const auto k = i_j == n / 2u ? F(0) : k_unit * freq(i_j);
+                            m_work[idx] = std::complex<F>(k * phi.imag(), -k * phi.real());
+                        }
+                    }
+                }
+            }
+        });
+    }
+    template <unsigned Q, unsigned P, typename Tree>
+    void acc_pot_impl(const std::array<F *, tree_nvecs_res<Q, 3>> &out, const Tree &t, F G)
+    {
+        simple_timer st("particle-mesh solver");
+        if (rakau_unlikely(t.box_size() != m_box_size)) {
+            throw std::invalid_argument("The box size of the tree (" + std::to_string(t.box_size())
+                                        + ") differs from the box size of the particle-mesh solver ("
+                                        + std::to_string(m_box_size) + ")");
+        }
+        if (rakau_unlikely(!std::isfinite(G))) {
+            throw std::domain_error("The value of the gravitational constant G must be finite, but it is "
+                                    + std::to_string(G) + " instead");
+        }
+        deposit<P>(t);
+        fft_forward();
+        if constexpr (Q == 0u || Q == 2u) {
+            for (std::size_t j = 0; j < 3u; ++j) {
+                build_spectrum(j);
+                fft_inverse();
+                interpolate<P>(t, out[j], G);
+            }
+        }
+        if constexpr (Q == 1u || Q == 2u) {
+            constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : 3u);
+            build_spectrum(3);
+            fft_inverse();
+            interpolate<P>(t, out[pot_idx], G);
+            // Remove the self-interaction of each particle (see build_green()), and multiply by the masses.
+            const auto m_ptr = t.p_its_u()[3];
+            const auto self_fac = G * m_self_pot;
+            tbb::parallel_for(tbb::blocked_range<size_type>(0, t.nparts()), [&](const auto &range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    out[pot_idx][i] = m_ptr[i] * (out[pot_idx][i] - self_fac * m_ptr[i]);
+                }
+            });
+        }
+    }
+    template <bool Ordered, unsigned Q, typename Tree, typename It>
+    void acc_pot_dispatch(const std::array<It, tree_nvecs_res<Q, 3>> &out, const Tree &t, F G)
+    {
+        constexpr auto nv = tree_nvecs_res<Q, 3>;
+        const auto np = t.nparts();
+        std::array<F *, nv> ptrs;
+        if constexpr (!Ordered && std::is_same_v<It, F *>) {
+            ptrs = out;
+        } else {
+            for (std::size_t j = 0; j < nv; ++j) {
+                m_tmp[j].resize(np);
+                ptrs[j] = m_tmp[j].data();
+            }
+        }
+        if (m_assignment == pm_assignment::cic) {
+            acc_pot_impl<Q, 2>(ptrs, t, G);
+        } else {
+            acc_pot_impl<Q, 3>(ptrs, t, G);
+        }
+        if constexpr (Ordered || !std::is_same_v<It, F *>) {
+            // Copy the results into the output iterators, in the requested order.
+            const auto &perm = t.perm();
+            using it_diff_t = typename std::iterator_traits<It>::difference_type;
+            for (std::size_t j = 0; j < nv; ++j) {
+                for (size_type i = 0; i < np; ++i) {
+                    *(out[j] + boost::numeric_cast<it_diff_t>(Ordered ? perm[i] : i)) = ptrs[j][i];
+                }
+            }
+        }
+    }
+    template <bool Ordered, unsigned Q, typename Tree, typename Allocator>
+    void acc_pot_dispatch(std::array<std::vector<F, Allocator>, tree_nvecs_res<Q, 3>> &out, const Tree &t, F G)
+    {
+        std::array<F *, tree_nvecs_res<Q, 3>> out_ptrs;
+        for (std::size_t j = 0; j < tree_nvecs_res<Q, 3>; ++j) {
+            out[j].resize(boost::numeric_cast<decltype(out[j].size())>(t.nparts()));
+            out_ptrs[j] = out[j].data();
+        }
+        acc_pot_dispatch<Ordered, Q>(out_ptrs, t, G);
+    }
+    template <typename... KwArgs>
+    static F parse_G(KwArgs &&... args)
+    {
+        igor::parser p{args...};
+
+        static_assert(!p.has_duplicates(), "Duplicate keyword arguments are not allowed.");
+        static_assert(!p.has_unnamed_arguments(),
+                      "Only keyword arguments can be passed to the functions of the particle-mesh solver.");
+
+        if constexpr (p.has(kwargs::G)) {
+            return boost::numeric_cast<F>(p(kwargs::G));
+        } else {
+            return F(1);
+        }
+    }
+
+public:
+    // Computation of the long-range accelerations/potentials of the particles of the octree t. The _u variants
+    // write the results in the internal order of the tree, the _o variants in the original order. The output
+    // can be an array of vectors (which will be resized as needed) or an array of iterators. The optional
+    // keyword argument is the grav constant G. Like in the tree, the potentials include the masses of the particles.
+    template <typename UInt, mac MAC, typename Out, typename... KwArgs>
+    void accs_u(Out &&out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        acc_pot_dispatch<false, 0>(out, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename Out, typename... KwArgs>
+    void accs_o(Out &&out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        acc_pot_dispatch<true, 0>(out, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename Allocator, typename... KwArgs>
+    void pots_u(std::vector<F, Allocator> &out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        out.resize(boost::numeric_cast<decltype(out.size())>(t.nparts()));
+        acc_pot_dispatch<false, 1>(std::array{out.data()}, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename It, typename... KwArgs>
+    void pots_u(It out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        acc_pot_dispatch<false, 1>(std::array<It, 1>{out}, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename Allocator, typename... KwArgs>
+    void pots_o(std::vector<F, Allocator> &out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        out.resize(boost::numeric_cast<decltype(out.size())>(t.nparts()));
+        acc_pot_dispatch<true, 1>(std::array{out.data()}, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename It, typename... KwArgs>
+    void pots_o(It out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        acc_pot_dispatch<true, 1>(std::array<It, 1>{out}, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename Out, typename... KwArgs>
+    void accs_pots_u(Out &&out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        acc_pot_dispatch<false, 2>(out, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    template <typename UInt, mac MAC, typename Out, typename... KwArgs>
+    void accs_pots_o(Out &&out, const tree<3, F, UInt, MAC> &t, KwArgs &&... args)
+    {
+        acc_pot_dispatch<true, 2>(out, t, parse_G(std::forward<KwArgs>(args)...));
+    }
+    size_type mesh_size() const
+    {
+        return m_n;
+    }
+    F box_size() const
+    {
+        return m_box_size;
+    }
+    F r_split() const
+    {
+        return m_r_split;
+    }
+    pm_assignment assignment() const
+    {
+        return m_assignment;
+    }
+
+private:
+    size_type m_n;
+    F m_box_size, m_r_split = F(0);
+    pm_assignment m_assignment = pm_assignment::cic;
+    pm_fft<F> m_fft_n{1}, m_fft_h{1};
+    // The real mesh, of size n**3, and the half spectra of the density and of the
+    // quantity being computed, of size n*n*(n/2 + 1). The z dimension is the contiguous one.
+    std::vector<F> m_rmesh;
+    std::vector<std::complex<F>> m_rho, m_work;
+    // The Green's function, and the long-range potential induced by a unit mass on itself.
+    std::vector<F> m_green;
+    F m_self_pot = F(0);
+    // Temporary storage for the results, when they cannot be written directly into the output.
+    std::array<std::vector<F>, 4> m_tmp;
+};
+
+} // namespace rakau
+
+#endif
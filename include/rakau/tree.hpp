@@ -42,6 +42,7 @@
 
 #include <tbb/blocked_range.h>
 #include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
 #include <tbb/parallel_reduce.h>
 #include <tbb/parallel_sort.h>
@@ -51,6 +52,9 @@
 #include <xsimd/xsimd.hpp>
 
 #include <rakau/config.hpp>
+#if defined(RAKAU_WITH_ISA_DISPATCH)
+#include <rakau/detail/cpu_fwd.hpp>
+#endif
 #if defined(RAKAU_WITH_CUDA)
 #include <rakau/detail/cuda_fwd.hpp>
 #endif
@@ -205,6 +209,31 @@ inline long double fma_wrap(long double x, long double y, long double z)
 #endif
 }
 
+// Compensated (Kahan-Babuska-Neumaier) summation.
+template <typename F>
+struct comp_sum {
+    void add(F x)
+    {
+        const auto t = m_sum + x;
+        if (std::abs(m_sum) >= std::abs(x)) {
+            m_comp += (m_sum - t) + x;
+        } else {
+            m_comp += (x - t) + m_sum;
+        }
+        m_sum = t;
+    }
+    void merge(const comp_sum &other)
+    {
+        add(other.m_sum);
+        m_comp += other.m_comp;
+    }
+    F value() const
+    {
+        return m_sum + m_comp;
+    }
+    F m_sum = F(0), m_comp = F(0);
+};
+
 // Some handy aliases for std::iterator_traits.
 template <typename It>
 using it_value_type = typename std::iterator_traits<It>::value_type;
@@ -546,6 +575,11 @@ inline constexpr bool simd_enabled_v =
 #endif
     ;
 
+// The batch type used by default in the tree traversal kernels for the type F:
+// the xsimd batch type if simd is enabled, F itself otherwise.
+template <typename F>
+using simd_batch_t = std::conditional_t<simd_enabled_v<F>, xsimd::simd_type<F>, F>;
+
 // Helper to detect whether fast rsqrt intrinsics should be used or not
 // for the batch type Batch. They are used if available and if not explicitly
 // disabled by the RAKAU_DISABLE_RSQRT config option.
@@ -558,8 +592,28 @@ inline constexpr bool use_fast_inv_sqrt =
 #endif
     ;
 
+// Alignment of the vectors of floating-point values. With runtime ISA dispatch,
+// the same tree type is used by kernels compiled for different instruction sets,
+// thus we need to pick the largest alignment required by any of them.
+inline constexpr std::size_t simd_alignment =
+#if defined(RAKAU_WITH_ISA_DISPATCH)
+    64
+#else
+    XSIMD_DEFAULT_ALIGNMENT
+#endif
+    ;
+
 // Default values for the max_leaf_n and ncrit tree parameters.
 // These are determined experimentally from benchmarks on various systems.
+#if defined(RAKAU_WITH_ISA_DISPATCH)
+
+// NOTE: with runtime ISA dispatch, use the values tuned for the
+// instruction set selected at runtime.
+inline const unsigned default_max_leaf_n = cpu_dispatch_default_max_leaf_n();
+
+inline const unsigned default_ncrit = cpu_dispatch_default_ncrit();
+
+#else
 
 // NOTE: a value of 8 might get *slightly* better performance on the
 // acc/pot computations, but it results in a tree twice as big.
@@ -575,6 +629,8 @@ inline constexpr unsigned default_ncrit =
     128
 #endif
     ;
+
+#endif
 } // namespace detail
 
 namespace kwargs
@@ -584,6 +640,8 @@ namespace kwargs
 IGOR_MAKE_NAMED_ARGUMENT(box_size);
 IGOR_MAKE_NAMED_ARGUMENT(max_leaf_n);
 IGOR_MAKE_NAMED_ARGUMENT(ncrit);
+IGOR_MAKE_NAMED_ARGUMENT(coord_bits);
+IGOR_MAKE_NAMED_ARGUMENT(periodic);
 
 template <std::size_t>
 struct coords_tag {
@@ -603,13 +661,182 @@ IGOR_MAKE_NAMED_ARGUMENT(nparts);
 IGOR_MAKE_NAMED_ARGUMENT(G);
 IGOR_MAKE_NAMED_ARGUMENT(eps);
 IGOR_MAKE_NAMED_ARGUMENT(split);
+IGOR_MAKE_NAMED_ARGUMENT(mutual);
+IGOR_MAKE_NAMED_ARGUMENT(mixed_precision);
+IGOR_MAKE_NAMED_ARGUMENT(active);
+IGOR_MAKE_NAMED_ARGUMENT(r_split);
+IGOR_MAKE_NAMED_ARGUMENT(r_cut);
+IGOR_MAKE_NAMED_ARGUMENT(err_tol);
 
 } // namespace kwargs
 
 // Vector type for storing floating-point values. The allocator does default-init,
 // rather than value-init, and it enforces the SIMD-mandated alignment value.
 template <typename F>
-using f_vector = std::vector<F, di_aligned_allocator<F, XSIMD_DEFAULT_ALIGNMENT>>;
+using f_vector = std::vector<F, di_aligned_allocator<F, simd_alignment>>;
+
+// The integrals of motion of a system of particles, as computed by tree::diagnostics_u/o(). In 2D,
+// the angular momentum has a single component (the one perpendicular to the plane).
+template <std::size_t NDim, typename F>
+struct tree_diagnostics {
+    F kinetic;
+    F potential;
+    std::array<F, NDim> momentum;
+    std::array<F, NDim == 2u ? 1u : 3u> ang_momentum;
+};
+
+inline namespace detail
+{
+
+// Table of the Ewald corrections for a periodic cubic domain of unit size. The corrections are the differences
+// between the periodic interaction (including the uniform neutralising background) and the Newtonian interaction
+// of a unit mass, as functions of the separation vector. By symmetry, the table needs to cover only the octant
+// [0, 1/2]**3: the correction to the potential is even in each component of the separation, while the
+// correction to each component of the acceleration is odd in that component and even in the others.
+template <typename F>
+struct ewald_table {
+    // The number of intervals per dimension.
+    static constexpr unsigned n = 64;
+    // For each of the (n + 1)**3 points of the grid, the corrections to the 3 components of the acceleration,
+    // followed by the correction to the potential.
+    std::vector<F> data;
+    // The correction to the potential at zero separation.
+    F pot0;
+    // Trilinear interpolation of the table at the point (x, y, z) of the octant.
+    void interp(F (&out)[4], F x, F y, F z) const
+    {
+        constexpr auto np1 = n + 1u;
+        unsigned idx[3];
+        F frac[3];
+        const F xs[3] = {x, y, z};
+        for (std::size_t j = 0; j < 3u; ++j) {
+            const auto u = xs[j] * static_cast<F>(2u * n);
+            // NOTE: clamp the index in order to handle separations which are slightly larger
+            // than 1/2 due to floating-point rounding.
+            idx[j] = std::min(static_cast<unsigned>(u), n - 1u);
+            frac[j] = u - static_cast<F>(idx[j]);
+        }
+        for (auto &o : out) {
+            o = F(0);
+        }
+        for (unsigned c = 0; c < 8u; ++c) {
+            const auto ix = idx[0] + (c & 1u), iy = idx[1] + ((c >> 1) & 1u), iz = idx[2] + ((c >> 2) & 1u);
+            const auto w = ((c & 1u) ? frac[0] : F(1) - frac[0]) * (((c >> 1) & 1u) ? frac[1] : F(1) - frac[1])
+                           * (((c >> 2) & 1u) ? frac[2] : F(1) - frac[2]);
+            const auto ptr = data.data() + static_cast<std::size_t>((ix * np1 + iy) * np1 + iz) * 4u;
+            for (std::size_t j = 0; j < 4u; ++j) {
+                out[j] = fma_wrap(w, ptr[j], out[j]);
+            }
+        }
+    }
+};
+
+// Ewald summation of the corrections to the acceleration (out[0..2]) and to the potential (out[3]) at the
+// separation x in a periodic cubic domain of unit size (see ewald_table). The sums in real and reciprocal space
+// are truncated so that the result is accurate to double precision for separations within the domain.
+inline void ewald_corr(double (&out)[4], const double (&x)[3])
+{
+    constexpr double pi = 3.141592653589793238462643383279502884, alpha = 2, r2max = 9;
+    constexpr int nmax = 3, h2max = 10;
+    for (auto &o : out) {
+        o = 0;
+    }
+    // Real space.
+    for (int n0 = -nmax; n0 <= nmax; ++n0) {
+        for (int n1 = -nmax; n1 <= nmax; ++n1) {
+            for (int n2 = -nmax; n2 <= nmax; ++n2) {
+                const double d[3] = {x[0] - n0, x[1] - n1, x[2] - n2};
+                const auto r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+                if (r2 > r2max) {
+                    // NOTE: erfc(alpha * r) is negligible here.
+                    continue;
+                }
+                const auto r = std::sqrt(r2);
+                if (r == 0) {
+                    // NOTE: limit of erfc(alpha * r) / r - 1 / r for r -> 0, where
+                    // the Newtonian term is removed below.
+                    out[3] += 2 * alpha / std::sqrt(pi);
+                    continue;
+                }
+                const auto erfc_ar = std::erfc(alpha * r);
+                const auto f
+                    = (erfc_ar + 2 * alpha * r / std::sqrt(pi) * std::exp(-alpha * alpha * r * r)) / (r * r * r);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    out[j] -= d[j] * f;
+                }
+                out[3] -= erfc_ar / r;
+            }
+        }
+    }
+    // Reciprocal space.
+    // NOTE: the terms for h and -h are identical, thus we sum only over the half-space
+    // of the wave vectors which are lexicographically positive, and double the result.
+    for (int h0 = 0; h0 <= nmax; ++h0) {
+        for (int h1 = -nmax; h1 <= nmax; ++h1) {
+            for (int h2 = -nmax; h2 <= nmax; ++h2) {
+                const auto hh = h0 * h0 + h1 * h1 + h2 * h2;
+                if (hh > h2max || (h0 == 0 && (h1 < 0 || (h1 == 0 && h2 <= 0)))) {
+                    continue;
+                }
+                const auto h2d = static_cast<double>(hh), e = std::exp(-pi * pi * h2d / (alpha * alpha)) / h2d,
+                           arg = 2 * pi * (h0 * x[0] + h1 * x[1] + h2 * x[2]);
+                const double h[3] = {static_cast<double>(h0), static_cast<double>(h1), static_cast<double>(h2)};
+                const auto s = std::sin(arg);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    out[j] -= 4 * h[j] * e * s;
+                }
+                out[3] -= 2 * e * std::cos(arg) / pi;
+            }
+        }
+    }
+    // The contribution of the background.
+    out[3] += pi / (alpha * alpha);
+    // Remove the Newtonian interaction with the nearest image.
+    const auto x2 = x[0] * x[0] + x[1] * x[1] + x[2] * x[2];
+    if (x2 != 0) {
+        const auto r = std::sqrt(x2);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            out[j] += x[j] / (x2 * r);
+        }
+        out[3] += 1 / r;
+    }
+}
+
+// Get the (lazily computed) table of the Ewald corrections.
+template <typename F>
+inline const ewald_table<F> &get_ewald_table()
+{
+    static const ewald_table<F> retval = []() {
+        ewald_table<F> t;
+        if constexpr (std::is_same_v<F, double>) {
+            simple_timer st("Ewald table computation");
+            constexpr auto n = ewald_table<F>::n, np1 = n + 1u;
+            t.data.resize(static_cast<std::size_t>(np1) * np1 * np1 * 4u);
+            tbb::parallel_for(tbb::blocked_range(0u, np1 * np1), [&t](const auto &range) {
+                double x[3], out[4];
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    x[0] = static_cast<double>(i / np1) / (2. * n);
+                    x[1] = static_cast<double>(i % np1) / (2. * n);
+                    for (unsigned k = 0; k < np1; ++k) {
+                        x[2] = static_cast<double>(k) / (2. * n);
+                        ewald_corr(out, x);
+                        std::copy(out, out + 4, t.data.data() + (static_cast<std::size_t>(i) * np1 + k) * 4u);
+                    }
+                }
+            });
+        } else {
+            // NOTE: the table is always computed in double precision, and then converted.
+            const auto &dt = get_ewald_table<double>();
+            t.data.resize(dt.data.size());
+            std::transform(dt.data.begin(), dt.data.end(), t.data.begin(), [](double x) { return static_cast<F>(x); });
+        }
+        t.pot0 = t.data[3];
+        return t;
+    }();
+    return retval;
+}
+
+} // namespace detail
 
 // NOTE: possible improvements:
 // - it is still not yet clear to me what the NUMA picture is here. During tree traversal, the results
@@ -652,11 +879,27 @@ class tree
     static_assert(std::is_integral_v<UInt> && std::is_unsigned_v<UInt>,
                   "The type UInt must be a C++ unsigned integral type.");
     // Check the MAC enum value.
-    static_assert(MAC >= mac::bh && MAC <= mac::bh_geom, "The selected MAC does not exist.");
+    static_assert(MAC >= mac::bh && MAC <= mac::bh_box, "The selected MAC does not exist.");
     // cbits shortcut.
     static constexpr auto cbits = cbits_v<UInt, NDim>;
     // simd_enabled shortcut.
     static constexpr bool simd_enabled = simd_enabled_v<F>;
+    // The traversal kernels are parametrised over the batch type B, and they
+    // take the SIMD codepaths if B is not F itself (see simd_batch_t).
+    template <typename B>
+    static constexpr bool batch_simd = !std::is_same_v<B, F> && (NDim == 2u || NDim == 3u);
+#if defined(RAKAU_WITH_ISA_DISPATCH)
+    // Flag signalling whether precompiled cpu kernels are available for this tree type.
+    static constexpr bool cpu_dispatch_supported
+        = (NDim == 3u || NDim == 2u)
+          && std::conjunction_v<std::disjunction<std::is_same<UInt, std::uint64_t>, std::is_same<UInt, std::uint32_t>>,
+                                std::disjunction<std::is_same<F, float>, std::is_same<F, double>>>;
+    // The precompiled cpu kernels need access to the internals.
+    template <cpu_isa, unsigned Q, std::size_t NDim2, typename F2, typename UInt2, mac MAC2>
+    friend void detail::cpu_acc_pot_impl(const tree<NDim2, F2, UInt2, MAC2> &,
+                                         const std::array<F2 *, tree_nvecs_res<Q, NDim2>> &, F2, F2, F2,
+                                         tree_size_t<F2>, tree_size_t<F2>, bool, bool, const tree_active_t<F2> *);
+#endif
 
 public:
     using size_type = tree_size_t<F>;
@@ -673,6 +916,16 @@ private:
     using cnode_type = tree_cnode_t<F, UInt>;
     // List of critical nodes.
     using cnode_list_type = std::vector<cnode_type, di_aligned_allocator<cnode_type>>;
+    // The compressed coordinate store. If bits is nonzero, the coordinates of the particles
+    // in each leaf node are also stored as bits-wide integer offsets (in c16 or c32) from the geometric
+    // centre of the leaf. nodes contains, for each leaf node in the tree structure, the coordinates of
+    // the geometric centre followed by the scale used to convert the offsets back to coordinates.
+    struct ccoords_store {
+        unsigned bits = 0;
+        std::array<std::vector<std::int16_t>, NDim> c16;
+        std::array<std::vector<std::int32_t>, NDim> c32;
+        std::vector<std::array<F, NDim + 1u>> nodes;
+    };
     // A small functor to right shift an input UInt by a fixed amount.
     // Used in the tree construction functions.
     struct code_shifter {
@@ -903,6 +1156,106 @@ private:
             return 0u;
         }
     }
+    // The largest offset that can be stored in the compressed coordinate store via the integral type Int.
+    // It is limited by the precision of F, so that the offsets can be represented exactly in F.
+    template <typename Int>
+    static constexpr F ccoords_q_max()
+    {
+        if constexpr (std::numeric_limits<F>::digits >= std::numeric_limits<Int>::digits) {
+            return static_cast<F>(std::numeric_limits<Int>::max());
+        } else {
+            return static_cast<F>((Int(1) << std::numeric_limits<F>::digits) - 1);
+        }
+    }
+    // Build the compressed coordinate store from the particle data and the tree structure.
+    // This is a no-op if the compressed coordinate store is not active.
+    void build_ccoords()
+    {
+        if (!m_ccoords.bits) {
+            return;
+        }
+        simple_timer st("compressed coordinates building");
+        const auto np = m_parts[0].size();
+        for (std::size_t j = 0; j < NDim; ++j) {
+            if (m_ccoords.bits == 16u) {
+                m_ccoords.c16[j].resize(np);
+            } else {
+                m_ccoords.c32[j].resize(np);
+            }
+        }
+        m_ccoords.nodes.resize(m_tree.size());
+        auto encode = [this](auto &c, size_type node_idx) {
+            using int_t = typename std::remove_reference_t<decltype(c[0])>::value_type;
+            constexpr auto q_max = ccoords_q_max<int_t>();
+            const auto &node = m_tree[node_idx];
+            auto &nd = m_ccoords.nodes[node_idx];
+            F centre[NDim];
+            get_node_centre(centre, node.code, m_box_size);
+            // NOTE: the particles of a node may lie slightly outside the node's
+            // boundaries due to the discretisation of the coordinates, thus we
+            // establish the scale from the largest offset rather than from the node size.
+            F max_off(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                nd[j] = centre[j];
+                for (auto i = node.begin; i != node.end; ++i) {
+                    max_off = std::max(max_off, std::abs(m_parts[j][i] - centre[j]));
+                }
+            }
+            nd[NDim] = max_off / q_max;
+            const auto inv_scale = max_off == F(0) ? F(0) : q_max / max_off;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                for (auto i = node.begin; i != node.end; ++i) {
+                    const auto q = std::nearbyint((m_parts[j][i] - centre[j]) * inv_scale);
+                    c[j][i] = static_cast<int_t>(std::max(-q_max, std::min(q_max, q)));
+                }
+            }
+        };
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, static_cast<size_type>(m_tree.size())),
+                          [this, &encode](const auto &range) {
+                              for (auto i = range.begin(); i != range.end(); ++i) {
+                                  if (m_tree[i].n_children) {
+                                      continue;
+                                  }
+                                  if (m_ccoords.bits == 16u) {
+                                      encode(m_ccoords.c16, i);
+                                  } else {
+                                      encode(m_ccoords.c32, i);
+                                  }
+                              }
+                          });
+    }
+    // Decode from the compressed coordinate store the coordinates of the particles in the node with index node_idx
+    // (in the tree structure). The coordinates are written into out, which must provide enough room for all the
+    // particles in the node.
+    void ccoords_decode_node(const std::array<F *, NDim> &out, size_type node_idx) const
+    {
+        assert(m_ccoords.bits);
+        const auto &node = m_tree[node_idx];
+        auto decode = [this, &out, &node](const auto &c, size_type leaf_idx) {
+            const auto &leaf = m_tree[leaf_idx];
+            const auto &nd = m_ccoords.nodes[leaf_idx];
+            const auto offset = static_cast<size_type>(leaf.begin - node.begin);
+            const auto size = static_cast<size_type>(leaf.end - leaf.begin);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                const auto c_ptr = c[j].data() + leaf.begin;
+                const auto o_ptr = out[j] + offset;
+                for (size_type k = 0; k < size; ++k) {
+                    o_ptr[k] = fma_wrap(static_cast<F>(c_ptr[k]), nd[NDim], nd[j]);
+                }
+            }
+        };
+        // Decode all the leaves of the node (including the node itself, if it is a leaf).
+        for (auto i = node_idx; i != node_idx + node.n_children + 1u; ++i) {
+            if (m_tree[i].n_children) {
+                continue;
+            }
+            if (m_ccoords.bits == 16u) {
+                decode(m_ccoords.c16, i);
+            } else {
+                decode(m_ccoords.c32, i);
+            }
+        }
+    }
     void build_tree()
     {
         simple_timer st("node building");
@@ -1033,6 +1386,9 @@ private:
         });
         tg.wait();
 
+        // Fill in the compressed coordinate store, if needed.
+        build_ccoords();
+
         // Various debug checks.
         // Check the tree is sorted according to the nodal code comparison.
         assert(std::is_sorted(m_tree.begin(), m_tree.end(),
@@ -1064,8 +1420,17 @@ private:
         // Verify more node properties.
         assert(std::all_of(m_tree.begin(), m_tree.end(), [this](const auto &n) {
             const auto node_dim = get_node_dim(n.level, m_box_size);
-            if constexpr (MAC == mac::bh) {
+            if constexpr (MAC == mac::bh || MAC == mac::relative) {
                 return n.dim2 == node_dim * node_dim;
+            } else if constexpr (MAC == mac::bh_box) {
+                // NOTE: the bounding box of the particles is contained in the node
+                // (up to the rounding errors in the discretisation of the coordinates).
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    if (!(n.lo[j] <= n.hi[j])) {
+                        return false;
+                    }
+                }
+                return n.dim2 >= F(0);
             } else {
                 static_assert(MAC == mac::bh_geom);
                 return n.dim == node_dim;
@@ -1105,16 +1470,17 @@ private:
         F tot_mass(0), com_pos[NDim]{};
 
         size_type i = 0;
-        if constexpr (simd_enabled && NDim == 3u) {
+        if constexpr (simd_enabled && (NDim == 2u || NDim == 3u)) {
             using batch_type = xsimd::simd_type<F>;
             constexpr auto batch_size = batch_type::size;
             const size_type vec_size = size - size % batch_size;
 
-            // Get out pointers to the coords.
-            auto [x_ptr, y_ptr, z_ptr] = c_ptrs;
-
             // Init the vector accumulators.
-            batch_type tot_mass_vec(F(0)), com_pos_x_vec(F(0)), com_pos_y_vec(F(0)), com_pos_z_vec(F(0));
+            batch_type tot_mass_vec(F(0));
+            std::array<batch_type, NDim> com_pos_vecs;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                com_pos_vecs[j] = batch_type(F(0));
+            }
 
             for (; i < vec_size; i += batch_size) {
                 // Load the mass.
@@ -1122,16 +1488,17 @@ private:
 
                 // Update the accumulators.
                 tot_mass_vec += mass_vec;
-                com_pos_x_vec = xsimd_fma(mass_vec, batch_type(x_ptr + i, xsimd::unaligned_mode{}), com_pos_x_vec);
-                com_pos_y_vec = xsimd_fma(mass_vec, batch_type(y_ptr + i, xsimd::unaligned_mode{}), com_pos_y_vec);
-                com_pos_z_vec = xsimd_fma(mass_vec, batch_type(z_ptr + i, xsimd::unaligned_mode{}), com_pos_z_vec);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    com_pos_vecs[j]
+                        = xsimd_fma(mass_vec, batch_type(c_ptrs[j] + i, xsimd::unaligned_mode{}), com_pos_vecs[j]);
+                }
             }
 
             // Flatten the vectors into the scalar accumulators.
             tot_mass = xsimd::hadd(tot_mass_vec);
-            com_pos[0] = xsimd::hadd(com_pos_x_vec);
-            com_pos[1] = xsimd::hadd(com_pos_y_vec);
-            com_pos[2] = xsimd::hadd(com_pos_z_vec);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                com_pos[j] = xsimd::hadd(com_pos_vecs[j]);
+            }
         }
         for (; i < size; ++i) {
             const auto mass = m_ptr[i];
@@ -1147,11 +1514,26 @@ private:
             get_node_centre(geo_centre, node.code, m_box_size);
         }
 
+        // Bounding box of the particles. Computed only with the bh_box MAC.
+        [[maybe_unused]] F bb_lo[NDim], bb_hi[NDim];
+        if constexpr (MAC == mac::bh_box) {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                const auto mm = std::minmax_element(c_ptrs[j], c_ptrs[j] + size);
+                bb_lo[j] = *mm.first;
+                bb_hi[j] = *mm.second;
+            }
+        }
+
         if (tot_mass == F(0)) {
             // If the total mass of the node is zero, it does not have a com.
             // Use the geometrical centre in its stead.
-            if constexpr (MAC == mac::bh) {
+            if constexpr (MAC == mac::bh || MAC == mac::relative) {
                 get_node_centre(com_pos, node.code, m_box_size);
+            } else if constexpr (MAC == mac::bh_box) {
+                // Use the centre of the bounding box, which is always inside the node.
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    com_pos[j] = (bb_lo[j] + bb_hi[j]) / F(2);
+                }
             } else {
                 static_assert(MAC == mac::bh_geom);
                 // Don't recompute it if it is available already.
@@ -1181,14 +1563,39 @@ private:
 
         // Compute the node dimension required by the selected MAC,
         // and copy it into the node structure.
-        const auto node_dim = get_node_dim(node.level, m_box_size);
-        if constexpr (MAC == mac::bh) {
+        [[maybe_unused]] const auto node_dim = get_node_dim(node.level, m_box_size);
+        if constexpr (MAC == mac::bh || MAC == mac::relative) {
             node.dim2 = node_dim * node_dim;
             if (rakau_unlikely(!std::isfinite(node.dim2))) {
                 throw std::invalid_argument(
                     "The computation of the square of the dimension of a node produced the non-finite value "
                     + std::to_string(node.dim2));
             }
+            if constexpr (MAC == mac::relative) {
+                // The relative MAC needs also the product of the mass and of the square of the dimension.
+                node.mdim2 = tot_mass * node.dim2;
+                if (rakau_unlikely(!std::isfinite(node.mdim2))) {
+                    throw std::invalid_argument("The computation of the product of the mass and of the square of the "
+                                                "dimension of a node produced the non-finite value "
+                                                + std::to_string(node.mdim2));
+                }
+            }
+        } else if constexpr (MAC == mac::bh_box) {
+            // NOTE: the size of the node is the largest extent of the bounding box,
+            // which is never larger than node_dim.
+            F dim2(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                node.lo[j] = bb_lo[j];
+                node.hi[j] = bb_hi[j];
+                dim2 = std::max(dim2, (bb_hi[j] - bb_lo[j]) * (bb_hi[j] - bb_lo[j]));
+            }
+            node.dim2 = dim2;
+            if (rakau_unlikely(!std::isfinite(node.dim2))) {
+                throw std::invalid_argument(
+                    "The computation of the square of the extent of the bounding box of a node produced the "
+                    "non-finite value "
+                    + std::to_string(node.dim2));
+            }
         } else {
             static_assert(MAC == mac::bh_geom);
             node.dim = node_dim;
@@ -1217,6 +1624,41 @@ private:
             retval[j] = detail::disc_single_coord<NDim, UInt>(m_parts[j][idx], inv_box_size);
         }
     }
+    // Wrap the coordinates of the particles into the domain (periodic mode). The coordinates
+    // which are already within the domain are not modified.
+    void periodic_wrap()
+    {
+        simple_timer st("periodic wrapping");
+        assert(m_periodic);
+        const auto np = nparts();
+        const auto box_size = m_box_size, inv_box_size = F(1) / m_box_size;
+        // NOTE: the position within the domain is computed as in disc_single_coord(), so that the wrapped
+        // coordinates are guaranteed to pass the discretisation checks. Non-finite coordinates are not
+        // modified, and they will be caught by the discretisation.
+        auto rel_pos = [inv_box_size](F x) { return fma_wrap(x, inv_box_size, F(1) / F(2)); };
+        for (std::size_t j = 0; j < NDim; ++j) {
+            tbb::parallel_for(tbb::blocked_range(size_type(0), np),
+                              [ptr = m_parts[j].data(), box_size, rel_pos](const auto &range) {
+                                  for (auto i = range.begin(); i != range.end(); ++i) {
+                                      const auto t = rel_pos(ptr[i]);
+                                      if (!std::isfinite(t) || (t >= F(0) && t < F(1))) {
+                                          continue;
+                                      }
+                                      auto x = ptr[i] - box_size * std::floor(t);
+                                      const auto t_new = rel_pos(x);
+                                      if (rakau_unlikely(t_new < F(0) || t_new >= F(1))) {
+                                          // NOTE: because of rounding, the wrapped coordinate might still
+                                          // be (barely) outside the domain. Move it to the lower boundary.
+                                          x = -box_size / F(2);
+                                          while (rel_pos(x) < F(0)) {
+                                              x = std::nextafter(x, F(0));
+                                          }
+                                      }
+                                      ptr[i] = x;
+                                  }
+                              });
+        }
+    }
     // Small helper to determine m_inv_perm based on the indirect sorting vector m_perm.
     // This is used when (re)building the tree.
     void perm_to_inv_perm()
@@ -1302,7 +1744,7 @@ private:
     // as we need to index into it for parallel iteration.
     template <typename PData>
     void construct_impl(const F &box_size, bool box_size_deduced, PData &&p_data, [[maybe_unused]] const size_type &N,
-                        const size_type &max_leaf_n, const size_type &ncrit)
+                        const size_type &max_leaf_n, const size_type &ncrit, unsigned coord_bits, bool periodic)
     {
         simple_timer st("overall tree construction");
 
@@ -1314,6 +1756,8 @@ private:
         m_box_size_deduced = box_size_deduced;
         m_max_leaf_n = max_leaf_n;
         m_ncrit = ncrit;
+        m_ccoords.bits = coord_bits;
+        m_periodic = periodic;
 
         // Param consistency checks: if size is deduced, box_size must be zero.
         assert(!m_box_size_deduced || m_box_size == F(0));
@@ -1334,6 +1778,24 @@ private:
             throw std::invalid_argument("The critical number of particles for the vectorised computation of the "
                                         "potentials/accelerations must be nonzero");
         }
+        // Check the coord_bits param.
+        if (coord_bits != 0u && coord_bits != 16u && coord_bits != 32u) {
+            throw std::invalid_argument("The number of bits for the compressed storage of the coordinates must be "
+                                        "0, 16 or 32, but it is "
+                                        + std::to_string(coord_bits) + " instead");
+        }
+        // Check the periodic flag.
+        if (periodic) {
+            if (NDim != 3u) {
+                throw std::invalid_argument("Periodic domains are available only in 3 dimensions");
+            }
+            if (box_size_deduced) {
+                throw std::invalid_argument("The box size of a periodic domain must be specified explicitly");
+            }
+            if (m_box_size == F(0)) {
+                throw std::invalid_argument("The box size of a periodic domain must be positive");
+            }
+        }
 
         if constexpr (move_data) {
 #if !defined(NDEBUG)
@@ -1406,6 +1868,11 @@ private:
             m_box_size = determine_box_size(p_its_u(), np);
         }
 
+        // Wrap the coordinates into the domain, if needed.
+        if (m_periodic) {
+            periodic_wrap();
+        }
+
         // Compute the inverse of the box size for discretisation.
         const auto inv_box_size = F(1) / m_box_size;
 
@@ -1474,9 +1941,12 @@ private:
         // have been called prior to calling this function).
         assert(!m_rocm);
         // If no accelerator is available, don't bother and leave m_rocm empty.
-        if (rocm_has_accelerator()) {
-            m_rocm.emplace(p_its_u(), m_codes.data(), boost::numeric_cast<int>(nparts()), m_tree.data(),
-                           boost::numeric_cast<int>(m_tree.size()));
+        // NOTE: the ROCm kernels are not available for the relative MAC.
+        if constexpr (MAC != mac::relative) {
+            if (rocm_has_accelerator()) {
+                m_rocm.emplace(p_its_u(), m_codes.data(), boost::numeric_cast<int>(nparts()), m_tree.data(),
+                               boost::numeric_cast<int>(m_tree.size()));
+            }
         }
 #endif
     }
@@ -1494,7 +1964,9 @@ private:
 
 public:
     // Default constructor.
-    tree() : m_box_size(0), m_box_size_deduced(false), m_max_leaf_n(default_max_leaf_n), m_ncrit(default_ncrit)
+    tree()
+        : m_box_size(0), m_box_size_deduced(false), m_max_leaf_n(default_max_leaf_n), m_ncrit(default_ncrit),
+          m_periodic(false)
     {
         rocm_init_state();
     }
@@ -1586,6 +2058,24 @@ public:
                 }
             }();
 
+            // Handle the compressed coordinate store.
+            const auto coord_bits = [&p]() {
+                if constexpr (p.has(kwargs::coord_bits)) {
+                    return boost::numeric_cast<unsigned>(p(kwargs::coord_bits));
+                } else {
+                    return 0u;
+                }
+            }();
+
+            // Handle the periodic domain flag.
+            const auto periodic = [&p]() {
+                if constexpr (p.has(kwargs::periodic)) {
+                    return static_cast<bool>(p(kwargs::periodic));
+                } else {
+                    return false;
+                }
+            }();
+
             // Fetch the type of the particle data for the first dimension.
             using p_data_t = decltype(p(kwargs::coords<0>));
             using p_data_strip_t = uncvref_t<p_data_t>;
@@ -1696,9 +2186,10 @@ public:
             // Invoke the ctor implementation. Need to separate the case in which we can move in the
             // data, which requires the use of std::move().
             if constexpr (move_data) {
-                construct_impl(box_size, box_size_deduced, std::move(p_data), N, max_leaf_n, ncrit);
+                construct_impl(box_size, box_size_deduced, std::move(p_data), N, max_leaf_n, ncrit, coord_bits,
+                               periodic);
             } else {
-                construct_impl(box_size, box_size_deduced, p_data, N, max_leaf_n, ncrit);
+                construct_impl(box_size, box_size_deduced, p_data, N, max_leaf_n, ncrit, coord_bits, periodic);
             }
 
             // NOTE: perhaps we can fold this into construct_impl() eventually.
@@ -1710,7 +2201,8 @@ public:
         : m_box_size(other.m_box_size), m_box_size_deduced(other.m_box_size_deduced), m_max_leaf_n(other.m_max_leaf_n),
           m_ncrit(other.m_ncrit), m_parts(other.m_parts), m_codes(other.m_codes), m_perm(other.m_perm),
           m_last_perm(other.m_last_perm), m_inv_perm(other.m_inv_perm), m_tree(other.m_tree),
-          m_crit_nodes(other.m_crit_nodes)
+          m_crit_nodes(other.m_crit_nodes), m_ccoords(other.m_ccoords), m_periodic(other.m_periodic),
+          m_acc_old(other.m_acc_old)
     {
         // We made deep copies from other, setup the views.
         rocm_init_state();
@@ -1721,7 +2213,8 @@ public:
           m_ncrit(other.m_ncrit), m_parts(std::move(other.m_parts)), m_codes(std::move(other.m_codes)),
           m_perm(std::move(other.m_perm)), m_last_perm(std::move(other.m_last_perm)),
           m_inv_perm(std::move(other.m_inv_perm)), m_tree(std::move(other.m_tree)),
-          m_crit_nodes(std::move(other.m_crit_nodes))
+          m_crit_nodes(std::move(other.m_crit_nodes)), m_ccoords(std::move(other.m_ccoords)),
+          m_periodic(other.m_periodic), m_acc_old(std::move(other.m_acc_old))
     {
         // Make sure other is left in a known state, otherwise we might
         // have in principle assertions failures in the destructor of other
@@ -1756,6 +2249,9 @@ public:
                 m_inv_perm = other.m_inv_perm;
                 m_tree = other.m_tree;
                 m_crit_nodes = other.m_crit_nodes;
+                m_ccoords = other.m_ccoords;
+                m_periodic = other.m_periodic;
+                m_acc_old = other.m_acc_old;
 
                 // Re-init the views.
                 rocm_init_state();
@@ -1789,6 +2285,9 @@ public:
             m_inv_perm = std::move(other.m_inv_perm);
             m_tree = std::move(other.m_tree);
             m_crit_nodes = std::move(other.m_crit_nodes);
+            m_ccoords = std::move(other.m_ccoords);
+            m_periodic = other.m_periodic;
+            m_acc_old = std::move(other.m_acc_old);
             // Make sure other is left in an empty state, otherwise we might
             // have in principle assertion failures in the destructor of other
             // in debug mode.
@@ -1872,6 +2371,9 @@ public:
         m_inv_perm.clear();
         m_tree.clear();
         m_crit_nodes.clear();
+        m_ccoords = ccoords_store{};
+        m_periodic = false;
+        m_acc_old.clear();
 
         // Re-init the views with the new (empty) data.
         rocm_init_state();
@@ -1882,7 +2384,8 @@ public:
         // NOTE: sanity check for the use of UInt in std::bitset.
         static_assert(unsigned(std::numeric_limits<UInt>::digits) <= std::numeric_limits<std::size_t>::max());
         const auto n_nodes = m_tree.size();
-        os << "Box size                 : " << m_box_size << (m_box_size_deduced ? " (deduced)" : "") << '\n';
+        os << "Box size                 : " << m_box_size << (m_box_size_deduced ? " (deduced)" : "")
+           << (m_periodic ? " (periodic)" : "") << '\n';
         os << "Total number of particles: " << m_codes.size() << '\n';
         os << "Total number of nodes    : " << n_nodes << "\n\n";
         if (!n_nodes) {
@@ -1963,28 +2466,141 @@ private:
     // Temporary storage to accumulate the accelerations/potentials induced on the
     // particles of a critical node. Data in here will be copied to
     // the output arrays after the accelerations/potentials from all the other
-    // particles/nodes in the domain have been computed.
+    // particles/nodes in the domain have been computed. This is not used
+    // if the output iterators are raw pointers.
     template <unsigned Q>
     static auto &acc_pot_tmp_res()
     {
         static thread_local std::array<f_vector<F>, nvecs_res<Q>> tmp_res;
         return tmp_res;
     }
-    // Temporary vectors to store the data of a target node during traversal.
-    static auto &tgt_tmp_data()
+    // Temporary storage for the coordinates of the target particles and of the source
+    // leaf particles decoded from the compressed coordinate store.
+    static auto &acc_pot_ccoords_tgt_vecs()
+    {
+        static thread_local std::array<f_vector<F>, NDim> tgt_vecs;
+        return tgt_vecs;
+    }
+    static auto &acc_pot_ccoords_src_vecs()
+    {
+        static thread_local std::array<f_vector<F>, NDim> src_vecs;
+        return src_vecs;
+    }
+    // Temporary vectors used to gather the active and inactive particles of a target node, when
+    // the computation is restricted to a subset of active particles.
+    static auto &acc_pot_active_tgt_vecs()
+    {
+        static thread_local std::array<f_vector<F>, NDim + 1u> tgt_vecs;
+        return tgt_vecs;
+    }
+    static auto &acc_pot_active_src_vecs()
+    {
+        static thread_local std::array<f_vector<F>, NDim + 1u> src_vecs;
+        return src_vecs;
+    }
+    // Pointers to the coordinates and masses of the particles of the leaf node with index leaf_idx (in the tree
+    // structure). If the compressed coordinate store is active, the coordinates are decoded into thread-local
+    // temporary vectors, otherwise they are read in place.
+    std::array<const F *, NDim + 1u> leaf_src_ptrs(size_type leaf_idx) const
+    {
+        const auto &leaf = m_tree[leaf_idx];
+        std::array<const F *, NDim + 1u> retval;
+        if (m_ccoords.bits) {
+            auto &src_vecs = acc_pot_ccoords_src_vecs();
+            std::array<F *, NDim> dec_ptrs;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                src_vecs[j].resize(static_cast<size_type>(leaf.end - leaf.begin));
+                dec_ptrs[j] = src_vecs[j].data();
+                retval[j] = dec_ptrs[j];
+            }
+            ccoords_decode_node(dec_ptrs, leaf_idx);
+        } else {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                retval[j] = m_parts[j].data() + leaf.begin;
+            }
+        }
+        retval[NDim] = m_parts[NDim].data() + leaf.begin;
+        return retval;
+    }
+    // Pointers to the coordinates and masses of the particles of the critical node with index cn_idx. If the
+    // compressed coordinate store is active, the coordinates are decoded into thread-local temporary vectors,
+    // otherwise they are read in place.
+    std::array<const F *, NDim + 1u> crit_node_tgt_ptrs(size_type cn_idx) const
+    {
+        const auto tgt_begin = m_crit_nodes[cn_idx].begin;
+        std::array<const F *, NDim + 1u> retval;
+        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+            retval[j] = m_parts[j].data() + tgt_begin;
+        }
+        if (m_ccoords.bits) {
+            auto &tgt_vecs = acc_pot_ccoords_tgt_vecs();
+            std::array<F *, NDim> dec_ptrs;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                tgt_vecs[j].resize(static_cast<size_type>(m_crit_nodes[cn_idx].end - tgt_begin));
+                dec_ptrs[j] = tgt_vecs[j].data();
+                retval[j] = dec_ptrs[j];
+            }
+            ccoords_decode_node(dec_ptrs, crit_node_tree_idx(cn_idx));
+        }
+        return retval;
+    }
+    // The data of the particles of a target node in the mixed-precision mode (see tree_acc_pot_leaf_mixed()).
+    // ref is a reference point, p_ptrs pointers to the coordinates of the target particles relative to ref and
+    // to their masses, narrowed to single precision, eps2 the square of the softening length in single precision.
+    struct mixed_tgt_data {
+        std::array<F, NDim> ref;
+        std::array<const float *, NDim + 1u> p_ptrs;
+        float eps2;
+    };
+    // Temporary storage for the single-precision data of the target particles
+    // and of the source leaf particles in the mixed-precision mode.
+    static auto &acc_pot_mixed_tgt_vecs()
+    {
+        static thread_local std::array<f_vector<float>, NDim + 1u> tgt_vecs;
+        return tgt_vecs;
+    }
+    static auto &acc_pot_mixed_src_vecs()
+    {
+        static thread_local std::array<f_vector<float>, NDim + 1u> src_vecs;
+        return src_vecs;
+    }
+    // The single-precision batch type used in the mixed-precision mode
+    // when the traversal kernels use the batch type B.
+    template <typename B>
+    using mixed_batch_t = std::conditional_t<std::is_same_v<B, F>, float, simd_batch_t<float>>;
+    // Compute the element-wise squared norm of the vector whose components are stored in the batches diffs.
+    template <typename B>
+    static B batch_norm2(const std::array<B, NDim> &diffs)
+    {
+        B retval = diffs[0] * diffs[0];
+        for (std::size_t j = 1; j < NDim; ++j) {
+            retval = retval + diffs[j] * diffs[j];
+        }
+        return retval;
+    }
+    // Same as above, but the square of the softening length eps2_vec is added to the result.
+    // NOTE: the last component is fused with the softening length.
+    template <typename B>
+    static B batch_norm2(const std::array<B, NDim> &diffs, B eps2_vec)
     {
-        static thread_local std::array<f_vector<F>, NDim + 1u> tmp_tgt;
-        return tmp_tgt;
+        B retval = diffs[0] * diffs[0];
+        for (std::size_t j = 1; j < NDim - 1u; ++j) {
+            retval = retval + diffs[j] * diffs[j];
+        }
+        return retval + xsimd_fma(diffs[NDim - 1u], diffs[NDim - 1u], eps2_vec);
     }
-    // Compute the element-wise accelerations on the batch of particles at xvec1, yvec1, zvec1 by the
-    // particles at xvec2, yvec2, zvec2 with masses mvec2, and add the result into res_x_vec, res_y_vec,
-    // res_z_vec. eps2_vec is the square of the softening length.
+    // Compute the element-wise accelerations on the batch of particles at pos1 by the
+    // particles at pos2 with masses mvec2, and add the result into res. eps2_vec is the
+    // square of the softening length.
     template <typename B>
-    static void batch_batch_3d_accs(B &res_x_vec, B &res_y_vec, B &res_z_vec, B xvec1, B yvec1, B zvec1, B xvec2,
-                                    B yvec2, B zvec2, B mvec2, B eps2_vec)
+    static void batch_batch_accs(std::array<B, NDim> &res, const std::array<B, NDim> &pos1,
+                                 const std::array<B, NDim> &pos2, B mvec2, B eps2_vec)
     {
-        const B diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
+        std::array<B, NDim> diffs;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            diffs[j] = pos2[j] - pos1[j];
+        }
+        const B dist2 = batch_norm2(diffs, eps2_vec);
         B m2_dist3;
         if constexpr (use_fast_inv_sqrt<B>) {
             m2_dist3 = mvec2 * inv_sqrt_3(dist2);
@@ -1993,18 +2609,22 @@ private:
             const B dist3 = dist * dist2;
             m2_dist3 = mvec2 / dist3;
         }
-        res_x_vec = xsimd_fma(diff_x, m2_dist3, res_x_vec);
-        res_y_vec = xsimd_fma(diff_y, m2_dist3, res_y_vec);
-        res_z_vec = xsimd_fma(diff_z, m2_dist3, res_z_vec);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            res[j] = xsimd_fma(diffs[j], m2_dist3, res[j]);
+        }
     }
     // Compute the element-wise mutual potential for 2 sets of particles at the specified coordinates and
     // with the specified masses. eps2_vec is the square of the softening length. The return value
     // is the negated mutual potential (that is, m1 * m2 / dist).
     template <typename B>
-    static B batch_batch_3d_pots(B xvec1, B yvec1, B zvec1, B mvec1, B xvec2, B yvec2, B zvec2, B mvec2, B eps2_vec)
+    static B batch_batch_pots(const std::array<B, NDim> &pos1, B mvec1, const std::array<B, NDim> &pos2, B mvec2,
+                              B eps2_vec)
     {
-        const B diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
+        std::array<B, NDim> diffs;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            diffs[j] = pos2[j] - pos1[j];
+        }
+        const B dist2 = batch_norm2(diffs, eps2_vec);
         B m1_dist;
         if constexpr (use_fast_inv_sqrt<B>) {
             m1_dist = mvec1 * inv_sqrt(dist2);
@@ -2014,13 +2634,17 @@ private:
         return m1_dist * mvec2;
     }
     // A combination of the 2 functions above, computing both accelerations and potentials between 2 batches.
-    // For both the accs and pots, the results are accumulated into the return values.
+    // For both the accs and pots, the results are accumulated into the return values (the potential
+    // being stored in res_pot).
     template <typename B>
-    static void batch_batch_3d_accs_pots(B &res_x_vec, B &res_y_vec, B &res_z_vec, B &res_pot_vec, B xvec1, B yvec1,
-                                         B zvec1, B mvec1, B xvec2, B yvec2, B zvec2, B mvec2, B eps2_vec)
+    static void batch_batch_accs_pots(std::array<B, NDim> &res, B &res_pot, const std::array<B, NDim> &pos1, B mvec1,
+                                      const std::array<B, NDim> &pos2, B mvec2, B eps2_vec)
     {
-        const B diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
+        std::array<B, NDim> diffs;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            diffs[j] = pos2[j] - pos1[j];
+        }
+        const B dist2 = batch_norm2(diffs, eps2_vec);
         B m2_dist, m2_dist3;
         if constexpr (use_fast_inv_sqrt<B>) {
             const auto tmp = inv_sqrt(dist2), tmp3 = tmp * tmp * tmp;
@@ -2034,55 +2658,68 @@ private:
             m2_dist3 = mvec2 / dist3;
         }
         // Write out the results.
-        res_x_vec = xsimd_fma(diff_x, m2_dist3, res_x_vec);
-        res_y_vec = xsimd_fma(diff_y, m2_dist3, res_y_vec);
-        res_z_vec = xsimd_fma(diff_z, m2_dist3, res_z_vec);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            res[j] = xsimd_fma(diffs[j], m2_dist3, res[j]);
+        }
         // NOTE: need a negated FMA for the potential.
-        res_pot_vec = xsimd_fnma(mvec1, m2_dist, res_pot_vec);
+        res_pot = xsimd_fnma(mvec1, m2_dist, res_pot);
     }
     // Function to compute the self-interactions within a target node. eps2 is the square of the softening length,
     // tgt_size is the number of particles in the target node, p_ptrs pointers to the target particles'
     // coordinates/masses, res_ptrs pointers to the output arrays. Q indicates which quantities will be computed
     // (accs, potentials, or both).
-    template <unsigned Q>
+    template <unsigned Q, typename B>
     void tree_self_interactions(F eps2, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
                                 const std::array<F *, nvecs_res<Q>> &res_ptrs) const
     {
-        if constexpr (simd_enabled && NDim == 3u) {
+        if constexpr (batch_simd<B>) {
             // xsimd batch type.
-            using batch_type = xsimd::simd_type<F>;
+            using batch_type = B;
             // Size of batch_type.
             constexpr auto batch_size = batch_type::size;
-            // Shortcuts to the node coordinates/masses.
-            const auto [x_ptr, y_ptr, z_ptr, m_ptr] = p_ptrs;
+            // Shortcut to the node masses.
+            const auto m_ptr = p_ptrs[NDim];
             // Softening length, vector version.
             const batch_type eps2_vec(eps2);
+            // Batches for the coordinates of the first batch of particles, and
+            // for the relative positions of the second batch wrt the first one.
+            std::array<batch_type, NDim> pos1, diffs;
             if constexpr (Q == 0u) {
                 // Q == 0, accelerations only.
-                //
-                // Shortcuts to the result vectors.
-                const auto [res_x, res_y, res_z] = res_ptrs;
                 for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
+                    // Number of particles available from i1 onwards. If this is less than the batch size,
+                    // we are dealing with the tail of the target node and we will use masked loads/stores.
+                    const auto n1 = static_cast<size_type>(tgt_size - i1);
                     // Load the first batch of particles.
-                    const auto xvec1 = batch_type(x_ptr + i1, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr + i1, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr + i1, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr + i1, xsimd::aligned_mode{});
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i1, n1, xsimd::unaligned_mode{});
+                    }
+                    const auto mvec1 = batch_load_n<batch_type>(m_ptr + i1, n1, xsimd::unaligned_mode{});
                     // Init the accumulators for the accelerations on the first batch of particles.
-                    batch_type res_x_vec1(F(0)), res_y_vec1(F(0)), res_z_vec1(F(0));
+                    std::array<batch_type, NDim> res_vecs1;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        res_vecs1[j] = batch_type(F(0));
+                    }
                     // Now we iterate over the node particles starting 1 position past i1 (to avoid self interactions).
                     // This is the classical n body inner loop.
                     for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                        // Load the second batch of particles.
-                        const auto xvec2 = batch_type(x_ptr + i2, xsimd::unaligned_mode{}),
-                                   yvec2 = batch_type(y_ptr + i2, xsimd::unaligned_mode{}),
-                                   zvec2 = batch_type(z_ptr + i2, xsimd::unaligned_mode{}),
-                                   mvec2 = batch_type(m_ptr + i2, xsimd::unaligned_mode{});
-                        // NOTE: now we are going to do a slight repetition of batch_batch_3d_accs(), with the goal
+                        const auto n2 = static_cast<size_type>(tgt_size - i2);
+                        // Load the second batch of particles, and compute the relative positions of 2 wrt 1.
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            diffs[j] = batch_load_n<batch_type>(p_ptrs[j] + i2, n2, xsimd::unaligned_mode{}) - pos1[j];
+                        }
+                        const auto mvec2 = batch_load_n<batch_type>(m_ptr + i2, n2, xsimd::unaligned_mode{});
+                        // NOTE: now we are going to do a slight repetition of batch_batch_accs(), with the goal
                         // of avoiding doing extra needless computations.
-                        // Compute the relative positions of 2 wrt 1, and the distance square.
-                        const auto diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                                   dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
+                        // Compute the distance square.
+                        auto dist2 = batch_norm2(diffs, eps2_vec);
+                        if (n2 < batch_size) {
+                            // The lanes of the second batch past the end of the node were zero-filled
+                            // by the masked load. Their distance from the first batch could be zero,
+                            // so we replace it with a dummy value in order to avoid generating
+                            // non-finite values (which would pollute the accumulators for 1).
+                            dist2 = xsimd::select(batch_lane_mask<batch_type>(n2), dist2, batch_type(F(1)));
+                        }
                         // Compute m1/dist3 and m2/dist3.
                         batch_type m1_dist3, m2_dist3;
                         if constexpr (use_fast_inv_sqrt<batch_type>) {
@@ -2098,22 +2735,22 @@ private:
                             m1_dist3 = mvec1 / dist3;
                             m2_dist3 = mvec2 / dist3;
                         }
-                        // Add to the accumulators for 1 the accelerations due to the batch 2.
-                        res_x_vec1 = xsimd_fma(diff_x, m2_dist3, res_x_vec1);
-                        res_y_vec1 = xsimd_fma(diff_y, m2_dist3, res_y_vec1);
-                        res_z_vec1 = xsimd_fma(diff_z, m2_dist3, res_z_vec1);
-                        // Add *directly into the result buffer* the acceleration on 2 due to 1.
-                        xsimd_fnma(diff_x, m1_dist3, batch_type(res_x + i2, xsimd::unaligned_mode{}))
-                            .store_unaligned(res_x + i2);
-                        xsimd_fnma(diff_y, m1_dist3, batch_type(res_y + i2, xsimd::unaligned_mode{}))
-                            .store_unaligned(res_y + i2);
-                        xsimd_fnma(diff_z, m1_dist3, batch_type(res_z + i2, xsimd::unaligned_mode{}))
-                            .store_unaligned(res_z + i2);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            // Add to the accumulators for 1 the accelerations due to the batch 2.
+                            res_vecs1[j] = xsimd_fma(diffs[j], m2_dist3, res_vecs1[j]);
+                            // Add *directly into the result buffer* the acceleration on 2 due to 1.
+                            batch_store_n(
+                                xsimd_fnma(diffs[j], m1_dist3,
+                                           batch_load_n<batch_type>(res_ptrs[j] + i2, n2, xsimd::unaligned_mode{})),
+                                res_ptrs[j] + i2, n2, xsimd::unaligned_mode{});
+                        }
                     }
                     // Add the accumulated acceleration on 1 to the values already in the result buffer.
-                    (batch_type(res_x + i1, xsimd::aligned_mode{}) + res_x_vec1).store_aligned(res_x + i1);
-                    (batch_type(res_y + i1, xsimd::aligned_mode{}) + res_y_vec1).store_aligned(res_y + i1);
-                    (batch_type(res_z + i1, xsimd::aligned_mode{}) + res_z_vec1).store_aligned(res_z + i1);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        batch_store_n(batch_load_n<batch_type>(res_ptrs[j] + i1, n1, xsimd::unaligned_mode{})
+                                          + res_vecs1[j],
+                                      res_ptrs[j] + i1, n1, xsimd::unaligned_mode{});
+                    }
                 }
             } else if constexpr (Q == 1u) {
                 // Q == 1, potentials only.
@@ -2121,26 +2758,32 @@ private:
                 // Shortcut to the result vector.
                 const auto res = res_ptrs[0];
                 for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
+                    const auto n1 = static_cast<size_type>(tgt_size - i1);
                     // Load the first batch of particles.
-                    const auto xvec1 = batch_type(x_ptr + i1, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr + i1, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr + i1, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr + i1, xsimd::aligned_mode{});
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i1, n1, xsimd::unaligned_mode{});
+                    }
+                    const auto mvec1 = batch_load_n<batch_type>(m_ptr + i1, n1, xsimd::unaligned_mode{});
                     // Init the accumulator for the potential on the first batch of particles.
                     batch_type res_vec(F(0));
                     // Now we iterate over the node particles starting 1 position past i1 (to avoid self interactions).
                     // This is the classical n body inner loop.
                     for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                        // Load the second batch of particles.
-                        const auto xvec2 = batch_type(x_ptr + i2, xsimd::unaligned_mode{}),
-                                   yvec2 = batch_type(y_ptr + i2, xsimd::unaligned_mode{}),
-                                   zvec2 = batch_type(z_ptr + i2, xsimd::unaligned_mode{}),
-                                   mvec2 = batch_type(m_ptr + i2, xsimd::unaligned_mode{});
-                        // NOTE: now we are going to do a slight repetition of batch_batch_3d_pots(), with the goal
+                        const auto n2 = static_cast<size_type>(tgt_size - i2);
+                        // Load the second batch of particles, and compute the relative positions of 2 wrt 1.
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            diffs[j] = batch_load_n<batch_type>(p_ptrs[j] + i2, n2, xsimd::unaligned_mode{}) - pos1[j];
+                        }
+                        const auto mvec2 = batch_load_n<batch_type>(m_ptr + i2, n2, xsimd::unaligned_mode{});
+                        // NOTE: now we are going to do a slight repetition of batch_batch_pots(), with the goal
                         // of avoiding doing extra needless computations.
-                        // Compute the relative positions of 2 wrt 1, and the distance square.
-                        const auto diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                                   dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
+                        // Compute the distance square.
+                        auto dist2 = batch_norm2(diffs, eps2_vec);
+                        if (n2 < batch_size) {
+                            // Replace the distances of the lanes past the end of the node
+                            // with a dummy value (see the Q == 0 case).
+                            dist2 = xsimd::select(batch_lane_mask<batch_type>(n2), dist2, batch_type(F(1)));
+                        }
                         // Compute m1/dist.
                         batch_type m1_dist;
                         if constexpr (use_fast_inv_sqrt<batch_type>) {
@@ -2153,39 +2796,51 @@ private:
                         // Subtract it from the acccumulator for 1.
                         res_vec -= mut_pot;
                         // Subtract *directly from the result buffer* the mutual negated potential for 2.
-                        (batch_type(res + i2, xsimd::unaligned_mode{}) - mut_pot).store_unaligned(res + i2);
+                        batch_store_n(batch_load_n<batch_type>(res + i2, n2, xsimd::unaligned_mode{}) - mut_pot,
+                                      res + i2, n2, xsimd::unaligned_mode{});
                     }
                     // Add the accumulated potentials on 1 from the values already in the result buffer.
                     // NOTE: we are doing an add here because we already built res_vec with repeated
                     // subtractions, thus generating a negative value.
-                    (batch_type(res + i1, xsimd::aligned_mode{}) + res_vec).store_aligned(res + i1);
+                    batch_store_n(batch_load_n<batch_type>(res + i1, n1, xsimd::unaligned_mode{}) + res_vec, res + i1,
+                                  n1, xsimd::unaligned_mode{});
                 }
             } else {
                 // Q == 2, accelerations and potentials.
                 //
-                // Shortcuts to the result vectors.
-                const auto [res_x, res_y, res_z, res_pot] = res_ptrs;
+                // Shortcut to the potential result vector.
+                const auto res_pot = res_ptrs[NDim];
                 for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
+                    const auto n1 = static_cast<size_type>(tgt_size - i1);
                     // Load the first batch of particles.
-                    const auto xvec1 = batch_type(x_ptr + i1, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr + i1, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr + i1, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr + i1, xsimd::aligned_mode{});
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i1, n1, xsimd::unaligned_mode{});
+                    }
+                    const auto mvec1 = batch_load_n<batch_type>(m_ptr + i1, n1, xsimd::unaligned_mode{});
                     // Init the accumulators for the accelerations/potentials on the first batch of particles.
-                    batch_type res_x_vec1(F(0)), res_y_vec1(F(0)), res_z_vec1(F(0)), res_pot_vec(F(0));
+                    std::array<batch_type, NDim> res_vecs1;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        res_vecs1[j] = batch_type(F(0));
+                    }
+                    batch_type res_pot_vec(F(0));
                     // Now we iterate over the node particles starting 1 position past i1 (to avoid self interactions).
                     // This is the classical n body inner loop.
                     for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                        // Load the second batch of particles.
-                        const auto xvec2 = batch_type(x_ptr + i2, xsimd::unaligned_mode{}),
-                                   yvec2 = batch_type(y_ptr + i2, xsimd::unaligned_mode{}),
-                                   zvec2 = batch_type(z_ptr + i2, xsimd::unaligned_mode{}),
-                                   mvec2 = batch_type(m_ptr + i2, xsimd::unaligned_mode{});
-                        // NOTE: now we are going to do a slight repetition of batch_batch_3d_accs_pots(), with the goal
+                        const auto n2 = static_cast<size_type>(tgt_size - i2);
+                        // Load the second batch of particles, and compute the relative positions of 2 wrt 1.
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            diffs[j] = batch_load_n<batch_type>(p_ptrs[j] + i2, n2, xsimd::unaligned_mode{}) - pos1[j];
+                        }
+                        const auto mvec2 = batch_load_n<batch_type>(m_ptr + i2, n2, xsimd::unaligned_mode{});
+                        // NOTE: now we are going to do a slight repetition of batch_batch_accs_pots(), with the goal
                         // of avoiding doing extra needless computations.
-                        // Compute the relative positions of 2 wrt 1, and the distance square.
-                        const auto diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                                   dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
+                        // Compute the distance square.
+                        auto dist2 = batch_norm2(diffs, eps2_vec);
+                        if (n2 < batch_size) {
+                            // Replace the distances of the lanes past the end of the node
+                            // with a dummy value (see the Q == 0 case).
+                            dist2 = xsimd::select(batch_lane_mask<batch_type>(n2), dist2, batch_type(F(1)));
+                        }
                         // Compute m1/dist, m1/dist3 and m2/dist3.
                         batch_type m1_dist, m1_dist3, m2_dist3;
                         if constexpr (use_fast_inv_sqrt<batch_type>) {
@@ -2205,28 +2860,30 @@ private:
                         }
                         // Compute the mutual (negated) potential between 1 and 2.
                         const auto mut_pot = m1_dist * mvec2;
-                        // Add to the accumulators for 1 the accelerations due to the batch 2,
-                        // and subtract the mutual negated potential from the acccumulator for 1.
-                        res_x_vec1 = xsimd_fma(diff_x, m2_dist3, res_x_vec1);
-                        res_y_vec1 = xsimd_fma(diff_y, m2_dist3, res_y_vec1);
-                        res_z_vec1 = xsimd_fma(diff_z, m2_dist3, res_z_vec1);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            // Add to the accumulators for 1 the accelerations due to the batch 2.
+                            res_vecs1[j] = xsimd_fma(diffs[j], m2_dist3, res_vecs1[j]);
+                            // Add *directly into the result buffer* the acceleration on 2 due to 1.
+                            batch_store_n(
+                                xsimd_fnma(diffs[j], m1_dist3,
+                                           batch_load_n<batch_type>(res_ptrs[j] + i2, n2, xsimd::unaligned_mode{})),
+                                res_ptrs[j] + i2, n2, xsimd::unaligned_mode{});
+                        }
+                        // Subtract the mutual negated potential from the acccumulator for 1
+                        // and *directly from the result buffer* for 2.
                         res_pot_vec -= mut_pot;
-                        // Add *directly into the result buffer* the acceleration on 2 due to 1,
-                        // and subtract the negated potential.
-                        xsimd_fnma(diff_x, m1_dist3, batch_type(res_x + i2, xsimd::unaligned_mode{}))
-                            .store_unaligned(res_x + i2);
-                        xsimd_fnma(diff_y, m1_dist3, batch_type(res_y + i2, xsimd::unaligned_mode{}))
-                            .store_unaligned(res_y + i2);
-                        xsimd_fnma(diff_z, m1_dist3, batch_type(res_z + i2, xsimd::unaligned_mode{}))
-                            .store_unaligned(res_z + i2);
-                        (batch_type(res_pot + i2, xsimd::unaligned_mode{}) - mut_pot).store_unaligned(res_pot + i2);
+                        batch_store_n(batch_load_n<batch_type>(res_pot + i2, n2, xsimd::unaligned_mode{}) - mut_pot,
+                                      res_pot + i2, n2, xsimd::unaligned_mode{});
                     }
                     // Add the accumulated accelerations/potentials on 1 to the values already in the result buffer.
-                    (batch_type(res_x + i1, xsimd::aligned_mode{}) + res_x_vec1).store_aligned(res_x + i1);
-                    (batch_type(res_y + i1, xsimd::aligned_mode{}) + res_y_vec1).store_aligned(res_y + i1);
-                    (batch_type(res_z + i1, xsimd::aligned_mode{}) + res_z_vec1).store_aligned(res_z + i1);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        batch_store_n(batch_load_n<batch_type>(res_ptrs[j] + i1, n1, xsimd::unaligned_mode{})
+                                          + res_vecs1[j],
+                                      res_ptrs[j] + i1, n1, xsimd::unaligned_mode{});
+                    }
                     // NOTE: the accumulated potential is added because it was constructed as a negative quantity.
-                    (batch_type(res_pot + i1, xsimd::aligned_mode{}) + res_pot_vec).store_aligned(res_pot + i1);
+                    batch_store_n(batch_load_n<batch_type>(res_pot + i1, n1, xsimd::unaligned_mode{}) + res_pot_vec,
+                                  res_pot + i1, n1, xsimd::unaligned_mode{});
                 }
             }
         } else {
@@ -2298,53 +2955,59 @@ private:
     // tgt_size the number of particles in the target node, p_ptrs pointers to the target particles' coordinates/masses,
     // res_ptrs pointers to the output arrays. Q indicates which quantities will be computed (accs, potentials, or
     // both).
-    template <unsigned Q>
+    template <unsigned Q, typename B>
     void tree_acc_pot_leaf(F eps2, size_type src_idx, size_type tgt_size,
                            const std::array<const F *, NDim + 1u> &p_ptrs,
                            const std::array<F *, nvecs_res<Q>> &res_ptrs) const
     {
         // Get a reference to the source node.
         const auto &src_node = m_tree[src_idx];
-        // Establish the range of the source node.
-        const auto src_begin = src_node.begin, src_end = src_node.end;
-        if constexpr (simd_enabled && NDim == 3u) {
+        tree_acc_pot_src_parts<Q, B>(eps2, leaf_src_ptrs(src_idx),
+                                     static_cast<size_type>(src_node.end - src_node.begin), tgt_size, p_ptrs, res_ptrs);
+    }
+    // Function to compute the accelerations/potentials on a target node by a set of source particles which does not
+    // overlap with the target particles. eps2 is the square of the softening length, src_ptrs pointers to the source
+    // particles' coordinates/masses, src_size the number of source particles, tgt_size the number of particles in the
+    // target node, p_ptrs pointers to the target particles' coordinates/masses, res_ptrs pointers to the output arrays.
+    // Q indicates which quantities will be computed (accs, potentials, or both).
+    template <unsigned Q, typename B>
+    void tree_acc_pot_src_parts(F eps2, const std::array<const F *, NDim + 1u> &src_ptrs, size_type src_size,
+                                size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                                const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    {
+        if constexpr (batch_simd<B>) {
             // The SIMD-accelerated version.
-            using batch_type = xsimd::simd_type<F>;
+            using batch_type = B;
             constexpr auto batch_size = batch_type::size;
-            // The number of particles in the source node.
-            const auto src_size = static_cast<size_type>(src_end - src_begin);
             // Vector version of eps2.
             const batch_type eps2_vec(eps2);
-            // Pointers to the target node data.
-            const auto [x_ptr1, y_ptr1, z_ptr1, m_ptr1] = p_ptrs;
-            // Pointers to the source node data.
-            const auto x_ptr2 = m_parts[0].data() + src_begin, y_ptr2 = m_parts[1].data() + src_begin,
-                       z_ptr2 = m_parts[2].data() + src_begin, m_ptr2 = m_parts[3].data() + src_begin;
+            // Batches for the coordinates of the target particles and of the (splatted)
+            // source particle.
+            std::array<batch_type, NDim> pos1, pos2;
             if constexpr (Q == 0u) {
                 // Q == 0, accelerations only.
-                //
-                // Pointers to the result data.
-                const auto [res_x, res_y, res_z] = res_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    // Load the current batch of target data.
-                    const auto xvec1 = batch_type(x_ptr1 + i, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr1 + i, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr1 + i, xsimd::aligned_mode{});
-                    // Init the batches for computing the accelerations, loading the
-                    // accumulated acceleration for the current batch.
-                    auto res_x_vec = batch_type(res_x + i, xsimd::aligned_mode{}),
-                         res_y_vec = batch_type(res_y + i, xsimd::aligned_mode{}),
-                         res_z_vec = batch_type(res_z + i, xsimd::aligned_mode{});
-                    for (size_type j = 0; j < src_size; ++j) {
+                    // Number of target particles available from i onwards (less than the batch
+                    // size in the tail of the target node, where we use masked loads/stores).
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    // Load the current batch of target data, and init the batches for computing
+                    // the accelerations, loading the accumulated acceleration for the current batch.
+                    std::array<batch_type, NDim> res_vecs;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                        res_vecs[j] = batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                    }
+                    for (size_type k = 0; k < src_size; ++k) {
                         // Compute the interaction with the source particle.
-                        batch_batch_3d_accs(res_x_vec, res_y_vec, res_z_vec, xvec1, yvec1, zvec1, batch_type(x_ptr2[j]),
-                                            batch_type(y_ptr2[j]), batch_type(z_ptr2[j]), batch_type(m_ptr2[j]),
-                                            eps2_vec);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            pos2[j] = batch_type(src_ptrs[j][k]);
+                        }
+                        batch_batch_accs(res_vecs, pos1, pos2, batch_type(src_ptrs[NDim][k]), eps2_vec);
                     }
                     // Store the updated accelerations in the temporary vectors.
-                    res_x_vec.store_aligned(res_x + i);
-                    res_y_vec.store_aligned(res_y + i);
-                    res_z_vec.store_aligned(res_z + i);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        batch_store_n(res_vecs[j], res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                    }
                 }
             } else if constexpr (Q == 1u) {
                 // Q == 1, potentials only.
@@ -2352,55 +3015,60 @@ private:
                 // Pointer to the result data.
                 const auto res = res_ptrs[0];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    // Number of target particles available from i onwards.
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Load the current batch of target data.
-                    const auto xvec1 = batch_type(x_ptr1 + i, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr1 + i, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr1 + i, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr1 + i, xsimd::aligned_mode{});
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                    }
+                    const auto mvec1 = batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{});
                     // Init the batch for computing the potentials, loading the
                     // accumulated potentials for the current batch.
-                    auto res_vec = batch_type(res + i, xsimd::aligned_mode{});
-                    for (size_type j = 0; j < src_size; ++j) {
+                    auto res_vec = batch_load_n<batch_type>(res + i, n, xsimd::unaligned_mode{});
+                    for (size_type k = 0; k < src_size; ++k) {
                         // Compute the interaction with the source particle,
                         // and subtract the obtained potentials from the current
                         // accumulated value.
-                        // NOTE: need a subtraction because batch_batch_3d_pots() returns
+                        // NOTE: need a subtraction because batch_batch_pots() returns
                         // the negated potential.
-                        res_vec -= batch_batch_3d_pots(xvec1, yvec1, zvec1, mvec1, batch_type(x_ptr2[j]),
-                                                       batch_type(y_ptr2[j]), batch_type(z_ptr2[j]),
-                                                       batch_type(m_ptr2[j]), eps2_vec);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            pos2[j] = batch_type(src_ptrs[j][k]);
+                        }
+                        res_vec -= batch_batch_pots(pos1, mvec1, pos2, batch_type(src_ptrs[NDim][k]), eps2_vec);
                     }
                     // Store the updated potentials in the temporary vector.
-                    res_vec.store_aligned(res + i);
+                    batch_store_n(res_vec, res + i, n, xsimd::unaligned_mode{});
                 }
             } else {
                 // Q == 2, accelerations and potentials.
                 //
-                // Pointers to the result data.
-                const auto [res_x, res_y, res_z, res_pot] = res_ptrs;
+                // Pointer to the potential result data.
+                const auto res_pot = res_ptrs[NDim];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    // Load the current batch of target data.
-                    const auto xvec1 = batch_type(x_ptr1 + i, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr1 + i, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr1 + i, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr1 + i, xsimd::aligned_mode{});
-                    // Init the batches for computing the accelerations and the potentials, loading the
-                    // accumulated values for the current batch.
-                    auto res_x_vec = batch_type(res_x + i, xsimd::aligned_mode{}),
-                         res_y_vec = batch_type(res_y + i, xsimd::aligned_mode{}),
-                         res_z_vec = batch_type(res_z + i, xsimd::aligned_mode{}),
-                         res_pot_vec = batch_type(res_pot + i, xsimd::aligned_mode{});
-                    for (size_type j = 0; j < src_size; ++j) {
-                        // Compute the interaction with the source particle.
-                        batch_batch_3d_accs_pots(res_x_vec, res_y_vec, res_z_vec, res_pot_vec, xvec1, yvec1, zvec1,
-                                                 mvec1, batch_type(x_ptr2[j]), batch_type(y_ptr2[j]),
-                                                 batch_type(z_ptr2[j]), batch_type(m_ptr2[j]), eps2_vec);
+                    // Number of target particles available from i onwards.
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    // Load the current batch of target data, and init the batches for computing
+                    // the accelerations and the potentials, loading the accumulated values for the current batch.
+                    std::array<batch_type, NDim> res_vecs;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                        res_vecs[j] = batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{});
                     }
-                    // Store the updated accelerations/potentials in the temporary vectors.
-                    res_x_vec.store_aligned(res_x + i);
-                    res_y_vec.store_aligned(res_y + i);
-                    res_z_vec.store_aligned(res_z + i);
-                    res_pot_vec.store_aligned(res_pot + i);
+                    const auto mvec1 = batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{});
+                    auto res_pot_vec = batch_load_n<batch_type>(res_pot + i, n, xsimd::unaligned_mode{});
+                    for (size_type k = 0; k < src_size; ++k) {
+                        // Compute the interaction with the source particle.
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            pos2[j] = batch_type(src_ptrs[j][k]);
+                        }
+                        batch_batch_accs_pots(res_vecs, res_pot_vec, pos1, mvec1, pos2, batch_type(src_ptrs[NDim][k]),
+                                              eps2_vec);
+                    }
+                    // Store the updated accelerations/potentials in the temporary vectors.
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        batch_store_n(res_vecs[j], res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                    }
+                    batch_store_n(res_pot_vec, res_pot + i, n, xsimd::unaligned_mode{});
                 }
             }
         } else {
@@ -2418,13 +3086,13 @@ private:
                     m1 = p_ptrs[NDim][i1];
                 }
                 // Iterate over the particles in the src node.
-                for (size_type i2 = src_begin; i2 < src_end; ++i2) {
+                for (size_type i2 = 0; i2 < src_size; ++i2) {
                     F dist2(eps2);
                     for (std::size_t j = 0; j < NDim; ++j) {
-                        diffs[j] = m_parts[j][i2] - pos1[j];
+                        diffs[j] = src_ptrs[j][i2] - pos1[j];
                         dist2 = fma_wrap(diffs[j], diffs[j], dist2);
                     }
-                    const auto dist = std::sqrt(dist2), m2 = m_parts[NDim][i2];
+                    const auto dist = std::sqrt(dist2), m2 = src_ptrs[NDim][i2];
                     if constexpr (Q == 0u || Q == 2u) {
                         // Q == 0 or 2: accelerations are requested.
                         const auto dist3 = dist * dist2, m_dist3 = m2 / dist3;
@@ -2443,45 +3111,327 @@ private:
             }
         }
     }
+    // Mixed-precision version of tree_acc_pot_leaf(), used for double-precision trees. The coordinates of the
+    // particles of the source leaf node with index src_idx are computed relative to the reference point mx.ref in
+    // double precision, and they are then narrowed to single precision together with the masses. The pairwise
+    // interactions with the tgt_size target particles described by mx are computed in single precision via the batch
+    // type BF, and the contribution of the source leaf is finally added to the double-precision accumulators
+    // in res_ptrs. Q indicates which quantities will be computed (accs, potentials, or both).
+    template <unsigned Q, typename BF>
+    void tree_acc_pot_leaf_mixed(size_type src_idx, size_type tgt_size, const mixed_tgt_data &mx,
+                                 const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    {
+        static_assert(std::is_same_v<F, double>);
+        // Get a reference to the source node.
+        const auto &src_node = m_tree[src_idx];
+        // The number of particles in the source node.
+        const auto src_size = static_cast<size_type>(src_node.end - src_node.begin);
+        // Pointers to the source node data.
+        const auto src_dptrs = leaf_src_ptrs(src_idx);
+        // Narrow the source data into the temporary vectors.
+        auto &src_vecs = acc_pot_mixed_src_vecs();
+        std::array<float *, NDim + 1u> src_ptrs;
+        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+            src_vecs[j].resize(src_size);
+            src_ptrs[j] = src_vecs[j].data();
+        }
+        for (size_type k = 0; k < src_size; ++k) {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                src_ptrs[j][k] = static_cast<float>(src_dptrs[j][k] - mx.ref[j]);
+            }
+            src_ptrs[NDim][k] = static_cast<float>(src_dptrs[NDim][k]);
+        }
+        const auto &p_ptrs = mx.p_ptrs;
+        if constexpr (!std::is_same_v<BF, float> && (NDim == 2u || NDim == 3u)) {
+            // The SIMD-accelerated version.
+            using batch_type = BF;
+            constexpr auto batch_size = batch_type::size;
+            // Vector version of eps2.
+            const batch_type eps2_vec(mx.eps2);
+            // Batches for the coordinates of the target particles and of the (splatted)
+            // source particle.
+            std::array<batch_type, NDim> pos1, pos2;
+            // Add the first n lanes of the single-precision batch b to the values starting at ptr.
+            std::array<float, batch_size> tmp;
+            auto add_widened = [&tmp](const batch_type &b, F *ptr, size_type n) {
+                b.store_unaligned(tmp.data());
+                for (size_type l = 0; l < n; ++l) {
+                    ptr[l] += tmp[l];
+                }
+            };
+            for (size_type i = 0; i < tgt_size; i += batch_size) {
+                // Number of target particles available from i onwards.
+                const auto n = static_cast<size_type>(tgt_size - i);
+                const auto n_lanes = std::min(n, static_cast<size_type>(batch_size));
+                // Load the current batch of target data.
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+                if constexpr (Q == 0u) {
+                    // Q == 0, accelerations only.
+                    std::array<batch_type, NDim> res_vecs;
+                    for (auto &r : res_vecs) {
+                        r = batch_type(0.f);
+                    }
+                    for (size_type k = 0; k < src_size; ++k) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            pos2[j] = batch_type(src_ptrs[j][k]);
+                        }
+                        batch_batch_accs(res_vecs, pos1, pos2, batch_type(src_ptrs[NDim][k]), eps2_vec);
+                    }
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        add_widened(res_vecs[j], res_ptrs[j] + i, n_lanes);
+                    }
+                } else if constexpr (Q == 1u) {
+                    // Q == 1, potentials only.
+                    const auto mvec1 = batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{});
+                    batch_type res_vec(0.f);
+                    for (size_type k = 0; k < src_size; ++k) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            pos2[j] = batch_type(src_ptrs[j][k]);
+                        }
+                        // NOTE: need a subtraction because batch_batch_pots() returns
+                        // the negated potential.
+                        res_vec -= batch_batch_pots(pos1, mvec1, pos2, batch_type(src_ptrs[NDim][k]), eps2_vec);
+                    }
+                    add_widened(res_vec, res_ptrs[0] + i, n_lanes);
+                } else {
+                    // Q == 2, accelerations and potentials.
+                    const auto mvec1 = batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{});
+                    std::array<batch_type, NDim> res_vecs;
+                    for (auto &r : res_vecs) {
+                        r = batch_type(0.f);
+                    }
+                    batch_type res_pot_vec(0.f);
+                    for (size_type k = 0; k < src_size; ++k) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            pos2[j] = batch_type(src_ptrs[j][k]);
+                        }
+                        batch_batch_accs_pots(res_vecs, res_pot_vec, pos1, mvec1, pos2, batch_type(src_ptrs[NDim][k]),
+                                              eps2_vec);
+                    }
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        add_widened(res_vecs[j], res_ptrs[j] + i, n_lanes);
+                    }
+                    add_widened(res_pot_vec, res_ptrs[NDim] + i, n_lanes);
+                }
+            }
+        } else {
+            // Local variables for the scalar computation.
+            std::array<float, NDim> pos1, diffs;
+            for (size_type i1 = 0; i1 < tgt_size; ++i1) {
+                // Load the coordinates of the current particle
+                // in the target node.
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = p_ptrs[j][i1];
+                }
+                // Load the target mass, but only if we are interested in the potentials.
+                [[maybe_unused]] float m1;
+                if constexpr (Q == 1u || Q == 2u) {
+                    m1 = p_ptrs[NDim][i1];
+                }
+                // The single-precision accumulators for the contribution of the source leaf.
+                std::array<float, nvecs_res<Q>> acc{};
+                // Iterate over the particles in the src node.
+                for (size_type i2 = 0; i2 < src_size; ++i2) {
+                    float dist2(mx.eps2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = src_ptrs[j][i2] - pos1[j];
+                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+                    }
+                    const auto dist = std::sqrt(dist2), m2 = src_ptrs[NDim][i2];
+                    if constexpr (Q == 0u || Q == 2u) {
+                        // Q == 0 or 2: accelerations are requested.
+                        const auto dist3 = dist * dist2, m_dist3 = m2 / dist3;
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            acc[j] = fma_wrap(diffs[j], m_dist3, acc[j]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        // Q == 1 or 2: potentials are requested.
+                        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                        acc[pot_idx] = fma_wrap(-m1, m2 / dist, acc[pot_idx]);
+                    }
+                }
+                // Widen and accumulate.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_ptrs[j][i1] += acc[j];
+                }
+            }
+        }
+    }
+    // Function to compute the mutual interactions between a set of target particles and the particles of a leaf source
+    // node, using Newton's third law. eps2 is the square of the softening length, src_idx is the index, in the tree
+    // structure, of the leaf node, tgt_size the number of target particles, p_ptrs pointers to the target particles'
+    // coordinates/masses, res_ptrs pointers to the output arrays for the target particles, src_res_ptrs pointers to
+    // the output arrays for the particles of the source node. Q indicates which quantities will be computed (accs,
+    // potentials, or both).
+    template <unsigned Q, typename B>
+    void tree_acc_pot_leaf_mutual(F eps2, size_type src_idx, size_type tgt_size,
+                                  const std::array<const F *, NDim + 1u> &p_ptrs,
+                                  const std::array<F *, nvecs_res<Q>> &res_ptrs,
+                                  const std::array<F *, nvecs_res<Q>> &src_res_ptrs) const
+    {
+        // Get a reference to the source node.
+        const auto &src_node = m_tree[src_idx];
+        // Establish the range of the source node.
+        const auto src_begin = src_node.begin, src_end = src_node.end;
+        // The number of particles in the source node.
+        const auto src_size = static_cast<size_type>(src_end - src_begin);
+        if constexpr (batch_simd<B>) {
+            // The SIMD-accelerated version. We vectorise over the target particles,
+            // and we use horizontal additions to accumulate the opposite
+            // interactions on the source particles.
+            using batch_type = B;
+            constexpr auto batch_size = batch_type::size;
+            // Vector version of eps2.
+            const batch_type eps2_vec(eps2);
+            // Pointers to the source node data.
+            std::array<const F *, NDim + 1u> src_ptrs;
+            for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                src_ptrs[j] = m_parts[j].data() + src_begin;
+            }
+            // Batches for the coordinates of the target particles and for
+            // the relative positions of the source particle.
+            std::array<batch_type, NDim> pos1, diffs;
+            for (size_type i = 0; i < tgt_size; i += batch_size) {
+                // Number of target particles available from i onwards.
+                const auto n = static_cast<size_type>(tgt_size - i);
+                // Load the current batch of target data. In the tail, the masses of the lanes
+                // past the end are set to zero by the masked load, so that they do not
+                // contribute to the interactions on the source particles.
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+                const auto mvec1 = batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{});
+                // Init the accumulators for the target batch.
+                std::array<batch_type, nvecs_res<Q>> res_vecs;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_vecs[j] = batch_type(F(0));
+                }
+                for (size_type k = 0; k < src_size; ++k) {
+                    const auto m2 = src_ptrs[NDim][k];
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = batch_type(src_ptrs[j][k]) - pos1[j];
+                    }
+                    auto dist2 = batch_norm2(diffs, eps2_vec);
+                    if (n < batch_size) {
+                        // Avoid generating non-finite values in the lanes past the end
+                        // of the target particles (see tree_self_interactions()).
+                        dist2 = xsimd::select(batch_lane_mask<batch_type>(n), dist2, batch_type(F(1)));
+                    }
+                    if constexpr (Q == 0u || Q == 2u) {
+                        // Q == 0 or 2: accelerations are requested.
+                        batch_type inv_dist3;
+                        if constexpr (use_fast_inv_sqrt<batch_type>) {
+                            inv_dist3 = inv_sqrt_3(dist2);
+                        } else {
+                            inv_dist3 = batch_type(F(1)) / (xsimd_sqrt(dist2) * dist2);
+                        }
+                        const auto m2_dist3 = batch_type(m2) * inv_dist3, m1_dist3 = mvec1 * inv_dist3;
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            res_vecs[j] = xsimd_fma(diffs[j], m2_dist3, res_vecs[j]);
+                            src_res_ptrs[j][k] -= xsimd::hadd(diffs[j] * m1_dist3);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        // Q == 1 or 2: potentials are requested.
+                        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                        batch_type m1_dist;
+                        if constexpr (use_fast_inv_sqrt<batch_type>) {
+                            m1_dist = mvec1 * inv_sqrt(dist2);
+                        } else {
+                            m1_dist = mvec1 / xsimd_sqrt(dist2);
+                        }
+                        // The negated mutual potential.
+                        const auto mut_pot = m1_dist * batch_type(m2);
+                        res_vecs[pot_idx] -= mut_pot;
+                        src_res_ptrs[pot_idx][k] -= xsimd::hadd(mut_pot);
+                    }
+                }
+                // Add the accumulated values to the output arrays of the targets.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    batch_store_n(batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{}) + res_vecs[j],
+                                  res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+            }
+        } else {
+            // Local variables for the scalar computation.
+            std::array<F, NDim> pos1, diffs;
+            for (size_type i1 = 0; i1 < tgt_size; ++i1) {
+                // Load the coordinates and the mass of the current target particle.
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = p_ptrs[j][i1];
+                }
+                const auto m1 = p_ptrs[NDim][i1];
+                // The acceleration/potential accumulator for the current particle.
+                std::array<F, nvecs_res<Q>> a1{};
+                // Iterate over the particles in the src node.
+                for (size_type k = 0; k < src_size; ++k) {
+                    const auto i2 = static_cast<size_type>(src_begin + k);
+                    F dist2(eps2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = m_parts[j][i2] - pos1[j];
+                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+                    }
+                    const auto dist = std::sqrt(dist2), m2 = m_parts[NDim][i2];
+                    if constexpr (Q == 0u || Q == 2u) {
+                        // Q == 0 or 2: accelerations are requested.
+                        const auto dist3 = dist2 * dist, m2_dist3 = m2 / dist3, m1_dist3 = m1 / dist3;
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            a1[j] = fma_wrap(m2_dist3, diffs[j], a1[j]);
+                            src_res_ptrs[j][k] = fma_wrap(m1_dist3, -diffs[j], src_res_ptrs[j][k]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        // Q == 1 or 2: potentials are requested.
+                        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                        const auto mut_pot = m1 / dist * m2;
+                        a1[pot_idx] -= mut_pot;
+                        src_res_ptrs[pot_idx][k] -= mut_pot;
+                    }
+                }
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_ptrs[j][i1] += a1[j];
+                }
+            }
+        }
+    }
     // Function to compute the accelerations/potentials due to the COM of a source node onto a target node. src_idx is
     // the index, in the tree structure, of the source node, tgt_size the number of particles in the target node,
     // p_ptrs pointers to the target particles' coordinates/masses, tmp_ptrs are pointers to the temporary data filled
     // in by the tree_acc_pot_mac_check() function (which will be re-used by this function), res_ptrs pointers to the
     // output arrays. Q indicates which quantities will be computed (accs, potentials, or both).
-    template <unsigned Q>
+    template <unsigned Q, typename B>
     void tree_acc_pot_src_com(size_type src_idx, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
                               const std::array<F *, nvecs_tmp<Q>> &tmp_ptrs,
                               const std::array<F *, nvecs_res<Q>> &res_ptrs) const
     {
         // Load locally the mass of the source node.
         const auto m_src = m_tree[src_idx].props[NDim];
-        if constexpr (simd_enabled && NDim == 3u) {
-            using batch_type = xsimd::simd_type<F>;
+        if constexpr (batch_simd<B>) {
+            using batch_type = B;
             constexpr auto batch_size = batch_type::size;
             // Vector version of the source node mass.
             const batch_type m_src_vec(m_src);
             if constexpr (Q == 0u) {
                 // Q == 0, accelerations only.
                 //
-                // Pointers to the temporary coordinate diffs and 1/dist3 values computed in the MAC check.
-                const auto [tmp_x, tmp_y, tmp_z, tmp_dist3] = tmp_ptrs;
-                // Pointers to the result arrays.
-                const auto [res_x, res_y, res_z] = res_ptrs;
+                // Pointer to the temporary 1/dist3 values computed in the MAC check (the coordinate
+                // diffs being stored in the first NDim temporary vectors).
+                const auto tmp_dist3 = tmp_ptrs[NDim];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    // Compute m_src/dist**3 and load the differences.
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    // Compute m_src/dist**3.
                     const auto m_src_dist3_vec = use_fast_inv_sqrt<batch_type>
                                                      ? m_src_vec * batch_type(tmp_dist3 + i, xsimd::aligned_mode{})
-                                                     : m_src_vec / batch_type(tmp_dist3 + i, xsimd::aligned_mode{}),
-                               xdiff = batch_type(tmp_x + i, xsimd::aligned_mode{}),
-                               ydiff = batch_type(tmp_y + i, xsimd::aligned_mode{}),
-                               zdiff = batch_type(tmp_z + i, xsimd::aligned_mode{});
-                    // Compute and accumulate the accelerations.
-                    xsimd_fma(xdiff, m_src_dist3_vec, batch_type(res_x + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_x + i);
-                    xsimd_fma(ydiff, m_src_dist3_vec, batch_type(res_y + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_y + i);
-                    xsimd_fma(zdiff, m_src_dist3_vec, batch_type(res_z + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_z + i);
+                                                     : m_src_vec / batch_type(tmp_dist3 + i, xsimd::aligned_mode{});
+                    // Load the differences, compute and accumulate the accelerations.
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        batch_store_n(xsimd_fma(batch_type(tmp_ptrs[j] + i, xsimd::aligned_mode{}), m_src_dist3_vec,
+                                                batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{})),
+                                      res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                    }
                 }
             } else if constexpr (Q == 1u) {
                 // Q == 1, potentials only.
@@ -2489,50 +3439,50 @@ private:
                 // Pointer to the temporary 1/dist values computed in the MAC check.
                 const auto tmp_dist = tmp_ptrs[0];
                 // Pointer to the target masses.
-                const auto m_ptr = p_ptrs[3];
+                const auto m_ptr = p_ptrs[NDim];
                 // Pointer to the result array.
                 const auto res = res_ptrs[0];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Compute m_src/dist.
                     const auto m_src_dist_vec = use_fast_inv_sqrt<batch_type>
                                                     ? m_src_vec * batch_type(tmp_dist + i, xsimd::aligned_mode{})
                                                     : m_src_vec / batch_type(tmp_dist + i, xsimd::aligned_mode{});
                     // Compute and accumulate the potential.
-                    xsimd_fnma(batch_type(m_ptr + i, xsimd::aligned_mode{}), m_src_dist_vec,
-                               batch_type(res + i, xsimd::aligned_mode{}))
-                        .store_aligned(res + i);
+                    batch_store_n(xsimd_fnma(batch_load_n<batch_type>(m_ptr + i, n, xsimd::unaligned_mode{}),
+                                             m_src_dist_vec,
+                                             batch_load_n<batch_type>(res + i, n, xsimd::unaligned_mode{})),
+                                  res + i, n, xsimd::unaligned_mode{});
                 }
             } else {
                 // Q == 2, accelerations and potentials.
                 //
-                // Pointers to the temporary coordinate diffs, 1/dist3 and 1/dist values computed in the MAC check.
-                const auto [tmp_x, tmp_y, tmp_z, tmp_dist3, tmp_dist] = tmp_ptrs;
+                // Pointers to the temporary 1/dist3 and 1/dist values computed in the MAC check.
+                const auto tmp_dist3 = tmp_ptrs[NDim], tmp_dist = tmp_ptrs[NDim + 1u];
                 // Pointer to the target masses.
-                const auto m_ptr = p_ptrs[3];
-                // Pointers to the result arrays.
-                const auto [res_x, res_y, res_z, res_pot] = res_ptrs;
+                const auto m_ptr = p_ptrs[NDim];
+                // Pointer to the potential result array.
+                const auto res_pot = res_ptrs[NDim];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    // Compute m_src/dist**3, m_src/dist and load the differences.
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    // Compute m_src/dist**3 and m_src/dist.
                     const auto m_src_dist3_vec = use_fast_inv_sqrt<batch_type>
                                                      ? m_src_vec * batch_type(tmp_dist3 + i, xsimd::aligned_mode{})
                                                      : m_src_vec / batch_type(tmp_dist3 + i, xsimd::aligned_mode{}),
                                m_src_dist_vec = use_fast_inv_sqrt<batch_type>
                                                     ? m_src_vec * batch_type(tmp_dist + i, xsimd::aligned_mode{})
-                                                    : m_src_vec / batch_type(tmp_dist + i, xsimd::aligned_mode{}),
-                               xdiff = batch_type(tmp_x + i, xsimd::aligned_mode{}),
-                               ydiff = batch_type(tmp_y + i, xsimd::aligned_mode{}),
-                               zdiff = batch_type(tmp_z + i, xsimd::aligned_mode{});
-                    // Compute and accumulate the accelerations.
-                    xsimd_fma(xdiff, m_src_dist3_vec, batch_type(res_x + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_x + i);
-                    xsimd_fma(ydiff, m_src_dist3_vec, batch_type(res_y + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_y + i);
-                    xsimd_fma(zdiff, m_src_dist3_vec, batch_type(res_z + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_z + i);
+                                                    : m_src_vec / batch_type(tmp_dist + i, xsimd::aligned_mode{});
+                    // Load the differences, compute and accumulate the accelerations.
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        batch_store_n(xsimd_fma(batch_type(tmp_ptrs[j] + i, xsimd::aligned_mode{}), m_src_dist3_vec,
+                                                batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{})),
+                                      res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                    }
                     // Compute and accumulate the potential.
-                    xsimd_fnma(batch_type(m_ptr + i, xsimd::aligned_mode{}), m_src_dist_vec,
-                               batch_type(res_pot + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_pot + i);
+                    batch_store_n(xsimd_fnma(batch_load_n<batch_type>(m_ptr + i, n, xsimd::unaligned_mode{}),
+                                             m_src_dist_vec,
+                                             batch_load_n<batch_type>(res_pot + i, n, xsimd::unaligned_mode{})),
+                                  res_pot + i, n, xsimd::unaligned_mode{});
                 }
             }
         } else {
@@ -2562,271 +3512,1218 @@ private:
             }
         }
     }
+    // Left-hand side of the MAC check for the source node src_node: the MAC is satisfied
+    // by a target particle if its squared distance from the COM of src_node is greater than this value.
+    // NOTE: for the relative MAC, this is only the geometric part of the criterion (see rel_mac_fail()).
+    static F node_mac_lh(const node_type &src_node, [[maybe_unused]] F mac_value)
+    {
+        if constexpr (MAC == mac::bh || MAC == mac::bh_box) {
+            // NOTE: for the BH MACs, mac_value is theta**-2.
+            return src_node.dim2 * mac_value;
+        } else if constexpr (MAC == mac::relative) {
+            // NOTE: with the relative MAC, the nodes are always opened by the targets
+            // closer than the node dimension (i.e., as in the BH MAC with theta = 1).
+            return src_node.dim2;
+        } else {
+            // NOTE: for the geometric BH MAC, mac_value is theta**-1.
+            static_assert(MAC == mac::bh_geom);
+            const auto tmp = fma_wrap(src_node.dim, mac_value, src_node.delta);
+            return tmp * tmp;
+        }
+    }
+    // Check of the relative MAC for a target (or a batch of targets) at the squared distance dist2 from the COM of
+    // a source node whose product of the mass and of the square of the dimension is mdim2. The relative MAC is
+    // satisfied if the estimated error of the monopole approximation, G*M*l**2/r**4, is not greater than
+    // alpha * |a_old|, where a_old is the acceleration of the target in the previous step. mac_value is
+    // alpha * |a_old| / G (see crit_node_mac_value()). The return value is true if the MAC is *not* satisfied.
+    template <typename T>
+    static auto rel_mac_fail(const T &dist2, const T &mdim2, const T &mac_value)
+    {
+        return dist2 * dist2 * mac_value <= mdim2;
+    }
+    // Value of the MAC used in the traversal for the critical node with index cn_idx. mac_value is the transformed
+    // MAC value, G the grav constant. For the relative MAC, the return value is alpha * |a_old| / |G|, where |a_old|
+    // is the smallest magnitude of the previous accelerations of the particles in the critical node, so that the
+    // criterion is never looser than for any of the targets. For the other MACs, mac_value is returned unchanged.
+    F crit_node_mac_value(size_type cn_idx, F mac_value, [[maybe_unused]] F G) const
+    {
+        if constexpr (MAC == mac::relative) {
+            assert(m_acc_old.size() == m_parts[0].size());
+            const auto begin = m_crit_nodes[cn_idx].begin, end = m_crit_nodes[cn_idx].end;
+            assert(begin < end);
+            return mac_value * *std::min_element(m_acc_old.data() + begin, m_acc_old.data() + end) / std::abs(G);
+        } else {
+            return mac_value;
+        }
+    }
+    // Estimate of the error of the monopole approximation in the traversal for the critical node with index cn_idx.
+    // p_ptrs are pointers to the coordinates of the particles of the critical node (see crit_node_tgt_ptrs()), which
+    // are enclosed in the bounding box [lo, hi], mac_value the transformed value of the (geometric) MAC. The source
+    // nodes are accepted as in the traversal. For each accepted node, the error of its contribution to the
+    // acceleration is estimated as the difference between the monopole contribution of the node and the monopole
+    // contributions of its children (or the contributions of its particles, if the node is a leaf), evaluated at the
+    // target particle closest to the COM of the node (or at the closest point of the bounding box, if the node is
+    // accepted by the whole box). The return value is the magnitude of the sum of these differences, without the
+    // grav constant.
+    F crit_node_err_estimate(size_type cn_idx, const std::array<const F *, NDim + 1u> &p_ptrs,
+                             const std::array<F, NDim> &lo, const std::array<F, NDim> &hi, F mac_value) const
+    {
+        static_assert(MAC != mac::relative);
+        assert(!m_tree.empty());
+        const auto tgt_code = m_crit_nodes[cn_idx].code;
+        const auto tgt_size = static_cast<size_type>(m_crit_nodes[cn_idx].end - m_crit_nodes[cn_idx].begin);
+        std::array<F, NDim> pt, err{};
+        // Helper to accumulate into err the acceleration at pt due to the mass m at x, multiplied by sign.
+        auto add_acc = [&pt, &err](const auto &x, F m, F sign) {
+            std::array<F, NDim> diff;
+            F dist2(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                diff[j] = x[j] - pt[j];
+                dist2 = fma_wrap(diff[j], diff[j], dist2);
+            }
+            if (rakau_unlikely(dist2 == F(0))) {
+                // NOTE: this can happen only for the particles of a leaf
+                // coinciding with a target particle, skip them.
+                return;
+            }
+            const auto m_dist3 = sign * m / (dist2 * std::sqrt(dist2));
+            for (std::size_t j = 0; j < NDim; ++j) {
+                err[j] = fma_wrap(diff[j], m_dist3, err[j]);
+            }
+        };
+        const auto tgt_level = tree_level<NDim>(tgt_code);
+        const auto tree_size = static_cast<size_type>(m_tree.size());
+        for (size_type src_idx = 0; src_idx < tree_size;) {
+            const auto &src_node = m_tree[src_idx];
+            // NOTE: skip the ancestors of the target node and the target node
+            // itself, as in tree_acc_pot().
+            const auto s_tgt_code = static_cast<UInt>(tgt_code >> ((tgt_level - src_node.level) * NDim));
+            if (s_tgt_code == src_node.code) {
+                src_idx += 1u + (src_node.code == tgt_code ? src_node.n_children : size_type(0));
+                continue;
+            }
+            const auto mac_lh = node_mac_lh(src_node, mac_value);
+            // NOTE: if the bounding box satisfies the MAC, all the target particles do, and the error is
+            // evaluated at the point of the box closest to the COM. Otherwise, the MAC is checked with the target
+            // particle closest to the COM.
+            F dist2(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                pt[j] = std::clamp(src_node.props[j], lo[j], hi[j]);
+                const auto diff = src_node.props[j] - pt[j];
+                dist2 = fma_wrap(diff, diff, dist2);
+            }
+            if (dist2 <= mac_lh) {
+                auto min_dist2 = std::numeric_limits<F>::infinity();
+                size_type min_idx = 0;
+                for (size_type i = 0; i < tgt_size; ++i) {
+                    F p_dist2(0);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        const auto diff = src_node.props[j] - p_ptrs[j][i];
+                        p_dist2 = fma_wrap(diff, diff, p_dist2);
+                    }
+                    if (p_dist2 < min_dist2) {
+                        min_dist2 = p_dist2;
+                        min_idx = i;
+                    }
+                }
+                if (mac_lh >= min_dist2) {
+                    // The node is opened or, if it is a leaf, its particles are used directly.
+                    ++src_idx;
+                    continue;
+                }
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pt[j] = p_ptrs[j][min_idx];
+                }
+            }
+            // The MAC is satisfied: accumulate the difference between the monopole contribution
+            // of the node and the refined contributions, and skip the children.
+            add_acc(src_node.props, src_node.props[NDim], F(1));
+            if (src_node.n_children) {
+                for (auto c_idx = src_idx + 1u; c_idx < src_idx + 1u + src_node.n_children;
+                     c_idx += 1u + m_tree[c_idx].n_children) {
+                    add_acc(m_tree[c_idx].props, m_tree[c_idx].props[NDim], F(-1));
+                }
+            } else {
+                const auto l_ptrs = leaf_src_ptrs(src_idx);
+                std::array<F, NDim> x;
+                for (size_type k = 0; k < src_node.end - src_node.begin; ++k) {
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        x[j] = l_ptrs[j][k];
+                    }
+                    add_acc(x, l_ptrs[NDim][k], F(-1));
+                }
+            }
+            src_idx += 1u + src_node.n_children;
+        }
+        F retval(0);
+        for (const auto &e : err) {
+            retval = fma_wrap(e, e, retval);
+        }
+        return std::sqrt(retval);
+    }
     // Function to check if a source node satisfies the MAC and, possibly, to compute the
     // accelerations/potentials due to that source node. src_idx is the index, in the tree structure, of the source
     // node, mac_value the value of the MAC (or some function of it), eps2 the square of the softening length, tgt_size
     // the number of particles in the target node, p_ptrs pointers to the coordinates/masses of the particles in the
-    // target node, res_ptrs pointers to the output arrays. The return value is the index of the next source node in the
-    // tree traversal. Q indicates which quantities will be computed (accs, potentials, or both).
-    template <unsigned Q>
+    // target node, res_ptrs pointers to the output arrays. If leaves is not null, the interactions with the source leaf
+    // nodes failing the MAC will not be computed, and the indices of such nodes will be appended to leaves instead.
+    // If mixed is not null, the interactions with the source leaf nodes failing the MAC will be computed in mixed
+    // precision using the target data in mixed. The return value is the index of the next source node in the tree
+    // traversal. Q indicates which quantities will be computed (accs, potentials, or both).
+    template <unsigned Q, typename B>
     size_type tree_acc_pot_mac_check(size_type src_idx, F mac_value, F eps2, size_type tgt_size,
                                      const std::array<const F *, NDim + 1u> &p_ptrs,
-                                     const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+                                     const std::array<F *, nvecs_res<Q>> &res_ptrs, std::vector<size_type> *leaves,
+                                     const mixed_tgt_data *mixed) const
     {
         // Temporary vectors to store the data computed during the MAC check.
         // We will re-use this data later in tree_acc_pot_src_com().
         auto &tmp_vecs = acc_pot_tmp_vecs<Q>();
         static_assert(nvecs_tmp<Q> == std::tuple_size_v<std::remove_reference_t<decltype(tmp_vecs)>>);
         std::array<F *, nvecs_tmp<Q>> tmp_ptrs;
-        // NOTE: the size of the vectors in tgt_tmp_data() might be
-        // greater than tgt_size, due to SIMD padding. Fetch the
-        // actual size.
-        const auto pdata_size = tgt_tmp_data()[0].size();
-        // Prepare the temporary data.
-        if constexpr (Q == 0u || Q == 2u) {
-            // Q == 0 or 2: accelerations are requested.
-            for (std::size_t j = 0; j < NDim + 1u; ++j) {
-                tmp_vecs[j].resize(pdata_size);
-                tmp_ptrs[j] = tmp_vecs[j].data();
-            }
-        }
-        if constexpr (Q == 1u || Q == 2u) {
-            // Q == 1 or 2: potentials are requested.
-            // Establish the index of the dist values in the temp data:
-            // 0 if only the potentials are requested, NDim + 1 otherwise.
-            constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
-            tmp_vecs[dist_idx].resize(pdata_size);
-            tmp_ptrs[dist_idx] = tmp_vecs[dist_idx].data();
+        // NOTE: the temporary vectors have already been sized
+        // appropriately in acc_pot_cpu_run(), here we just fetch
+        // the pointers.
+        for (std::size_t j = 0; j < nvecs_tmp<Q>; ++j) {
+            tmp_ptrs[j] = tmp_vecs[j].data();
         }
         // Local cache.
         const auto &src_node = m_tree[src_idx];
         // Copy locally the number of children of the source node.
         const auto n_children_src = src_node.n_children;
         // Left-hand side of the MAC check.
-        const auto mac_lh = [mac_value, &src_node]() {
-            if constexpr (MAC == mac::bh) {
-                // NOTE: for the BH MAC, mac_value is theta**-2.
-                return src_node.dim2 * mac_value;
-            } else {
-                // NOTE: for the geometric BH MAC, mac_value is theta**-1.
-                static_assert(MAC == mac::bh_geom);
-                const auto tmp = fma_wrap(src_node.dim, mac_value, src_node.delta);
-                return tmp * tmp;
-            }
-        }();
+        const auto mac_lh = node_mac_lh(src_node, mac_value);
         // The flag for the BH criterion check. Initially set to true,
         // it will be set to false if at least one particle in the
         // target node fails the check.
         bool mac_flag = true;
-        if constexpr (simd_enabled && NDim == 3u) {
+        if constexpr (batch_simd<B>) {
             // The SIMD-accelerated version.
-            using batch_type = xsimd::simd_type<F>;
+            using batch_type = B;
             constexpr auto batch_size = batch_type::size;
             // Splatted vector versions of the scalar variables.
-            const batch_type eps2_vec(eps2), mac_lh_vec(mac_lh), x_com_vec(src_node.props[0]),
-                y_com_vec(src_node.props[1]), z_com_vec(src_node.props[2]);
-            // Pointers to the coordinates.
-            const auto [x_ptr, y_ptr, z_ptr, m_ptr] = p_ptrs;
-            (void)m_ptr;
-            if constexpr (Q == 0u) {
-                // Q == 0, accelerations only.
-                //
-                // Pointers to the temporary data.
-                const auto [tmp_x, tmp_y, tmp_z, tmp_dist3] = tmp_ptrs;
-                for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    const auto diff_x = x_com_vec - batch_type(x_ptr + i, xsimd::aligned_mode{}),
-                               diff_y = y_com_vec - batch_type(y_ptr + i, xsimd::aligned_mode{}),
-                               diff_z = z_com_vec - batch_type(z_ptr + i, xsimd::aligned_mode{});
-                    auto dist2 = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
-                    if (xsimd::any(mac_lh_vec >= dist2)) {
-                        // At least one particle in the current batch fails the MAC
-                        // check. Mark the mac_flag as false, then break out.
-                        mac_flag = false;
-                        break;
+            const batch_type eps2_vec(eps2), mac_lh_vec(mac_lh);
+            [[maybe_unused]] batch_type mdim2_vec, mac_value_vec;
+            if constexpr (MAC == mac::relative) {
+                mdim2_vec = batch_type(src_node.mdim2);
+                mac_value_vec = batch_type(mac_value);
+            }
+            std::array<batch_type, NDim> com_vecs;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                com_vecs[j] = batch_type(src_node.props[j]);
+            }
+            // Batches for the coordinate diffs.
+            std::array<batch_type, NDim> diffs;
+            for (size_type i = 0; i < tgt_size; i += batch_size) {
+                const auto n = static_cast<size_type>(tgt_size - i);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    diffs[j] = com_vecs[j] - batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+                auto dist2 = batch_norm2(diffs);
+                auto fail_mask = mac_lh_vec >= dist2;
+                if constexpr (MAC == mac::relative) {
+                    fail_mask = fail_mask | rel_mac_fail(dist2, mdim2_vec, mac_value_vec);
+                }
+                // NOTE: in the last batch, the lanes past the end of the target
+                // node contain dummy values which must not take part in the MAC check.
+                // The values computed for these lanes are written into the scratch
+                // buffers, but they will never reach the output arrays.
+                if (n < batch_size ? xsimd::any(fail_mask & batch_lane_mask<batch_type>(n))
+                                   : xsimd::any(fail_mask)) {
+                    // At least one particle in the current batch fails the MAC
+                    // check. Mark the mac_flag as false, then break out.
+                    mac_flag = false;
+                    break;
+                }
+                // Add the softening length.
+                dist2 += eps2_vec;
+                if constexpr (Q == 0u) {
+                    // Q == 0, accelerations only: store the diffs and 1/dist3 (or dist3).
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j].store_aligned(tmp_ptrs[j] + i);
+                    }
+                    if constexpr (use_fast_inv_sqrt<batch_type>) {
+                        inv_sqrt_3(dist2).store_aligned(tmp_ptrs[NDim] + i);
+                    } else {
+                        (xsimd_sqrt(dist2) * dist2).store_aligned(tmp_ptrs[NDim] + i);
+                    }
+                } else if constexpr (Q == 1u) {
+                    // Q == 1, potentials only: store 1/dist (or dist).
+                    if constexpr (use_fast_inv_sqrt<batch_type>) {
+                        inv_sqrt(dist2).store_aligned(tmp_ptrs[0] + i);
+                    } else {
+                        xsimd_sqrt(dist2).store_aligned(tmp_ptrs[0] + i);
+                    }
+                } else {
+                    // Q == 2, accelerations and potentials: store the diffs,
+                    // 1/dist3 and 1/dist (or dist3 and dist).
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j].store_aligned(tmp_ptrs[j] + i);
                     }
-                    // Add the softening length.
-                    dist2 += eps2_vec;
-                    diff_x.store_aligned(tmp_x + i);
-                    diff_y.store_aligned(tmp_y + i);
-                    diff_z.store_aligned(tmp_z + i);
                     if constexpr (use_fast_inv_sqrt<batch_type>) {
-                        inv_sqrt_3(dist2).store_aligned(tmp_dist3 + i);
+                        const auto inv_dist = inv_sqrt(dist2);
+                        (inv_dist * inv_dist * inv_dist).store_aligned(tmp_ptrs[NDim] + i);
+                        inv_dist.store_aligned(tmp_ptrs[NDim + 1u] + i);
                     } else {
-                        (xsimd_sqrt(dist2) * dist2).store_aligned(tmp_dist3 + i);
+                        const auto dist = xsimd_sqrt(dist2);
+                        (dist2 * dist).store_aligned(tmp_ptrs[NDim] + i);
+                        dist.store_aligned(tmp_ptrs[NDim + 1u] + i);
                     }
                 }
-            } else if constexpr (Q == 1u) {
-                // Q == 1, potentials only.
-                //
-                // Pointer to the temporary data.
-                const auto tmp = tmp_ptrs[0];
-                for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    const auto diff_x = x_com_vec - batch_type(x_ptr + i, xsimd::aligned_mode{}),
-                               diff_y = y_com_vec - batch_type(y_ptr + i, xsimd::aligned_mode{}),
-                               diff_z = z_com_vec - batch_type(z_ptr + i, xsimd::aligned_mode{});
-                    auto dist2 = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
-                    if (xsimd::any(mac_lh_vec >= dist2)) {
-                        // At least one particle in the current batch fails the MAC
-                        // check. Mark the mac_flag as false, then break out.
-                        mac_flag = false;
-                        break;
+            }
+        } else {
+            // The scalar version.
+            for (size_type i = 0; i < tgt_size; ++i) {
+                F dist2(0);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    const auto diff = src_node.props[j] - p_ptrs[j][i];
+                    if constexpr (Q == 0u || Q == 2u) {
+                        // Store the differences for later use, if we are computing
+                        // accelerations.
+                        tmp_ptrs[j][i] = diff;
+                    }
+                    dist2 = fma_wrap(diff, diff, dist2);
+                }
+                bool fail = mac_lh >= dist2;
+                if constexpr (MAC == mac::relative) {
+                    fail = fail || rel_mac_fail(dist2, src_node.mdim2, mac_value);
+                }
+                if (fail) {
+                    // At least one of the particles in the target
+                    // node is too close to the COM. Set the flag
+                    // to false and exit.
+                    mac_flag = false;
+                    break;
+                }
+                // Add the softening length and compute the distance.
+                dist2 += eps2;
+                const auto dist = std::sqrt(dist2);
+                if constexpr (Q == 0u || Q == 2u) {
+                    // Q == 0 or 2: accelerations are requested, store dist3.
+                    // NOTE: in the scalar part, we always store dist3.
+                    tmp_ptrs[NDim][i] = dist * dist2;
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    // Q == 1 or 2: potentials are requested.
+                    // Establish the index of the dist values in the temp data:
+                    // 0 if only the potentials are requested, NDim + 1 otherwise.
+                    constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
+                    // NOTE: in the scalar part, we always store dist.
+                    tmp_ptrs[dist_idx][i] = dist;
+                }
+            }
+        }
+        if (mac_flag) {
+            // The source node satisfies the MAC for all the particles of the target node. Add the
+            // interaction due to the com of the source node.
+            tree_acc_pot_src_com<Q, B>(src_idx, tgt_size, p_ptrs, tmp_ptrs, res_ptrs);
+            // We can now skip all the children of the source node.
+            return static_cast<size_type>(src_idx + n_children_src + 1u);
+        }
+        // The source node does not satisfy the MAC. We check if it is a leaf
+        // node, in which case we need to compute all the pairwise interactions.
+        if (!n_children_src) {
+            // Leaf node.
+            if (leaves) {
+                // The leaf-leaf interactions will be computed later, just
+                // record the leaf.
+                leaves->push_back(src_idx);
+            } else if (mixed) {
+                if constexpr (std::is_same_v<F, double>) {
+                    tree_acc_pot_leaf_mixed<Q, mixed_batch_t<B>>(src_idx, tgt_size, *mixed, res_ptrs);
+                }
+            } else {
+                tree_acc_pot_leaf<Q, B>(eps2, src_idx, tgt_size, p_ptrs, res_ptrs);
+            }
+        }
+        // In any case, we keep traversing the tree moving to the next node in depth-first order.
+        return static_cast<size_type>(src_idx + 1u);
+    }
+    // Tree traversal for the computation of the accelerations/potentials. mac_value is the value of the MAC, or some
+    // function of it, eps2 the square of the softening length, tgt_size the number of particles in the target node,
+    // tgt_code its code, p_ptrs are pointers to the coordinates/masses of the particles in the target node, res_ptrs
+    // pointers to the output arrays. If leaves is not null, the interactions with the source leaf nodes failing the MAC
+    // will be skipped, and the indices of such nodes will be appended to leaves. If mixed is not null, the leaf-leaf
+    // interactions will be computed in mixed precision (see tree_acc_pot_leaf_mixed()). Q indicates which quantities
+    // will be computed (accs, potentials, or both).
+    template <unsigned Q, typename B>
+    void tree_acc_pot(F mac_value, F eps2, size_type tgt_size, UInt tgt_code,
+                      const std::array<const F *, NDim + 1u> &p_ptrs, const std::array<F *, nvecs_res<Q>> &res_ptrs,
+                      std::vector<size_type> *leaves = nullptr, const mixed_tgt_data *mixed = nullptr) const
+    {
+        assert(!m_tree.empty());
+        // Tree level of the target node.
+        // NOTE: the target level is available in the tree structure, so in principle we could get
+        // it from there. However, the target node is taken from the list of critical nodes, which
+        // currently does not store the target node index. Let's keep this in mind if we change
+        // the tree building routine.
+        const auto tgt_level = tree_level<NDim>(tgt_code);
+        // Total size of the tree.
+        const auto tree_size = static_cast<size_type>(m_tree.size());
+        // Start the iteration over the source nodes.
+        for (size_type src_idx = 0; src_idx < tree_size;) {
+            // Get a reference to the current source node.
+            const auto &src_node = m_tree[src_idx];
+            // Extract the code of the source node.
+            const auto src_code = src_node.code;
+            // Number of children of the source node.
+            const auto n_children_src = src_node.n_children;
+            // Extract the level of the source node.
+            const auto src_level = src_node.level;
+            // Compute the shifted target code. This is tgt_code
+            // shifted down by the difference between tgt_level
+            // and src_level. For instance, in an octree,
+            // if the target code is 1 000 000 001 000, then tgt_level
+            // is 4, and, if src_level is 2, then the shifted code
+            // will be 1 000 000.
+            const auto s_tgt_code = static_cast<UInt>(tgt_code >> ((tgt_level - src_level) * NDim));
+            if (s_tgt_code == src_code) {
+                // The shifted target code coincides with the source code. This means
+                // that either the source node is an ancestor of the target node, or it is
+                // the target node itself. In the former cases, we just have to continue
+                // the depth-first traversal by setting ++src_idx. In the latter case,
+                // we want to bump up src_idx by n_children_src + 1 in order to skip
+                // the target node and all its children. We will compute later the self
+                // interactions in the target node.
+                const auto tgt_eq_src_mask = static_cast<size_type>(-(src_code == tgt_code));
+                src_idx += 1u + (n_children_src & tgt_eq_src_mask);
+            } else {
+                // The source node is not an ancestor of the target. We need to run the MAC
+                // check. The tree_acc_pot_mac_check() function will return the index of the next node
+                // in the traversal.
+                src_idx = tree_acc_pot_mac_check<Q, B>(src_idx, mac_value, eps2, tgt_size, p_ptrs, res_ptrs, leaves,
+                                                       mixed);
+            }
+        }
+
+        // Compute the self interactions within the target node.
+        tree_self_interactions<Q, B>(eps2, tgt_size, p_ptrs, res_ptrs);
+    }
+    // Parameters of the traversals of the short-range and periodic modes (see tree_acc_pot_walk()).
+    struct walk_params {
+        // The square of the softening length.
+        F eps2;
+        // 1 / (2 * r_split) and the cutoff radius (short-range mode).
+        F inv_2rs, r_cut;
+        // The box size and its inverse (periodic mode).
+        F box_size, inv_box_size;
+        // The table of the Ewald corrections (periodic mode without the short-range split).
+        const ewald_table<F> *ewald;
+    };
+    // Nearest-image convention for the separation x (scalar or batch) in a periodic
+    // domain of size box_size.
+    template <typename T>
+    static T nearest_image(const T &x, const T &box_size, const T &inv_box_size)
+    {
+        using std::round;
+        using xsimd::round;
+        return x - box_size * round(x * inv_box_size);
+    }
+    // Computation of the short-range accelerations/potentials induced by the src_size source particles at src_ptrs on
+    // the tgt_size target particles at p_ptrs. The results are accumulated into res_ptrs. The Newtonian interaction
+    // is multiplied by the TreePM split function, that is, erfc(u) + 2u/sqrt(pi)*exp(-u**2) for the accelerations
+    // and erfc(u) for the potentials, where u = r / (2 * r_split) and r is the softened distance. If Periodic is
+    // true, the separations follow the nearest-image convention. If self is true, the sources are the target
+    // particles themselves, and the interaction of each particle with itself is skipped. Q indicates which
+    // quantities will be computed (accs, potentials, or both).
+    template <unsigned Q, typename B, bool Periodic>
+    static void tree_acc_pot_sr_parts(const walk_params &wp, const std::array<const F *, NDim + 1u> &src_ptrs,
+                                      size_type src_size, bool self, size_type tgt_size,
+                                      const std::array<const F *, NDim + 1u> &p_ptrs,
+                                      const std::array<F *, nvecs_res<Q>> &res_ptrs)
+    {
+        // 2/sqrt(pi).
+        constexpr auto two_sqrt_pi = static_cast<F>(1.1283791670955125738961589031215452L);
+        // Establish the index of the potential in the result array:
+        // 0 if only the potentials are requested, NDim otherwise.
+        [[maybe_unused]] constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        if constexpr (batch_simd<B>) {
+            using batch_type = B;
+            constexpr auto batch_size = batch_type::size;
+            const batch_type eps2_vec(wp.eps2), inv_2rs_vec(wp.inv_2rs), two_sqrt_pi_vec(two_sqrt_pi),
+                zero_vec(F(0)), one_vec(F(1));
+            [[maybe_unused]] const batch_type box_size_vec(wp.box_size), inv_box_size_vec(wp.inv_box_size);
+            std::array<batch_type, NDim> tgt_pos, diffs;
+            std::array<batch_type, nvecs_res<Q>> res;
+            for (size_type i = 0; i < tgt_size; i += batch_size) {
+                const auto n = static_cast<size_type>(tgt_size - i);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    tgt_pos[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+                for (auto &r : res) {
+                    r = zero_vec;
+                }
+                for (size_type k = 0; k < src_size; ++k) {
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = batch_type(src_ptrs[j][k]) - tgt_pos[j];
+                        if constexpr (Periodic) {
+                            diffs[j] = nearest_image(diffs[j], box_size_vec, inv_box_size_vec);
+                        }
+                    }
+                    auto dist2 = batch_norm2(diffs, eps2_vec);
+                    batch_type m_src_vec(src_ptrs[NDim][k]);
+                    if (self && k >= i && k - i < batch_size) {
+                        // Zero out the interaction of the particle with itself, while
+                        // making sure we do not generate non-finite values.
+                        const auto self_mask = batch_lane_eq_mask<batch_type>(k - i);
+                        m_src_vec = xsimd::select(self_mask, zero_vec, m_src_vec);
+                        dist2 = xsimd::select(self_mask, one_vec, dist2);
+                    }
+                    const auto dist = xsimd_sqrt(dist2);
+                    const auto u = dist * inv_2rs_vec;
+                    const auto erfc_u = xsimd::erfc(u);
+                    const auto m_src_dist = m_src_vec / dist;
+                    if constexpr (Q == 0u || Q == 2u) {
+                        const auto m_src_dist3
+                            = m_src_dist / dist2 * xsimd_fma(two_sqrt_pi_vec * u, xsimd::exp(-(u * u)), erfc_u);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            res[j] = xsimd_fma(diffs[j], m_src_dist3, res[j]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        res[pot_idx] = xsimd_fma(m_src_dist, erfc_u, res[pot_idx]);
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    // Multiply the potentials by the masses of the targets, and flip the sign.
+                    res[pot_idx]
+                        = -(res[pot_idx] * batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{}));
+                }
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    batch_store_n(batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{}) + res[j],
+                                  res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+            }
+        } else {
+            std::array<F, NDim> diffs;
+            std::array<F, nvecs_res<Q>> res;
+            for (size_type i = 0; i < tgt_size; ++i) {
+                res.fill(F(0));
+                for (size_type k = 0; k < src_size; ++k) {
+                    if (self && k == i) {
+                        continue;
+                    }
+                    F dist2(wp.eps2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = src_ptrs[j][k] - p_ptrs[j][i];
+                        if constexpr (Periodic) {
+                            diffs[j] = nearest_image(diffs[j], wp.box_size, wp.inv_box_size);
+                        }
+                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+                    }
+                    const auto dist = std::sqrt(dist2), u = dist * wp.inv_2rs, erfc_u = std::erfc(u),
+                               m_src_dist = src_ptrs[NDim][k] / dist;
+                    if constexpr (Q == 0u || Q == 2u) {
+                        const auto m_src_dist3
+                            = m_src_dist / dist2 * fma_wrap(two_sqrt_pi * u, std::exp(-(u * u)), erfc_u);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            res[j] = fma_wrap(diffs[j], m_src_dist3, res[j]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        res[pot_idx] = fma_wrap(m_src_dist, erfc_u, res[pot_idx]);
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    res[pot_idx] = -(res[pot_idx] * p_ptrs[NDim][i]);
+                }
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_ptrs[j][i] += res[j];
+                }
+            }
+        }
+    }
+    // Computation of the periodic accelerations/potentials induced by the src_size source particles at src_ptrs on
+    // the tgt_size target particles at p_ptrs, via the Ewald corrections. The results are accumulated into res_ptrs.
+    // The interaction is the softened Newtonian interaction with the nearest image of each source, plus the
+    // (unsoftened) Ewald correction interpolated from wp.ewald. The self argument is as in tree_acc_pot_sr_parts().
+    // NOTE: the interaction of each particle with its own periodic images is not included.
+    template <unsigned Q, typename B>
+    static void tree_acc_pot_ewald_parts(const walk_params &wp, const std::array<const F *, NDim + 1u> &src_ptrs,
+                                         size_type src_size, bool self, size_type tgt_size,
+                                         const std::array<const F *, NDim + 1u> &p_ptrs,
+                                         const std::array<F *, nvecs_res<Q>> &res_ptrs)
+    {
+        static_assert(NDim == 3u);
+        [[maybe_unused]] constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        const auto &ewt = *wp.ewald;
+        // The scaling factors of the corrections, which are tabulated for a unit box.
+        const auto acc_scale = wp.inv_box_size * wp.inv_box_size, pot_scale = wp.inv_box_size;
+        if constexpr (batch_simd<B>) {
+            using batch_type = B;
+            constexpr auto batch_size = batch_type::size;
+            const batch_type eps2_vec(wp.eps2), zero_vec(F(0)), one_vec(F(1)), box_size_vec(wp.box_size),
+                inv_box_size_vec(wp.inv_box_size);
+            std::array<batch_type, NDim> tgt_pos, diffs;
+            std::array<batch_type, nvecs_res<Q>> res;
+            // Storage for the separations and the corrections of each lane.
+            // NOTE: xsimd does not provide gathers, thus the table lookups are done lane by lane.
+            std::array<std::array<F, batch_size>, NDim> d_lanes;
+            std::array<std::array<F, batch_size>, NDim + 1u> c_lanes;
+            for (size_type i = 0; i < tgt_size; i += batch_size) {
+                const auto n = static_cast<size_type>(tgt_size - i);
+                const auto n_lanes = std::min(n, static_cast<size_type>(batch_size));
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    tgt_pos[j] = batch_load_n<batch_type>(p_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+                for (auto &r : res) {
+                    r = zero_vec;
+                }
+                for (auto &c : c_lanes) {
+                    c.fill(F(0));
+                }
+                for (size_type k = 0; k < src_size; ++k) {
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = nearest_image(batch_type(src_ptrs[j][k]) - tgt_pos[j], box_size_vec,
+                                                 inv_box_size_vec);
+                        diffs[j].store_unaligned(d_lanes[j].data());
+                    }
+                    for (size_type l = 0; l < n_lanes; ++l) {
+                        F c[4];
+                        ewt.interp(c, std::abs(d_lanes[0][l]) * wp.inv_box_size,
+                                   std::abs(d_lanes[1][l]) * wp.inv_box_size,
+                                   std::abs(d_lanes[2][l]) * wp.inv_box_size);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            c_lanes[j][l] = std::copysign(c[j], d_lanes[j][l]) * acc_scale;
+                        }
+                        c_lanes[NDim][l] = c[3] * pot_scale;
+                    }
+                    auto dist2 = batch_norm2(diffs, eps2_vec);
+                    batch_type m_src_vec(src_ptrs[NDim][k]);
+                    if (self && k >= i && k - i < batch_size) {
+                        // Zero out the interaction of the particle with itself, while
+                        // making sure we do not generate non-finite values.
+                        const auto self_mask = batch_lane_eq_mask<batch_type>(k - i);
+                        m_src_vec = xsimd::select(self_mask, zero_vec, m_src_vec);
+                        dist2 = xsimd::select(self_mask, one_vec, dist2);
+                    }
+                    const auto m_src_dist = m_src_vec / xsimd_sqrt(dist2);
+                    if constexpr (Q == 0u || Q == 2u) {
+                        const auto m_src_dist3 = m_src_dist / dist2;
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            const auto corr
+                                = batch_load_n<batch_type>(c_lanes[j].data(), batch_size, xsimd::unaligned_mode{});
+                            res[j] = xsimd_fnma(m_src_vec, corr, xsimd_fma(diffs[j], m_src_dist3, res[j]));
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        const auto corr
+                            = batch_load_n<batch_type>(c_lanes[NDim].data(), batch_size, xsimd::unaligned_mode{});
+                        res[pot_idx] = xsimd_fnma(m_src_vec, corr, res[pot_idx] + m_src_dist);
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    // Multiply the potentials by the masses of the targets, and flip the sign.
+                    res[pot_idx]
+                        = -(res[pot_idx] * batch_load_n<batch_type>(p_ptrs[NDim] + i, n, xsimd::unaligned_mode{}));
+                }
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    batch_store_n(batch_load_n<batch_type>(res_ptrs[j] + i, n, xsimd::unaligned_mode{}) + res[j],
+                                  res_ptrs[j] + i, n, xsimd::unaligned_mode{});
+                }
+            }
+        } else {
+            std::array<F, NDim> diffs;
+            std::array<F, nvecs_res<Q>> res;
+            for (size_type i = 0; i < tgt_size; ++i) {
+                res.fill(F(0));
+                for (size_type k = 0; k < src_size; ++k) {
+                    if (self && k == i) {
+                        continue;
+                    }
+                    F dist2(wp.eps2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = nearest_image(src_ptrs[j][k] - p_ptrs[j][i], wp.box_size, wp.inv_box_size);
+                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+                    }
+                    F c[4];
+                    ewt.interp(c, std::abs(diffs[0]) * wp.inv_box_size, std::abs(diffs[1]) * wp.inv_box_size,
+                               std::abs(diffs[2]) * wp.inv_box_size);
+                    const auto m_src = src_ptrs[NDim][k], m_src_dist = m_src / std::sqrt(dist2);
+                    if constexpr (Q == 0u || Q == 2u) {
+                        const auto m_src_dist3 = m_src_dist / dist2;
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            res[j] = fma_wrap(diffs[j], m_src_dist3, res[j])
+                                     - m_src * std::copysign(c[j], diffs[j]) * acc_scale;
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        res[pot_idx] += m_src_dist - m_src * c[3] * pot_scale;
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    res[pot_idx] = -(res[pot_idx] * p_ptrs[NDim][i]);
+                }
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_ptrs[j][i] += res[j];
+                }
+            }
+        }
+    }
+    // Tree traversal for the computation of the short-range accelerations/potentials (see tree_acc_pot_sr_parts())
+    // and of the periodic accelerations/potentials (see tree_acc_pot_ewald_parts()). If Ewald is false, the source
+    // nodes whose geometric box is farther than wp.r_cut from the bounding box of the target particles are skipped
+    // together with all their children, thus the cost of the traversal depends only on the local density. If
+    // Periodic is true, all distances follow the nearest-image convention, and the nodes larger than a quarter of
+    // the domain are always opened. The other arguments are as in tree_acc_pot().
+    // NOTE: because of the uniform background, the Ewald correction is not a harmonic function, and the error of
+    // the monopole approximation on the periodic potentials does not decrease with the distance from the node
+    // as quickly as in the Newtonian case. The periodic accelerations are not affected.
+    template <unsigned Q, typename B, bool Periodic, bool Ewald>
+    void tree_acc_pot_walk(F mac_value, const walk_params &wp, size_type tgt_size, UInt tgt_code,
+                           const std::array<const F *, NDim + 1u> &p_ptrs,
+                           const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    {
+        static_assert(!Ewald || Periodic);
+        assert(!m_tree.empty());
+        assert(tgt_size);
+        auto parts = [&wp, tgt_size, &p_ptrs, &res_ptrs](const std::array<const F *, NDim + 1u> &src_ptrs,
+                                                         size_type src_size, bool self) {
+            if constexpr (Ewald) {
+                tree_acc_pot_ewald_parts<Q, B>(wp, src_ptrs, src_size, self, tgt_size, p_ptrs, res_ptrs);
+            } else {
+                tree_acc_pot_sr_parts<Q, B, Periodic>(wp, src_ptrs, src_size, self, tgt_size, p_ptrs, res_ptrs);
+            }
+        };
+        const auto tgt_level = tree_level<NDim>(tgt_code);
+        // Bounding box of the target particles, and its centre.
+        std::array<F, NDim> tgt_lo, tgt_hi, tgt_mid;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            const auto mm = std::minmax_element(p_ptrs[j], p_ptrs[j] + tgt_size);
+            tgt_lo[j] = *mm.first;
+            tgt_hi[j] = *mm.second;
+            tgt_mid[j] = (tgt_lo[j] + tgt_hi[j]) / F(2);
+        }
+        [[maybe_unused]] const auto r_cut2 = wp.r_cut * wp.r_cut;
+        const auto tree_size = static_cast<size_type>(m_tree.size());
+        for (size_type src_idx = 0; src_idx < tree_size;) {
+            const auto &src_node = m_tree[src_idx];
+            const auto src_code = src_node.code;
+            const auto n_children_src = src_node.n_children;
+            // NOTE: see tree_acc_pot() for the handling of the ancestors of the target node.
+            const auto s_tgt_code = static_cast<UInt>(tgt_code >> ((tgt_level - src_node.level) * NDim));
+            if (s_tgt_code == src_code) {
+                if (src_code == tgt_code) {
+                    // Self interactions within the target node.
+                    parts(p_ptrs, tgt_size, true);
+                    src_idx += n_children_src + 1u;
+                } else {
+                    ++src_idx;
+                }
+                continue;
+            }
+            if constexpr (!Ewald) {
+                // Minimum distance between the box of the source node and the bounding box of the targets. The box
+                // of the source node is the bounding box of its particles with the bh_box MAC, the geometric
+                // box otherwise.
+                F centre[NDim], half_dim[NDim];
+                if constexpr (MAC == mac::bh_box) {
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        centre[j] = (src_node.lo[j] + src_node.hi[j]) * (F(1) / F(2));
+                        half_dim[j] = (src_node.hi[j] - src_node.lo[j]) * (F(1) / F(2));
+                    }
+                } else {
+                    get_node_centre(centre, src_code, m_box_size);
+                    std::fill(half_dim, half_dim + NDim, get_node_dim(src_node.level, m_box_size) * (F(1) / F(2)));
+                }
+                if constexpr (Periodic) {
+                    // NOTE: move the box of the source node to its image nearest to the targets.
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        centre[j] = tgt_mid[j] + nearest_image(centre[j] - tgt_mid[j], wp.box_size, wp.inv_box_size);
+                    }
+                }
+                F min_dist2(0);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    const auto d = std::max(
+                        {tgt_lo[j] - (centre[j] + half_dim[j]), (centre[j] - half_dim[j]) - tgt_hi[j], F(0)});
+                    min_dist2 = fma_wrap(d, d, min_dist2);
+                }
+                if (min_dist2 > r_cut2) {
+                    // The source node is beyond the cutoff radius: skip it together with its children.
+                    src_idx += n_children_src + 1u;
+                    continue;
+                }
+            }
+            // MAC check.
+            // NOTE: in periodic mode, the nodes at the first two levels of the tree are
+            // too large for the nearest-image convention to be applied to their COM.
+            bool mac_flag = !Periodic || src_node.level >= 2u;
+            const auto mac_lh = node_mac_lh(src_node, mac_value);
+            for (size_type i = 0; i < tgt_size && mac_flag; ++i) {
+                F dist2(0);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    auto diff = src_node.props[j] - p_ptrs[j][i];
+                    if constexpr (Periodic) {
+                        diff = nearest_image(diff, wp.box_size, wp.inv_box_size);
+                    }
+                    dist2 = fma_wrap(diff, diff, dist2);
+                }
+                mac_flag = dist2 > mac_lh;
+            }
+            if (mac_flag) {
+                // Interaction with the COM of the source node.
+                std::array<const F *, NDim + 1u> com_ptrs;
+                for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                    com_ptrs[j] = src_node.props + j;
+                }
+                parts(com_ptrs, 1, false);
+                src_idx += n_children_src + 1u;
+            } else {
+                if (!n_children_src) {
+                    // Leaf node: compute all the pairwise interactions.
+                    parts(leaf_src_ptrs(src_idx), static_cast<size_type>(src_node.end - src_node.begin), false);
+                }
+                ++src_idx;
+            }
+        }
+    }
+    // Multiply by G the n values starting at ptr.
+    template <typename B>
+    static void acc_pot_mul_G(F *ptr, size_type n, F G)
+    {
+        if constexpr (!std::is_same_v<B, F>) {
+            using batch_type = B;
+            constexpr auto batch_size = batch_type::size;
+            const batch_type Gvec(G);
+            for (size_type k = 0; k < n; k += batch_size) {
+                const auto nk = static_cast<size_type>(n - k);
+                batch_store_n(batch_load_n<batch_type>(ptr + k, nk, xsimd::unaligned_mode{}) * Gvec, ptr + k, nk,
+                              xsimd::unaligned_mode{});
+            }
+        } else {
+            for (size_type k = 0; k < n; ++k) {
+                ptr[k] *= G;
+            }
+        }
+    }
+    // Size of the temporary vectors used in the MAC check for a target node containing tgt_size particles. These are
+    // internal scratch buffers, and, when SIMD is active, we round their size up to a multiple of the batch size
+    // so that the MAC check can always write full batches into them.
+    template <typename B>
+    static size_type acc_pot_scratch_size(size_type tgt_size)
+    {
+        if constexpr (!std::is_same_v<B, F>) {
+            using batch_type = B;
+            constexpr auto batch_size = batch_type::size;
+            static_assert(batch_size);
+            if ((batch_size - 1u) > (std::numeric_limits<size_type>::max() - tgt_size)) {
+                throw std::overflow_error("The number of particles in a critical node (" + std::to_string(tgt_size)
+                                          + ") is too large, and it results in an overflow condition");
+            }
+            return static_cast<size_type>((tgt_size + (batch_size - 1u)) / batch_size * batch_size);
+        } else {
+            return tgt_size;
+        }
+    }
+    // Index, in the tree structure, of the critical node with index cn_idx.
+    size_type crit_node_tree_idx(size_type cn_idx) const
+    {
+        const auto code = m_crit_nodes[cn_idx].code;
+        const auto it = std::lower_bound(m_tree.begin(), m_tree.end(), code, [](const auto &n, UInt c) {
+            return node_compare<NDim>(n.code, c);
+        });
+        assert(it != m_tree.end() && it->code == code);
+        return static_cast<size_type>(it - m_tree.begin());
+    }
+    // Computation of the accelerations/potentials in which the leaf-leaf interactions between distinct critical nodes
+    // are evaluated only once when the two sides open each other. out is the array of output pointers (in tree
+    // order), mac_value the value of the MAC, or some function of it, G the grav constant, eps2 the square of the
+    // softening length. Q indicates which quantities will be computed (accs, potentials, or both).
+    //
+    // The computation is split in two passes over the critical nodes. In the first pass we do the usual
+    // tree traversal, but we skip the source leaf nodes failing the MAC, recording them instead. In the
+    // second pass, for each critical node A and for each source leaf L (belonging to the critical node B)
+    // recorded by A, we consider each leaf LA of A: if LA was recorded by B as well, the interactions
+    // between LA and L are computed only once (by the critical node with the lowest index) via Newton's
+    // third law, otherwise they are computed only on LA. The interactions on the particles of L are
+    // accumulated into per-thread buffers, which are summed into the output at the end.
+    template <unsigned Q, typename B>
+    void acc_pot_mutual_impl(const std::array<F *, nvecs_res<Q>> &out, F mac_value, F G, F eps2) const
+    {
+        using c_size_type = decltype(m_crit_nodes.size());
+        const auto n_cnodes = m_crit_nodes.size();
+        const auto nparts = static_cast<size_type>(m_parts[0].size());
+        // The lists of source leaves failing the MAC for each critical node.
+        // NOTE: the lists are sorted, as they are filled during a depth-first traversal.
+        std::vector<std::vector<size_type>> open_leaves(n_cnodes);
+
+        // First pass.
+        tbb::parallel_for(tbb::blocked_range<c_size_type>(0, n_cnodes), [this, &out, &open_leaves, mac_value, G,
+                                                                          eps2](const auto &range) {
+            auto &tmp_vecs = acc_pot_tmp_vecs<Q>();
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto tgt_code = m_crit_nodes[i].code;
+                const auto tgt_begin = m_crit_nodes[i].begin,
+                           tgt_size = static_cast<size_type>(m_crit_nodes[i].end - tgt_begin);
+                // Size the MAC scratch buffers.
+                const auto scratch_size = acc_pot_scratch_size<B>(tgt_size);
+                for (auto &v : tmp_vecs) {
+                    v.resize(scratch_size);
+                }
+                std::array<const F *, NDim + 1u> p_ptrs;
+                for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                    p_ptrs[j] = m_parts[j].data() + tgt_begin;
+                }
+                std::array<F *, nvecs_res<Q>> res_ptrs;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_ptrs[j] = out[j] + tgt_begin;
+                    std::fill(res_ptrs[j], res_ptrs[j] + tgt_size, F(0));
+                }
+                tree_acc_pot<Q, B>(crit_node_mac_value(static_cast<size_type>(i), mac_value, G), eps2, tgt_size,
+                                   tgt_code, p_ptrs, res_ptrs, &open_leaves[i]);
+            }
+            flush_simd_counters_tl();
+        });
+
+        // Second pass.
+        // NOTE: the buffers are created lazily, the first time a thread needs them.
+        tbb::enumerable_thread_specific<std::array<f_vector<F>, nvecs_res<Q>>> src_bufs;
+        tbb::parallel_for(tbb::blocked_range<c_size_type>(0, n_cnodes), [this, &out, &open_leaves, &src_bufs, G, eps2,
+                                                                          nparts](const auto &range) {
+            auto &src_buf = src_bufs.local();
+            if (src_buf[0].size() != nparts) {
+                for (auto &v : src_buf) {
+                    v.resize(nparts);
+                    std::fill(v.data(), v.data() + nparts, F(0));
+                }
+            }
+            std::array<F *, nvecs_res<Q>> src_buf_ptrs;
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                src_buf_ptrs[j] = src_buf[j].data();
+            }
+            // The list of leaves in the current target node.
+            std::vector<size_type> tgt_leaves;
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto tgt_begin = m_crit_nodes[i].begin, tgt_end = m_crit_nodes[i].end;
+                const auto tgt_idx = crit_node_tree_idx(static_cast<size_type>(i));
+                tgt_leaves.clear();
+                for (auto k = tgt_idx; k <= tgt_idx + m_tree[tgt_idx].n_children; ++k) {
+                    if (!m_tree[k].n_children) {
+                        tgt_leaves.push_back(k);
+                    }
+                }
+                // Helpers to fetch pointers into the target particles and results.
+                auto p_ptrs = [this](size_type idx) {
+                    std::array<const F *, NDim + 1u> retval;
+                    for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                        retval[j] = m_parts[j].data() + idx;
+                    }
+                    return retval;
+                };
+                auto r_ptrs = [](const std::array<F *, nvecs_res<Q>> &ptrs, size_type idx) {
+                    std::array<F *, nvecs_res<Q>> retval;
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        retval[j] = ptrs[j] + idx;
+                    }
+                    return retval;
+                };
+                for (const auto src_idx : open_leaves[i]) {
+                    // Locate the critical node the source leaf belongs to.
+                    const auto src_begin = m_tree[src_idx].begin;
+                    const auto src_cn = static_cast<c_size_type>(
+                        std::upper_bound(m_crit_nodes.begin(), m_crit_nodes.end(), src_begin,
+                                         [](size_type value, const auto &cn) { return value < cn.begin; })
+                        - m_crit_nodes.begin() - 1);
+                    assert(src_cn != i);
+                    const auto &src_open = open_leaves[src_cn];
+                    // Iterate over the target leaves. Consecutive leaves which were not recorded
+                    // by the source critical node are processed at once.
+                    auto run_begin = tgt_begin;
+                    for (const auto tgt_leaf : tgt_leaves) {
+                        if (!std::binary_search(src_open.begin(), src_open.end(), tgt_leaf)) {
+                            continue;
+                        }
+                        const auto tl_begin = m_tree[tgt_leaf].begin, tl_end = m_tree[tgt_leaf].end;
+                        if (tl_begin > run_begin) {
+                            tree_acc_pot_leaf<Q, B>(eps2, src_idx, static_cast<size_type>(tl_begin - run_begin),
+                                                 p_ptrs(run_begin), r_ptrs(out, run_begin));
+                        }
+                        if (i < src_cn) {
+                            tree_acc_pot_leaf_mutual<Q, B>(eps2, src_idx, static_cast<size_type>(tl_end - tl_begin),
+                                                        p_ptrs(tl_begin), r_ptrs(out, tl_begin),
+                                                        r_ptrs(src_buf_ptrs, src_begin));
+                        }
+                        run_begin = tl_end;
+                    }
+                    if (tgt_end > run_begin) {
+                        tree_acc_pot_leaf<Q, B>(eps2, src_idx, static_cast<size_type>(tgt_end - run_begin),
+                                             p_ptrs(run_begin), r_ptrs(out, run_begin));
+                    }
+                }
+                // Multiply by G, if needed.
+                if (G != F(1)) {
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        acc_pot_mul_G<B>(out[j] + tgt_begin, static_cast<size_type>(tgt_end - tgt_begin), G);
+                    }
+                }
+            }
+            flush_simd_counters_tl();
+        });
+
+        // Add the contributions accumulated in the per-thread buffers.
+        tbb::parallel_for(tbb::blocked_range<size_type>(0, nparts), [&out, &src_bufs, G](const auto &range) {
+            for (const auto &src_buf : src_bufs) {
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    for (auto k = range.begin(); k != range.end(); ++k) {
+                        out[j][k] = fma_wrap(G, src_buf[j][k], out[j][k]);
+                    }
+                }
+            }
+        });
+    }
+    // Tag type signalling the absence of a callback in acc_pot_cpu_run().
+    struct acc_pot_no_cb {
+    };
+    // Computation of the accelerations/potentials on the cpu for the critical nodes in the [c_begin, c_end) range.
+    // out is the array of output iterators, mac_value the value of the MAC, or some function of it, G the grav
+    // constant, eps2 the square of the softening length. Q indicates which quantities will be computed (accs,
+    // potentials, or both), B is the batch type used in the traversal kernels. If mixed is true, the leaf-leaf
+    // interactions will be computed in mixed precision. If active is not null, only the accelerations/potentials
+    // of the particles in the active subset will be computed, and [c_begin, c_end) is a range in active->cnodes
+    // rather than in the list of critical nodes. If a callback cb is provided, out is ignored and, for each
+    // critical node, cb is invoked with the index of the first particle of the node (in the internal order),
+    // the number of particles in the node and pointers to the results (see accs_cb_u()).
+    template <unsigned Q, typename B, typename It, typename Cb = acc_pot_no_cb>
+    void acc_pot_cpu_run(const std::array<It, nvecs_res<Q>> &out, F mac_value, F G, F eps2, size_type c_begin,
+                         size_type c_end, bool mixed, const tree_active_t<F> *active, const Cb &cb = Cb{}) const
+    {
+        constexpr bool with_cb = !std::is_same_v<Cb, acc_pot_no_cb>;
+
+        assert(c_begin <= c_end);
+        assert(c_end <= (active ? active->cnodes.size() : m_crit_nodes.size()));
+        assert(!mixed || (std::is_same_v<F, double>));
+        assert(!with_cb || !active);
+
+        tbb::parallel_for(tbb::blocked_range(c_begin, c_end), [this, mac_value, G, eps2, &out, mixed, active,
+                                                               &cb](const auto &range) {
+            // Get references to the local temporary data.
+            auto &tmp_res = acc_pot_tmp_res<Q>();
+            auto &tmp_vecs = acc_pot_tmp_vecs<Q>();
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                // Index of the target node in the list of critical nodes.
+                const auto cn_idx = active ? active->cnodes[i][0] : i;
+                const auto tgt_code = m_crit_nodes[cn_idx].code;
+                const auto tgt_begin = m_crit_nodes[cn_idx].begin,
+                           node_size = static_cast<size_type>(m_crit_nodes[cn_idx].end - tgt_begin);
+                // The number of target particles. In the active subset mode, the inactive particles
+                // of the target node act only as sources.
+                const auto tgt_size
+                    = active ? static_cast<size_type>(active->cnodes[i][2] - active->cnodes[i][1]) : node_size;
+                // Prepare the temporary vectors used in the MAC check.
+                const auto scratch_size = acc_pot_scratch_size<B>(tgt_size);
+                for (auto &v : tmp_vecs) {
+                    v.resize(scratch_size);
+                }
+                // The particles of the target node are contiguous in m_parts,
+                // thus we can read their coordinates and masses in place. If the compressed coordinate
+                // store is active, the coordinates are decoded into the thread-local temporary vectors instead.
+                auto p_ptrs = crit_node_tgt_ptrs(cn_idx);
+                // In the active subset mode, gather the active particles of the target node,
+                // which become the targets, and the inactive ones, which will be used as sources
+                // after the tree traversal.
+                [[maybe_unused]] const size_type *a_idx = nullptr;
+                std::array<const F *, NDim + 1u> inact_ptrs;
+                size_type inact_size = 0;
+                if (active) {
+                    a_idx = active->idx.data() + active->cnodes[i][1];
+                    auto &act_vecs = acc_pot_active_tgt_vecs();
+                    auto &inact_vecs = acc_pot_active_src_vecs();
+                    for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                        act_vecs[j].resize(tgt_size);
+                        inact_vecs[j].resize(static_cast<size_type>(node_size - tgt_size));
                     }
-                    // Add the softening length.
-                    dist2 += eps2_vec;
-                    if constexpr (use_fast_inv_sqrt<batch_type>) {
-                        inv_sqrt(dist2).store_aligned(tmp + i);
-                    } else {
-                        xsimd_sqrt(dist2).store_aligned(tmp + i);
+                    size_type act_size = 0;
+                    for (size_type k = 0; k < node_size; ++k) {
+                        // NOTE: the active indices are sorted.
+                        const bool is_act = act_size < tgt_size && a_idx[act_size] == tgt_begin + k;
+                        auto &vecs = is_act ? act_vecs : inact_vecs;
+                        const auto dst = is_act ? act_size++ : inact_size++;
+                        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                            vecs[j][dst] = p_ptrs[j][k];
+                        }
+                    }
+                    assert(act_size == tgt_size);
+                    assert(inact_size == node_size - tgt_size);
+                    for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                        p_ptrs[j] = act_vecs[j].data();
+                        inact_ptrs[j] = inact_vecs[j].data();
                     }
                 }
-            } else {
-                // Q == 2, accelerations and potentials.
-                //
-                // Pointers to the temporary data.
-                const auto [tmp_x, tmp_y, tmp_z, tmp_dist3, tmp_dist] = tmp_ptrs;
-                for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    const auto diff_x = x_com_vec - batch_type(x_ptr + i, xsimd::aligned_mode{}),
-                               diff_y = y_com_vec - batch_type(y_ptr + i, xsimd::aligned_mode{}),
-                               diff_z = z_com_vec - batch_type(z_ptr + i, xsimd::aligned_mode{});
-                    auto dist2 = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
-                    if (xsimd::any(mac_lh_vec >= dist2)) {
-                        // At least one particle in the current batch fails the MAC
-                        // check. Mark the mac_flag as false, then break out.
-                        mac_flag = false;
-                        break;
+                // Prepare the pointers to the arrays in which the results will be accumulated.
+                // If the output iterators are raw pointers, we accumulate directly
+                // into the output range. Otherwise, or in the active subset and callback modes, we go through
+                // the temporary result vectors, whose content will be written out at the end.
+                std::array<F *, nvecs_res<Q>> res_ptrs;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    if constexpr (std::is_same_v<It, F *> && !with_cb) {
+                        if (!active) {
+                            res_ptrs[j] = out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin);
+                        }
                     }
-                    // Add the softening length.
-                    dist2 += eps2_vec;
-                    diff_x.store_aligned(tmp_x + i);
-                    diff_y.store_aligned(tmp_y + i);
-                    diff_z.store_aligned(tmp_z + i);
-                    if constexpr (use_fast_inv_sqrt<batch_type>) {
-                        const auto inv_dist = inv_sqrt(dist2);
-                        (inv_dist * inv_dist * inv_dist).store_aligned(tmp_dist3 + i);
-                        inv_dist.store_aligned(tmp_dist + i);
-                    } else {
-                        const auto dist = xsimd_sqrt(dist2);
-                        (dist2 * dist).store_aligned(tmp_dist3 + i);
-                        dist.store_aligned(tmp_dist + i);
+                    if (!std::is_same_v<It, F *> || with_cb || active) {
+                        tmp_res[j].resize(tgt_size);
+                        res_ptrs[j] = tmp_res[j].data();
                     }
+                    std::fill(res_ptrs[j], res_ptrs[j] + tgt_size, F(0));
                 }
-            }
-        } else {
-            // The scalar version.
-            for (size_type i = 0; i < tgt_size; ++i) {
-                F dist2(0);
-                for (std::size_t j = 0; j < NDim; ++j) {
-                    const auto diff = src_node.props[j] - p_ptrs[j][i];
-                    if constexpr (Q == 0u || Q == 2u) {
-                        // Store the differences for later use, if we are computing
-                        // accelerations.
-                        tmp_ptrs[j][i] = diff;
+                // In the mixed-precision mode, narrow the data of the target particles to single precision.
+                // The coordinates are taken relative to the first target particle.
+                [[maybe_unused]] mixed_tgt_data mx;
+                const mixed_tgt_data *mx_ptr = nullptr;
+                if constexpr (std::is_same_v<F, double>) {
+                    if (mixed && tgt_size) {
+                        auto &mixed_vecs = acc_pot_mixed_tgt_vecs();
+                        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                            mixed_vecs[j].resize(tgt_size);
+                            mx.p_ptrs[j] = mixed_vecs[j].data();
+                        }
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            mx.ref[j] = p_ptrs[j][0];
+                            std::transform(p_ptrs[j], p_ptrs[j] + tgt_size, mixed_vecs[j].data(),
+                                           [r = mx.ref[j]](F x) { return static_cast<float>(x - r); });
+                        }
+                        std::transform(p_ptrs[NDim], p_ptrs[NDim] + tgt_size, mixed_vecs[NDim].data(),
+                                       [](F m) { return static_cast<float>(m); });
+                        mx.eps2 = static_cast<float>(eps2);
+                        mx_ptr = &mx;
                     }
-                    dist2 = fma_wrap(diff, diff, dist2);
                 }
-                if (mac_lh >= dist2) {
-                    // At least one of the particles in the target
-                    // node is too close to the COM. Set the flag
-                    // to false and exit.
-                    mac_flag = false;
-                    break;
+                // Do the computation.
+                tree_acc_pot<Q, B>(crit_node_mac_value(cn_idx, mac_value, G), eps2, tgt_size, tgt_code, p_ptrs,
+                                   res_ptrs, nullptr, mx_ptr);
+                // Add the contribution of the inactive particles of the target node.
+                if (inact_size) {
+                    tree_acc_pot_src_parts<Q, B>(eps2, inact_ptrs, inact_size, tgt_size, p_ptrs, res_ptrs);
                 }
-                // Add the softening length and compute the distance.
-                dist2 += eps2;
-                const auto dist = std::sqrt(dist2);
-                if constexpr (Q == 0u || Q == 2u) {
-                    // Q == 0 or 2: accelerations are requested, store dist3.
-                    // NOTE: in the scalar part, we always store dist3.
-                    tmp_ptrs[NDim][i] = dist * dist2;
+                // Multiply by G, if needed.
+                if (G != F(1)) {
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        acc_pot_mul_G<B>(res_ptrs[j], tgt_size, G);
+                    }
                 }
-                if constexpr (Q == 1u || Q == 2u) {
-                    // Q == 1 or 2: potentials are requested.
-                    // Establish the index of the dist values in the temp data:
-                    // 0 if only the potentials are requested, NDim + 1 otherwise.
-                    constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
-                    // NOTE: in the scalar part, we always store dist.
-                    tmp_ptrs[dist_idx][i] = dist;
+                // Write out the result, if needed.
+                if constexpr (with_cb) {
+                    // Hand the results over to the callback while they are still hot in cache.
+                    std::array<const F *, nvecs_res<Q>> c_res_ptrs;
+                    std::copy(res_ptrs.begin(), res_ptrs.end(), c_res_ptrs.begin());
+                    cb(tgt_begin, tgt_size, c_res_ptrs);
+                } else if (active) {
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        for (size_type k = 0; k < tgt_size; ++k) {
+                            out[j][boost::numeric_cast<it_diff_type<It>>(a_idx[k])] = res_ptrs[j][k];
+                        }
+                    }
+                } else if constexpr (!std::is_same_v<It, F *>) {
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        std::copy(res_ptrs[j], res_ptrs[j] + tgt_size,
+                                  out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin));
+                    }
                 }
             }
+            // For the current thread, add the thread local simd counters
+            // to the global atomic ones, then reset them.
+            flush_simd_counters_tl();
+        });
+    }
+    // Computation of the accelerations/potentials on the cpu, with raw pointers as output. If mutual is true, the
+    // leaf-leaf interactions will be evaluated via acc_pot_mutual_impl(), and [c_begin, c_end) must then be the
+    // full range of critical nodes. mixed is the flag for the mixed-precision mode, active the optional subset of
+    // active particles (see acc_pot_cpu_run()). B is the batch type used in the traversal kernels.
+    template <unsigned Q, typename B>
+    void acc_pot_cpu_kernel(const std::array<F *, nvecs_res<Q>> &out, F mac_value, F G, F eps2, size_type c_begin,
+                            size_type c_end, bool mutual, bool mixed, const tree_active_t<F> *active) const
+    {
+        if (mutual) {
+            assert(c_begin == 0u && c_end == m_crit_nodes.size());
+            assert(!mixed && !active);
+            acc_pot_mutual_impl<Q, B>(out, mac_value, G, eps2);
+        } else {
+            acc_pot_cpu_run<Q, B>(out, mac_value, G, eps2, c_begin, c_end, mixed, active);
         }
-        if (mac_flag) {
-            // The source node satisfies the MAC for all the particles of the target node. Add the
-            // interaction due to the com of the source node.
-            tree_acc_pot_src_com<Q>(src_idx, tgt_size, p_ptrs, tmp_ptrs, res_ptrs);
-            // We can now skip all the children of the source node.
-            return static_cast<size_type>(src_idx + n_children_src + 1u);
-        }
-        // The source node does not satisfy the MAC. We check if it is a leaf
-        // node, in which case we need to compute all the pairwise interactions.
-        if (!n_children_src) {
-            // Leaf node.
-            tree_acc_pot_leaf<Q>(eps2, src_idx, tgt_size, p_ptrs, res_ptrs);
-        }
-        // In any case, we keep traversing the tree moving to the next node in depth-first order.
-        return static_cast<size_type>(src_idx + 1u);
     }
-    // Tree traversal for the computation of the accelerations/potentials. mac_value is the value of the MAC, or some
-    // function of it, eps2 the square of the softening length, tgt_size the number of particles in the target node,
-    // tgt_code its code, p_ptrs are pointers to the coordinates/masses of the particles in the target node, res_ptrs
-    // pointers to the output arrays. Q indicates which quantities will be computed (accs, potentials, or both).
+    // Same as above, but the batch type is chosen automatically. If rakau was configured with runtime ISA
+    // dispatch, the computation is forwarded to the precompiled kernels for the best instruction set
+    // available on the host cpu (see cpu_fwd.hpp).
     template <unsigned Q>
-    void tree_acc_pot(F mac_value, F eps2, size_type tgt_size, UInt tgt_code,
-                      const std::array<const F *, NDim + 1u> &p_ptrs,
-                      const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    void acc_pot_cpu(const std::array<F *, nvecs_res<Q>> &out, F mac_value, F G, F eps2, size_type c_begin,
+                     size_type c_end, bool mutual, bool mixed, const tree_active_t<F> *active) const
     {
-        assert(!m_tree.empty());
-        // Tree level of the target node.
-        // NOTE: the target level is available in the tree structure, so in principle we could get
-        // it from there. However, the target node is taken from the list of critical nodes, which
-        // currently does not store the target node index. Let's keep this in mind if we change
-        // the tree building routine.
-        const auto tgt_level = tree_level<NDim>(tgt_code);
-        // Total size of the tree.
-        const auto tree_size = static_cast<size_type>(m_tree.size());
-        // Start the iteration over the source nodes.
-        for (size_type src_idx = 0; src_idx < tree_size;) {
-            // Get a reference to the current source node.
-            const auto &src_node = m_tree[src_idx];
-            // Extract the code of the source node.
-            const auto src_code = src_node.code;
-            // Number of children of the source node.
-            const auto n_children_src = src_node.n_children;
-            // Extract the level of the source node.
-            const auto src_level = src_node.level;
-            // Compute the shifted target code. This is tgt_code
-            // shifted down by the difference between tgt_level
-            // and src_level. For instance, in an octree,
-            // if the target code is 1 000 000 001 000, then tgt_level
-            // is 4, and, if src_level is 2, then the shifted code
-            // will be 1 000 000.
-            const auto s_tgt_code = static_cast<UInt>(tgt_code >> ((tgt_level - src_level) * NDim));
-            if (s_tgt_code == src_code) {
-                // The shifted target code coincides with the source code. This means
-                // that either the source node is an ancestor of the target node, or it is
-                // the target node itself. In the former cases, we just have to continue
-                // the depth-first traversal by setting ++src_idx. In the latter case,
-                // we want to bump up src_idx by n_children_src + 1 in order to skip
-                // the target node and all its children. We will compute later the self
-                // interactions in the target node.
-                const auto tgt_eq_src_mask = static_cast<size_type>(-(src_code == tgt_code));
-                src_idx += 1u + (n_children_src & tgt_eq_src_mask);
-            } else {
-                // The source node is not an ancestor of the target. We need to run the MAC
-                // check. The tree_acc_pot_mac_check() function will return the index of the next node
-                // in the traversal.
-                src_idx = tree_acc_pot_mac_check<Q>(src_idx, mac_value, eps2, tgt_size, p_ptrs, res_ptrs);
+#if defined(RAKAU_WITH_ISA_DISPATCH)
+        if constexpr (cpu_dispatch_supported) {
+            switch (cpu_dispatch_isa()) {
+                case cpu_isa::avx512:
+                    cpu_acc_pot_impl<cpu_isa::avx512, Q>(*this, out, mac_value, G, eps2, c_begin, c_end, mutual,
+                                                         mixed, active);
+                    break;
+                case cpu_isa::avx2:
+                    cpu_acc_pot_impl<cpu_isa::avx2, Q>(*this, out, mac_value, G, eps2, c_begin, c_end, mutual,
+                                                       mixed, active);
+                    break;
+                default:
+                    assert(cpu_dispatch_isa() == cpu_isa::sse2);
+                    cpu_acc_pot_impl<cpu_isa::sse2, Q>(*this, out, mac_value, G, eps2, c_begin, c_end, mutual,
+                                                       mixed, active);
             }
+        } else {
+            acc_pot_cpu_kernel<Q, simd_batch_t<F>>(out, mac_value, G, eps2, c_begin, c_end, mutual, mixed, active);
         }
-
-        // Compute the self interactions within the target node.
-        tree_self_interactions<Q>(eps2, tgt_size, p_ptrs, res_ptrs);
+#else
+        acc_pot_cpu_kernel<Q, simd_batch_t<F>>(out, mac_value, G, eps2, c_begin, c_end, mutual, mixed, active);
+#endif
+    }
+    // Same as above, but with generic output iterators. The computation is run into
+    // temporary buffers, whose content is then copied into out.
+    template <unsigned Q, typename It>
+    void acc_pot_cpu_tmp_out(const std::array<It, nvecs_res<Q>> &out, F mac_value, F G, F eps2, size_type c_begin,
+                             size_type c_end, bool mutual, bool mixed, const tree_active_t<F> *active) const
+    {
+        assert(c_begin <= c_end);
+        assert(c_end <= (active ? active->cnodes.size() : m_crit_nodes.size()));
+        // NOTE: the buffers span all the particles (the kernels index into the output
+        // arrays via the particle indices), but, as they are default-initialised, only
+        // the portion we write into will actually be touched.
+        std::array<f_vector<F>, nvecs_res<Q>> tmp_out;
+        std::array<F *, nvecs_res<Q>> tmp_ptrs;
+        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+            tmp_out[j].resize(m_parts[0].size());
+            tmp_ptrs[j] = tmp_out[j].data();
+        }
+        acc_pot_cpu<Q>(tmp_ptrs, mac_value, G, eps2, c_begin, c_end, mutual, mixed, active);
+        if (active) {
+            // Copy out only the values of the active particles.
+            const auto a_begin = c_begin == c_end ? size_type(0) : active->cnodes[c_begin][1];
+            const auto a_end = c_begin == c_end ? size_type(0) : active->cnodes[c_end - 1u][2];
+            tbb::parallel_for(tbb::blocked_range<size_type>(a_begin, a_end),
+                              [&out, &tmp_out, active](const auto &range) {
+                                  for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                                      for (auto k = range.begin(); k != range.end(); ++k) {
+                                          const auto idx = active->idx[k];
+                                          out[j][boost::numeric_cast<it_diff_type<It>>(idx)] = tmp_out[j][idx];
+                                      }
+                                  }
+                              });
+            return;
+        }
+        // The range of particles covered by the critical nodes.
+        const auto p_begin = c_begin == c_end ? size_type(0) : m_crit_nodes[c_begin].begin;
+        const auto p_end = c_begin == c_end ? size_type(0) : m_crit_nodes[c_end - 1u].end;
+        tbb::parallel_for(tbb::blocked_range<size_type>(p_begin, p_end), [&out, &tmp_out](const auto &range) {
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                std::copy(tmp_out[j].data() + range.begin(), tmp_out[j].data() + range.end(),
+                          out[j] + boost::numeric_cast<it_diff_type<It>>(range.begin()));
+            }
+        });
     }
     // Top level function for the computation of the accelerations/potentials. out is the array of output iterators,
     // mac_value is the value of the MAC, or some function of it, G the grav constant, eps2 the square of the softening
-    // length. Q indicates which quantities will be computed (accs, potentials, or both).
+    // length, mutual a flag to enable the mutual evaluation of the leaf-leaf interactions (see acc_pot_mutual_impl()),
+    // mixed a flag to enable the mixed-precision mode (see tree_acc_pot_leaf_mixed()), active the optional subset of
+    // active particles (see acc_pot_cpu_run()). Q indicates which quantities will be computed (accs, potentials,
+    // or both).
     template <unsigned Q, typename It>
     void acc_pot_impl(const std::array<It, nvecs_res<Q>> &out, F mac_value, F G, F eps2,
-                      const std::vector<double> &split) const
+                      const std::vector<double> &split, bool mutual, bool mixed,
+                      const tree_active_t<F> *active) const
     {
         // Validation of split, common to all codepaths.
         if (rakau_unlikely(
@@ -2841,159 +4738,81 @@ private:
             throw std::invalid_argument("The values in the 'split' parameter cannot all be zero");
         }
 
-        using c_size_type = decltype(m_crit_nodes.size());
-        auto cpu_run = [this, &out, mac_value, G, eps2](c_size_type c_begin, c_size_type c_end) {
-            assert(c_begin <= c_end);
-            assert(c_end <= m_crit_nodes.size());
-
-            // NOTE: we will be adding padding to the target node data when SIMD is active,
-            // in order to be able to use SIMD instructions on all the particles of the node.
-            // The padding data must be crafted so that it does not interfere with the useful
-            // calculations. This means that:
-            // - we will set the masses to zero so that, when computing the self interactions
-            //   in a target node, the extra accelerations/potentials due to the padding data will be zero,
-            // - for the positions, we must ensure 2 things:
-            //   - they must not overlap with any other real particle, in order to avoid singularities
-            //     when computing self-interactions in the target node, hence they must be outside the box,
-            //   - the distance of the padding particles from any point of the box must be large enough so
-            //     that they never fail the MAC check. The bh check fails when node_dim >= theta * dist,
-            //     the geometric bh check fails when node_dim >= theta * (dist - delta).
-            //     The maximum node_dim is the box size b_size, the maximum possible delta is
-            //     b_size / 2 * sqrt(NDim). For the bh check we then must ensure that dist > b_size / theta
-            //     for the padding particles, for the geometric check we must ensure that
-            //     dist > b_size / theta + b_size / 2 * sqrt(NDim) for the padding particles.
-            //
-            // The strategy is that we put the padding particles at coordinates (M, M, ...), with M to
-            // be determined. The upper right corner of the box, with coordinates (b_size/2, b_size/2, ...)
-            // will be the closest point of the box to the padding particles, and the corner-particles distance
-            // will be sqrt(NDim * (M - b_size/2)**2), which simplifies to sqrt(NDim) / 2 * (2*M - b_size).
-            // Now we require this distance to be large enough to always satisfy the MAC criteria,
-            // that is, sqrt(NDim) / 2 * (2*M - b_size) > b_size / theta for the bh check, which yields the requirement
-            // M > b_size / (theta * sqrt(NDim)) + b_size / 2, and
-            // sqrt(NDim) / 2 * (2*M - b_size) > b_size / theta + sqrt(NDim) * b_size / 2 for the geometric bh
-            // check, which yields the requirement M > b_size / (theta * sqrt(NDim)) + b_size.
-            const auto pad_coord = [this, mac_value]() {
-                if constexpr (MAC == mac::bh) {
-                    // NOTE: for the bh mac, mac_value is theta**-2.
-                    const auto M
-                        = m_box_size / (std::sqrt(F(1) / mac_value) * std::sqrt(F(NDim))) + m_box_size * (F(1) / F(2));
-                    // NOTE: M is mathematically always >= m_box_size / F(2), which puts it on the top right
-                    // corner of the box for theta2 == inf. To make it completely safe with respect to the requirement
-                    // of avoiding singularities in the self interaction routine, we double it.
-                    return M * F(2);
-                } else {
-                    static_assert(MAC == mac::bh_geom);
-                    // NOTE: for the geometric bh mac, mac_value is theta**-1.
-                    const auto M = m_box_size / (F(1) / mac_value * std::sqrt(F(NDim))) + m_box_size;
-                    return M * F(2);
-                }
-            }();
-            // Double check the padding coordinate.
-            if (rakau_unlikely(!std::isfinite(pad_coord))) {
-                throw std::invalid_argument(
-                    "The calculation of the SIMD padding coordinate produced the non-finite value "
-                    + std::to_string(pad_coord));
-            }
-            tbb::parallel_for(tbb::blocked_range(c_begin, c_end), [this, mac_value, G, eps2, pad_coord,
-                                                                   &out](const auto &range) {
-                // Get references to the local temporary data.
-                auto &tmp_res = acc_pot_tmp_res<Q>();
-                auto &tmp_tgt = tgt_tmp_data();
-                for (auto i = range.begin(); i != range.end(); ++i) {
-                    const auto tgt_code = m_crit_nodes[i].code;
-                    const auto tgt_begin = m_crit_nodes[i].begin,
-                               tgt_size = static_cast<size_type>(m_crit_nodes[i].end - tgt_begin);
-                    // Size of the temporary vectors that will be used to store the target node
-                    // data and the total accelerations/potentials on its particles. If simd is not enabled, this
-                    // value will be tgt_size. Otherwise, we add extra padding at the end based on the
-                    // simd vector size.
-                    const auto pdata_size = [tgt_size]() {
-                        if constexpr (simd_enabled) {
-                            using batch_type = xsimd::simd_type<F>;
-                            constexpr auto batch_size = batch_type::size;
-                            static_assert(batch_size);
-                            // NOTE: we will need batch_size - 1 extra elements at the end of the
-                            // temp vectors, to ensure we can load/store a simd vector starting from
-                            // the last element.
-                            if ((batch_size - 1u) > (std::numeric_limits<size_type>::max() - tgt_size)) {
-                                throw std::overflow_error("The number of particles in a critical node ("
-                                                          + std::to_string(tgt_size)
-                                                          + ") is too large, and it results in an overflow condition");
-                            }
-                            return static_cast<size_type>(tgt_size + (batch_size - 1u));
-                        } else {
-                            return tgt_size;
-                        }
-                    }();
-                    // Prepare the temporary vectors containing the result.
-                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                        // Resize and fill with zeroes (everything, including the padding data).
-                        tmp_res[j].resize(pdata_size);
-                        std::fill(tmp_res[j].data(), tmp_res[j].data() + pdata_size, F(0));
-                    }
-                    // Prepare the temporary vectors containing the target node's data.
-                    for (std::size_t j = 0; j < NDim; ++j) {
-                        tmp_tgt[j].resize(pdata_size);
-                        // From 0 to tgt_size we copy the actual node coordinates.
-                        std::copy(m_parts[j].data() + tgt_begin, m_parts[j].data() + tgt_begin + tgt_size,
-                                  tmp_tgt[j].data());
-                        // From tgt_size to pdata_size (the padding values) we insert the padding coordinate.
-                        std::fill(tmp_tgt[j].data() + tgt_size, tmp_tgt[j].data() + pdata_size, pad_coord);
-                    }
-                    // Copy the particle masses and set the padding masses to zero.
-                    tmp_tgt[NDim].resize(pdata_size);
-                    std::copy(m_parts[NDim].data() + tgt_begin, m_parts[NDim].data() + tgt_begin + tgt_size,
-                              tmp_tgt[NDim].data());
-                    std::fill(tmp_tgt[NDim].data() + tgt_size, tmp_tgt[NDim].data() + pdata_size, F(0));
-                    // Prepare arrays of pointers to the temporary data.
-                    std::array<F *, nvecs_res<Q>> res_ptrs;
-                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                        res_ptrs[j] = tmp_res[j].data();
-                    }
-                    std::array<const F *, NDim + 1u> p_ptrs;
-                    for (std::size_t j = 0; j < NDim + 1u; ++j) {
-                        p_ptrs[j] = tmp_tgt[j].data();
-                    }
-                    // Do the computation.
-                    tree_acc_pot<Q>(mac_value, eps2, tgt_size, tgt_code, p_ptrs, res_ptrs);
-                    // Multiply by G, if needed.
-                    if (G != F(1)) {
-                        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                            auto r_ptr = res_ptrs[j];
-                            if constexpr (simd_enabled) {
-                                using batch_type = xsimd::simd_type<F>;
-                                constexpr auto batch_size = batch_type::size;
-                                const batch_type Gvec(G);
-                                for (size_type k = 0; k < tgt_size; k += batch_size) {
-                                    (batch_type(r_ptr + k, xsimd::aligned_mode{}) * Gvec).store_aligned(r_ptr + k);
-                                }
-                            } else {
-                                for (size_type k = 0; k < tgt_size; ++k) {
-                                    *(r_ptr + k) *= G;
-                                }
-                            }
-                        }
-                    }
-                    // Write out the result.
-                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                        std::copy(res_ptrs[j], res_ptrs[j] + tgt_size,
-                                  out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin));
-                    }
-                }
-#if defined(RAKAU_WITH_SIMD_COUNTERS)
-                // For the current thread, add the thread local counters
-                // to the global atomic ones, then reset them.
-                simd_fma_counter += simd_fma_counter_tl;
-                simd_fma_counter_tl = 0;
+        if (mixed) {
+            if constexpr (!std::is_same_v<F, double>) {
+                throw std::invalid_argument("The mixed-precision mode is available only for double-precision trees");
+            }
+            if (rakau_unlikely(mutual)) {
+                throw std::invalid_argument("The mixed-precision mode cannot be combined with the mutual evaluation of "
+                                            "the leaf-leaf interactions");
+            }
+            // NOTE: the accelerator kernels do not implement the mixed-precision mode.
+            if (rakau_unlikely(split.size() > 1u)) {
+                throw std::invalid_argument("The mixed-precision mode cannot be used when splitting the computation "
+                                            "between multiple devices");
+            }
+        }
+
+        if constexpr (MAC == mac::relative) {
+            // NOTE: the accelerator kernels implement only the geometric MACs.
+            if (rakau_unlikely(split.size() > 1u)) {
+                throw std::invalid_argument("The relative MAC cannot be used when splitting the computation between "
+                                            "multiple devices");
+            }
+        }
+
+        if (active) {
+            if (rakau_unlikely(mutual)) {
+                throw std::invalid_argument("The computation restricted to a subset of active particles cannot be "
+                                            "combined with the mutual evaluation of the leaf-leaf interactions");
+            }
+            // NOTE: the accelerator kernels do not implement the active subset mode.
+            if (rakau_unlikely(split.size() > 1u)) {
+                throw std::invalid_argument("The computation restricted to a subset of active particles cannot be "
+                                            "split between multiple devices");
+            }
+        }
 
-                simd_sqrt_counter += simd_sqrt_counter_tl;
-                simd_sqrt_counter_tl = 0;
+        if (mutual) {
+            // NOTE: the mutual mode needs to see all the critical nodes at once, so it cannot
+            // be combined with the offloading of part of the computation to an accelerator.
+            if (rakau_unlikely(split.size() > 1u)) {
+                throw std::invalid_argument("The mutual evaluation of the leaf-leaf interactions cannot be used when "
+                                            "splitting the computation between multiple devices");
+            }
+            // NOTE: the mutual kernels read the particle coordinates in place.
+            if (rakau_unlikely(m_ccoords.bits)) {
+                throw std::invalid_argument("The mutual evaluation of the leaf-leaf interactions cannot be used with "
+                                            "the compressed storage of the coordinates");
+            }
+            if constexpr (std::is_same_v<It, F *>) {
+                acc_pot_cpu<Q>(out, mac_value, G, eps2, 0, m_crit_nodes.size(), true, false, nullptr);
+            } else {
+                // The output iterators are not raw pointers: go through temporary buffers.
+                acc_pot_cpu_tmp_out<Q>(out, mac_value, G, eps2, 0, m_crit_nodes.size(), true, false, nullptr);
+            }
+            return;
+        }
 
-                simd_rsqrt_counter += simd_rsqrt_counter_tl;
-                simd_rsqrt_counter_tl = 0;
+        using c_size_type = decltype(m_crit_nodes.size());
+        auto cpu_run = [this, &out, mac_value, G, eps2, mixed, active](c_size_type c_begin, c_size_type c_end) {
+            if constexpr (std::is_same_v<It, F *>) {
+                acc_pot_cpu<Q>(out, mac_value, G, eps2, c_begin, c_end, false, mixed, active);
+            } else {
+#if defined(RAKAU_WITH_ISA_DISPATCH)
+                // NOTE: the precompiled kernels can write only into raw pointers.
+                acc_pot_cpu_tmp_out<Q>(out, mac_value, G, eps2, c_begin, c_end, false, mixed, active);
+#else
+                acc_pot_cpu_run<Q, simd_batch_t<F>>(out, mac_value, G, eps2, c_begin, c_end, mixed, active);
 #endif
-            });
+            }
         };
+        if (active) {
+            // NOTE: in the active subset mode, the ranges passed to cpu_run()
+            // refer to the critical nodes containing active particles.
+            cpu_run(0, active->cnodes.size());
+            return;
+        }
 #if defined(RAKAU_WITH_ROCM)
         // Validation of split specific to ROCm.
         //
@@ -3008,7 +4827,7 @@ private:
                 "Cannot split the computation of accelerations/potentials: no accelerator has been detected");
         }
 
-        if constexpr ((NDim == 3u || NDim == 2u)
+        if constexpr ((NDim == 3u || NDim == 2u) && MAC != mac::relative
                       && std::conjunction_v<
                           std::disjunction<std::is_same<UInt, std::uint64_t>, std::is_same<UInt, std::uint32_t>>,
                           std::disjunction<std::is_same<F, float>, std::is_same<F, double>>>) {
@@ -3114,7 +4933,7 @@ private:
                 + " were detected");
         }
 
-        if constexpr ((NDim == 3u || NDim == 2u)
+        if constexpr ((NDim == 3u || NDim == 2u) && MAC != mac::relative
                       && std::conjunction_v<
                           std::disjunction<std::is_same<UInt, std::uint64_t>, std::is_same<UInt, std::uint32_t>>,
                           std::disjunction<std::is_same<F, float>, std::is_same<F, double>>>) {
@@ -3237,6 +5056,203 @@ private:
         cpu_run(0, m_crit_nodes.size());
 #endif
     }
+    // Maximum level of the opening angle in the error-controlled mode (see acc_pot_err_impl()).
+    static constexpr unsigned err_max_level = 8;
+    // Error-controlled computation of the accelerations. err_tol is the target relative error of the accelerations,
+    // orig_mac_value the largest opening angle, the other arguments are as in acc_pot_impl().
+    //
+    // The accelerations are first computed for all the particles with the opening angle orig_mac_value. Then, for
+    // each critical node, the error of the monopole approximation is estimated via crit_node_err_estimate(),
+    // and the opening angle of the node is decreased by factors of sqrt(2) until the estimated error falls within
+    // err_tol times the smallest magnitude of the accelerations in the node, up to a total factor of
+    // 2**(err_max_level/2). Finally, the critical nodes are grouped by opening angle, and the computation is re-run
+    // for each group in the active subset mode.
+    template <unsigned Q, typename It>
+    void acc_pot_err_impl(const std::array<It, nvecs_res<Q>> &out, F orig_mac_value, F err_tol, F G, F eps2,
+                          const std::vector<double> &split, bool mutual, bool mixed, const tree_active_t<F> *active,
+                          bool sr) const
+    {
+        if (rakau_unlikely(!std::isfinite(err_tol) || err_tol <= F(0))) {
+            throw std::domain_error("The target relative error of the accelerations must be finite and "
+                                    "positive, but it is "
+                                    + std::to_string(err_tol) + " instead");
+        }
+        if constexpr (Q == 1u || MAC == mac::relative) {
+            // NOTE: the error budget is defined in terms of the accelerations, and the
+            // relative MAC is an error-controlled criterion on its own.
+            ignore(out, orig_mac_value, G, eps2, split, mutual, mixed, active, sr);
+            throw std::invalid_argument("The error-controlled mode requires the computation of the accelerations and "
+                                        "a geometric MAC");
+        } else {
+            if (rakau_unlikely(split.size() > 1u || mutual || active || sr || m_periodic)) {
+                throw std::invalid_argument("The error-controlled mode cannot be split between multiple devices, and "
+                                            "it does not support the mutual, active subset, short-range and periodic "
+                                            "modes");
+            }
+            // The transformed MAC values at each level.
+            std::array<F, err_max_level + 1u> level_mac_values;
+            for (unsigned lvl = 0; lvl <= err_max_level; ++lvl) {
+                level_mac_values[lvl]
+                    = transform_mac_value(orig_mac_value * std::pow(F(2), -static_cast<F>(lvl) / F(2)));
+            }
+            // First pass with the largest opening angle.
+            acc_pot_impl<Q>(out, level_mac_values[0], G, eps2, split, false, mixed, nullptr);
+            // Determine the level of each critical node.
+            const auto n_cn = m_crit_nodes.size();
+            std::vector<unsigned> cn_levels(n_cn);
+            tbb::parallel_for(tbb::blocked_range(decltype(m_crit_nodes.size())(0), n_cn), [&](const auto &range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    // The bounding box of the particles of the node.
+                    const auto tgt_size = static_cast<size_type>(m_crit_nodes[i].end - m_crit_nodes[i].begin);
+                    const auto p_ptrs = crit_node_tgt_ptrs(static_cast<size_type>(i));
+                    std::array<F, NDim> lo, hi;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        const auto mm = std::minmax_element(p_ptrs[j], p_ptrs[j] + tgt_size);
+                        lo[j] = *mm.first;
+                        hi[j] = *mm.second;
+                    }
+                    // The smallest magnitude of the accelerations in the node.
+                    auto a2_min = std::numeric_limits<F>::infinity();
+                    for (auto k = m_crit_nodes[i].begin; k != m_crit_nodes[i].end; ++k) {
+                        F a2(0);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            const auto a = *(out[j] + boost::numeric_cast<it_diff_type<It>>(k));
+                            a2 = fma_wrap(a, a, a2);
+                        }
+                        a2_min = std::min(a2, a2_min);
+                    }
+                    const auto budget = err_tol * std::sqrt(a2_min);
+                    unsigned lvl = 0;
+                    for (; lvl < err_max_level; ++lvl) {
+                        const auto err = crit_node_err_estimate(static_cast<size_type>(i), p_ptrs, lo, hi,
+                                                                level_mac_values[lvl]);
+                        if (err * std::abs(G) <= budget) {
+                            break;
+                        }
+                    }
+                    cn_levels[i] = lvl;
+                }
+            });
+            // Group the critical nodes by level, with all their particles active.
+            std::array<tree_active_t<F>, err_max_level + 1u> level_act;
+            for (decltype(m_crit_nodes.size()) i = 0; i < n_cn; ++i) {
+                auto &act = level_act[cn_levels[i]];
+                const auto a_begin = static_cast<size_type>(act.idx.size());
+                for (auto k = m_crit_nodes[i].begin; k != m_crit_nodes[i].end; ++k) {
+                    act.idx.push_back(k);
+                }
+                act.cnodes.push_back({static_cast<size_type>(i), a_begin, static_cast<size_type>(act.idx.size())});
+            }
+            // Re-run the computation for the critical nodes above level 0.
+            for (unsigned lvl = 1; lvl <= err_max_level; ++lvl) {
+                if (!level_act[lvl].cnodes.empty()) {
+                    acc_pot_impl<Q>(out, level_mac_values[lvl], G, eps2, split, false, mixed, &level_act[lvl]);
+                }
+            }
+        }
+    }
+    // Computation of the accelerations/potentials in the short-range mode of the TreePM method and/or in a periodic
+    // domain (see tree_acc_pot_walk()). sr contains the optional split scale and cutoff radius of the short-range
+    // mode, the other arguments are as in acc_pot_impl(). In a periodic domain without the short-range mode, the
+    // periodic interaction is computed via the Ewald corrections.
+    template <unsigned Q, typename It>
+    void acc_pot_walk_impl(const std::array<It, nvecs_res<Q>> &out, F mac_value, F G, F eps2,
+                           const std::vector<double> &split, bool mutual, bool mixed, const tree_active_t<F> *active,
+                           const std::optional<std::array<F, 2>> &sr) const
+    {
+        assert(sr || m_periodic);
+        walk_params wp{eps2, F(0), F(0), m_box_size, F(1) / m_box_size, nullptr};
+        if (sr) {
+            const auto [r_split, r_cut] = *sr;
+            if (rakau_unlikely(!std::isfinite(r_split) || r_split <= F(0))) {
+                throw std::domain_error("The split scale of the short-range mode must be finite and positive, but it "
+                                        "is "
+                                        + std::to_string(r_split) + " instead");
+            }
+            if (rakau_unlikely(!std::isfinite(r_cut) || r_cut <= F(0))) {
+                throw std::domain_error("The cutoff radius of the short-range mode must be finite and positive, but "
+                                        "it is "
+                                        + std::to_string(r_cut) + " instead");
+            }
+            if (rakau_unlikely(m_periodic && r_cut >= m_box_size / F(2))) {
+                throw std::domain_error("In a periodic domain, the cutoff radius of the short-range mode must be less "
+                                        "than half the box size, but it is "
+                                        + std::to_string(r_cut) + " and the box size is "
+                                        + std::to_string(m_box_size));
+            }
+            wp.inv_2rs = F(1) / (F(2) * r_split);
+            if (rakau_unlikely(!std::isfinite(wp.inv_2rs))) {
+                throw std::domain_error("The inverse of twice the split scale of the short-range mode must be finite, "
+                                        "but it is "
+                                        + std::to_string(wp.inv_2rs) + " instead");
+            }
+            wp.r_cut = r_cut;
+        }
+        // NOTE: the accelerator kernels do not implement the short-range and periodic modes.
+        if (rakau_unlikely(split.size() > 1u)) {
+            throw std::invalid_argument("The short-range and periodic modes cannot be used when splitting the "
+                                        "computation between multiple devices");
+        }
+        if (rakau_unlikely(mutual || mixed || active)) {
+            throw std::invalid_argument("The short-range and periodic modes cannot be combined with the mutual, "
+                                        "mixed-precision and active subset modes");
+        }
+        const bool ewald = m_periodic && !sr;
+        if constexpr (NDim == 3u) {
+            if (ewald) {
+                wp.ewald = &get_ewald_table<F>();
+            }
+        }
+
+        // NOTE: as in the callback mode, the traversal is run with the batch type selected by the current
+        // compiler flags, also when rakau is configured with runtime ISA dispatch.
+        using B = simd_batch_t<F>;
+        const auto n_cnodes = static_cast<size_type>(m_crit_nodes.size());
+        tbb::parallel_for(tbb::blocked_range(size_type(0), n_cnodes), [&](const auto &range) {
+            auto &tmp_res = acc_pot_tmp_res<Q>();
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto tgt_code = m_crit_nodes[i].code;
+                const auto tgt_begin = m_crit_nodes[i].begin,
+                           tgt_size = static_cast<size_type>(m_crit_nodes[i].end - tgt_begin);
+                const auto p_ptrs = crit_node_tgt_ptrs(i);
+                std::array<F *, nvecs_res<Q>> res_ptrs;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    tmp_res[j].resize(tgt_size);
+                    res_ptrs[j] = tmp_res[j].data();
+                    std::fill(res_ptrs[j], res_ptrs[j] + tgt_size, F(0));
+                }
+                if (!m_periodic) {
+                    tree_acc_pot_walk<Q, B, false, false>(mac_value, wp, tgt_size, tgt_code, p_ptrs, res_ptrs);
+                } else if (!ewald) {
+                    tree_acc_pot_walk<Q, B, true, false>(mac_value, wp, tgt_size, tgt_code, p_ptrs, res_ptrs);
+                } else {
+                    if constexpr (NDim == 3u) {
+                        tree_acc_pot_walk<Q, B, true, true>(mac_value, wp, tgt_size, tgt_code, p_ptrs, res_ptrs);
+                        if constexpr (Q == 1u || Q == 2u) {
+                            // Add the interaction of each particle with its own periodic images.
+                            constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                            const auto self_pot = wp.ewald->pot0 * wp.inv_box_size;
+                            for (size_type k = 0; k < tgt_size; ++k) {
+                                const auto m = p_ptrs[NDim][k];
+                                res_ptrs[pot_idx][k] = fma_wrap(m * m, self_pot, res_ptrs[pot_idx][k]);
+                            }
+                        }
+                    }
+                }
+                // Multiply by G, if needed.
+                if (G != F(1)) {
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        acc_pot_mul_G<B>(res_ptrs[j], tgt_size, G);
+                    }
+                }
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    std::copy(res_ptrs[j], res_ptrs[j] + tgt_size,
+                              out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin));
+                }
+            }
+            flush_simd_counters_tl();
+        });
+    }
     // Small helper to check the value of the softening length, and compute its square.
     // Re-used in a few places, hence factored out.
     static F compute_eps2(const F &eps)
@@ -3261,23 +5277,65 @@ private:
                                     + std::to_string(G) + " instead");
         }
     }
-    // Top level dispatcher for the accs/pots functions. It will run a few checks and then invoke acc_pot_impl().
-    // out is the array of output iterators, orig_mac_value the MAC value, G the grav const, eps the softening length.
-    // Q indicates which quantities will be computed (accs, potentials, or both).
-    template <bool Ordered, unsigned Q, typename It>
-    void acc_pot_dispatch(const std::array<It, nvecs_res<Q>> &out, F orig_mac_value, F G, F eps,
-                          const std::vector<double> &split) const
+    // Small helper to check that the previous accelerations needed by the relative MAC are available.
+    void check_acc_old() const
+    {
+        if (rakau_unlikely(m_acc_old.size() != m_parts[0].size())) {
+            throw std::invalid_argument("The relative MAC requires the accelerations of the particles in the previous "
+                                        "step, which must be set via set_acc_old_u() or set_acc_old_o()");
+        }
+    }
+    // Build the description of the subset of active particles from the list of particle indices idx. If Ordered
+    // is true, the indices refer to the original order of the particles, otherwise to the internal order.
+    template <bool Ordered>
+    tree_active_t<F> make_active(const std::vector<size_type> &idx) const
+    {
+        const auto np = static_cast<size_type>(m_parts[0].size());
+        tree_active_t<F> retval;
+        retval.idx.reserve(idx.size());
+        for (const auto &n : idx) {
+            if (rakau_unlikely(n >= np)) {
+                throw std::invalid_argument("The index of an active particle (" + std::to_string(n)
+                                            + ") must be less than the number of particles in the tree ("
+                                            + std::to_string(np) + ")");
+            }
+            if constexpr (Ordered) {
+                retval.idx.push_back(m_inv_perm[n]);
+            } else {
+                retval.idx.push_back(n);
+            }
+        }
+        std::sort(retval.idx.begin(), retval.idx.end());
+        retval.idx.erase(std::unique(retval.idx.begin(), retval.idx.end()), retval.idx.end());
+        // Group the active particles by critical node.
+        // NOTE: the critical nodes cover contiguously the whole particle range.
+        for (auto it = retval.idx.begin(); it != retval.idx.end();) {
+            const auto cn_it = std::upper_bound(m_crit_nodes.begin(), m_crit_nodes.end(), *it,
+                                                [](size_type n, const auto &cn) { return n < cn.end; });
+            assert(cn_it != m_crit_nodes.end());
+            const auto it_end = std::lower_bound(it, retval.idx.end(), cn_it->end);
+            retval.cnodes.push_back({static_cast<size_type>(cn_it - m_crit_nodes.begin()),
+                                     static_cast<size_type>(it - retval.idx.begin()),
+                                     static_cast<size_type>(it_end - retval.idx.begin())});
+            it = it_end;
+        }
+        return retval;
+    }
+    // Check the MAC value orig_mac_value and transform it into the value used in the traversal kernels.
+    static F transform_mac_value(F orig_mac_value)
     {
-        simple_timer st("vector accs/pots computation");
-        // Input param check.
         if (rakau_unlikely(!std::isfinite(orig_mac_value) || orig_mac_value <= F(0))) {
             throw std::domain_error("The MAC value must be finite and positive, but it is "
                                     + std::to_string(orig_mac_value) + " instead");
         }
         const auto mac_value = [orig_mac_value]() {
-            if constexpr (MAC == mac::bh) {
+            if constexpr (MAC == mac::bh || MAC == mac::bh_box) {
                 // Transform the original value, theta, into theta**-2.
                 return F(1) / (orig_mac_value * orig_mac_value);
+            } else if constexpr (MAC == mac::relative) {
+                // The original value, alpha, is used as it is. It will be multiplied
+                // by the previous accelerations in crit_node_mac_value().
+                return orig_mac_value;
             } else {
                 static_assert(MAC == mac::bh_geom);
                 // Transform the original value, theta, into theta**-1.
@@ -3289,8 +5347,37 @@ private:
             throw std::domain_error("The transformed MAC value must be finite and positive, but it is "
                                     + std::to_string(mac_value) + " instead");
         }
+        return mac_value;
+    }
+    // Top level dispatcher for the accs/pots functions. It will run a few checks and then invoke acc_pot_impl().
+    // out is the array of output iterators, orig_mac_value the MAC value, G the grav const, eps the softening length,
+    // mutual the flag for the mutual evaluation of the leaf-leaf interactions, mixed the flag for the mixed-precision
+    // mode, active the optional list of indices of the active particles, sr the optional split scale and cutoff
+    // radius of the short-range mode (see acc_pot_walk_impl()), err_tol the optional target relative error of the
+    // error-controlled mode (see acc_pot_err_impl()). Q indicates which quantities will be computed (accs,
+    // potentials, or both).
+    template <bool Ordered, unsigned Q, typename It>
+    void acc_pot_dispatch(const std::array<It, nvecs_res<Q>> &out, F orig_mac_value, F G, F eps,
+                          const std::vector<double> &split, bool mutual, bool mixed,
+                          const std::optional<std::vector<size_type>> &active,
+                          const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
+    {
+        simple_timer st("vector accs/pots computation");
+        const auto mac_value = transform_mac_value(orig_mac_value);
         const auto eps2 = compute_eps2(eps);
         check_G_const(G);
+        if constexpr (MAC == mac::relative) {
+            check_acc_old();
+            // NOTE: the traversals of the short-range and periodic modes implement only the geometric MACs.
+            if (rakau_unlikely(sr || m_periodic)) {
+                throw std::invalid_argument("The relative MAC cannot be used in the short-range and periodic modes");
+            }
+        }
+        std::optional<tree_active_t<F>> act;
+        if (active) {
+            act = make_active<Ordered>(*active);
+        }
+        const auto act_ptr = act ? &*act : nullptr;
         if constexpr (Ordered) {
             // Make sure we don't run into overflows when doing a permutated iteration
             // over the iterators in out.
@@ -3301,33 +5388,51 @@ private:
             });
             // NOTE: we are checking in the acc_pot_impl() function that we can index into
             // the permuted iterators without overflows (see the use of boost::numeric_cast()).
-            acc_pot_impl<Q>(out_pits, mac_value, G, eps2, split);
+            if (err_tol) {
+                acc_pot_err_impl<Q>(out_pits, orig_mac_value, *err_tol, G, eps2, split, mutual, mixed, act_ptr,
+                                    sr.has_value());
+            } else if (sr || m_periodic) {
+                acc_pot_walk_impl<Q>(out_pits, mac_value, G, eps2, split, mutual, mixed, act_ptr, sr);
+            } else {
+                acc_pot_impl<Q>(out_pits, mac_value, G, eps2, split, mutual, mixed, act_ptr);
+            }
         } else {
-            acc_pot_impl<Q>(out, mac_value, G, eps2, split);
+            if (err_tol) {
+                acc_pot_err_impl<Q>(out, orig_mac_value, *err_tol, G, eps2, split, mutual, mixed, act_ptr,
+                                    sr.has_value());
+            } else if (sr || m_periodic) {
+                acc_pot_walk_impl<Q>(out, mac_value, G, eps2, split, mutual, mixed, act_ptr, sr);
+            } else {
+                acc_pot_impl<Q>(out, mac_value, G, eps2, split, mutual, mixed, act_ptr);
+            }
         }
     }
     // Helper overload for an array of vectors. It will prepare the vectors and then
     // call the other overload.
     template <bool Ordered, unsigned Q, typename Allocator>
     void acc_pot_dispatch(std::array<std::vector<F, Allocator>, nvecs_res<Q>> &out, F mac_value, F G, F eps,
-                          const std::vector<double> &split) const
+                          const std::vector<double> &split, bool mutual, bool mixed,
+                          const std::optional<std::vector<size_type>> &active,
+                          const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
     {
         std::array<F *, nvecs_res<Q>> out_ptrs;
         for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
             out[j].resize(boost::numeric_cast<decltype(out[j].size())>(m_parts[0].size()));
             out_ptrs[j] = out[j].data();
         }
-        acc_pot_dispatch<Ordered, Q>(out_ptrs, mac_value, G, eps, split);
+        acc_pot_dispatch<Ordered, Q>(out_ptrs, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     // Helper overload for a single vector. It will prepare the vector and then
     // call the other overload. This is used for the potential-only computations.
     template <bool Ordered, unsigned Q, typename Allocator>
-    void acc_pot_dispatch(std::vector<F, Allocator> &out, F mac_value, F G, F eps,
-                          const std::vector<double> &split) const
+    void acc_pot_dispatch(std::vector<F, Allocator> &out, F mac_value, F G, F eps, const std::vector<double> &split,
+                          bool mutual, bool mixed, const std::optional<std::vector<size_type>> &active,
+                          const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
     {
         static_assert(Q == 1u);
         out.resize(boost::numeric_cast<decltype(out.size())>(m_parts[0].size()));
-        acc_pot_dispatch<Ordered, Q>(std::array{out.data()}, mac_value, G, eps, split);
+        acc_pot_dispatch<Ordered, Q>(std::array{out.data()}, mac_value, G, eps, split, mutual, mixed, active, sr,
+                                     err_tol);
     }
     // Small helper to turn an init list into an array, in the functions for the computation
     // of the accelerations/potentials. Q indicates which quantities will be computed (accs,
@@ -3369,10 +5474,50 @@ private:
             eps = boost::numeric_cast<F>(p(kwargs::eps));
         }
 
+        bool mutual = false;
+        if constexpr (p.has(kwargs::mutual)) {
+            mutual = static_cast<bool>(p(kwargs::mutual));
+        }
+
+        bool mixed = false;
+        if constexpr (p.has(kwargs::mixed_precision)) {
+            mixed = static_cast<bool>(p(kwargs::mixed_precision));
+        }
+
+        // NOTE: the active particles can be passed as any range of integral indices.
+        std::optional<std::vector<size_type>> active;
+        if constexpr (p.has(kwargs::active)) {
+            active.emplace();
+            for (const auto &n : p(kwargs::active)) {
+                active->push_back(boost::numeric_cast<size_type>(n));
+            }
+        }
+
+        // NOTE: the short-range mode is activated by the r_split kwarg. By default, the cutoff
+        // radius is 4.5 times the split scale, where the split function is ~1.5E-3.
+        std::optional<std::array<F, 2>> sr;
+        if constexpr (p.has(kwargs::r_split)) {
+            const auto rs = boost::numeric_cast<F>(p(kwargs::r_split));
+            if constexpr (p.has(kwargs::r_cut)) {
+                sr = std::array{rs, boost::numeric_cast<F>(p(kwargs::r_cut))};
+            } else {
+                sr = std::array{rs, rs * (F(9) / F(2))};
+            }
+        } else {
+            static_assert(!p.has(kwargs::r_cut), "The r_cut keyword argument can be used only together with the "
+                                                 "r_split keyword argument");
+        }
+
+        // NOTE: the error-controlled mode is activated by the err_tol kwarg (see acc_pot_err_impl()).
+        std::optional<F> err_tol;
+        if constexpr (p.has(kwargs::err_tol)) {
+            err_tol = boost::numeric_cast<F>(p(kwargs::err_tol));
+        }
+
         if constexpr (p.has(kwargs::split)) {
-            return std::tuple{G, eps, std::cref(p(kwargs::split))};
+            return std::tuple{G, eps, std::cref(p(kwargs::split)), mutual, mixed, std::move(active), sr, err_tol};
         } else {
-            return std::tuple{G, eps, std::vector<double>{}};
+            return std::tuple{G, eps, std::vector<double>{}, mutual, mixed, std::move(active), sr, err_tol};
         }
     }
 
@@ -3380,14 +5525,16 @@ public:
     template <typename Allocator, typename... KwArgs>
     void accs_u(std::array<std::vector<F, Allocator>, NDim> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 0>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 0>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_u(const std::array<It, NDim> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 0>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 0>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_u(std::initializer_list<It> out, F mac_value, KwArgs &&... args) const
@@ -3397,26 +5544,30 @@ public:
     template <typename Allocator, typename... KwArgs>
     void pots_u(std::vector<F, Allocator> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 1>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 1>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void pots_u(It out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 1>(std::array{out}, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 1>(std::array{out}, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename Allocator, typename... KwArgs>
     void accs_pots_u(std::array<std::vector<F, Allocator>, NDim + 1u> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 2>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 2>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_u(const std::array<It, NDim + 1u> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 2>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 2>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_u(std::initializer_list<It> out, F mac_value, KwArgs &&... args) const
@@ -3426,14 +5577,16 @@ public:
     template <typename Allocator, typename... KwArgs>
     void accs_o(std::array<std::vector<F, Allocator>, NDim> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 0>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 0>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_o(const std::array<It, NDim> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 0>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 0>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_o(std::initializer_list<It> out, F mac_value, KwArgs &&... args) const
@@ -3443,26 +5596,30 @@ public:
     template <typename Allocator, typename... KwArgs>
     void pots_o(std::vector<F, Allocator> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 1>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 1>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void pots_o(It out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 1>(std::array{out}, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 1>(std::array{out}, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename Allocator, typename... KwArgs>
     void accs_pots_o(std::array<std::vector<F, Allocator>, NDim + 1u> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 2>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 2>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_o(const std::array<It, NDim + 1u> &out, F mac_value, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 2>(out, mac_value, G, eps, split);
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 2>(out, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_o(std::initializer_list<It> out, F mac_value, KwArgs &&... args) const
@@ -3470,6 +5627,621 @@ public:
         accs_pots_o(acc_pot_ilist_to_array<2>(out), mac_value, std::forward<KwArgs>(args)...);
     }
 
+private:
+    // Top level dispatcher for the accs/pots functions with a callback. f is the callback, the other
+    // arguments are as in acc_pot_dispatch(). Q indicates which quantities will be computed (accs,
+    // potentials, or both).
+    template <unsigned Q, typename Func>
+    void acc_pot_cb_dispatch(F orig_mac_value, Func &f, F G, F eps, const std::vector<double> &split, bool mutual,
+                             bool mixed, const std::optional<std::vector<size_type>> &active,
+                             const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
+    {
+        simple_timer st("vector accs/pots computation with callback");
+        const auto mac_value = transform_mac_value(orig_mac_value);
+        const auto eps2 = compute_eps2(eps);
+        check_G_const(G);
+        if constexpr (MAC == mac::relative) {
+            check_acc_old();
+        }
+        // NOTE: the callback needs the results for contiguous ranges of target particles,
+        // on the cpu, and at the end of the traversal of each critical node.
+        if (rakau_unlikely(split.size() > 1u)) {
+            throw std::invalid_argument("The computation of accelerations/potentials with a callback cannot be split "
+                                        "between multiple devices");
+        }
+        if (rakau_unlikely(mutual)) {
+            throw std::invalid_argument("The computation of accelerations/potentials with a callback cannot be "
+                                        "combined with the mutual evaluation of the leaf-leaf interactions");
+        }
+        if (rakau_unlikely(active)) {
+            throw std::invalid_argument("The computation of accelerations/potentials with a callback cannot be "
+                                        "restricted to a subset of active particles");
+        }
+        if (rakau_unlikely(sr || m_periodic)) {
+            throw std::invalid_argument("The computation of accelerations/potentials with a callback cannot be "
+                                        "combined with the short-range and periodic modes");
+        }
+        if (rakau_unlikely(err_tol)) {
+            throw std::invalid_argument("The computation of accelerations/potentials with a callback cannot be "
+                                        "combined with the error-controlled mode");
+        }
+        if (mixed) {
+            if constexpr (!std::is_same_v<F, double>) {
+                throw std::invalid_argument("The mixed-precision mode is available only for double-precision trees");
+            }
+        }
+        // NOTE: with runtime ISA dispatch, the callback cannot cross the boundary of the precompiled
+        // kernels, and the traversal is run with the batch type selected by the current compiler flags.
+        acc_pot_cpu_run<Q, simd_batch_t<F>>(std::array<F *, nvecs_res<Q>>{}, mac_value, G, eps2, 0,
+                                            m_crit_nodes.size(), mixed, nullptr, f);
+    }
+
+public:
+    // Computation of the accelerations/potentials with a callback. Instead of writing the results into
+    // output arrays, f is invoked at the end of the traversal of each critical node with the index of the
+    // first particle of the node (in the internal order), the number of particles in the node, and an array of
+    // pointers to the results for the particles of the node (the accelerations, the potentials, or the
+    // accelerations followed by the potentials). This allows to consume the results (e.g., to update the
+    // velocities) while they are still in cache. f is invoked concurrently from multiple threads, on
+    // disjoint ranges of particles, and the result pointers are valid only for the duration of the call.
+    template <typename Func, typename... KwArgs>
+    void accs_cb_u(F mac_value, Func &&f, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_cb_dispatch<0>(mac_value, f, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename Func, typename... KwArgs>
+    void pots_cb_u(F mac_value, Func &&f, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_cb_dispatch<1>(mac_value, f, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename Func, typename... KwArgs>
+    void accs_pots_cb_u(F mac_value, Func &&f, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_cb_dispatch<2>(mac_value, f, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+
+private:
+    // Implementation of the diagnostics. vel are the velocities of the particles,
+    // either in the original order (Ordered == true) or in the internal order.
+    template <bool Ordered, typename It, typename... KwArgs>
+    tree_diagnostics<NDim, F> diagnostics_impl(const std::array<It, NDim> &vel, F mac_value, KwArgs &&... args) const
+    {
+        static_assert(NDim == 2u || NDim == 3u, "The diagnostics are available only in 2 and 3 dimensions.");
+        simple_timer st("diagnostics computation");
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        // Make sure we can index into the velocity iterators.
+        it_diff_check<It>(m_parts[0].size());
+        // NOTE: in the ordered case, we read the velocities via permutated iterators.
+        const auto v_its = [&vel, this]() {
+            if constexpr (Ordered) {
+                return index_apply<NDim>([&vel, this](auto... I) {
+                    return std::array{boost::make_permutation_iterator(vel[I()], m_perm.begin())...};
+                });
+            } else {
+                return vel;
+            }
+        }();
+        using v_diff_t = it_diff_type<uncvref_t<decltype(v_its[0])>>;
+        // The accumulated quantities: kinetic energy, potential energy,
+        // the components of the momentum and of the angular momentum.
+        constexpr auto n_ang = NDim == 2u ? std::size_t(1) : std::size_t(3), nq = 2u + NDim + n_ang;
+        using acc_t = std::array<comp_sum<F>, nq>;
+        // The partial sums for each critical node, together with the index of the first particle in the node.
+        tbb::concurrent_vector<std::pair<size_type, acc_t>> partials;
+        // NOTE: the potential energy is accumulated while the potentials of each
+        // critical node are still in cache, and the rest of the quantities
+        // are computed in the same pass.
+        auto cb = [&v_its, &partials, this](size_type begin, size_type size, const auto &r_ptrs) {
+            acc_t acc{};
+            std::array<F, NDim> x, v;
+            for (size_type k = 0; k < size; ++k) {
+                const auto i = begin + k;
+                const auto m = m_parts[NDim][i];
+                F v2(0);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    x[j] = m_parts[j][i];
+                    v[j] = *(v_its[j] + static_cast<v_diff_t>(i));
+                    v2 = fma_wrap(v[j], v[j], v2);
+                }
+                acc[0].add(m * v2 / F(2));
+                // NOTE: the potentials already include the mass of the target particle,
+                // and we divide by 2 in order to count each pair only once.
+                acc[1].add(r_ptrs[0][k] / F(2));
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    acc[2u + j].add(m * v[j]);
+                }
+                if constexpr (NDim == 2u) {
+                    acc[2u + NDim].add(m * (x[0] * v[1] - x[1] * v[0]));
+                } else {
+                    acc[2u + NDim].add(m * (x[1] * v[2] - x[2] * v[1]));
+                    acc[3u + NDim].add(m * (x[2] * v[0] - x[0] * v[2]));
+                    acc[4u + NDim].add(m * (x[0] * v[1] - x[1] * v[0]));
+                }
+            }
+            partials.emplace_back(begin, acc);
+        };
+        acc_pot_cb_dispatch<1>(mac_value, cb, G, eps, split, mutual, mixed, active, sr, err_tol);
+        // NOTE: the order in which the critical nodes are completed depends on the scheduling, thus
+        // we sort the partials and reduce them deterministically in order to get reproducible results.
+        tbb::parallel_sort(partials.begin(), partials.end(),
+                           [](const auto &p1, const auto &p2) { return p1.first < p2.first; });
+        const auto tot = tbb::parallel_deterministic_reduce(
+            tbb::blocked_range(decltype(partials.size())(0), partials.size()), acc_t{},
+            [&partials](const auto &range, acc_t cur) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    for (std::size_t j = 0; j < nq; ++j) {
+                        cur[j].merge(partials[i].second[j]);
+                    }
+                }
+                return cur;
+            },
+            [](acc_t a, const acc_t &b) {
+                for (std::size_t j = 0; j < nq; ++j) {
+                    a[j].merge(b[j]);
+                }
+                return a;
+            });
+        tree_diagnostics<NDim, F> retval;
+        retval.kinetic = tot[0].value();
+        retval.potential = tot[1].value();
+        for (std::size_t j = 0; j < NDim; ++j) {
+            retval.momentum[j] = tot[2u + j].value();
+        }
+        for (std::size_t j = 0; j < n_ang; ++j) {
+            retval.ang_momentum[j] = tot[2u + NDim + j].value();
+        }
+        return retval;
+    }
+
+public:
+    // Fused computation of the kinetic energy, potential energy, momentum and angular momentum of the
+    // system, given the velocities of the particles. The potential energy is accumulated during the tree
+    // traversal for the computation of the potentials (see pots_cb_u()), and the rest of the quantities
+    // are computed in the same pass. The optional keyword arguments are the same as in pots_u().
+    template <typename It, typename... KwArgs>
+    tree_diagnostics<NDim, F> diagnostics_u(const std::array<It, NDim> &vel, F mac_value, KwArgs &&... args) const
+    {
+        return diagnostics_impl<false>(vel, mac_value, std::forward<KwArgs>(args)...);
+    }
+    template <typename It, typename... KwArgs>
+    tree_diagnostics<NDim, F> diagnostics_o(const std::array<It, NDim> &vel, F mac_value, KwArgs &&... args) const
+    {
+        return diagnostics_impl<true>(vel, mac_value, std::forward<KwArgs>(args)...);
+    }
+
+private:
+    // Tree traversal for the computation of the accelerations/potentials on tgt_size target particles which do not
+    // belong to the tree. The traversal starts from the root and no source node is skipped. p_ptrs are pointers to
+    // the coordinates/masses of the target particles, res_ptrs pointers to the zero-initialised arrays in which the
+    // results will be accumulated (including the multiplication by G). The other arguments are as in tree_acc_pot().
+    template <unsigned Q, typename B>
+    void tree_acc_pot_ext(F mac_value, F eps2, F G, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                          const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    {
+        auto &tmp_vecs = acc_pot_tmp_vecs<Q>();
+        const auto scratch_size = acc_pot_scratch_size<B>(tgt_size);
+        for (auto &v : tmp_vecs) {
+            v.resize(scratch_size);
+        }
+        const auto tree_size = static_cast<size_type>(m_tree.size());
+        for (size_type src_idx = 0; src_idx < tree_size;) {
+            src_idx
+                = tree_acc_pot_mac_check<Q, B>(src_idx, mac_value, eps2, tgt_size, p_ptrs, res_ptrs, nullptr, nullptr);
+        }
+        // Multiply by G, if needed.
+        if (G != F(1)) {
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                acc_pot_mul_G<B>(res_ptrs[j], tgt_size, G);
+            }
+        }
+    }
+    // Computation of the accelerations/potentials at n external query points. out is the array of output
+    // iterators, q the array of iterators to the coordinates of the query points, the other arguments are as
+    // in acc_pot_dispatch(). Q indicates which quantities will be computed (accs, potentials, or both).
+    //
+    // The query points are sorted in Morton order and split into buckets of at most ncrit points following
+    // the node structure, similarly to the critical nodes. Each bucket is then used as a target node in a
+    // traversal which starts from the root and in which no source node is skipped. The potentials are computed
+    // with unit target masses.
+    template <unsigned Q, typename It, typename QIt>
+    void acc_pot_query_impl(const std::array<It, nvecs_res<Q>> &out, const std::array<QIt, NDim> &q, size_type n,
+                            F orig_mac_value, F G, F eps, const std::vector<double> &split, bool mutual, bool mixed,
+                            const std::optional<std::vector<size_type>> &active,
+                            const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
+    {
+        simple_timer st("accs/pots computation at query points");
+        const auto mac_value = transform_mac_value(orig_mac_value);
+        const auto eps2 = compute_eps2(eps);
+        check_G_const(G);
+        if constexpr (MAC == mac::relative) {
+            throw std::invalid_argument("The relative MAC cannot be used in the computation of "
+                                        "accelerations/potentials at query points, as the previous "
+                                        "accelerations of the targets are not known");
+        }
+        if (rakau_unlikely(split.size() > 1u)) {
+            throw std::invalid_argument(
+                "The computation of accelerations/potentials at query points cannot be split between multiple devices");
+        }
+        if (rakau_unlikely(mutual || mixed || active || sr || m_periodic || err_tol)) {
+            throw std::invalid_argument("The computation of accelerations/potentials at query points does not support "
+                                        "the mutual, mixed-precision, active subset, short-range, periodic and "
+                                        "error-controlled modes");
+        }
+        if (!n) {
+            return;
+        }
+        it_diff_check<QIt>(n);
+        it_diff_check<It>(n);
+
+        // Copy the coordinates of the query points and compute their codes. The query points may lie
+        // outside the domain of the tree: the codes are used only for sorting, thus we clamp the
+        // discretised coordinates to the domain.
+        constexpr auto cbits = cbits_v<UInt, NDim>;
+        constexpr UInt factor = UInt(1) << cbits;
+        const auto inv_box_size = F(1) / m_box_size;
+        std::array<f_vector<F>, NDim> q_coords;
+        for (auto &v : q_coords) {
+            v.resize(n);
+        }
+        std::vector<UInt, di_aligned_allocator<UInt>> q_codes(n);
+        std::vector<size_type, di_aligned_allocator<size_type>> q_perm(n);
+        tbb::parallel_for(tbb::blocked_range(size_type(0), n), [&](const auto &range) {
+            std::array<UInt, NDim> tmp_dcoord;
+            morton_encoder<NDim, UInt> me;
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    const auto x = static_cast<F>(*(q[j] + static_cast<it_diff_type<QIt>>(i)));
+                    const auto tmp = fma_wrap(x, inv_box_size, F(1) / F(2)) * F(factor);
+                    if (rakau_unlikely(!std::isfinite(tmp))) {
+                        throw std::invalid_argument("The non-finite coordinate " + std::to_string(x)
+                                                    + " was detected in a query point");
+                    }
+                    q_coords[j][i] = x;
+                    // NOTE: F(factor - 1u) might be rounded up to factor.
+                    tmp_dcoord[j] = std::min(static_cast<UInt>(std::clamp(tmp, F(0), F(factor - 1u))),
+                                             static_cast<UInt>(factor - 1u));
+                }
+                q_codes[i] = me(tmp_dcoord.data());
+                q_perm[i] = i;
+            }
+        });
+        // NOTE: ties are broken by index, so that the buckets do not depend on the sorting algorithm.
+        tbb::parallel_sort(q_perm.begin(), q_perm.end(), [&q_codes](size_type i1, size_type i2) {
+            return q_codes[i1] < q_codes[i2] || (q_codes[i1] == q_codes[i2] && i1 < i2);
+        });
+        apply_isort(q_codes, q_perm);
+        for (auto &v : q_coords) {
+            apply_isort(v, q_perm);
+        }
+
+        // Split the query points into buckets.
+        std::vector<std::array<size_type, 2>> buckets;
+        const auto split_bucket = [this, &buckets, &q_codes](const auto &self, size_type begin, size_type end,
+                                                             unsigned level) -> void {
+            if (end - begin <= m_ncrit || level == cbits) {
+                buckets.push_back({begin, end});
+                return;
+            }
+            // Split according to the children of the current node.
+            const auto shift = (cbits - level - 1u) * NDim;
+            for (auto b = begin; b != end;) {
+                const auto e = static_cast<size_type>(
+                    std::upper_bound(q_codes.begin() + static_cast<std::ptrdiff_t>(b),
+                                     q_codes.begin() + static_cast<std::ptrdiff_t>(end), q_codes[b],
+                                     [shift](UInt c1, UInt c2) { return (c1 >> shift) < (c2 >> shift); })
+                    - q_codes.begin());
+                self(self, b, e, level + 1u);
+                b = e;
+            }
+        };
+        split_bucket(split_bucket, 0, n, 0);
+        // The unit masses of the query points.
+        size_type max_bsize = 0;
+        for (const auto &b : buckets) {
+            max_bsize = std::max(max_bsize, static_cast<size_type>(b[1] - b[0]));
+        }
+        const f_vector<F> unit_masses(max_bsize, F(1));
+
+        // NOTE: as in the callback mode, the traversal is run with the batch type selected by the current
+        // compiler flags, also when rakau is configured with runtime ISA dispatch.
+        using B = simd_batch_t<F>;
+        tbb::parallel_for(tbb::blocked_range(decltype(buckets.size())(0), buckets.size()), [&](const auto &range) {
+            auto &tmp_res = acc_pot_tmp_res<Q>();
+            for (auto bi = range.begin(); bi != range.end(); ++bi) {
+                const auto tgt_begin = buckets[bi][0], tgt_size = static_cast<size_type>(buckets[bi][1] - tgt_begin);
+                std::array<const F *, NDim + 1u> p_ptrs;
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    p_ptrs[j] = q_coords[j].data() + tgt_begin;
+                }
+                p_ptrs[NDim] = unit_masses.data();
+                std::array<F *, nvecs_res<Q>> res_ptrs;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    tmp_res[j].resize(tgt_size);
+                    res_ptrs[j] = tmp_res[j].data();
+                    std::fill(res_ptrs[j], res_ptrs[j] + tgt_size, F(0));
+                }
+                tree_acc_pot_ext<Q, B>(mac_value, eps2, G, tgt_size, p_ptrs, res_ptrs);
+                // Scatter the results back in the input order.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    for (size_type k = 0; k < tgt_size; ++k) {
+                        *(out[j] + static_cast<it_diff_type<It>>(q_perm[tgt_begin + k])) = res_ptrs[j][k];
+                    }
+                }
+            }
+            flush_simd_counters_tl();
+        });
+    }
+    // Helper overload for an array of vectors. It will resize the vectors and then call the other overload.
+    template <unsigned Q, typename Allocator, typename QIt>
+    void acc_pot_query_impl(std::array<std::vector<F, Allocator>, nvecs_res<Q>> &out, const std::array<QIt, NDim> &q,
+                            size_type n, F mac_value, F G, F eps, const std::vector<double> &split, bool mutual,
+                            bool mixed, const std::optional<std::vector<size_type>> &active,
+                            const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
+    {
+        std::array<F *, nvecs_res<Q>> out_ptrs;
+        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+            out[j].resize(boost::numeric_cast<decltype(out[j].size())>(n));
+            out_ptrs[j] = out[j].data();
+        }
+        acc_pot_query_impl<Q>(out_ptrs, q, n, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+
+public:
+    // Computation of the accelerations/potentials at n external query points, whose coordinates are read from
+    // the iterators in q. The results are written in the same order as the query points. The query points do
+    // not need to lie within the domain of the tree, and they are not treated as particles: they feel the
+    // field of all the particles of the tree (i.e., there is no self-interaction exclusion), and the potentials
+    // are per unit mass. The optional keyword arguments are the grav constant G and the softening length eps.
+    template <typename Allocator, typename QIt, typename... KwArgs>
+    void accs_query(std::array<std::vector<F, Allocator>, NDim> &out, const std::array<QIt, NDim> &q, size_type n,
+                    F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_query_impl<0>(out, q, n, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename It, typename QIt, typename... KwArgs>
+    void accs_query(const std::array<It, NDim> &out, const std::array<QIt, NDim> &q, size_type n, F mac_value,
+                    KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_query_impl<0>(out, q, n, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename Allocator, typename QIt, typename... KwArgs>
+    void pots_query(std::vector<F, Allocator> &out, const std::array<QIt, NDim> &q, size_type n, F mac_value,
+                    KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        out.resize(boost::numeric_cast<decltype(out.size())>(n));
+        acc_pot_query_impl<1>(std::array{out.data()}, q, n, mac_value, G, eps, split, mutual, mixed, active, sr,
+                              err_tol);
+    }
+    template <typename It, typename QIt, typename... KwArgs>
+    void pots_query(It out, const std::array<QIt, NDim> &q, size_type n, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_query_impl<1>(std::array<It, 1>{out}, q, n, mac_value, G, eps, split, mutual, mixed, active, sr,
+                              err_tol);
+    }
+    template <typename Allocator, typename QIt, typename... KwArgs>
+    void accs_pots_query(std::array<std::vector<F, Allocator>, NDim + 1u> &out, const std::array<QIt, NDim> &q,
+                         size_type n, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_query_impl<2>(out, q, n, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename It, typename QIt, typename... KwArgs>
+    void accs_pots_query(const std::array<It, NDim + 1u> &out, const std::array<QIt, NDim> &q, size_type n,
+                         F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_query_impl<2>(out, q, n, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+
+private:
+    // Computation of the accelerations/potentials on the particles of this tree due to the particles of the
+    // tree src (dual-tree mode). out is the array of output iterators, in the internal order of this tree if
+    // Ordered is false, in the original order otherwise. The other arguments are as in acc_pot_dispatch().
+    //
+    // The critical nodes of this tree are the target nodes, and each of them is used in a traversal
+    // of the whole source tree (see tree_acc_pot_ext()).
+    template <bool Ordered, unsigned Q, typename It>
+    void acc_pot_from_impl(const std::array<It, nvecs_res<Q>> &out, const tree &src, F orig_mac_value, F G, F eps,
+                           const std::vector<double> &split, bool mutual, bool mixed,
+                           const std::optional<std::vector<size_type>> &active,
+                           const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
+    {
+        simple_timer st("dual-tree accs/pots computation");
+        const auto mac_value = transform_mac_value(orig_mac_value);
+        const auto eps2 = compute_eps2(eps);
+        check_G_const(G);
+        if constexpr (MAC == mac::relative) {
+            throw std::invalid_argument(
+                "The relative MAC cannot be used in the dual-tree computation of accelerations/potentials");
+        }
+        if (rakau_unlikely(split.size() > 1u)) {
+            throw std::invalid_argument(
+                "The dual-tree computation of accelerations/potentials cannot be split between multiple devices");
+        }
+        if (rakau_unlikely(mutual || mixed || active || sr || m_periodic || src.m_periodic || err_tol)) {
+            throw std::invalid_argument("The dual-tree computation of accelerations/potentials does not support "
+                                        "the mutual, mixed-precision, active subset, short-range, periodic and "
+                                        "error-controlled modes");
+        }
+        if (rakau_unlikely(src.m_box_size != m_box_size)) {
+            throw std::invalid_argument("In the dual-tree computation of accelerations/potentials, the source and "
+                                        "target trees must have the same box size, but the box size of the source "
+                                        "tree is "
+                                        + std::to_string(src.m_box_size) + " and the box size of the target tree is "
+                                        + std::to_string(m_box_size));
+        }
+        it_diff_check<It>(m_parts[0].size());
+        const auto out_its = [&out, this]() {
+            if constexpr (Ordered) {
+                return index_apply<nvecs_res<Q>>([&out, this](auto... I) {
+                    return std::array{boost::make_permutation_iterator(out[I()], m_perm.begin())...};
+                });
+            } else {
+                return out;
+            }
+        }();
+        using out_diff_t = it_diff_type<uncvref_t<decltype(out_its[0])>>;
+
+        // NOTE: as in the callback mode, the traversal is run with the batch type selected by the current
+        // compiler flags, also when rakau is configured with runtime ISA dispatch.
+        using B = simd_batch_t<F>;
+        const auto n_cnodes = static_cast<size_type>(m_crit_nodes.size());
+        tbb::parallel_for(tbb::blocked_range(size_type(0), n_cnodes), [&](const auto &range) {
+            auto &tmp_res = acc_pot_tmp_res<Q>();
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto tgt_begin = m_crit_nodes[i].begin,
+                           tgt_size = static_cast<size_type>(m_crit_nodes[i].end - tgt_begin);
+                const auto p_ptrs = crit_node_tgt_ptrs(i);
+                std::array<F *, nvecs_res<Q>> res_ptrs;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    tmp_res[j].resize(tgt_size);
+                    res_ptrs[j] = tmp_res[j].data();
+                    std::fill(res_ptrs[j], res_ptrs[j] + tgt_size, F(0));
+                }
+                src.template tree_acc_pot_ext<Q, B>(mac_value, eps2, G, tgt_size, p_ptrs, res_ptrs);
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    std::copy(res_ptrs[j], res_ptrs[j] + tgt_size, out_its[j] + static_cast<out_diff_t>(tgt_begin));
+                }
+            }
+            flush_simd_counters_tl();
+        });
+    }
+    // Helper overload for an array of vectors. It will resize the vectors and then call the other overload.
+    template <bool Ordered, unsigned Q, typename Allocator>
+    void acc_pot_from_impl(std::array<std::vector<F, Allocator>, nvecs_res<Q>> &out, const tree &src, F mac_value,
+                           F G, F eps, const std::vector<double> &split, bool mutual, bool mixed,
+                           const std::optional<std::vector<size_type>> &active,
+                           const std::optional<std::array<F, 2>> &sr, const std::optional<F> &err_tol) const
+    {
+        std::array<F *, nvecs_res<Q>> out_ptrs;
+        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+            out[j].resize(boost::numeric_cast<decltype(out[j].size())>(m_parts[0].size()));
+            out_ptrs[j] = out[j].data();
+        }
+        acc_pot_from_impl<Ordered, Q>(out_ptrs, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+
+public:
+    // Dual-tree computation of the accelerations/potentials. The particles of this tree are the targets, and
+    // the particles of the tree src are the sources. The two trees must have the same box size (e.g., via the
+    // box_size keyword argument in the constructors). No self-interaction is excluded, thus the targets and the
+    // sources are expected to be distinct sets of particles (e.g., different species). The output arrays are
+    // in the internal (_u) or original (_o) order of this tree. The optional keyword arguments are the grav
+    // constant G and the softening length eps.
+    template <typename Allocator, typename... KwArgs>
+    void accs_from_u(std::array<std::vector<F, Allocator>, NDim> &out, const tree &src, F mac_value,
+                     KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<false, 0>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_from_u(const std::array<It, NDim> &out, const tree &src, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<false, 0>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void accs_from_o(std::array<std::vector<F, Allocator>, NDim> &out, const tree &src, F mac_value,
+                     KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<true, 0>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_from_o(const std::array<It, NDim> &out, const tree &src, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<true, 0>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void pots_from_u(std::vector<F, Allocator> &out, const tree &src, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        out.resize(boost::numeric_cast<decltype(out.size())>(m_parts[0].size()));
+        acc_pot_from_impl<false, 1>(std::array{out.data()}, src, mac_value, G, eps, split, mutual, mixed, active, sr,
+                                    err_tol);
+    }
+    template <typename It, typename... KwArgs>
+    void pots_from_u(It out, const tree &src, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<false, 1>(std::array<It, 1>{out}, src, mac_value, G, eps, split, mutual, mixed, active, sr,
+                                    err_tol);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void pots_from_o(std::vector<F, Allocator> &out, const tree &src, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        out.resize(boost::numeric_cast<decltype(out.size())>(m_parts[0].size()));
+        acc_pot_from_impl<true, 1>(std::array{out.data()}, src, mac_value, G, eps, split, mutual, mixed, active, sr,
+                                   err_tol);
+    }
+    template <typename It, typename... KwArgs>
+    void pots_from_o(It out, const tree &src, F mac_value, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<true, 1>(std::array<It, 1>{out}, src, mac_value, G, eps, split, mutual, mixed, active, sr,
+                                   err_tol);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void accs_pots_from_u(std::array<std::vector<F, Allocator>, NDim + 1u> &out, const tree &src, F mac_value,
+                          KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<false, 2>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_pots_from_u(const std::array<It, NDim + 1u> &out, const tree &src, F mac_value,
+                          KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<false, 2>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void accs_pots_from_o(std::array<std::vector<F, Allocator>, NDim + 1u> &out, const tree &src, F mac_value,
+                          KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<true, 2>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_pots_from_o(const std::array<It, NDim + 1u> &out, const tree &src, F mac_value,
+                          KwArgs &&... args) const
+    {
+        const auto [G, eps, split, mutual, mixed, active, sr, err_tol]
+            = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_from_impl<true, 2>(out, src, mac_value, G, eps, split, mutual, mixed, active, sr, err_tol);
+    }
+
 private:
     template <bool Ordered, unsigned Q>
     auto exact_acc_pot_impl(size_type orig_idx, F G, F eps) const
@@ -3515,46 +6287,46 @@ public:
     template <typename... KwArgs>
     std::array<F, NDim> exact_acc_u(size_type idx, KwArgs &&... args) const
     {
-        // NOTE: we are also parsing the split kwarg here, which is not used. I don't
+        // NOTE: we are also parsing the split and mutual kwargs here, which are not used. I don't
         // think it has any performance implications, and perhaps in the future
         // we will use it.
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, __, ___, ____, _____, ______] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, __, ___, ____, _____, ______);
         return exact_acc_pot_impl<false, 0>(idx, G, eps);
     }
     template <typename... KwArgs>
     F exact_pot_u(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, __, ___, ____, _____, ______] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, __, ___, ____, _____, ______);
         return exact_acc_pot_impl<false, 1>(idx, G, eps)[0];
     }
     template <typename... KwArgs>
     std::array<F, NDim + 1u> exact_acc_pot_u(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, __, ___, ____, _____, ______] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, __, ___, ____, _____, ______);
         return exact_acc_pot_impl<false, 2>(idx, G, eps);
     }
     template <typename... KwArgs>
     std::array<F, NDim> exact_acc_o(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, __, ___, ____, _____, ______] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, __, ___, ____, _____, ______);
         return exact_acc_pot_impl<true, 0>(idx, G, eps);
     }
     template <typename... KwArgs>
     F exact_pot_o(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, __, ___, ____, _____, ______] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, __, ___, ____, _____, ______);
         return exact_acc_pot_impl<true, 1>(idx, G, eps)[0];
     }
     template <typename... KwArgs>
     std::array<F, NDim + 1u> exact_acc_pot_o(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, __, ___, ____, _____, ______] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, __, ___, ____, _____, ______);
         return exact_acc_pot_impl<true, 2>(idx, G, eps);
     }
 
@@ -3630,6 +6402,11 @@ private:
             m_box_size = determine_box_size(p_its_u(), nparts);
         }
 
+        // Wrap the coordinates into the domain, if needed.
+        if (m_periodic) {
+            periodic_wrap();
+        }
+
         // Compute the inverse of the box size for discretisation.
         const auto inv_box_size = F(1) / m_box_size;
 
@@ -3665,6 +6442,10 @@ private:
             for (std::size_t j = 0; j < NDim + 1u; ++j) {
                 tg.run([this, j]() { apply_isort(m_parts[j], m_last_perm); });
             }
+            if (!m_acc_old.empty()) {
+                // The previous accelerations follow the particles.
+                tg.run([this]() { apply_isort(m_acc_old, m_last_perm); });
+            }
             tg.run([this]() {
                 // Apply the new indirect sorting to the original one.
                 apply_isort(m_perm, m_last_perm);
@@ -3758,6 +6539,67 @@ public:
     {
         update_masses_dispatch<true>(std::forward<Func>(f));
     }
+
+private:
+    // Store the magnitudes of the accelerations in the previous step, whose components are read
+    // from the iterators in accs, for use in the relative MAC. If Ordered is true, the accelerations
+    // are in the original order of the particles, otherwise in the internal order.
+    template <bool Ordered, typename It>
+    void set_acc_old_impl(const std::array<It, NDim> &accs)
+    {
+        static_assert(MAC == mac::relative,
+                      "The previous accelerations can be set only in a tree using the relative MAC.");
+        const auto np = nparts();
+        it_diff_check<It>(np);
+        f_vector<F> tmp(np);
+        tbb::parallel_for(tbb::blocked_range(size_type(0), np), [this, &accs, &tmp](const auto &range) {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto idx = boost::numeric_cast<it_diff_type<It>>(Ordered ? m_perm[i] : i);
+                F a2(0);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    const F a = accs[j][idx];
+                    a2 = fma_wrap(a, a, a2);
+                }
+                tmp[i] = std::sqrt(a2);
+            }
+        });
+        if (rakau_unlikely(std::any_of(tmp.begin(), tmp.end(), [](const F &x) { return !std::isfinite(x); }))) {
+            throw std::invalid_argument("The previous accelerations used by the relative MAC must be finite");
+        }
+        m_acc_old = std::move(tmp);
+    }
+    template <bool Ordered, typename Allocator>
+    void set_acc_old_impl(const std::array<std::vector<F, Allocator>, NDim> &accs)
+    {
+        for (const auto &v : accs) {
+            if (rakau_unlikely(v.size() != nparts())) {
+                throw std::invalid_argument("A vector of size " + std::to_string(v.size())
+                                            + " was passed as the previous accelerations in a tree with "
+                                            + std::to_string(nparts()) + " particles");
+            }
+        }
+        set_acc_old_impl<Ordered>(
+            index_apply<NDim>([&accs](auto... I) { return std::array{accs[I()].data()...}; }));
+    }
+
+public:
+    // NOTE: the previous accelerations are kept by the tree, and they follow the particles
+    // when these are re-ordered by update_particles_u()/update_particles_o().
+    template <typename T>
+    void set_acc_old_u(const T &accs)
+    {
+        set_acc_old_impl<false>(accs);
+    }
+    template <typename T>
+    void set_acc_old_o(const T &accs)
+    {
+        set_acc_old_impl<true>(accs);
+    }
+    // The magnitudes of the previous accelerations, in the internal order.
+    const auto &acc_old() const
+    {
+        return m_acc_old;
+    }
     F box_size() const
     {
         return m_box_size;
@@ -3774,6 +6616,14 @@ public:
     {
         return m_ncrit;
     }
+    unsigned coord_bits() const
+    {
+        return m_ccoords.bits;
+    }
+    bool periodic() const
+    {
+        return m_periodic;
+    }
     size_type nparts() const
     {
         return m_parts[0].size();
@@ -3822,6 +6672,13 @@ private:
     tree_type m_tree;
     // The list of critical nodes.
     cnode_list_type m_crit_nodes;
+    // The compressed coordinate store.
+    ccoords_store m_ccoords;
+    // Flag to signal if the domain is periodic.
+    bool m_periodic;
+    // The magnitudes of the accelerations of the particles in the previous
+    // step (in the internal order), used by the relative MAC.
+    f_vector<F> m_acc_old;
 #if defined(RAKAU_WITH_ROCM)
     std::optional<rocm_state<NDim, F, UInt, MAC>> m_rocm;
 #endif
@@ -0,0 +1,110 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// NOTE: this file is compiled multiple times, once for each instruction set
+// in cpu_isa, with the appropriate compiler flags. The build system sets
+// the RAKAU_CPU_ISA_NAME definition to the name of the instruction set.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/preprocessor/seq/elem.hpp>
+#include <boost/preprocessor/seq/for_each_product.hpp>
+
+#include <xsimd/xsimd.hpp>
+
+#include <rakau/config.hpp>
+#include <rakau/detail/cpu_fwd.hpp>
+#include <rakau/detail/tree_fwd.hpp>
+#include <rakau/tree.hpp>
+
+#if !defined(RAKAU_WITH_ISA_DISPATCH)
+
+#error This file must be compiled only if rakau is configured with runtime ISA dispatch
+
+#endif
+
+#if !defined(RAKAU_CPU_ISA_NAME)
+
+#error The RAKAU_CPU_ISA_NAME definition must be set when compiling this file
+
+#endif
+
+namespace rakau
+{
+
+inline namespace detail
+{
+
+// Check that the compiler flags are consistent with the instruction set
+// we are compiling for. We take the batch types from xsimd, so if the flags
+// were wrong we would end up with kernels for the wrong instruction set.
+// NOTE: this has internal linkage, as its value differs in each compilation.
+constexpr cpu_isa cpu_isa_current = cpu_isa::RAKAU_CPU_ISA_NAME;
+
+static_assert(cpu_isa_current != cpu_isa::sse2
+                  || (XSIMD_X86_INSTR_SET >= XSIMD_X86_SSE2_VERSION && XSIMD_X86_INSTR_SET < XSIMD_X86_AVX_VERSION),
+              "The compiler flags are not consistent with the SSE2 instruction set.");
+static_assert(cpu_isa_current != cpu_isa::avx2
+                  || (XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX2_VERSION
+                      && XSIMD_X86_INSTR_SET < XSIMD_X86_AVX512_VERSION),
+              "The compiler flags are not consistent with the AVX2 instruction set.");
+static_assert(cpu_isa_current != cpu_isa::avx512 || XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION,
+              "The compiler flags are not consistent with the AVX-512 instruction set.");
+
+template <cpu_isa ISA, unsigned Q, std::size_t NDim, typename F, typename UInt, mac MAC>
+void cpu_acc_pot_impl(const tree<NDim, F, UInt, MAC> &t, const std::array<F *, tree_nvecs_res<Q, NDim>> &out,
+                      F mac_value, F G, F eps2, tree_size_t<F> c_begin, tree_size_t<F> c_end, bool mutual,
+                      bool mixed, const tree_active_t<F> *active)
+{
+    static_assert(ISA == cpu_isa_current);
+    t.template acc_pot_cpu_kernel<Q, simd_batch_t<F>>(out, mac_value, G, eps2, c_begin, c_end, mutual, mixed,
+                                                      active);
+}
+
+// Explicit instantiations of the templates implemented above. We are going to use Boost.Preprocessor.
+// It's gonna look ugly, but it will allow us to avoid a lot of typing.
+
+// Define the values/types that we will use for the concrete instantiations.
+
+// Only quadtrees and octrees for the moment.
+#define RAKAU_CPU_INST_DIM_SEQUENCE (2)(3)
+
+// float and double only.
+#define RAKAU_CPU_INST_FP_SEQUENCE (float)(double)
+
+// 32/64bit types for the particle codes.
+#define RAKAU_CPU_INST_UINT_SEQUENCE (std::uint32_t)(std::uint64_t)
+
+// Computation of accelerations, potentials or both.
+#define RAKAU_CPU_INST_Q_SEQUENCE (0)(1)(2)
+
+// Enable all MACs.
+#define RAKAU_CPU_INST_MACS_SEQUENCE (mac::bh)(mac::bh_geom)(mac::relative)(mac::bh_box)
+
+// Macro for the instantiation of the main function. NDim, F, UInt, Q and MAC will be passed in
+// as a sequence named Args (in that order).
+#define RAKAU_CPU_EXPLICIT_INST_FUN(r, Args)                                                                           \
+    template void cpu_acc_pot_impl<cpu_isa_current, BOOST_PP_SEQ_ELEM(3, Args), BOOST_PP_SEQ_ELEM(0, Args),           \
+                                   BOOST_PP_SEQ_ELEM(1, Args), BOOST_PP_SEQ_ELEM(2, Args), BOOST_PP_SEQ_ELEM(4, Args)>( \
+        const tree<BOOST_PP_SEQ_ELEM(0, Args), BOOST_PP_SEQ_ELEM(1, Args), BOOST_PP_SEQ_ELEM(2, Args),                 \
+                   BOOST_PP_SEQ_ELEM(4, Args)> &,                                                                      \
+        const std::array<BOOST_PP_SEQ_ELEM(1, Args) *,                                                                 \
+                         tree_nvecs_res<BOOST_PP_SEQ_ELEM(3, Args), BOOST_PP_SEQ_ELEM(0, Args)>> &,                    \
+        BOOST_PP_SEQ_ELEM(1, Args), BOOST_PP_SEQ_ELEM(1, Args), BOOST_PP_SEQ_ELEM(1, Args),                            \
+        tree_size_t<BOOST_PP_SEQ_ELEM(1, Args)>, tree_size_t<BOOST_PP_SEQ_ELEM(1, Args)>, bool, bool,                  \
+        const tree_active_t<BOOST_PP_SEQ_ELEM(1, Args)> *);
+
+// Do the actual instantiation via a cartesian product over the sequences.
+// clang-format off
+BOOST_PP_SEQ_FOR_EACH_PRODUCT(RAKAU_CPU_EXPLICIT_INST_FUN, (RAKAU_CPU_INST_DIM_SEQUENCE)(RAKAU_CPU_INST_FP_SEQUENCE)(RAKAU_CPU_INST_UINT_SEQUENCE)(RAKAU_CPU_INST_Q_SEQUENCE)(RAKAU_CPU_INST_MACS_SEQUENCE));
+// clang-format on
+
+} // namespace detail
+} // namespace rakau
@@ -0,0 +1,90 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// NOTE: this file is compiled with the baseline compiler flags, as it
+// runs before we know which instruction sets are available.
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include <rakau/config.hpp>
+#include <rakau/detail/cpu_fwd.hpp>
+
+#if !defined(RAKAU_WITH_ISA_DISPATCH)
+
+#error This file must be compiled only if rakau is configured with runtime ISA dispatch
+
+#endif
+
+namespace rakau
+{
+
+inline namespace detail
+{
+
+namespace
+{
+
+// Detect the best instruction set supported by the host cpu.
+cpu_isa cpu_detect_isa()
+{
+    __builtin_cpu_init();
+    // NOTE: the AVX-512 kernels are compiled with the F and DQ extensions,
+    // the AVX2 kernels with FMA.
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        return cpu_isa::avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return cpu_isa::avx2;
+    }
+    return cpu_isa::sse2;
+}
+
+} // namespace
+
+cpu_isa cpu_dispatch_isa()
+{
+    static const cpu_isa retval = []() {
+        const auto detected = cpu_detect_isa();
+        const auto env = std::getenv("RAKAU_CPU_ISA");
+        if (!env) {
+            return detected;
+        }
+        const std::string name(env);
+        cpu_isa requested;
+        if (name == "sse2") {
+            requested = cpu_isa::sse2;
+        } else if (name == "avx2") {
+            requested = cpu_isa::avx2;
+        } else if (name == "avx512") {
+            requested = cpu_isa::avx512;
+        } else {
+            throw std::invalid_argument("Invalid value for the RAKAU_CPU_ISA environment variable: '" + name
+                                        + "' was specified, but only 'sse2', 'avx2' and 'avx512' are supported");
+        }
+        // NOTE: never select an instruction set the cpu does not support.
+        return requested < detected ? requested : detected;
+    }();
+    return retval;
+}
+
+// NOTE: these are the values determined experimentally
+// for the corresponding single-ISA builds (see tree.hpp).
+unsigned cpu_dispatch_default_max_leaf_n()
+{
+    return 16;
+}
+
+unsigned cpu_dispatch_default_ncrit()
+{
+    return cpu_dispatch_isa() == cpu_isa::avx512 ? 256 : 128;
+}
+
+} // namespace detail
+} // namespace rakau
@@ -135,7 +135,8 @@ struct arr_wrap {
 
 // Small helpers to compute the rhs of the MAC check. We need this because the members
 // of the node structure vary depending on the MAC.
-template <std::size_t NDim, typename F, typename UInt, mac MAC, std::enable_if_t<MAC == mac::bh, int> = 0>
+template <std::size_t NDim, typename F, typename UInt, mac MAC,
+          std::enable_if_t<MAC == mac::bh || MAC == mac::bh_box, int> = 0>
 __device__ F compute_mac_lh(const tree_node_t<NDim, F, UInt, MAC> &node, const F &mac_value)
 {
     return node.dim2 * mac_value;
@@ -545,7 +546,7 @@ void cuda_acc_pot_impl(const std::array<F *, tree_nvecs_res<Q, NDim>> &out,
 #define RAKAU_CUDA_INST_Q_SEQUENCE (0)(1)(2)
 
 // Enable all MACs.
-#define RAKAU_CUDA_INST_MACS_SEQUENCE (mac::bh)(mac::bh_geom)
+#define RAKAU_CUDA_INST_MACS_SEQUENCE (mac::bh)(mac::bh_geom)(mac::bh_box)
 
 // Macro for the instantiation of the main function. NDim, F, UInt, Q and MAC will be passed in
 // as a sequence named Args (in that order).
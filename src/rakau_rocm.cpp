@@ -172,8 +172,8 @@ void rocm_state<NDim, F, UInt, MAC>::acc_pot(int p_begin, int p_end,
             const auto src_level = src_node.level;
             // Left-hand side of the MAC check.
             const auto mac_lh = [mac_value, &src_node]() {
-                if constexpr (MAC == mac::bh) {
-                    // NOTE: for the BH MAC, mac_value is theta**-2.
+                if constexpr (MAC == mac::bh || MAC == mac::bh_box) {
+                    // NOTE: for the BH MACs, mac_value is theta**-2.
                     return src_node.dim2 * mac_value;
                 } else {
                     // NOTE: for the geometric BH MAC, mac_value is theta**-1.
@@ -342,7 +342,7 @@ void rocm_state<NDim, F, UInt, MAC>::acc_pot(int p_begin, int p_end,
 #define RAKAU_ROCM_INST_Q_SEQUENCE (0)(1)(2)
 
 // Enable all MACs.
-#define RAKAU_ROCM_INST_MACS_SEQUENCE (mac::bh)(mac::bh_geom)
+#define RAKAU_ROCM_INST_MACS_SEQUENCE (mac::bh)(mac::bh_geom)(mac::bh_box)
 
 // Macro for the instantiation of the member function. NDim, F, UInt, Q and MAC will be passed in
 // as a sequence named Args (in that order).
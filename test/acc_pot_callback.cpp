@@ -0,0 +1,139 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+TEST_CASE("accelerations/potentials with callback")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            // NOTE: with runtime ISA dispatch, the callback codepath might run
+            // with a different instruction set than the plain one.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-10) : fp_type(1E-5);
+            auto sizes = {0u, 1u, 10u, 2000u};
+            auto ncrits = {1u, 16u, 128u};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+                for (auto nc : ncrits) {
+                    octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                 y_coords = parts.begin() + 2u * s,
+                                                                 z_coords = parts.begin() + 3u * s,
+                                                                 masses = parts.begin(),
+                                                                 nparts = s,
+                                                                 kwargs::ncrit = nc};
+                    std::array<std::vector<fp_type>, 4> ref, res;
+                    t.accs_pots_u(ref, fp_type(0.75), G = fp_type(2), eps = fp_type(0.001));
+                    for (auto &v : res) {
+                        v.assign(s, fp_type(0));
+                    }
+                    // Count how many times each particle is visited.
+                    std::vector<std::atomic<unsigned>> visits(s);
+                    t.accs_pots_cb_u(
+                        fp_type(0.75),
+                        [&](auto begin, auto size, const auto &r_ptrs) {
+                            for (std::size_t j = 0; j < 4u; ++j) {
+                                std::copy(r_ptrs[j], r_ptrs[j] + size, res[j].data() + begin);
+                            }
+                            for (auto i = begin; i < begin + size; ++i) {
+                                ++visits[i];
+                            }
+                        },
+                        G = fp_type(2), eps = fp_type(0.001));
+                    REQUIRE(std::all_of(visits.begin(), visits.end(), [](const auto &v) { return v == 1u; }));
+                    for (std::size_t j = 0; j < 4u; ++j) {
+                        REQUIRE(max_norm_diff(res[j], ref[j]) <= tol);
+                    }
+                    // Accelerations only: fused kick of the velocities.
+                    std::array<std::vector<fp_type>, 3> vel;
+                    for (auto &v : vel) {
+                        v.assign(s, fp_type(1));
+                    }
+                    t.accs_cb_u(
+                        fp_type(0.75),
+                        [&vel](auto begin, auto size, const auto &r_ptrs) {
+                            for (std::size_t j = 0; j < 3u; ++j) {
+                                for (auto i = begin; i < begin + size; ++i) {
+                                    vel[j][i] += r_ptrs[j][i - begin] * fp_type(0.5);
+                                }
+                            }
+                        },
+                        G = fp_type(2), eps = fp_type(0.001));
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        std::vector<fp_type> exp_vel(s);
+                        std::transform(ref[j].begin(), ref[j].end(), exp_vel.begin(),
+                                       [](fp_type a) { return fp_type(1) + a * fp_type(0.5); });
+                        REQUIRE(max_norm_diff(vel[j], exp_vel) <= tol);
+                    }
+                    // Potentials only.
+                    std::vector<fp_type> pots(s);
+                    t.pots_cb_u(
+                        fp_type(0.75),
+                        [&pots](auto begin, auto size, const auto &r_ptrs) {
+                            std::copy(r_ptrs[0], r_ptrs[0] + size, pots.data() + begin);
+                        },
+                        G = fp_type(2), eps = fp_type(0.001));
+                    REQUIRE(max_norm_diff(pots, ref[3]) <= tol);
+                }
+            }
+        });
+    });
+}
+
+TEST_CASE("callback errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    auto cb = [](auto, auto, const auto &) {};
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, cb, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, cb, active = std::vector<unsigned>{1, 2}), std::invalid_argument);
+    const std::vector<double> sp{0.5, 0.5};
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, cb, split = sp), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_cb_u(-1., cb), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, cb, eps = -1.), std::domain_error);
+}
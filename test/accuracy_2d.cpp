@@ -0,0 +1,103 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Accuracy of the accelerations/potentials computed with a quadtree, for all
+// the combinations of requested quantities (accs only, pots only, accs + pots).
+TEST_CASE("2D acceleration/potential accuracy")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [mac_type](auto x) {
+            using fp_type = decltype(x);
+            constexpr auto theta = static_cast<fp_type>(.001), bsize = static_cast<fp_type>(1);
+            auto sizes = {10u, 100u, 1000u};
+            auto max_leaf_ns = {1u, 2u, 8u, 16u};
+            auto ncrits = {1u, 16u, 128u, 256u};
+            std::array<std::vector<fp_type>, 3> accpots;
+            std::array<std::vector<fp_type>, 2> accs;
+            std::vector<fp_type> pots;
+            fp_type tot_max_x_diff(0), tot_max_y_diff(0), tot_max_pot_diff(0);
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<2>(s, bsize, rng);
+                for (auto max_leaf_n : max_leaf_ns) {
+                    for (auto ncrit : ncrits) {
+                        quadtree<fp_type, decltype(mac_type)::value> t{kwargs::x_coords = parts.begin() + s,
+                                                                       kwargs::y_coords = parts.begin() + 2u * s,
+                                                                       kwargs::masses = parts.begin(),
+                                                                       kwargs::nparts = s,
+                                                                       kwargs::box_size = bsize,
+                                                                       kwargs::max_leaf_n = max_leaf_n,
+                                                                       kwargs::ncrit = ncrit};
+                        t.accs_pots_o(accpots, theta);
+                        t.accs_u(accs, theta);
+                        t.pots_u(pots, theta);
+                        // Check that all accelerations/potentials are finite.
+                        for (const auto &v : accpots) {
+                            REQUIRE(std::all_of(v.begin(), v.end(), [](auto c) { return std::isfinite(c); }));
+                        }
+                        for (const auto &v : accs) {
+                            REQUIRE(std::all_of(v.begin(), v.end(), [](auto c) { return std::isfinite(c); }));
+                        }
+                        REQUIRE(std::all_of(pots.begin(), pots.end(), [](auto c) { return std::isfinite(c); }));
+                        for (auto i = 0u; i < s; ++i) {
+                            const auto eacc_o = t.exact_acc_pot_o(i), eacc_u = t.exact_acc_pot_u(i);
+                            tot_max_x_diff
+                                = std::max({tot_max_x_diff, std::abs((eacc_o[0] - accpots[0][i]) / eacc_o[0]),
+                                            std::abs((eacc_u[0] - accs[0][i]) / eacc_u[0])});
+                            tot_max_y_diff
+                                = std::max({tot_max_y_diff, std::abs((eacc_o[1] - accpots[1][i]) / eacc_o[1]),
+                                            std::abs((eacc_u[1] - accs[1][i]) / eacc_u[1])});
+                            tot_max_pot_diff
+                                = std::max({tot_max_pot_diff, std::abs((eacc_o[2] - accpots[2][i]) / eacc_o[2]),
+                                            std::abs((eacc_u[2] - pots[i]) / eacc_u[2])});
+                        }
+                    }
+                }
+            }
+            std::cout << "Results for mac=" << static_cast<int>(mac_type()) << ".\n=========\n";
+            std::cout << "tot_max_x_diff=" << tot_max_x_diff << '\n';
+            std::cout << "tot_max_y_diff=" << tot_max_y_diff << '\n';
+            std::cout << "tot_max_pot_diff=" << tot_max_pot_diff << "\n=========\n\n";
+            if constexpr (std::is_same_v<fp_type, double> && std::numeric_limits<fp_type>::is_iec559) {
+                // These numbers are, of course, totally arbitrary, based
+                // on the fact that 'double' is actually double-precision,
+                // and derived experimentally. The bounds are looser than in 3D
+                // because in a plane the component-wise relative errors are
+                // amplified by the cancellations in the exact accelerations.
+                REQUIRE(tot_max_x_diff < fp_type(1E-6));
+                REQUIRE(tot_max_y_diff < fp_type(1E-6));
+                REQUIRE(tot_max_pot_diff < fp_type(1E-9));
+            }
+        });
+    });
+}
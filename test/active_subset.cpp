@@ -0,0 +1,183 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <list>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Random subset of the indices in [0, s), in random order and with some duplicates.
+static std::vector<unsigned> random_subset(unsigned s, double frac)
+{
+    std::vector<unsigned> retval;
+    std::uniform_real_distribution<double> rdist;
+    for (unsigned i = 0; i < s; ++i) {
+        if (rdist(rng) < frac) {
+            retval.push_back(i);
+            if (rdist(rng) < 0.1) {
+                retval.push_back(i);
+            }
+        }
+    }
+    std::shuffle(retval.begin(), retval.end(), rng);
+    return retval;
+}
+
+// Check that the values of the active particles in res are close to the ones in ref (normalised
+// wrt the max abs value in ref), and that the values of the inactive particles are equal to fill.
+template <typename F>
+static void check_active(const std::vector<F> &res, const std::vector<F> &ref, const std::vector<unsigned> &act,
+                         F fill, F tol)
+{
+    REQUIRE(res.size() == ref.size());
+    F rmax(0);
+    for (const auto &x : ref) {
+        rmax = std::max(rmax, std::abs(x));
+    }
+    std::vector<char> flags(ref.size(), 0);
+    for (auto idx : act) {
+        flags[idx] = 1;
+        REQUIRE(std::abs(res[idx] - ref[idx]) <= (rmax == F(0) ? tol : tol * rmax));
+    }
+    for (decltype(res.size()) i = 0; i < res.size(); ++i) {
+        if (!flags[i]) {
+            REQUIRE(res[i] == fill);
+        }
+    }
+}
+
+TEST_CASE("active subset accelerations/potentials")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            // NOTE: with a very small opening angle, the results are dominated by the
+            // direct interactions, and we can compare them tightly with the full computation.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+            constexpr auto theta = fp_type(0.001), fill = fp_type(-42);
+            auto sizes = {0u, 1u, 10u, 2000u};
+            auto ncrits = {1u, 16u, 128u};
+            auto fracs = {0., 0.05, 0.5, 1.};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+                for (auto nc : ncrits) {
+                    octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                 y_coords = parts.begin() + 2u * s,
+                                                                 z_coords = parts.begin() + 3u * s,
+                                                                 masses = parts.begin(),
+                                                                 nparts = s,
+                                                                 kwargs::ncrit = nc};
+                    std::array<std::vector<fp_type>, 4> ref_u, ref_o;
+                    t.accs_pots_u(ref_u, theta, G = fp_type(2), eps = fp_type(0.001));
+                    t.accs_pots_o(ref_o, theta, G = fp_type(2), eps = fp_type(0.001));
+                    for (auto frac : fracs) {
+                        const auto act = random_subset(s, frac);
+                        std::array<std::vector<fp_type>, 4> res;
+                        for (auto &v : res) {
+                            v.assign(s, fill);
+                        }
+                        t.accs_pots_u(res, theta, G = fp_type(2), eps = fp_type(0.001), active = act);
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            check_active(res[j], ref_u[j], act, fill, tol);
+                        }
+                        for (auto &v : res) {
+                            v.assign(s, fill);
+                        }
+                        t.accs_pots_o(res, theta, G = fp_type(2), eps = fp_type(0.001), active = act);
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            check_active(res[j], ref_o[j], act, fill, tol);
+                        }
+                        // Potentials only, with a list as the range of indices.
+                        std::vector<fp_type> pots(s, fill);
+                        t.pots_o(pots, theta, G = fp_type(2), eps = fp_type(0.001),
+                                 active = std::list<unsigned>(act.begin(), act.end()));
+                        check_active(pots, ref_o[3], act, fill, tol);
+                        // Raw pointer outputs.
+                        std::vector<fp_type> xa(s, fill), ya(s, fill), za(s, fill);
+                        t.accs_o({xa.data(), ya.data(), za.data()}, theta, G = fp_type(2), eps = fp_type(0.001),
+                                 active = act);
+                        check_active(xa, ref_o[0], act, fill, tol);
+                        check_active(ya, ref_o[1], act, fill, tol);
+                        check_active(za, ref_o[2], act, fill, tol);
+                        if (frac == 1.) {
+                            // With all the particles active, the result must be identical
+                            // to the full computation, for any opening angle.
+                            std::array<std::vector<fp_type>, 4> full, all;
+                            t.accs_pots_u(full, fp_type(0.75), eps = fp_type(0.001));
+                            t.accs_pots_u(all, fp_type(0.75), eps = fp_type(0.001), active = act);
+                            REQUIRE(full == all);
+                        }
+                    }
+                }
+            }
+        });
+    });
+}
+
+TEST_CASE("active subset 2d")
+{
+    const auto s = 1000u;
+    auto parts = get_uniform_particles<2>(s, 1., rng);
+    quadtree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, masses = parts.begin(),
+                       nparts = s};
+    std::array<std::vector<double>, 3> ref, res;
+    t.accs_pots_o(ref, 0.001, eps = 0.001);
+    const auto act = random_subset(s, 0.2);
+    for (auto &v : res) {
+        v.assign(s, -42.);
+    }
+    t.accs_pots_o(res, 0.001, eps = 0.001, active = act);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        check_active(res[j], ref[j], act, -42., 1E-12);
+    }
+}
+
+TEST_CASE("active subset errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, active = std::vector<unsigned>{1, 100}), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_o(accs, 0.75, active = std::vector<unsigned>{1, 2}, mutual = true),
+                      std::invalid_argument);
+    const std::vector<double> sp{0.5, 0.5};
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, split = sp, active = std::vector<unsigned>{1, 2}), std::invalid_argument);
+    // An empty subset is allowed, and it does not touch the output.
+    for (auto &v : accs) {
+        v.assign(s, 1.);
+    }
+    t.accs_u(accs, 0.75, active = std::vector<unsigned>{});
+    for (const auto &v : accs) {
+        REQUIRE(std::all_of(v.begin(), v.end(), [](double x) { return x == 1.; }));
+    }
+}
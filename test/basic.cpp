@@ -31,7 +31,8 @@ using namespace rakau::kwargs;
 using namespace rakau_test;
 
 using fp_types = std::tuple<float, double>;
-using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>,
+                        std::integral_constant<mac, mac::bh_box>>;
 
 static std::mt19937 rng;
 
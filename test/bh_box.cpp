@@ -0,0 +1,163 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// A few compact clumps of particles in a box of size 1.
+template <typename F>
+static std::vector<F> get_clumps(unsigned s)
+{
+    std::vector<F> retval(4u * s);
+    std::uniform_real_distribution<F> cdist(F(-0.4), F(0.4)), pdist(F(-0.01), F(0.01)), mdist(F(0), F(1));
+    std::array<F, 3> centre{};
+    for (unsigned i = 0; i < s; ++i) {
+        if (i % 100u == 0u) {
+            for (auto &c : centre) {
+                c = cdist(rng);
+            }
+        }
+        retval[i] = mdist(rng);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            retval[(j + 1u) * s + i] = centre[j] + pdist(rng);
+        }
+    }
+    return retval;
+}
+
+// Max and median relative errors of the accelerations in accs wrt the exact accelerations of the tree t.
+template <typename Tree, typename F>
+static std::array<F, 2> rel_errs(const Tree &t, const std::array<std::vector<F>, 3> &accs)
+{
+    std::vector<F> errs;
+    for (decltype(accs[0].size()) i = 0; i < accs[0].size(); ++i) {
+        const auto eacc = t.exact_acc_o(i);
+        F d2(0), r2(0);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            d2 += (accs[j][i] - eacc[j]) * (accs[j][i] - eacc[j]);
+            r2 += eacc[j] * eacc[j];
+        }
+        errs.push_back(std::sqrt(d2 / r2));
+    }
+    return {*std::max_element(errs.begin(), errs.end()), median(errs)};
+}
+
+TEST_CASE("bh_box nodes")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto s = 1000u;
+        auto parts = get_clumps<fp_type>(s);
+        octree<fp_type, mac::bh_box> t{x_coords = parts.begin() + s,
+                                       y_coords = parts.begin() + 2u * s,
+                                       z_coords = parts.begin() + 3u * s,
+                                       masses = parts.begin(),
+                                       nparts = s,
+                                       box_size = fp_type(1)};
+        const auto p_its = t.p_its_u();
+        for (const auto &n : t.nodes()) {
+            // The bounding box is tight and never larger than the node.
+            fp_type dim2(0);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                const auto mm = std::minmax_element(p_its[j] + n.begin, p_its[j] + n.end);
+                REQUIRE(n.lo[j] == *mm.first);
+                REQUIRE(n.hi[j] == *mm.second);
+                dim2 = std::max(dim2, (n.hi[j] - n.lo[j]) * (n.hi[j] - n.lo[j]));
+            }
+            REQUIRE(n.dim2 == dim2);
+            const auto node_dim = fp_type(1) / static_cast<fp_type>(1u << n.level);
+            REQUIRE(n.dim2 <= node_dim * node_dim);
+            // The COM is inside the bounding box.
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(n.props[j] >= n.lo[j] - std::numeric_limits<fp_type>::epsilon());
+                REQUIRE(n.props[j] <= n.hi[j] + std::numeric_limits<fp_type>::epsilon());
+            }
+        }
+        // The bounding boxes are recomputed in the updates of the masses and of the particles.
+        t.update_masses_u([](const auto &m_it) {
+            for (auto i = 0u; i < s; ++i) {
+                m_it[i] = fp_type(1);
+            }
+        });
+        t.update_particles_u([](const auto &its) {
+            for (auto i = 0u; i < s; ++i) {
+                its[0][i] = its[0][i] / 2;
+            }
+        });
+        const auto p_its2 = t.p_its_u();
+        for (const auto &n : t.nodes()) {
+            const auto mm = std::minmax_element(p_its2[0] + n.begin, p_its2[0] + n.end);
+            REQUIRE(n.lo[0] == *mm.first);
+            REQUIRE(n.hi[0] == *mm.second);
+        }
+    });
+}
+
+TEST_CASE("bh_box accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto s = 2000u;
+        auto parts = get_clumps<fp_type>(s);
+        for (auto nc : {1u, 16u, 128u}) {
+            octree<fp_type, mac::bh_box> t{x_coords = parts.begin() + s,
+                                           y_coords = parts.begin() + 2u * s,
+                                           z_coords = parts.begin() + 3u * s,
+                                           masses = parts.begin(),
+                                           nparts = s,
+                                           box_size = fp_type(1),
+                                           kwargs::ncrit = nc};
+            std::array<std::vector<fp_type>, 3> accs;
+            // With a small opening angle, the results are close to the exact ones.
+            t.accs_o(accs, fp_type(0.001));
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-9) : fp_type(1E-3);
+            REQUIRE(rel_errs(t, accs)[0] < tol);
+            // The median error decreases together with the opening angle. The thresholds are derived
+            // experimentally.
+            fp_type prev_err(1);
+            for (auto [theta, max_err] : {std::array{fp_type(0.75), fp_type(2E-2)},
+                                          std::array{fp_type(0.5), fp_type(5E-3)},
+                                          std::array{fp_type(0.25), fp_type(5E-4)}}) {
+                t.accs_o(accs, theta);
+                const auto err = rel_errs(t, accs)[1];
+                REQUIRE(err < max_err);
+                REQUIRE(err <= prev_err);
+                prev_err = err;
+            }
+            // Potentials.
+            std::array<std::vector<fp_type>, 4> res;
+            t.accs_pots_o(res, fp_type(0.001));
+            for (auto i = 0u; i < s; ++i) {
+                const auto epot = t.exact_acc_pot_o(i)[3];
+                REQUIRE(std::abs(res[3][i] - epot) <= tol * std::abs(epot));
+            }
+        }
+    });
+}
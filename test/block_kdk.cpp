@@ -0,0 +1,179 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/integrator.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+static std::mt19937 rng(0);
+
+// Uniform distribution with a dense clump, normalised to unit total mass. The
+// first s values are the masses, followed by the coordinates.
+static std::vector<double> clumpy_particles(unsigned s)
+{
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    for (unsigned i = 0; i < s; ++i) {
+        parts[i] /= s / 2.;
+        if (i % 5u == 0u) {
+            for (unsigned j = 1; j < 4u; ++j) {
+                parts[j * s + i] = 0.1 + parts[j * s + i] / 20.;
+            }
+        }
+    }
+    return parts;
+}
+
+// Total energy of the system.
+// NOTE: the potentials computed by the tree already include the mass of the target particle.
+template <typename Int>
+static double tot_energy(const Int &integ)
+{
+    const auto &t = integ.get_tree();
+    std::vector<double> pots;
+    t.pots_u(pots, 0.001, eps = 0.01);
+    const auto m_it = t.p_its_u()[3];
+    double retval = 0;
+    for (decltype(pots.size()) i = 0; i < pots.size(); ++i) {
+        double v2 = 0;
+        for (std::size_t j = 0; j < 3u; ++j) {
+            v2 += integ.vels()[j][i] * integ.vels()[j][i];
+        }
+        retval += m_it[i] * v2 / 2. + pots[i] / 2.;
+    }
+    return retval;
+}
+
+TEST_CASE("block kdk fixed step")
+{
+    // With a single rung, the integrator must reproduce a hand-rolled leapfrog.
+    const auto s = 500u;
+    const double dt = 1E-3;
+    auto parts = clumpy_particles(s);
+    std::vector<double> vx(s), vy(s), vz(s);
+    std::uniform_real_distribution<double> vdist(-.1, .1);
+    for (unsigned i = 0; i < s; ++i) {
+        vx[i] = vdist(rng);
+        vy[i] = vdist(rng);
+        vz[i] = vdist(rng);
+    }
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s};
+    auto t_ref = t;
+    block_kdk<3, double, std::size_t, mac::bh> integ(t, std::array{vx.begin(), vy.begin(), vz.begin()}, dt, 0.75,
+                                                     eps = 0.01);
+    REQUIRE(integ.max_rung() == 0u);
+    std::array<std::vector<double>, 3> accs;
+    t_ref.accs_o(accs, 0.75, eps = 0.01);
+    std::array<std::vector<double> *, 3> vels{&vx, &vy, &vz};
+    for (auto n = 0; n < 5; ++n) {
+        integ.step();
+        for (std::size_t j = 0; j < 3u; ++j) {
+            for (unsigned i = 0; i < s; ++i) {
+                (*vels[j])[i] = std::fma(accs[j][i], dt / 2., (*vels[j])[i]);
+            }
+        }
+        t_ref.update_particles_o([&](const auto &p_its) {
+            for (std::size_t j = 0; j < 3u; ++j) {
+                for (unsigned i = 0; i < s; ++i) {
+                    p_its[j][i] = std::fma((*vels[j])[i], dt, p_its[j][i]);
+                }
+            }
+        });
+        t_ref.accs_o(accs, 0.75, eps = 0.01);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            for (unsigned i = 0; i < s; ++i) {
+                (*vels[j])[i] = std::fma(accs[j][i], dt / 2., (*vels[j])[i]);
+            }
+        }
+    }
+    REQUIRE(integ.n_evals() == 5u * s);
+    REQUIRE(integ.time() == 5 * dt);
+    const auto p_o = integ.get_tree().p_its_o(), p_ref = t_ref.p_its_o();
+    const auto &perm = integ.get_tree().perm();
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (unsigned i = 0; i < s; ++i) {
+            REQUIRE(std::abs(p_o[j][i] - p_ref[j][i]) <= 1E-12);
+            REQUIRE(std::abs(integ.vels()[j][i] - (*vels[j])[perm[i]]) <= 1E-10);
+        }
+    }
+}
+
+TEST_CASE("block kdk multiple rungs")
+{
+    const auto s = 1000u;
+    const double dt = 2E-3;
+    const unsigned mr = 4;
+    auto parts = clumpy_particles(s);
+    std::vector<double> vel(3u * s);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s};
+    block_kdk<3, double, std::size_t, mac::bh> integ(
+        t, std::array{vel.begin(), vel.begin() + s, vel.begin() + 2u * s}, dt, 0.5, eps = 0.01, max_rung = mr);
+    // Reference run with a single rung and the finest timestep.
+    block_kdk<3, double, std::size_t, mac::bh> integ_ref(
+        t, std::array{vel.begin(), vel.begin() + s, vel.begin() + 2u * s}, dt / (1u << mr), 0.5, eps = 0.01);
+    const auto E0 = tot_energy(integ);
+    // Check that the particles are spread across multiple rungs.
+    const auto &r = integ.rungs();
+    REQUIRE(*std::max_element(r.begin(), r.end()) <= mr);
+    REQUIRE(std::any_of(r.begin(), r.end(), [](unsigned x) { return x == 0u; }));
+    REQUIRE(!std::all_of(r.begin(), r.end(), [](unsigned x) { return x == 0u; }));
+    for (auto n = 0; n < 4; ++n) {
+        integ.step();
+        for (unsigned k = 0; k < (1u << mr); ++k) {
+            integ_ref.step();
+        }
+    }
+    REQUIRE(std::abs(integ.time() - 4 * dt) < 1E-15);
+    // The block timesteps save force evaluations wrt the finest rung.
+    REQUIRE(integ.n_evals() < integ_ref.n_evals());
+    REQUIRE(integ_ref.n_evals() == 4u * (1u << mr) * s);
+    // Energy conservation.
+    REQUIRE(std::abs((tot_energy(integ) - E0) / E0) < 1E-3);
+    // Compare the positions with the reference run.
+    const auto p_o = integ.get_tree().p_its_o(), p_ref = integ_ref.get_tree().p_its_o();
+    double max_diff = 0;
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (unsigned i = 0; i < s; ++i) {
+            max_diff = std::max(max_diff, std::abs(p_o[j][i] - p_ref[j][i]));
+        }
+    }
+    REQUIRE(max_diff < 1E-3);
+}
+
+TEST_CASE("block kdk errors")
+{
+    const auto s = 10u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    std::vector<double> vel(3u * s);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s};
+    const auto vits = std::array{vel.begin(), vel.begin() + s, vel.begin() + 2u * s};
+    using int_t = block_kdk<3, double, std::size_t, mac::bh>;
+    REQUIRE_THROWS_AS(int_t(t, vits, 0., 0.75), std::domain_error);
+    REQUIRE_THROWS_AS(int_t(t, vits, -1., 0.75), std::domain_error);
+    REQUIRE_THROWS_AS(int_t(t, vits, 1., 0.75, eta = 0.), std::domain_error);
+    REQUIRE_THROWS_AS(int_t(t, vits, 1., 0.75, max_rung = 64, eps = 0.1), std::invalid_argument);
+    REQUIRE_THROWS_AS(int_t(t, vits, 1., 0.75, max_rung = 2), std::invalid_argument);
+    int_t(t, vits, 1., 0.75, max_rung = 2, eps = 0.1);
+}
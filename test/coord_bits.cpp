@@ -0,0 +1,138 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+TEST_CASE("compressed coordinates accelerations/potentials")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            constexpr auto bsize = static_cast<fp_type>(1);
+            auto sizes = {0u, 1u, 10u, 2000u};
+            auto max_leaf_ns = {1u, 16u};
+            auto ncrits = {1u, 128u};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, bsize, rng);
+                for (auto max_leaf_n : max_leaf_ns) {
+                    for (auto ncrit : ncrits) {
+                        octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                     y_coords = parts.begin() + 2u * s,
+                                                                     z_coords = parts.begin() + 3u * s,
+                                                                     masses = parts.begin(),
+                                                                     nparts = s,
+                                                                     box_size = bsize,
+                                                                     kwargs::max_leaf_n = max_leaf_n,
+                                                                     kwargs::ncrit = ncrit};
+                        REQUIRE(t.coord_bits() == 0u);
+                        std::array<std::vector<fp_type>, 4> accpots;
+                        t.accs_pots_o(accpots, fp_type(0.75), eps = fp_type(0.01));
+                        for (auto cb : {16u, 32u}) {
+                            // NOTE: the tolerance is dominated by the resolution of the offsets for 16 bits,
+                            // and by the precision of fp_type for 32 bits.
+                            const auto tol = cb == 16u ? fp_type(1E-3)
+                                                       : (std::is_same_v<fp_type, double> ? fp_type(1E-7)
+                                                                                          : fp_type(1E-4));
+                            octree<fp_type, decltype(mac_type)::value> tc{x_coords = parts.begin() + s,
+                                                                          y_coords = parts.begin() + 2u * s,
+                                                                          z_coords = parts.begin() + 3u * s,
+                                                                          masses = parts.begin(),
+                                                                          nparts = s,
+                                                                          box_size = bsize,
+                                                                          kwargs::max_leaf_n = max_leaf_n,
+                                                                          kwargs::ncrit = ncrit,
+                                                                          kwargs::coord_bits = cb};
+                            REQUIRE(tc.coord_bits() == cb);
+                            std::array<std::vector<fp_type>, 4> accpots_c;
+                            tc.accs_pots_o(accpots_c, fp_type(0.75), eps = fp_type(0.01));
+                            for (std::size_t j = 0; j < 4u; ++j) {
+                                REQUIRE(max_norm_diff(accpots_c[j], accpots[j]) <= tol);
+                            }
+                            // Copy/move semantics.
+                            auto tc2(tc);
+                            REQUIRE(tc2.coord_bits() == cb);
+                            std::array<std::vector<fp_type>, 4> accpots_c2;
+                            tc2.accs_pots_o(accpots_c2, fp_type(0.75), eps = fp_type(0.01));
+                            REQUIRE(accpots_c2 == accpots_c);
+                            auto tc3(std::move(tc2));
+                            REQUIRE(tc3.coord_bits() == cb);
+                            tc3.accs_pots_o(accpots_c2, fp_type(0.75), eps = fp_type(0.01));
+                            REQUIRE(accpots_c2 == accpots_c);
+                            // The store must be rebuilt after a particle update.
+                            auto swap_xy = [s](const auto &its) {
+                                for (auto i = 0u; i < s; ++i) {
+                                    std::swap(its[0][i], its[1][i]);
+                                }
+                            };
+                            auto t2(t);
+                            t2.update_particles_u(swap_xy);
+                            tc.update_particles_u(swap_xy);
+                            std::array<std::vector<fp_type>, 4> accpots_u, accpots_cu;
+                            t2.accs_pots_o(accpots_u, fp_type(0.75), eps = fp_type(0.01));
+                            tc.accs_pots_o(accpots_cu, fp_type(0.75), eps = fp_type(0.01));
+                            for (std::size_t j = 0; j < 4u; ++j) {
+                                REQUIRE(max_norm_diff(accpots_cu[j], accpots_u[j]) <= tol);
+                            }
+                        }
+                    }
+                }
+                if (s) {
+                    using tree_t = octree<fp_type, decltype(mac_type)::value>;
+                    REQUIRE_THROWS_AS((tree_t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                              z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                                              kwargs::coord_bits = 8u}),
+                                      std::invalid_argument);
+                    tree_t tc{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                              z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                              kwargs::coord_bits = 16u};
+                    std::array<std::vector<fp_type>, 3> accs;
+                    REQUIRE_THROWS_AS(tc.accs_u(accs, fp_type(0.75), mutual = true), std::invalid_argument);
+                    tc.clear();
+                    REQUIRE(tc.coord_bits() == 0u);
+                }
+            }
+        });
+    });
+}
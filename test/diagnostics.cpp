@@ -0,0 +1,147 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// Check that a and b are close, relative to the scale sc.
+template <typename F>
+static void check_close(F a, F b, F sc, F tol)
+{
+    REQUIRE(std::abs(a - b) <= (sc == F(0) ? tol : tol * sc));
+}
+
+TEST_CASE("diagnostics")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+        auto sizes = {0u, 1u, 10u, 3000u};
+        auto ncrits = {1u, 16u, 128u};
+        std::uniform_real_distribution<fp_type> vdist(fp_type(-1), fp_type(1));
+        for (auto s : sizes) {
+            auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+            std::vector<fp_type> vel(3u * s);
+            std::generate(vel.begin(), vel.end(), [&vdist]() { return vdist(rng); });
+            const auto v_o = std::array{vel.begin(), vel.begin() + s, vel.begin() + 2u * s};
+            for (auto nc : ncrits) {
+                octree<fp_type> t{x_coords = parts.begin() + s,
+                                  y_coords = parts.begin() + 2u * s,
+                                  z_coords = parts.begin() + 3u * s,
+                                  masses = parts.begin(),
+                                  nparts = s,
+                                  kwargs::ncrit = nc};
+                // The reference values, computed with separate passes in long double.
+                std::vector<fp_type> pots;
+                t.pots_o(pots, fp_type(0.75), G = fp_type(2), eps = fp_type(0.01));
+                long double K = 0, U = 0, P[3] = {0, 0, 0}, L[3] = {0, 0, 0}, sc_P = 0, sc_L = 0, sc_U = 0;
+                for (unsigned i = 0; i < s; ++i) {
+                    const long double m = parts[i], px = parts[s + i], py = parts[2u * s + i],
+                                      pz = parts[3u * s + i], vx = vel[i], vy = vel[s + i], vz = vel[2u * s + i];
+                    K += m * (vx * vx + vy * vy + vz * vz) / 2;
+                    U += pots[i] / 2.L;
+                    sc_U += std::abs(pots[i] / 2.L);
+                    P[0] += m * vx;
+                    P[1] += m * vy;
+                    P[2] += m * vz;
+                    sc_P += m * std::sqrt(vx * vx + vy * vy + vz * vz);
+                    L[0] += m * (py * vz - pz * vy);
+                    L[1] += m * (pz * vx - px * vz);
+                    L[2] += m * (px * vy - py * vx);
+                    sc_L += m * std::sqrt(px * px + py * py + pz * pz) * std::sqrt(vx * vx + vy * vy + vz * vz);
+                }
+                auto check = [&](const auto &d) {
+                    check_close(d.kinetic, static_cast<fp_type>(K), static_cast<fp_type>(K), tol);
+                    check_close(d.potential, static_cast<fp_type>(U), static_cast<fp_type>(sc_U), tol);
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        check_close(d.momentum[j], static_cast<fp_type>(P[j]), static_cast<fp_type>(sc_P), tol);
+                        check_close(d.ang_momentum[j], static_cast<fp_type>(L[j]), static_cast<fp_type>(sc_L), tol);
+                    }
+                };
+                const auto d_o = t.diagnostics_o(v_o, fp_type(0.75), G = fp_type(2), eps = fp_type(0.01));
+                check(d_o);
+                // Same with the velocities in the internal order.
+                const auto &perm = t.perm();
+                std::vector<fp_type> vel_u(3u * s);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    for (unsigned i = 0; i < s; ++i) {
+                        vel_u[j * s + i] = vel[j * s + perm[i]];
+                    }
+                }
+                const auto d_u = t.diagnostics_u(std::array{vel_u.data(), vel_u.data() + s, vel_u.data() + 2u * s},
+                                                 fp_type(0.75), G = fp_type(2), eps = fp_type(0.01));
+                check(d_u);
+                // The reduction is deterministic.
+                const auto d_o2 = t.diagnostics_o(v_o, fp_type(0.75), G = fp_type(2), eps = fp_type(0.01));
+                REQUIRE(d_o2.kinetic == d_o.kinetic);
+                REQUIRE(d_o2.potential == d_o.potential);
+                REQUIRE(d_o2.momentum == d_o.momentum);
+                REQUIRE(d_o2.ang_momentum == d_o.ang_momentum);
+            }
+        }
+    });
+}
+
+TEST_CASE("diagnostics 2d")
+{
+    const auto s = 1000u;
+    auto parts = get_uniform_particles<2>(s, 1., rng);
+    std::vector<double> vx(s, 1.), vy(s, -2.);
+    quadtree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, masses = parts.begin(),
+                       nparts = s};
+    std::vector<double> pots;
+    t.pots_u(pots, 0.75);
+    double M = 0, U = 0, L = 0;
+    for (unsigned i = 0; i < s; ++i) {
+        M += parts[i];
+        U += pots[i] / 2;
+        L += parts[i] * (parts[s + i] * -2. - parts[2u * s + i]);
+    }
+    const auto d = t.diagnostics_o(std::array{vx.begin(), vy.begin()}, 0.75);
+    REQUIRE(std::abs(d.kinetic - M * 5. / 2.) <= 1E-12 * M);
+    REQUIRE(std::abs(d.potential - U) <= 1E-12 * std::abs(U));
+    REQUIRE(std::abs(d.momentum[0] - M) <= 1E-12 * M);
+    REQUIRE(std::abs(d.momentum[1] + 2. * M) <= 1E-12 * M);
+    REQUIRE(std::abs(d.ang_momentum[0] - L) <= 1E-11 * M);
+}
+
+TEST_CASE("diagnostics errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    std::vector<double> vel(3u * s);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    const auto v = std::array{vel.begin(), vel.begin() + s, vel.begin() + 2u * s};
+    REQUIRE_THROWS_AS(t.diagnostics_o(v, 0.75, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.diagnostics_o(v, 0.75, active = std::vector<unsigned>{1, 2}), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.diagnostics_o(v, -1.), std::domain_error);
+    REQUIRE_THROWS_AS(t.diagnostics_o(v, 0.75, eps = -1.), std::domain_error);
+}
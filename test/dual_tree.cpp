@@ -0,0 +1,179 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+// Direct computation of the accelerations/potentials induced by the particles in src on the particles in tgt,
+// in the original order.
+template <typename F>
+static std::array<std::vector<F>, 4> direct_cross(const std::vector<F> &tgt, unsigned nt, const std::vector<F> &src,
+                                                  unsigned ns, F G, F eps)
+{
+    std::array<std::vector<F>, 4> retval;
+    for (auto &v : retval) {
+        v.assign(nt, F(0));
+    }
+    for (unsigned i = 0; i < nt; ++i) {
+        long double acc[4] = {0, 0, 0, 0};
+        for (unsigned k = 0; k < ns; ++k) {
+            long double diffs[3], dist2 = static_cast<long double>(eps) * eps;
+            for (unsigned j = 0; j < 3u; ++j) {
+                diffs[j] = static_cast<long double>(src[(j + 1u) * ns + k]) - tgt[(j + 1u) * nt + i];
+                dist2 += diffs[j] * diffs[j];
+            }
+            const auto dist = std::sqrt(dist2), m = static_cast<long double>(src[k]);
+            for (unsigned j = 0; j < 3u; ++j) {
+                acc[j] += G * m * diffs[j] / (dist2 * dist);
+            }
+            acc[3] -= G * m * tgt[i] / dist;
+        }
+        for (unsigned j = 0; j < 4u; ++j) {
+            retval[j][i] = static_cast<F>(acc[j]);
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("dual tree")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            using tree_t = octree<fp_type, decltype(mac_type)::value>;
+            // NOTE: with a very small opening angle, the results are dominated by the direct interactions.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+            constexpr auto theta = fp_type(0.001);
+            auto sizes = {0u, 1u, 10u, 1000u};
+            auto ncrits = {1u, 16u, 128u};
+            for (auto nt : sizes) {
+                for (auto ns : sizes) {
+                    auto tgt_parts = get_uniform_particles<3>(nt, fp_type(1), rng);
+                    auto src_parts = get_uniform_particles<3>(ns, fp_type(1), rng);
+                    const auto ref = direct_cross(tgt_parts, nt, src_parts, ns, fp_type(2), fp_type(0.01));
+                    for (auto nc : ncrits) {
+                        tree_t tgt{x_coords = tgt_parts.begin() + nt, y_coords = tgt_parts.begin() + 2u * nt,
+                                   z_coords = tgt_parts.begin() + 3u * nt, masses = tgt_parts.begin(),
+                                   nparts = nt, kwargs::ncrit = nc, box_size = fp_type(1)};
+                        tree_t src{x_coords = src_parts.begin() + ns, y_coords = src_parts.begin() + 2u * ns,
+                                   z_coords = src_parts.begin() + 3u * ns, masses = src_parts.begin(),
+                                   nparts = ns, box_size = fp_type(1)};
+                        std::array<std::vector<fp_type>, 4> res_o, res_u;
+                        tgt.accs_pots_from_o(res_o, src, theta, G = fp_type(2), eps = fp_type(0.01));
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            REQUIRE(max_norm_diff(res_o[j], ref[j]) <= tol);
+                        }
+                        // Internal order.
+                        tgt.accs_pots_from_u(res_u, src, theta, G = fp_type(2), eps = fp_type(0.01));
+                        const auto &perm = tgt.perm();
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            for (unsigned i = 0; i < nt; ++i) {
+                                REQUIRE(res_u[j][i] == res_o[j][perm[i]]);
+                            }
+                        }
+                        // Accelerations only, into raw pointers.
+                        std::vector<fp_type> ax(nt), ay(nt), az(nt);
+                        tgt.accs_from_o(std::array{ax.data(), ay.data(), az.data()}, src, theta, G = fp_type(2),
+                                        eps = fp_type(0.01));
+                        REQUIRE(ax == res_o[0]);
+                        REQUIRE(ay == res_o[1]);
+                        REQUIRE(az == res_o[2]);
+                        // Potentials only.
+                        std::vector<fp_type> pots;
+                        tgt.pots_from_o(pots, src, theta, G = fp_type(2), eps = fp_type(0.01));
+                        REQUIRE(max_norm_diff(pots, ref[3]) <= tol);
+                    }
+                }
+            }
+        });
+    });
+}
+
+TEST_CASE("dual tree species")
+{
+    // The field on a species in a tree containing all the particles is the sum of the fields
+    // due to each species, computed via the dual-tree mode.
+    const auto na = 500u, nb = 700u;
+    auto pa = get_uniform_particles<3>(na, 1., rng), pb = get_uniform_particles<3>(nb, 1., rng);
+    octree<double> ta{x_coords = pa.begin() + na, y_coords = pa.begin() + 2u * na, z_coords = pa.begin() + 3u * na,
+                      masses = pa.begin(), nparts = na, box_size = 1.};
+    octree<double> tb{x_coords = pb.begin() + nb, y_coords = pb.begin() + 2u * nb, z_coords = pb.begin() + 3u * nb,
+                      masses = pb.begin(), nparts = nb, box_size = 1.};
+    std::vector<double> all(4u * (na + nb));
+    for (unsigned j = 0; j < 4u; ++j) {
+        std::copy(pa.begin() + j * na, pa.begin() + (j + 1u) * na, all.begin() + j * (na + nb));
+        std::copy(pb.begin() + j * nb, pb.begin() + (j + 1u) * nb, all.begin() + j * (na + nb) + na);
+    }
+    const auto n = na + nb;
+    octree<double> t_all{x_coords = all.begin() + n, y_coords = all.begin() + 2u * n, z_coords = all.begin() + 3u * n,
+                         masses = all.begin(), nparts = n, box_size = 1.};
+    std::array<std::vector<double>, 3> acc_all, acc_aa, acc_ab;
+    t_all.accs_o(acc_all, 0.001, eps = 0.01);
+    ta.accs_o(acc_aa, 0.001, eps = 0.01);
+    ta.accs_from_o(acc_ab, tb, 0.001, eps = 0.01);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        std::vector<double> sum(na), ref(acc_all[j].begin(), acc_all[j].begin() + na);
+        for (unsigned i = 0; i < na; ++i) {
+            sum[i] = acc_aa[j][i] + acc_ab[j][i];
+        }
+        REQUIRE(max_norm_diff(sum, ref) <= 1E-12);
+    }
+}
+
+TEST_CASE("dual tree errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    octree<double> t2{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                      z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s, box_size = 2.};
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t2, 0.75), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75, mixed_precision = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75, active = std::vector<unsigned>{1}), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, -1.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75, eps = -1.), std::domain_error);
+}
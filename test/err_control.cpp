@@ -0,0 +1,186 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// A few compact clumps of particles on top of a uniform background, in a box of size 1.
+template <typename F>
+static std::vector<F> get_clumps(unsigned s)
+{
+    std::vector<F> retval(4u * s);
+    std::uniform_real_distribution<F> cdist(F(-0.4), F(0.4)), pdist(F(-0.01), F(0.01)), mdist(F(0), F(1));
+    std::array<F, 3> centre{};
+    for (unsigned i = 0; i < s; ++i) {
+        if (i % 200u == 0u) {
+            for (auto &c : centre) {
+                c = cdist(rng);
+            }
+        }
+        retval[i] = mdist(rng);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            retval[(j + 1u) * s + i] = i % 2u ? cdist(rng) : centre[j] + pdist(rng);
+        }
+    }
+    return retval;
+}
+
+// Median and 99th percentile of the relative errors of the accelerations in accs wrt the exact accelerations of
+// the tree t.
+template <typename Tree, typename F>
+static std::array<F, 2> rel_errs(const Tree &t, const std::array<std::vector<F>, 3> &accs)
+{
+    std::vector<F> errs;
+    for (decltype(accs[0].size()) i = 0; i < accs[0].size(); ++i) {
+        const auto eacc = t.exact_acc_o(i);
+        F d2(0), r2(0);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            d2 += (accs[j][i] - eacc[j]) * (accs[j][i] - eacc[j]);
+            r2 += eacc[j] * eacc[j];
+        }
+        errs.push_back(std::sqrt(d2 / r2));
+    }
+    std::sort(errs.begin(), errs.end());
+    return {errs[errs.size() / 2u], errs[errs.size() * 99u / 100u]};
+}
+
+TEST_CASE("err control accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto s = 2000u;
+        for (const auto &parts : {get_uniform_particles<3>(s, fp_type(1), rng), get_clumps<fp_type>(s)}) {
+            for (auto nc : {1u, 16u, 128u}) {
+                octree<fp_type> t{x_coords = parts.begin() + s,
+                                  y_coords = parts.begin() + 2u * s,
+                                  z_coords = parts.begin() + 3u * s,
+                                  masses = parts.begin(),
+                                  nparts = s,
+                                  box_size = fp_type(1),
+                                  kwargs::ncrit = nc};
+                std::array<std::vector<fp_type>, 3> accs;
+                // The errors stay within the target, and they decrease together with it. The 99th percentile
+                // is allowed to exceed the target by a small factor.
+                fp_type prev_err(1);
+                for (auto tol : {fp_type(1E-2), fp_type(1E-3)}) {
+                    t.accs_o(accs, fp_type(1), err_tol = tol);
+                    const auto [med_err, p99_err] = rel_errs(t, accs);
+                    REQUIRE(med_err < tol);
+                    REQUIRE(p99_err < 3 * tol);
+                    REQUIRE(p99_err <= prev_err);
+                    prev_err = p99_err;
+                }
+                // A loose target does not refine the largest opening angle.
+                std::array<std::vector<fp_type>, 3> accs2;
+                t.accs_o(accs, fp_type(0.75), err_tol = fp_type(1E3));
+                t.accs_o(accs2, fp_type(0.75));
+                REQUIRE(accs == accs2);
+            }
+        }
+    });
+}
+
+TEST_CASE("err control modes")
+{
+    const auto s = 2000u;
+    auto parts = get_clumps<double>(s);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                     z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s, kwargs::ncrit = 16u};
+    const auto tol = 1E-3;
+    std::array<std::vector<double>, 3> accs, accs2;
+    t.accs_o(accs, 1., err_tol = tol);
+    // Accs and pots together.
+    std::array<std::vector<double>, 4> accs_pots;
+    t.accs_pots_o(accs_pots, 1., err_tol = tol);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        REQUIRE(accs_pots[j] == accs[j]);
+    }
+    for (auto i = 0u; i < s; ++i) {
+        const auto epot = t.exact_pot_o(i);
+        REQUIRE(std::abs(accs_pots[3][i] - epot) <= 1E-2 * std::abs(epot));
+    }
+    // Unordered results.
+    t.accs_u(accs2, 1., err_tol = tol);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(accs2[j][t.inv_perm()[i]] == accs[j][i]);
+        }
+    }
+    // The grav constant and the softening.
+    t.accs_o(accs2, 1., err_tol = tol, G = 2.);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(std::abs(accs2[j][i] - 2 * accs[j][i]) <= 1E-12 * std::abs(accs[j][i]));
+        }
+    }
+    t.accs_o(accs2, 1., err_tol = tol, eps = 1E-3);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(std::isfinite(accs2[j][i]));
+        }
+    }
+    // The BH MAC with bounding boxes.
+    octree<double, mac::bh_box> t2{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                   z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                                   kwargs::ncrit = 16u};
+    t2.accs_o(accs2, 1., err_tol = tol);
+    const auto [med_err, p99_err] = rel_errs(t2, accs2);
+    REQUIRE(med_err < tol);
+    REQUIRE(p99_err < 3 * tol);
+}
+
+TEST_CASE("err control errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                     z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s, box_size = 1.};
+    std::array<std::vector<double>, 3> accs;
+    std::vector<double> pots;
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, err_tol = 0.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, err_tol = -1.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, err_tol = std::numeric_limits<double>::quiet_NaN()), std::domain_error);
+    // Unsupported modes.
+    REQUIRE_THROWS_AS(t.pots_u(pots, 0.75, err_tol = 1E-3), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, err_tol = 1E-3, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, err_tol = 1E-3, active = std::vector<unsigned>{1}),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, err_tol = 1E-3, r_split = 0.1), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, [](auto, auto, const auto &) {}, err_tol = 1E-3), std::invalid_argument);
+    std::vector<double> q(30u);
+    REQUIRE_THROWS_AS(t.accs_query(accs, std::array{q.begin(), q.begin() + 10, q.begin() + 20}, 10, 0.75,
+                                   err_tol = 1E-3),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75, err_tol = 1E-3), std::invalid_argument);
+    octree<double, mac::relative> t2{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                     z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                                     box_size = 1.};
+    REQUIRE_THROWS_AS(t2.accs_u(accs, 1E-3, err_tol = 1E-3), std::invalid_argument);
+}
@@ -0,0 +1,145 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <rakau/detail/cpu_fwd.hpp>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+// Number of critical nodes in the tree t. These are the nodes with
+// no critical ancestors which either have no children or contain at most
+// ncrit particles.
+template <typename Tree>
+static auto n_crit_nodes(const Tree &t)
+{
+    const auto &nodes = t.nodes();
+    typename Tree::size_type retval = 0;
+    for (decltype(nodes.size()) i = 0; i < nodes.size();) {
+        if (!nodes[i].n_children || nodes[i].end - nodes[i].begin <= t.ncrit()) {
+            ++retval;
+            i += nodes[i].n_children + 1u;
+        } else {
+            ++i;
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("isa dispatch defaults")
+{
+    REQUIRE(default_max_leaf_n == cpu_dispatch_default_max_leaf_n());
+    REQUIRE(default_ncrit == cpu_dispatch_default_ncrit());
+    REQUIRE(default_ncrit == (cpu_dispatch_isa() == cpu_isa::avx512 ? 256u : 128u));
+}
+
+// Check that the kernels for all the instruction sets supported by the host
+// produce results consistent with the kernels selected at runtime.
+TEST_CASE("isa dispatch consistency")
+{
+    const auto isas = {cpu_isa::sse2, cpu_isa::avx2, cpu_isa::avx512};
+    tuple_for_each(macs{}, [&isas](auto mac_type) {
+        tuple_for_each(fp_types{}, [&isas](auto x) {
+            using fp_type = decltype(x);
+            constexpr auto bsize = static_cast<fp_type>(1);
+            // NOTE: the kernels for different instruction sets might differ in the
+            // use of FMA and of the fast inverse sqrt.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-10) : fp_type(1E-5);
+            // The transformed MAC value and the square of the softening length,
+            // as passed to the kernels by the tree.
+            constexpr auto theta = fp_type(0.75), eps_ = fp_type(0.001);
+            const auto mac_value
+                = decltype(mac_type)::value == mac::bh ? fp_type(1) / (theta * theta) : fp_type(1) / theta;
+            auto sizes = {0u, 10u, 2000u};
+            auto ncrits = {1u, 16u, 128u};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, bsize, rng);
+                for (auto nc : ncrits) {
+                    octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                 y_coords = parts.begin() + 2u * s,
+                                                                 z_coords = parts.begin() + 3u * s,
+                                                                 masses = parts.begin(),
+                                                                 nparts = s,
+                                                                 box_size = bsize,
+                                                                 ncrit = nc};
+                    const auto ncn = n_crit_nodes(t);
+                    for (auto mutual_ : {false, true}) {
+                        std::array<std::vector<fp_type>, 4> ref;
+                        t.accs_pots_u(ref, theta, G = fp_type(2), eps = eps_, mutual = mutual_);
+                        for (auto isa : isas) {
+                            if (isa > cpu_dispatch_isa()) {
+                                continue;
+                            }
+                            std::array<std::vector<fp_type>, 4> res;
+                            for (auto &v : res) {
+                                v.resize(s);
+                            }
+                            const std::array<fp_type *, 4> res_ptrs{res[0].data(), res[1].data(), res[2].data(),
+                                                                    res[3].data()};
+                            const tree_active_t<fp_type> *no_active = nullptr;
+                            auto run = [&](auto isa_c) {
+                                cpu_acc_pot_impl<decltype(isa_c)::value, 2>(t, res_ptrs, mac_value, fp_type(2),
+                                                                            eps_ * eps_, 0, ncn, mutual_, false,
+                                                                            no_active);
+                            };
+                            if (isa == cpu_isa::sse2) {
+                                run(std::integral_constant<cpu_isa, cpu_isa::sse2>{});
+                            } else if (isa == cpu_isa::avx2) {
+                                run(std::integral_constant<cpu_isa, cpu_isa::avx2>{});
+                            } else {
+                                run(std::integral_constant<cpu_isa, cpu_isa::avx512>{});
+                            }
+                            for (std::size_t j = 0; j < 4u; ++j) {
+                                if (isa == cpu_dispatch_isa()) {
+                                    REQUIRE(res[j] == ref[j]);
+                                } else {
+                                    REQUIRE(max_norm_diff(res[j], ref[j]) <= tol);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        });
+    });
+}
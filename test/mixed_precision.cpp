@@ -0,0 +1,128 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+static double max_norm_diff(const std::vector<double> &a, const std::vector<double> &b)
+{
+    REQUIRE(a.size() == b.size());
+    double retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == 0. ? retval : retval / bmax;
+}
+
+TEST_CASE("mixed-precision accelerations/potentials")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        // NOTE: the leaf-leaf interactions are computed in single precision.
+        constexpr auto tol = 1E-5;
+        auto sizes = {0u, 1u, 10u, 3000u};
+        auto max_leaf_ns = {1u, 4u, 16u};
+        auto ncrits = {1u, 16u, 128u};
+        auto thetas = {0.01, 0.75};
+        for (auto s : sizes) {
+            // NOTE: use a box not centred on the origin, so that the use of
+            // relative coordinates in the leaf-leaf interactions matters.
+            auto parts = get_uniform_particles<3>(s, 1., rng);
+            std::transform(parts.begin() + s, parts.end(), parts.begin() + s, [](double x) { return x + 1000.; });
+            for (auto max_leaf_n : max_leaf_ns) {
+                for (auto ncrit : ncrits) {
+                    octree<double, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                y_coords = parts.begin() + 2u * s,
+                                                                z_coords = parts.begin() + 3u * s,
+                                                                masses = parts.begin(),
+                                                                nparts = s,
+                                                                kwargs::max_leaf_n = max_leaf_n,
+                                                                kwargs::ncrit = ncrit};
+                    for (auto theta : thetas) {
+                        std::array<std::vector<double>, 4> accpots, accpots_m;
+                        std::array<std::vector<double>, 3> accs, accs_m;
+                        std::vector<double> pots, pots_m;
+                        t.accs_pots_u(accpots, theta, G = 2., eps = 0.001);
+                        t.accs_pots_u(accpots_m, theta, G = 2., eps = 0.001, mixed_precision = true);
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            REQUIRE(max_norm_diff(accpots_m[j], accpots[j]) <= tol);
+                        }
+                        t.accs_o(accs, theta);
+                        t.accs_o(accs_m, theta, mixed_precision = true);
+                        for (std::size_t j = 0; j < 3u; ++j) {
+                            REQUIRE(max_norm_diff(accs_m[j], accs[j]) <= tol);
+                        }
+                        t.pots_o(pots, theta, eps = 0.01);
+                        t.pots_o(pots_m, theta, eps = 0.01, mixed_precision = true);
+                        REQUIRE(max_norm_diff(pots_m, pots) <= tol);
+                        // Raw pointer outputs.
+                        std::vector<double> xa(s), ya(s), za(s), pa(s);
+                        t.accs_pots_u({xa.data(), ya.data(), za.data(), pa.data()}, theta, G = 2., eps = 0.001,
+                                      mixed_precision = true);
+                        REQUIRE(xa == accpots_m[0]);
+                        REQUIRE(ya == accpots_m[1]);
+                        REQUIRE(za == accpots_m[2]);
+                        REQUIRE(pa == accpots_m[3]);
+                    }
+                }
+            }
+        }
+        // Quadtree.
+        const auto s = 2000u;
+        auto parts = get_uniform_particles<2>(s, 1., rng);
+        quadtree<double, decltype(mac_type)::value> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                                      masses = parts.begin(), nparts = s};
+        std::array<std::vector<double>, 3> accpots, accpots_m;
+        t.accs_pots_u(accpots, 0.75, eps = 0.001);
+        t.accs_pots_u(accpots_m, 0.75, eps = 0.001, mixed_precision = true);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            REQUIRE(max_norm_diff(accpots_m[j], accpots[j]) <= tol);
+        }
+    });
+}
+
+TEST_CASE("mixed-precision errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, mixed_precision = true, mutual = true), std::invalid_argument);
+    const std::vector<double> sp{0.5, 0.5};
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, split = sp, mixed_precision = true), std::invalid_argument);
+    // The mixed-precision mode is available only for double-precision trees.
+    std::vector<float> fparts(parts.begin(), parts.end());
+    octree<float> tf{x_coords = fparts.begin() + s, y_coords = fparts.begin() + 2u * s,
+                     z_coords = fparts.begin() + 3u * s, masses = fparts.begin(), nparts = s, box_size = 1.f};
+    std::array<std::vector<float>, 3> faccs;
+    REQUIRE_THROWS_AS(tf.accs_u(faccs, 0.75f, mixed_precision = true), std::invalid_argument);
+    tf.accs_u(faccs, 0.75f, mixed_precision = false);
+}
@@ -0,0 +1,116 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+TEST_CASE("mutual leaf-leaf accelerations/potentials")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            constexpr auto bsize = static_cast<fp_type>(1);
+            // NOTE: the mutual mode changes the order in which the leaf-leaf
+            // interactions are accumulated, so we cannot expect bit-for-bit
+            // identical results.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+            auto sizes = {0u, 1u, 10u, 2000u};
+            auto max_leaf_ns = {1u, 4u, 16u};
+            auto ncrits = {1u, 16u, 128u};
+            auto thetas = {fp_type(0.01), fp_type(0.75)};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, bsize, rng);
+                for (auto max_leaf_n : max_leaf_ns) {
+                    for (auto ncrit : ncrits) {
+                        octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                     y_coords = parts.begin() + 2u * s,
+                                                                     z_coords = parts.begin() + 3u * s,
+                                                                     masses = parts.begin(),
+                                                                     nparts = s,
+                                                                     box_size = bsize,
+                                                                     kwargs::max_leaf_n = max_leaf_n,
+                                                                     kwargs::ncrit = ncrit};
+                        for (auto theta : thetas) {
+                            std::array<std::vector<fp_type>, 4> accpots, accpots_m;
+                            std::array<std::vector<fp_type>, 3> accs, accs_m;
+                            std::vector<fp_type> pots, pots_m;
+                            t.accs_pots_u(accpots, theta, G = fp_type(2), eps = fp_type(0.001));
+                            t.accs_pots_u(accpots_m, theta, G = fp_type(2), eps = fp_type(0.001), mutual = true);
+                            for (std::size_t j = 0; j < 4u; ++j) {
+                                REQUIRE(max_norm_diff(accpots_m[j], accpots[j]) <= tol);
+                            }
+                            t.accs_o(accs, theta);
+                            t.accs_o(accs_m, theta, mutual = true);
+                            for (std::size_t j = 0; j < 3u; ++j) {
+                                REQUIRE(max_norm_diff(accs_m[j], accs[j]) <= tol);
+                            }
+                            t.pots_o(pots, theta, eps = fp_type(0.01));
+                            t.pots_o(pots_m, theta, eps = fp_type(0.01), mutual = true);
+                            REQUIRE(max_norm_diff(pots_m, pots) <= tol);
+                            // Raw pointer outputs.
+                            std::vector<fp_type> xa(s), ya(s), za(s), pa(s);
+                            t.accs_pots_u({xa.data(), ya.data(), za.data(), pa.data()}, theta, G = fp_type(2),
+                                          eps = fp_type(0.001), mutual = true);
+                            REQUIRE(xa == accpots_m[0]);
+                            REQUIRE(ya == accpots_m[1]);
+                            REQUIRE(za == accpots_m[2]);
+                            REQUIRE(pa == accpots_m[3]);
+                        }
+                    }
+                }
+                if (s) {
+                    octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                 y_coords = parts.begin() + 2u * s,
+                                                                 z_coords = parts.begin() + 3u * s,
+                                                                 masses = parts.begin(),
+                                                                 nparts = s,
+                                                                 box_size = bsize};
+                    std::array<std::vector<fp_type>, 3> accs;
+                    const std::vector<double> sp{0.5, 0.5};
+                    REQUIRE_THROWS_AS(t.accs_u(accs, fp_type(0.75), split = sp, mutual = true),
+                                      std::invalid_argument);
+                }
+            }
+        });
+    });
+}
@@ -0,0 +1,249 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/pm.hpp>
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+static const long double pi_ld = 3.141592653589793238462643383279502884L;
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+// Reference computation of the long-range accelerations/potentials in a periodic box of size L,
+// via the direct summation over the wave vectors.
+template <typename F>
+static std::array<std::vector<F>, 4> kspace_ref(const std::vector<F> &parts, unsigned s, long double L,
+                                                long double rs, int fmax)
+{
+    std::array<std::vector<F>, 4> retval;
+    for (auto &v : retval) {
+        v.assign(s, F(0));
+    }
+    const auto k_unit = 2 * pi_ld / L, norm = 4 * pi_ld / (L * L * L);
+    for (unsigned i = 0; i < s; ++i) {
+        long double acc[4] = {0, 0, 0, 0};
+        for (unsigned k = 0; k < s; ++k) {
+            const long double m = parts[k], dx = static_cast<long double>(parts[s + i]) - parts[s + k],
+                              dy = static_cast<long double>(parts[2u * s + i]) - parts[2u * s + k],
+                              dz = static_cast<long double>(parts[3u * s + i]) - parts[3u * s + k];
+            for (int fx = -fmax; fx <= fmax; ++fx) {
+                for (int fy = -fmax; fy <= fmax; ++fy) {
+                    for (int fz = -fmax; fz <= fmax; ++fz) {
+                        if (!fx && !fy && !fz) {
+                            continue;
+                        }
+                        const auto kx = k_unit * fx, ky = k_unit * fy, kz = k_unit * fz;
+                        const auto k2 = kx * kx + ky * ky + kz * kz;
+                        const auto g = norm * std::exp(-k2 * rs * rs) / k2, arg = kx * dx + ky * dy + kz * dz;
+                        const auto sn = std::sin(arg);
+                        acc[0] -= m * g * kx * sn;
+                        acc[1] -= m * g * ky * sn;
+                        acc[2] -= m * g * kz * sn;
+                        if (k != i) {
+                            acc[3] -= m * g * std::cos(arg);
+                        }
+                    }
+                }
+            }
+        }
+        for (unsigned j = 0; j < 3u; ++j) {
+            retval[j][i] = static_cast<F>(acc[j]);
+        }
+        retval[3][i] = static_cast<F>(acc[3] * parts[i]);
+    }
+    return retval;
+}
+
+TEST_CASE("fft")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-4);
+        std::uniform_real_distribution<fp_type> dist(fp_type(-1), fp_type(1));
+        for (std::size_t n : {2u, 4u, 8u, 64u}) {
+            // Complex transform vs naive DFT.
+            std::vector<std::complex<fp_type>> v(n), ref(n);
+            for (auto &c : v) {
+                c = std::complex<fp_type>(dist(rng), dist(rng));
+            }
+            for (std::size_t k = 0; k < n; ++k) {
+                std::complex<long double> acc = 0;
+                for (std::size_t j = 0; j < n; ++j) {
+                    acc += std::complex<long double>(v[j].real(), v[j].imag())
+                           * std::polar(1.L, -2 * pi_ld * static_cast<long double>(j * k) / n);
+                }
+                ref[k] = std::complex<fp_type>(static_cast<fp_type>(acc.real()), static_cast<fp_type>(acc.imag()));
+            }
+            const pm_fft<fp_type> fft(n);
+            auto w = v;
+            fft(w.data(), false);
+            for (std::size_t k = 0; k < n; ++k) {
+                REQUIRE(std::abs(w[k] - ref[k]) <= tol * static_cast<fp_type>(n));
+            }
+            fft(w.data(), true);
+            for (std::size_t k = 0; k < n; ++k) {
+                REQUIRE(std::abs(w[k] / static_cast<fp_type>(n) - v[k]) <= tol);
+            }
+            if (n < 4u) {
+                continue;
+            }
+            // Real transform.
+            std::vector<fp_type> r(n), r2(n);
+            std::generate(r.begin(), r.end(), [&dist]() { return dist(rng); });
+            std::vector<std::complex<fp_type>> spec(n / 2u + 1u), buf(n / 2u);
+            const pm_fft<fp_type> fft_h(n / 2u);
+            pm_rfft_fwd(fft, fft_h, r.data(), spec.data(), buf.data());
+            std::vector<std::complex<fp_type>> rc(n);
+            std::copy(r.begin(), r.end(), rc.begin());
+            fft(rc.data(), false);
+            for (std::size_t k = 0; k <= n / 2u; ++k) {
+                REQUIRE(std::abs(spec[k] - rc[k]) <= tol * static_cast<fp_type>(n));
+            }
+            pm_rfft_inv(fft, fft_h, spec.data(), r2.data(), buf.data());
+            for (std::size_t k = 0; k < n; ++k) {
+                REQUIRE(std::abs(r2[k] / static_cast<fp_type>(n) - r[k]) <= tol);
+            }
+        }
+    });
+}
+
+TEST_CASE("particle mesh long range")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto s = 6u;
+        auto parts = get_uniform_particles<3>(s, fp_type(0.8), rng);
+        const auto rs = fp_type(0.04);
+        const auto ref = kspace_ref(parts, s, 1.L, rs, 20);
+        for (auto as : {pm_assignment::cic, pm_assignment::tsc}) {
+            // NOTE: r_split is about 2.5 times the mesh spacing.
+            particle_mesh<fp_type> pm(64, fp_type(1), r_split = rs, assignment = as);
+            REQUIRE(pm.mesh_size() == 64u);
+            REQUIRE(pm.r_split() == rs);
+            REQUIRE(pm.assignment() == as);
+            octree<fp_type> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                              z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                              box_size = fp_type(1)};
+            std::array<std::vector<fp_type>, 4> res;
+            pm.accs_pots_o(res, t);
+            const auto tol = as == pm_assignment::cic ? fp_type(1E-2) : fp_type(5E-3);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(max_norm_diff(res[j], ref[j]) <= tol);
+            }
+            if (as == pm_assignment::tsc) {
+                REQUIRE(max_norm_diff(res[3], ref[3]) <= tol);
+            } else {
+                // NOTE: with the cloud-in-cell scheme, the mesh self-interaction of a particle depends
+                // noticeably on its position within the mesh cell, thus we check the potentials
+                // against the scale of the self-interaction.
+                fp_type sc(0);
+                for (unsigned i = 0; i < s; ++i) {
+                    sc = std::max(sc, parts[i] * parts[i] / (std::sqrt(static_cast<fp_type>(pi_ld)) * rs));
+                }
+                for (unsigned i = 0; i < s; ++i) {
+                    REQUIRE(std::abs(res[3][i] - ref[3][i]) <= tol * sc);
+                }
+            }
+            // G multiplies the results.
+            std::array<std::vector<fp_type>, 3> accs;
+            pm.accs_o(accs, t, G = fp_type(3));
+            for (std::size_t j = 0; j < 3u; ++j) {
+                for (unsigned i = 0; i < s; ++i) {
+                    REQUIRE(std::abs(accs[j][i] - 3 * res[j][i]) <= fp_type(1E-4) * std::abs(3 * res[j][i]));
+                }
+            }
+            // Internal order, potentials only, output as an iterator.
+            std::vector<fp_type> pots(s);
+            pm.pots_u(pots.begin(), t);
+            for (unsigned i = 0; i < s; ++i) {
+                REQUIRE(pots[i] == res[3][t.perm()[i]]);
+            }
+        }
+    });
+}
+
+TEST_CASE("treepm")
+{
+    // A compact cluster in the middle of a large periodic box: the sum of the short-range tree
+    // interaction and of the long-range mesh interaction is close to the Newtonian interaction.
+    const auto s = 2000u;
+    auto parts = get_uniform_particles<3>(s, 0.1, rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    std::array<std::vector<double>, 3> ref, sr, lr;
+    t.accs_u(ref, 0.5, eps = 0.001);
+    const auto rs = 1.25 / 128;
+    t.accs_u(sr, 0.5, eps = 0.001, r_split = rs);
+    for (auto &v : lr) {
+        v.resize(s);
+    }
+    for (auto as : {pm_assignment::cic, pm_assignment::tsc}) {
+        particle_mesh<double> pm(128, 1., r_split = rs, assignment = as);
+        pm.accs_u(std::array{lr[0].begin(), lr[1].begin(), lr[2].begin()}, t);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            std::vector<double> tot(s);
+            for (unsigned i = 0; i < s; ++i) {
+                tot[i] = sr[j][i] + lr[j][i];
+            }
+            REQUIRE(max_norm_diff(tot, ref[j]) <= 2E-2);
+        }
+        // Run again to check the reuse of the internal buffers.
+        std::array<std::vector<double>, 3> lr2;
+        pm.accs_u(lr2, t);
+        REQUIRE(lr2 == lr);
+    }
+}
+
+TEST_CASE("particle mesh errors")
+{
+    REQUIRE_THROWS_AS(particle_mesh<double>(2, 1.), std::invalid_argument);
+    REQUIRE_THROWS_AS(particle_mesh<double>(12, 1.), std::invalid_argument);
+    REQUIRE_THROWS_AS(particle_mesh<double>(16, 0.), std::domain_error);
+    REQUIRE_THROWS_AS(particle_mesh<double>(16, 1., r_split = -1.), std::domain_error);
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 2.};
+    particle_mesh<double> pm(16, 1.);
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(pm.accs_u(accs, t), std::invalid_argument);
+}
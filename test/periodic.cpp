@@ -0,0 +1,390 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/pm.hpp>
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+// Ewald corrections at the separation x, either computed exactly or interpolated from the table.
+static void get_corr(double (&corr)[4], const double (&x)[3], bool exact)
+{
+    if (exact) {
+        ewald_corr(corr, x);
+    } else {
+        get_ewald_table<double>().interp(corr, std::abs(x[0]), std::abs(x[1]), std::abs(x[2]));
+        for (std::size_t j = 0; j < 3u; ++j) {
+            corr[j] = std::copysign(corr[j], x[j]);
+        }
+    }
+}
+
+// Direct computation of the periodic accelerations/potentials in a box of size L, in the original order.
+// If exact is true, the Ewald corrections are computed exactly for each pair of particles, otherwise
+// they are interpolated from the table.
+template <typename F>
+static std::array<std::vector<F>, 4> direct_ewald(const std::vector<F> &parts, unsigned s, double L, double G,
+                                                  bool exact)
+{
+    std::array<std::vector<F>, 4> retval;
+    for (auto &v : retval) {
+        v.assign(s, F(0));
+    }
+    double corr[4];
+    for (unsigned i = 0; i < s; ++i) {
+        double acc[4] = {0, 0, 0, 0};
+        for (unsigned k = 0; k < s; ++k) {
+            const double m = parts[k];
+            if (k == i) {
+                // Interaction with the periodic images of the particle itself.
+                const double x[3] = {0, 0, 0};
+                get_corr(corr, x, exact);
+                acc[3] += m * corr[3] / L;
+                continue;
+            }
+            double diffs[3], x[3], dist2 = 0;
+            for (unsigned j = 0; j < 3u; ++j) {
+                diffs[j] = static_cast<double>(parts[(j + 1u) * s + k]) - parts[(j + 1u) * s + i];
+                diffs[j] -= L * std::round(diffs[j] / L);
+                x[j] = -diffs[j] / L;
+                dist2 += diffs[j] * diffs[j];
+            }
+            get_corr(corr, x, exact);
+            const auto dist = std::sqrt(dist2);
+            for (unsigned j = 0; j < 3u; ++j) {
+                acc[j] += m * (diffs[j] / (dist2 * dist) + corr[j] / (L * L));
+            }
+            acc[3] += m * (-1 / dist + corr[3] / L);
+        }
+        for (unsigned j = 0; j < 3u; ++j) {
+            retval[j][i] = static_cast<F>(G * acc[j]);
+        }
+        retval[3][i] = static_cast<F>(G * acc[3] * parts[i]);
+    }
+    return retval;
+}
+
+// Direct computation of the short-range accelerations/potentials with the nearest-image convention,
+// in the original order.
+template <typename F>
+static std::array<std::vector<F>, 4> direct_sr_periodic(const std::vector<F> &parts, unsigned s, double L, double rs)
+{
+    const auto two_sqrt_pi = 1.1283791670955125738961589031215452;
+    std::array<std::vector<F>, 4> retval;
+    for (auto &v : retval) {
+        v.assign(s, F(0));
+    }
+    for (unsigned i = 0; i < s; ++i) {
+        double acc[4] = {0, 0, 0, 0};
+        for (unsigned k = 0; k < s; ++k) {
+            if (k == i) {
+                continue;
+            }
+            double diffs[3], dist2 = 0;
+            for (unsigned j = 0; j < 3u; ++j) {
+                diffs[j] = static_cast<double>(parts[(j + 1u) * s + k]) - parts[(j + 1u) * s + i];
+                diffs[j] -= L * std::round(diffs[j] / L);
+                dist2 += diffs[j] * diffs[j];
+            }
+            const double dist = std::sqrt(dist2), m = parts[k], u = dist / (2 * rs), erfc_u = std::erfc(u);
+            for (unsigned j = 0; j < 3u; ++j) {
+                acc[j] += m * diffs[j] / (dist2 * dist) * (erfc_u + two_sqrt_pi * u * std::exp(-u * u));
+            }
+            acc[3] -= m * parts[i] / dist * erfc_u;
+        }
+        for (unsigned j = 0; j < 4u; ++j) {
+            retval[j][i] = static_cast<F>(acc[j]);
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("ewald corrections")
+{
+    double corr[4];
+    // The Madelung-like constant of a simple cubic lattice in a neutralising background.
+    const double x0[3] = {0, 0, 0};
+    ewald_corr(corr, x0);
+    REQUIRE(std::abs(corr[3] - 2.8372974794806) <= 1E-10);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        REQUIRE(std::abs(corr[j]) <= 1E-12);
+    }
+    // By symmetry, the periodic acceleration vanishes halfway between two images, thus
+    // the correction cancels the Newtonian acceleration.
+    const double x1[3] = {0.5, 0, 0};
+    ewald_corr(corr, x1);
+    REQUIRE(std::abs(corr[0] - 4.) <= 1E-10);
+    REQUIRE(std::abs(corr[1]) <= 1E-12);
+    REQUIRE(std::abs(corr[2]) <= 1E-12);
+    const double x2[3] = {0.5, 0.5, 0.5};
+    ewald_corr(corr, x2);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        REQUIRE(std::abs(corr[j] - 0.5 / std::pow(0.75, 1.5)) <= 1E-10);
+    }
+    // Symmetries.
+    const double x3[3] = {0.1, -0.2, 0.3}, x4[3] = {-0.1, -0.2, 0.3}, x5[3] = {-0.2, 0.3, 0.1};
+    double corr4[4], corr5[4];
+    ewald_corr(corr, x3);
+    ewald_corr(corr4, x4);
+    ewald_corr(corr5, x5);
+    REQUIRE(std::abs(corr[0] + corr4[0]) <= 1E-12);
+    REQUIRE(std::abs(corr[1] - corr4[1]) <= 1E-12);
+    REQUIRE(std::abs(corr[3] - corr4[3]) <= 1E-12);
+    REQUIRE(std::abs(corr[0] - corr5[2]) <= 1E-12);
+    REQUIRE(std::abs(corr[3] - corr5[3]) <= 1E-12);
+    // Interpolation of the table.
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto &t = get_ewald_table<fp_type>();
+        REQUIRE(std::abs(t.pot0 - fp_type(2.8372974794806)) <= fp_type(1E-6));
+        std::uniform_real_distribution<double> dist(0., 0.5);
+        double c[4], p[3];
+        fp_type ct[4];
+        for (int i = 0; i < 1000; ++i) {
+            std::generate(p, p + 3, [&dist]() { return dist(rng); });
+            ewald_corr(c, p);
+            t.interp(ct, static_cast<fp_type>(p[0]), static_cast<fp_type>(p[1]), static_cast<fp_type>(p[2]));
+            for (std::size_t j = 0; j < 4u; ++j) {
+                REQUIRE(std::abs(ct[j] - c[j]) <= 1E-3);
+            }
+        }
+    });
+}
+
+TEST_CASE("periodic")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            // NOTE: with a very small opening angle, the results are dominated by the direct interactions.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+            constexpr auto theta = fp_type(0.001);
+            auto sizes = {0u, 1u, 10u, 300u};
+            auto ncrits = {1u, 16u, 128u};
+            for (auto L : {fp_type(1), fp_type(10)}) {
+                for (auto s : sizes) {
+                    auto parts = get_uniform_particles<3>(s, L, rng);
+                    const auto ref = direct_ewald(parts, s, L, 2., false);
+                    for (auto nc : ncrits) {
+                        octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                     y_coords = parts.begin() + 2u * s,
+                                                                     z_coords = parts.begin() + 3u * s,
+                                                                     masses = parts.begin(),
+                                                                     nparts = s,
+                                                                     kwargs::ncrit = nc,
+                                                                     box_size = L,
+                                                                     periodic = true};
+                        REQUIRE(t.periodic());
+                        std::array<std::vector<fp_type>, 4> res;
+                        t.accs_pots_o(res, theta, G = fp_type(2));
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            REQUIRE(max_norm_diff(res[j], ref[j]) <= tol);
+                        }
+                        // Accelerations and potentials only.
+                        std::array<std::vector<fp_type>, 3> accs;
+                        t.accs_o(accs, theta, G = fp_type(2));
+                        for (std::size_t j = 0; j < 3u; ++j) {
+                            REQUIRE(accs[j] == res[j]);
+                        }
+                        std::vector<fp_type> pots;
+                        t.pots_o(pots, theta, G = fp_type(2));
+                        REQUIRE(max_norm_diff(pots, res[3]) <= fp_type(1E-5));
+                    }
+                }
+            }
+        });
+    });
+    // Larger opening angle, against the exact Ewald corrections.
+    const auto s = 1000u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    const auto ref = direct_ewald(parts, s, 1., 1., true);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1., periodic = true};
+    std::array<std::vector<double>, 4> res;
+    t.accs_pots_o(res, 0.5);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        REQUIRE(max_norm_diff(res[j], ref[j]) <= 1E-2);
+    }
+    // NOTE: the potentials are less accurate, because of the contribution
+    // of the background to the monopole approximation.
+    t.accs_pots_o(res, 0.3);
+    REQUIRE(max_norm_diff(res[3], ref[3]) <= 2E-2);
+}
+
+TEST_CASE("periodic wrapping")
+{
+    const auto s = 300u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1., periodic = true};
+    std::array<std::vector<double>, 4> ref;
+    t.accs_pots_o(ref, 0.001);
+    // A rigid translation of the whole system, with the particles outside the domain
+    // wrapped back into it, does not change the accelerations and the potentials.
+    const double shift[3] = {0.3, -1.7, 2.45};
+    auto parts_s = parts;
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (unsigned i = 0; i < s; ++i) {
+            parts_s[(j + 1u) * s + i] += shift[j];
+        }
+    }
+    octree<double> t_s{x_coords = parts_s.begin() + s, y_coords = parts_s.begin() + 2u * s,
+                       z_coords = parts_s.begin() + 3u * s, masses = parts_s.begin(), nparts = s, box_size = 1.,
+                       periodic = true};
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (unsigned i = 0; i < s; ++i) {
+            const auto c = t_s.p_its_o()[j][i];
+            REQUIRE(c >= -0.5);
+            REQUIRE(c < 0.5);
+            const auto d = c - parts[(j + 1u) * s + i] - shift[j];
+            REQUIRE(std::abs(d - std::round(d)) <= 1E-12);
+        }
+    }
+    std::array<std::vector<double>, 4> res;
+    t_s.accs_pots_o(res, 0.001);
+    for (std::size_t j = 0; j < 4u; ++j) {
+        REQUIRE(max_norm_diff(res[j], ref[j]) <= 1E-3);
+    }
+    // Same via the update of the particles.
+    t.update_particles_u([s](const auto &p_its) {
+        for (std::size_t j = 0; j < 3u; ++j) {
+            for (unsigned i = 0; i < s; ++i) {
+                p_its[j][i] -= 2.;
+            }
+        }
+    });
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (unsigned i = 0; i < s; ++i) {
+            REQUIRE(std::abs(t.p_its_o()[j][i] - parts[(j + 1u) * s + i]) <= 1E-12);
+        }
+    }
+    t.accs_pots_o(res, 0.001);
+    for (std::size_t j = 0; j < 4u; ++j) {
+        REQUIRE(max_norm_diff(res[j], ref[j]) <= 1E-9);
+    }
+    // Copy and move semantics.
+    auto t2(t);
+    REQUIRE(t2.periodic());
+    auto t3(std::move(t2));
+    REQUIRE(t3.periodic());
+    REQUIRE(!t2.periodic());
+    t2 = t3;
+    REQUIRE(t2.periodic());
+    t3 = octree<double>{};
+    REQUIRE(!t3.periodic());
+}
+
+TEST_CASE("periodic short range")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+        const auto s = 500u;
+        auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+        const auto rs = fp_type(0.05);
+        const auto ref = direct_sr_periodic(parts, s, 1., rs);
+        for (auto nc : {1u, 16u, 128u}) {
+            octree<fp_type> t{x_coords = parts.begin() + s,
+                              y_coords = parts.begin() + 2u * s,
+                              z_coords = parts.begin() + 3u * s,
+                              masses = parts.begin(),
+                              nparts = s,
+                              kwargs::ncrit = nc,
+                              box_size = fp_type(1),
+                              periodic = true};
+            std::array<std::vector<fp_type>, 4> res;
+            t.accs_pots_o(res, fp_type(0.001), r_split = rs, r_cut = fp_type(0.45));
+            for (std::size_t j = 0; j < 4u; ++j) {
+                REQUIRE(max_norm_diff(res[j], ref[j]) <= tol);
+            }
+        }
+    });
+}
+
+TEST_CASE("periodic treepm")
+{
+    // In a periodic domain, the sum of the short-range tree interaction and of the long-range
+    // mesh interaction is close to the periodic interaction computed via the Ewald corrections.
+    const auto s = 2000u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1., periodic = true};
+    std::array<std::vector<double>, 3> ref, sr, lr;
+    t.accs_u(ref, 0.4);
+    const auto rs = 1.25 / 64;
+    t.accs_u(sr, 0.4, r_split = rs);
+    particle_mesh<double> pm(64, 1., r_split = rs, assignment = pm_assignment::tsc);
+    pm.accs_u(lr, t);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        std::vector<double> tot(s);
+        for (unsigned i = 0; i < s; ++i) {
+            tot[i] = sr[j][i] + lr[j][i];
+        }
+        REQUIRE(max_norm_diff(tot, ref[j]) <= 2E-2);
+    }
+}
+
+TEST_CASE("periodic errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    REQUIRE_THROWS_AS((octree<double>{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                      z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                                      periodic = true}),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS((quadtree<double>{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                        masses = parts.begin(), nparts = s, box_size = 1., periodic = true}),
+                      std::invalid_argument);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1., periodic = true};
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, mixed_precision = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, active = std::vector<unsigned>{1}), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.01, r_cut = 0.5), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, [](auto, auto, const auto &) {}), std::invalid_argument);
+    std::vector<double> q(30, 0.1);
+    REQUIRE_THROWS_AS(t.accs_query(accs, std::array{q.begin(), q.begin() + 10, q.begin() + 20}, 10, 0.75),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75), std::invalid_argument);
+}
@@ -0,0 +1,165 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+// Direct computation of the accelerations/potentials (per unit mass) at the query points q.
+template <typename F>
+static std::array<std::vector<F>, 4> direct_query(const std::vector<F> &parts, unsigned s, const std::vector<F> &q,
+                                                  unsigned nq, F G, F eps)
+{
+    std::array<std::vector<F>, 4> retval;
+    for (auto &v : retval) {
+        v.assign(nq, F(0));
+    }
+    for (unsigned i = 0; i < nq; ++i) {
+        long double acc[4] = {0, 0, 0, 0};
+        for (unsigned k = 0; k < s; ++k) {
+            long double diffs[3], dist2 = static_cast<long double>(eps) * eps;
+            for (unsigned j = 0; j < 3u; ++j) {
+                diffs[j] = static_cast<long double>(parts[(j + 1u) * s + k]) - q[j * nq + i];
+                dist2 += diffs[j] * diffs[j];
+            }
+            const auto dist = std::sqrt(dist2), m = static_cast<long double>(parts[k]);
+            for (unsigned j = 0; j < 3u; ++j) {
+                acc[j] += G * m * diffs[j] / (dist2 * dist);
+            }
+            acc[3] -= G * m / dist;
+        }
+        for (unsigned j = 0; j < 4u; ++j) {
+            retval[j][i] = static_cast<F>(acc[j]);
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("query points")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            // NOTE: with a very small opening angle, the results are dominated by the direct interactions.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-12) : fp_type(1E-5);
+            constexpr auto theta = fp_type(0.001);
+            auto sizes = {0u, 1u, 10u, 1000u};
+            auto ncrits = {1u, 16u, 128u};
+            auto nqs = {0u, 1u, 7u, 500u};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+                for (auto nc : ncrits) {
+                    octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                 y_coords = parts.begin() + 2u * s,
+                                                                 z_coords = parts.begin() + 3u * s,
+                                                                 masses = parts.begin(),
+                                                                 nparts = s,
+                                                                 kwargs::ncrit = nc,
+                                                                 box_size = fp_type(1)};
+                    for (auto nq : nqs) {
+                        // Query points within and outside the domain of the tree.
+                        std::vector<fp_type> q(3u * nq);
+                        std::uniform_real_distribution<fp_type> qdist(fp_type(-1), fp_type(1));
+                        std::generate(q.begin(), q.end(), [&qdist]() { return qdist(rng); });
+                        const auto q_its = std::array{q.begin(), q.begin() + nq, q.begin() + 2u * nq};
+                        const auto ref = direct_query(parts, s, q, nq, fp_type(2), fp_type(0.01));
+                        std::array<std::vector<fp_type>, 4> res;
+                        t.accs_pots_query(res, q_its, nq, theta, G = fp_type(2), eps = fp_type(0.01));
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            REQUIRE(max_norm_diff(res[j], ref[j]) <= tol);
+                        }
+                        // Accelerations only, with the output as iterators.
+                        std::vector<fp_type> ax(nq), ay(nq), az(nq);
+                        t.accs_query(std::array{ax.data(), ay.data(), az.data()}, q_its, nq, theta,
+                                     G = fp_type(2), eps = fp_type(0.01));
+                        REQUIRE(max_norm_diff(ax, ref[0]) <= tol);
+                        REQUIRE(max_norm_diff(ay, ref[1]) <= tol);
+                        REQUIRE(max_norm_diff(az, ref[2]) <= tol);
+                        // Potentials only.
+                        std::vector<fp_type> pots;
+                        t.pots_query(pots, q_its, nq, theta, G = fp_type(2), eps = fp_type(0.01));
+                        REQUIRE(max_norm_diff(pots, ref[3]) <= tol);
+                        // The results must match the accs/pots of the tree
+                        // when the query points coincide with the particles.
+                        if (nq == 1u) {
+                            std::array<std::vector<fp_type>, 4> ref_o, res_o;
+                            t.accs_pots_o(ref_o, theta, eps = fp_type(0.01));
+                            t.accs_pots_query(res_o,
+                                              std::array{parts.begin() + s, parts.begin() + 2u * s,
+                                                         parts.begin() + 3u * s},
+                                              s, theta, eps = fp_type(0.01));
+                            for (std::size_t j = 0; j < 3u; ++j) {
+                                REQUIRE(max_norm_diff(res_o[j], ref_o[j]) <= tol);
+                            }
+                            // NOTE: the potential at the query points includes the
+                            // self-interaction, and it is per unit mass.
+                            for (unsigned i = 0; i < s; ++i) {
+                                res_o[3][i] = parts[i] * (res_o[3][i] + parts[i] / fp_type(0.01));
+                            }
+                            REQUIRE(max_norm_diff(res_o[3], ref_o[3]) <= tol);
+                        }
+                    }
+                }
+            }
+        });
+    });
+}
+
+TEST_CASE("query points errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    std::vector<double> q(30, 0.1);
+    const auto q_its = std::array{q.begin(), q.begin() + 10, q.begin() + 20};
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_query(accs, q_its, 10, 0.75, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_query(accs, q_its, 10, 0.75, mixed_precision = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_query(accs, q_its, 10, 0.75, active = std::vector<unsigned>{1}), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_query(accs, q_its, 10, -1.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_query(accs, q_its, 10, 0.75, eps = -1.), std::domain_error);
+    q[5] = std::numeric_limits<double>::infinity();
+    REQUIRE_THROWS_AS(t.accs_query(accs, q_its, 10, 0.75), std::invalid_argument);
+}
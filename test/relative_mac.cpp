@@ -0,0 +1,198 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// Max relative error of the accelerations in accs wrt the accelerations in ref.
+template <typename F>
+static F max_rel_err(const std::array<std::vector<F>, 3> &accs, const std::array<std::vector<F>, 3> &ref)
+{
+    F retval(0);
+    for (decltype(ref[0].size()) i = 0; i < ref[0].size(); ++i) {
+        F d2(0), r2(0);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            d2 += (accs[j][i] - ref[j][i]) * (accs[j][i] - ref[j][i]);
+            r2 += ref[j][i] * ref[j][i];
+        }
+        retval = std::max(retval, std::sqrt(d2 / r2));
+    }
+    return retval;
+}
+
+TEST_CASE("relative mac accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        const auto s = 2000u;
+        auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+        for (auto nc : {1u, 16u, 128u}) {
+            octree<fp_type, mac::relative> t{x_coords = parts.begin() + s,
+                                             y_coords = parts.begin() + 2u * s,
+                                             z_coords = parts.begin() + 3u * s,
+                                             masses = parts.begin(),
+                                             nparts = s,
+                                             box_size = fp_type(1),
+                                             kwargs::ncrit = nc};
+            // The exact accelerations, used both as reference and as previous accelerations.
+            std::array<std::vector<fp_type>, 3> ref;
+            for (auto &v : ref) {
+                v.resize(s);
+            }
+            for (auto i = 0u; i < s; ++i) {
+                const auto eacc = t.exact_acc_o(i);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    ref[j][i] = eacc[j];
+                }
+            }
+            t.set_acc_old_o(ref);
+            for (auto i = 0u; i < s; ++i) {
+                const auto p = t.perm()[i];
+                REQUIRE(std::abs(t.acc_old()[i]
+                                 - std::sqrt(ref[0][p] * ref[0][p] + ref[1][p] * ref[1][p] + ref[2][p] * ref[2][p]))
+                        <= std::numeric_limits<fp_type>::epsilon() * 10 * t.acc_old()[i]);
+            }
+            // The error decreases together with alpha. The thresholds are derived experimentally.
+            std::array<std::vector<fp_type>, 3> accs;
+            fp_type prev_err(1);
+            for (auto alpha : {fp_type(1E-2), fp_type(1E-3), fp_type(1E-4)}) {
+                t.accs_o(accs, alpha);
+                const auto err = max_rel_err(accs, ref);
+                REQUIRE(err < 10 * alpha);
+                REQUIRE(err <= prev_err);
+                prev_err = err;
+            }
+            // With null previous accelerations, all the nodes are opened.
+            std::array<std::vector<fp_type>, 3> zero_accs;
+            for (auto &v : zero_accs) {
+                v.assign(s, fp_type(0));
+            }
+            t.set_acc_old_u(zero_accs);
+            t.accs_o(accs, fp_type(1E-2));
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-11) : fp_type(1E-3);
+            REQUIRE(max_rel_err(accs, ref) < tol);
+        }
+    });
+}
+
+TEST_CASE("relative mac modes")
+{
+    const auto s = 1000u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double, mac::relative> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                    z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                                    kwargs::ncrit = 16u};
+    const auto alpha = 1E-3;
+    // Bootstrap the previous accelerations with the BH MAC.
+    std::array<std::vector<double>, 3> acc_old, accs, accs2;
+    octree<double>{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                   masses = parts.begin(), nparts = s, kwargs::ncrit = 16u}
+        .accs_o(acc_old, 0.5);
+    t.set_acc_old_o(std::array{acc_old[0].begin(), acc_old[1].begin(), acc_old[2].begin()});
+    t.accs_o(accs, alpha);
+    // Accs and pots together.
+    std::array<std::vector<double>, 4> accs_pots;
+    t.accs_pots_o(accs_pots, alpha);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        REQUIRE(accs_pots[j] == accs[j]);
+    }
+    std::vector<double> pots;
+    t.pots_o(pots, alpha);
+    for (auto i = 0u; i < s; ++i) {
+        REQUIRE(std::abs(pots[i] - accs_pots[3][i]) <= 1E-12 * std::abs(pots[i]));
+    }
+    // The grav constant: the previous accelerations scale with it.
+    for (auto &v : acc_old) {
+        for (auto &a : v) {
+            a *= 2;
+        }
+    }
+    t.set_acc_old_o(acc_old);
+    t.accs_o(accs2, alpha, G = 2.);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(accs2[j][i] == 2 * accs[j][i]);
+        }
+    }
+    // The mutual evaluation of the leaf-leaf interactions.
+    t.accs_o(accs2, alpha, G = 2., mutual = true);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(std::abs(accs2[j][i] - 2 * accs[j][i]) <= 1E-12 * std::abs(accs[j][i]));
+        }
+    }
+    // The previous accelerations follow the particles in the updates.
+    const auto old_mags = t.acc_old();
+    const auto old_perm = t.perm();
+    t.update_particles_u([](const auto &p_its) {
+        for (auto i = 0u; i < s; ++i) {
+            p_its[0][i] = -p_its[0][i] * 0.5;
+        }
+    });
+    for (auto i = 0u; i < s; ++i) {
+        const auto k = static_cast<std::size_t>(
+            std::find(old_perm.begin(), old_perm.end(), t.perm()[i]) - old_perm.begin());
+        REQUIRE(t.acc_old()[i] == old_mags[k]);
+    }
+    // Copy/move.
+    auto t2(t);
+    REQUIRE(t2.acc_old() == t.acc_old());
+    auto t3(std::move(t2));
+    REQUIRE(t3.acc_old() == t.acc_old());
+    REQUIRE(t2.acc_old().empty());
+}
+
+TEST_CASE("relative mac errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double, mac::relative> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                                    z_coords = parts.begin() + 3u * s, masses = parts.begin(), nparts = s,
+                                    box_size = 1.};
+    std::array<std::vector<double>, 3> accs;
+    // The previous accelerations have not been set.
+    REQUIRE_THROWS_AS(t.accs_u(accs, 1E-3), std::invalid_argument);
+    std::array<std::vector<double>, 3> acc_old{std::vector<double>(s, 1.), std::vector<double>(s, 1.),
+                                               std::vector<double>(s - 1u, 1.)};
+    REQUIRE_THROWS_AS(t.set_acc_old_u(acc_old), std::invalid_argument);
+    acc_old[2].push_back(std::numeric_limits<double>::infinity());
+    REQUIRE_THROWS_AS(t.set_acc_old_u(acc_old), std::invalid_argument);
+    REQUIRE(t.acc_old().empty());
+    acc_old[2].back() = 1.;
+    t.set_acc_old_u(acc_old);
+    REQUIRE(t.acc_old().size() == s);
+    REQUIRE_THROWS_AS(t.accs_u(accs, -1.), std::domain_error);
+    // Unsupported modes.
+    REQUIRE_THROWS_AS(t.accs_u(accs, 1E-3, r_split = .01), std::invalid_argument);
+    std::vector<double> q(3u);
+    REQUIRE_THROWS_AS(t.accs_query(accs, std::array{q.data(), q.data() + 1, q.data() + 2}, 1u, 1E-3),
+                      std::invalid_argument);
+}
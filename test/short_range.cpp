@@ -0,0 +1,203 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau::kwargs;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+using macs = std::tuple<std::integral_constant<mac, mac::bh>, std::integral_constant<mac, mac::bh_geom>,
+                        std::integral_constant<mac, mac::bh_box>>;
+
+static std::mt19937 rng(0);
+
+// Max abs difference between a and b, normalised wrt the max abs value in b.
+template <typename F>
+static F max_norm_diff(const std::vector<F> &a, const std::vector<F> &b)
+{
+    REQUIRE(a.size() == b.size());
+    F retval(0), bmax(0);
+    for (decltype(a.size()) i = 0; i < a.size(); ++i) {
+        retval = std::max(retval, std::abs(a[i] - b[i]));
+        bmax = std::max(bmax, std::abs(b[i]));
+    }
+    return bmax == F(0) ? retval : retval / bmax;
+}
+
+// Direct computation of the short-range accelerations/potentials, in the original order.
+// Only the pairs closer than rc are accounted for.
+template <typename F>
+static std::array<std::vector<F>, 4> direct_sr(const std::vector<F> &parts, unsigned s, F G, F eps, F rs, F rc)
+{
+    const auto two_sqrt_pi = 1.1283791670955125738961589031215452L;
+    std::array<std::vector<F>, 4> retval;
+    for (auto &v : retval) {
+        v.assign(s, F(0));
+    }
+    for (unsigned i = 0; i < s; ++i) {
+        long double acc[4] = {0, 0, 0, 0};
+        for (unsigned k = 0; k < s; ++k) {
+            if (k == i) {
+                continue;
+            }
+            long double diffs[3], d2 = 0;
+            for (unsigned j = 0; j < 3u; ++j) {
+                diffs[j] = static_cast<long double>(parts[(j + 1u) * s + k]) - parts[(j + 1u) * s + i];
+                d2 += diffs[j] * diffs[j];
+            }
+            if (d2 > static_cast<long double>(rc) * rc) {
+                continue;
+            }
+            const auto dist2 = d2 + static_cast<long double>(eps) * eps, dist = std::sqrt(dist2),
+                       m = static_cast<long double>(parts[k]), u = dist / (2 * static_cast<long double>(rs));
+            const auto erfc_u = std::erfc(u);
+            for (unsigned j = 0; j < 3u; ++j) {
+                acc[j] += G * m * diffs[j] / (dist2 * dist) * (erfc_u + two_sqrt_pi * u * std::exp(-u * u));
+            }
+            acc[3] -= G * m * parts[i] / dist * erfc_u;
+        }
+        for (unsigned j = 0; j < 4u; ++j) {
+            retval[j][i] = static_cast<F>(acc[j]);
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("short range")
+{
+    tuple_for_each(macs{}, [](auto mac_type) {
+        tuple_for_each(fp_types{}, [](auto x) {
+            using fp_type = decltype(x);
+            // NOTE: with a very small opening angle, the results are dominated by the direct interactions.
+            // The cutoff radius is larger than the domain, thus no pair is pruned.
+            const auto tol = std::is_same_v<fp_type, double> ? fp_type(1E-10) : fp_type(1E-4);
+            constexpr auto theta = fp_type(0.001);
+            constexpr auto rs = fp_type(0.05);
+            auto sizes = {0u, 1u, 10u, 1000u};
+            auto ncrits = {1u, 16u, 128u};
+            for (auto s : sizes) {
+                auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+                const auto ref = direct_sr(parts, s, fp_type(2), fp_type(0.01), rs, fp_type(2));
+                for (auto nc : ncrits) {
+                    octree<fp_type, decltype(mac_type)::value> t{x_coords = parts.begin() + s,
+                                                                 y_coords = parts.begin() + 2u * s,
+                                                                 z_coords = parts.begin() + 3u * s,
+                                                                 masses = parts.begin(),
+                                                                 nparts = s,
+                                                                 kwargs::ncrit = nc,
+                                                                 box_size = fp_type(1)};
+                    std::array<std::vector<fp_type>, 4> res_o, res_u;
+                    t.accs_pots_o(res_o, theta, G = fp_type(2), eps = fp_type(0.01), r_split = rs, r_cut = fp_type(2));
+                    for (std::size_t j = 0; j < 4u; ++j) {
+                        REQUIRE(max_norm_diff(res_o[j], ref[j]) <= tol);
+                    }
+                    // Internal order.
+                    t.accs_pots_u(res_u, theta, G = fp_type(2), eps = fp_type(0.01), r_split = rs, r_cut = fp_type(2));
+                    const auto &perm = t.perm();
+                    for (std::size_t j = 0; j < 4u; ++j) {
+                        for (unsigned i = 0; i < s; ++i) {
+                            REQUIRE(res_u[j][i] == res_o[j][perm[i]]);
+                        }
+                    }
+                    // Accelerations and potentials separately.
+                    std::array<std::vector<fp_type>, 3> accs;
+                    t.accs_o(accs, theta, G = fp_type(2), eps = fp_type(0.01), r_split = rs, r_cut = fp_type(2));
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        REQUIRE(max_norm_diff(accs[j], ref[j]) <= tol);
+                    }
+                    std::vector<fp_type> pots;
+                    t.pots_o(pots, theta, G = fp_type(2), eps = fp_type(0.01), r_split = rs, r_cut = fp_type(2));
+                    REQUIRE(max_norm_diff(pots, ref[3]) <= tol);
+                }
+            }
+        });
+    });
+}
+
+TEST_CASE("short range cutoff")
+{
+    // With a cutoff radius smaller than the domain, the results must match the direct
+    // summation over the pairs within the cutoff. The pruning of the nodes is conservative,
+    // thus a few pairs beyond the cutoff are accounted for by the tree.
+    const auto s = 3000u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    const auto rs = 0.02, rc = 0.2;
+    const auto ref = direct_sr(parts, s, 1., 0., rs, rc);
+    for (auto nc : {1u, 16u, 128u}) {
+        octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s,
+                         z_coords = parts.begin() + 3u * s, masses = parts.begin(),
+                         nparts = s, kwargs::ncrit = nc, box_size = 1.};
+        std::array<std::vector<double>, 4> res;
+        t.accs_pots_o(res, 0.001, r_split = rs, r_cut = rc);
+        for (std::size_t j = 0; j < 4u; ++j) {
+            // NOTE: erfc(rc / (2 * rs)) is about 1.5E-12.
+            REQUIRE(max_norm_diff(res[j], ref[j]) <= 1E-9);
+        }
+        // The default cutoff radius is 4.5 times the split scale.
+        std::array<std::vector<double>, 4> res_def, res_exp;
+        t.accs_pots_o(res_def, 0.75, r_split = rs);
+        t.accs_pots_o(res_exp, 0.75, r_split = rs, r_cut = rs * 4.5);
+        REQUIRE(res_def == res_exp);
+    }
+}
+
+TEST_CASE("short range large split")
+{
+    // With a split scale much larger than the domain, the short-range mode reproduces the Newtonian interaction.
+    const auto s = 1000u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    std::array<std::vector<double>, 4> ref, res;
+    t.accs_pots_o(ref, 0.5, eps = 0.01);
+    t.accs_pots_o(res, 0.5, eps = 0.01, r_split = 1E6);
+    for (std::size_t j = 0; j < 4u; ++j) {
+        REQUIRE(max_norm_diff(res[j], ref[j]) <= 1E-5);
+    }
+}
+
+TEST_CASE("short range errors")
+{
+    const auto s = 100u;
+    auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t{x_coords = parts.begin() + s, y_coords = parts.begin() + 2u * s, z_coords = parts.begin() + 3u * s,
+                     masses = parts.begin(), nparts = s, box_size = 1.};
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = -1.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.1, r_cut = 0.), std::domain_error);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.1, mutual = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.1, mixed_precision = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.1, active = std::vector<unsigned>{1}),
+                      std::invalid_argument);
+    const std::vector<double> sp{0.5, 0.5};
+    REQUIRE_THROWS_AS(t.accs_u(accs, 0.75, r_split = 0.1, split = sp), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_cb_u(0.75, [](auto, auto, const auto &) {}, r_split = 0.1), std::invalid_argument);
+    std::vector<double> q(30, 0.1);
+    REQUIRE_THROWS_AS(t.accs_query(accs, std::array{q.begin(), q.begin() + 10, q.begin() + 20}, 10, 0.75,
+                                   r_split = 0.1),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_from_u(accs, t, 0.75, r_split = 0.1), std::invalid_argument);
+}